@@ -7,11 +7,17 @@
  * Examples:
     ./kv_benchmark --key_path=../resources/fb_1M_uint64_ks_0 --target_db_path=tmp/alex/fb_1M_uint64 --out_path=tmp/out.txt
     ./kv_benchmark --key_path=../resources/fb_200M_uint64_ks_0 --target_db_path=tmp/alex/fb_200M_uint64 --out_path=tmp/out.txt
+    ./kv_benchmark --key_path=../resources/fb_200M_uint64_ks_0 --target_db_path=tmp/alex/fb_200M_uint64 --out_path=tmp/out.txt --batch=64
+    ./kv_benchmark --key_path=../resources/fb_200M_uint64_ks_0 --target_db_path=tmp/alex/fb_200M_uint64 --out_path=tmp/out.txt --node_cache_mb=256
+    ./kv_benchmark --key_path=../resources/fb_200M_uint64_ks_0 --target_db_path=tmp/alex/fb_200M_uint64 --out_path=tmp/out.txt --pager=pread_direct --batch=64
+    ./kv_benchmark --key_path=../resources/fb_200M_uint64_ks_0 --target_db_path=tmp/alex/fb_200M_uint64 --out_path=tmp/out.txt --pager=pread --async=64
  */
 
 #include "../core/alex.h"
+#include "../core/async_lookup.h"
 
 #include <iomanip>
+#include <memory>
 
 #include "flags.h"
 #include "utils.h"
@@ -41,6 +47,27 @@ double report_t(size_t t_idx, size_t &count_milestone, size_t &last_count_milest
  * --target_db_path         path to the saved alex
  * --key_path               path to keyset file
  * --out_path               path to save benchmark results
+ *
+ * Optional flags:
+ * --num_samples            number of queries to issue (default: all)
+ * --batch                  issue queries in batches of this size through
+ *                          get_payloads (default: 1, one get_payload per query)
+ * --node_cache_mb          memory budget for loaded data nodes, cold ones are
+ *                          evicted beyond it (default: 0, unlimited, mmap only)
+ * --pager                  how node records are read: mmap, pread, or
+ *                          pread_direct to bypass the page cache (default: mmap)
+ * --access                 how the mmap pager expects the file to be read:
+ *                          default, random, sequential, populate (read it all
+ *                          on load), warm_inner (read the model nodes on
+ *                          load) or huge_pages (copy it all on load into
+ *                          memory on 2 MiB pages) (default: default)
+ * --async                  keep up to this many queries in flight on one
+ *                          thread, suspending those that wait for I/O
+ *                          (default: 0, queries block, see --batch)
+ * --count_pages            after the queries, report the average number of
+ *                          distinct 4 KiB pages that a lookup reads
+ * --scan                   instead of looking the key up, read this many
+ *                          consecutive keys from it with scan_n (default: 0)
  */
 int main(int argc, char* argv[]) {
   auto flags = parse_flags(argc, argv);
@@ -52,6 +79,43 @@ int main(int argc, char* argv[]) {
   size_t num_samples = 0;
   std::stringstream(num_samples_str) >> num_samples;
   std::cout << "num_samples= " << num_samples << std::endl;
+  std::string batch_str = get_with_default(flags, "batch", "1");  // queries per get_payloads call
+  size_t batch = 1;
+  std::stringstream(batch_str) >> batch;
+  batch = std::max<size_t>(batch, 1);
+  std::cout << "batch= " << batch << std::endl;
+  std::string node_cache_mb_str = get_with_default(flags, "node_cache_mb", "0");
+  size_t node_cache_mb = 0;
+  std::stringstream(node_cache_mb_str) >> node_cache_mb;
+  std::cout << "node_cache_mb= " << node_cache_mb << std::endl;
+  std::string pager_type = get_with_default(flags, "pager", "mmap");
+  std::cout << "pager= " << pager_type << std::endl;
+  std::string access_str = get_with_default(flags, "access", "default");
+  std::cout << "access= " << access_str << std::endl;
+  alex::PagerAccess access = alex::PagerAccess::kDefault;
+  if (access_str == "random") {
+    access = alex::PagerAccess::kRandom;
+  } else if (access_str == "sequential") {
+    access = alex::PagerAccess::kSequential;
+  } else if (access_str == "populate") {
+    access = alex::PagerAccess::kPopulate;
+  } else if (access_str == "warm_inner") {
+    access = alex::PagerAccess::kWarmInner;
+  } else if (access_str == "huge_pages") {
+    access = alex::PagerAccess::kHugePages;
+  } else if (access_str != "default") {
+    std::cerr << "Unknown access: " << access_str << std::endl;
+    exit(1);
+  }
+  std::string async_str = get_with_default(flags, "async", "0");  // queries in flight
+  size_t async = 0;
+  std::stringstream(async_str) >> async;
+  std::cout << "async= " << async << std::endl;
+  bool count_pages = get_boolean_flag(flags, "count_pages");
+  std::string scan_str = get_with_default(flags, "scan", "0");  // keys per scan
+  size_t scan = 0;
+  std::stringstream(scan_str) >> scan;
+  std::cout << "scan= " << scan << std::endl;
 
   // Load keyset
   std::vector<uint64_t> queries;
@@ -86,36 +150,107 @@ int main(int argc, char* argv[]) {
   auto start_t = std::chrono::high_resolution_clock::now();
 
   // Load alex from file
-  alex::ReadPager<KEY_TYPE, PAYLOAD_TYPE> pager(target_db_path_page);
-  alex::Alex<KEY_TYPE, PAYLOAD_TYPE> index(&pager);
+  std::unique_ptr<alex::Pager<KEY_TYPE, PAYLOAD_TYPE>> pager;
+  if (pager_type == "mmap") {
+    pager.reset(new alex::ReadPager<KEY_TYPE, PAYLOAD_TYPE>(target_db_path_page, access));
+  } else if (pager_type == "pread" || pager_type == "pread_direct") {
+    pager.reset(new alex::PreadReadPager<KEY_TYPE, PAYLOAD_TYPE>(
+        target_db_path_page, pager_type == "pread_direct"));
+  } else {
+    std::cerr << "Unknown pager: " << pager_type << std::endl;
+    exit(1);
+  }
+  if (node_cache_mb > 0 && pager->node_cache() != nullptr) {
+    pager->node_cache()->set_budget(node_cache_mb << 20);
+  }
+  alex::Alex<KEY_TYPE, PAYLOAD_TYPE> index(pager.get());
   {
     std::ifstream ifs(target_db_path);
     boost::archive::binary_iarchive ia(ifs);
     ia >> index;
-    std::cout << "Loaded from " << target_db_path << std::endl;
+    std::cout << "Loaded from " << target_db_path << " in "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::high_resolution_clock::now() - start_t).count()
+              << " ns" << std::endl;
   }
 
-  // Issue queries and check answers
-  for (size_t t_idx = 0; t_idx < num_samples; t_idx++) {
-    // Query key and answer
+  // Checks the answer to query t_idx, the num_done-th one to complete
+  auto check_answer = [&](size_t t_idx, PAYLOAD_TYPE* payload, size_t num_done) {
     uint64_t key = queries[t_idx];
-    uint64_t answer = expected_ans[t_idx];  
-
-    // Search
-    PAYLOAD_TYPE* payload = index.get_payload(key);
+    uint64_t answer = expected_ans[t_idx];
 
     // Check with answer
     if (!payload) {
       printf("ERROR: not found key= %lu\n", key);
-    }
-    if (*payload != answer) {
+    } else if (*payload != answer) {
       printf("ERROR: incorrect rank: %lu, expected: %lu (key= %lu)\n", *payload, answer, key);
     }
 
     // Step milestone
-    if (t_idx + 1 == count_milestone || t_idx + 1 == num_samples) {
-      timestamps.push_back(report_t(t_idx, count_milestone, last_count_milestone, last_elapsed, start_t));    
+    if (num_done == count_milestone || num_done == num_samples) {
+      timestamps.push_back(report_t(num_done - 1, count_milestone, last_count_milestone, last_elapsed, start_t));
+    }
+  };
+
+  // Issue queries and check answers
+  DtlbCounter dtlb;
+  dtlb.enable();
+  if (scan > 0) {
+    std::vector<std::pair<KEY_TYPE, PAYLOAD_TYPE>> values(scan);
+    size_t num_scanned = 0;
+    for (size_t t_idx = 0; t_idx < num_samples; t_idx++) {
+      size_t n = index.scan_n(queries[t_idx], scan, values.data());
+      num_scanned += n;
+      bool found = (n > 0 && values[0].first == queries[t_idx]);
+      check_answer(t_idx, found ? &values[0].second : nullptr, t_idx + 1);
     }
+    std::cout << "Scanned " << num_scanned << " keys" << std::endl;
+  } else if (async > 0) {
+    alex::AsyncLookupScheduler<KEY_TYPE, PAYLOAD_TYPE> scheduler(&index, async);
+    size_t num_done = 0;
+    for (size_t t_idx = 0; t_idx < num_samples; t_idx++) {
+      scheduler.submit(queries[t_idx], [&, t_idx](const KEY_TYPE&, PAYLOAD_TYPE* payload) {
+        check_answer(t_idx, payload, ++num_done);
+      });
+    }
+    scheduler.drain();
+  } else {
+    std::vector<PAYLOAD_TYPE*> payloads(batch);
+    for (size_t batch_begin = 0; batch_begin < num_samples; batch_begin += batch) {
+      size_t batch_size = std::min(batch, num_samples - batch_begin);
+
+      // Search
+      if (batch_size == 1) {
+        payloads[0] = index.get_payload(queries[batch_begin]);
+      } else {
+        index.get_payloads(&queries[batch_begin], batch_size, payloads.data());
+      }
+
+      for (size_t b_idx = 0; b_idx < batch_size; b_idx++) {
+        size_t t_idx = batch_begin + b_idx;
+        check_answer(t_idx, payloads[b_idx], t_idx + 1);
+      }
+    }
+  }
+  dtlb.disable();
+  dtlb.report(std::cout, num_samples);
+
+  if (node_cache_mb > 0 && pager->node_cache() != nullptr) {
+    std::cout << "Node cache: " << pager->node_cache()->resident_bytes()
+              << " bytes resident, " << pager->node_cache()->num_evictions()
+              << " evictions" << std::endl;
+  }
+  if (count_pages) {
+    size_t num_pages = 0;
+    for (size_t t_idx = 0; t_idx < num_samples; t_idx++) {
+      num_pages += index.count_lookup_pages(queries[t_idx]);
+    }
+    std::cout << "Pages touched per lookup: " << (double) num_pages / num_samples << std::endl;
+  }
+  auto pread_pager = dynamic_cast<alex::PreadReadPager<KEY_TYPE, PAYLOAD_TYPE>*>(pager.get());
+  if (pread_pager != nullptr) {
+    std::cout << "Pager: " << pread_pager->num_reads() << " reads, "
+              << pread_pager->num_bytes_read() << " bytes read" << std::endl;
   }
 
   // Write result to file
@@ -7,11 +7,14 @@
  * Examples:
     ./kv_benchmark_rw --key_path=../resources/fb_1M_uint64_ks_0 --target_db_path=tmp/alex/fb_1M_uint64 --out_path=tmp/out.txt
     ./kv_benchmark_rw --key_path=../resources/fb_200M_uint64_ks_0 --target_db_path=tmp/alex/fb_200M_uint64 --out_path=tmp/out.txt
+    ./kv_benchmark_rw --key_path=../resources/fb_200M_uint64_ks_0 --target_db_path=tmp/alex/fb_200M_uint64 --out_path=tmp/out.txt --threads=8
  */
 
 #include "../core/alex.h"
 
+#include <algorithm>
 #include <iomanip>
+#include <thread>
 
 #include "flags.h"
 #include "utils.h"
@@ -41,6 +44,27 @@ double report_t(size_t t_idx, size_t &count_milestone, size_t &last_count_milest
  * --target_db_path         path to the saved alex
  * --key_path               path to keyset file
  * --out_path               path to save benchmark results
+ *
+ * Optional flags:
+ * --num_samples            number of queries to run, all by default
+ * --threads                run queries on this many threads sharing the index
+ *                          in multi-writer mode (default 1). Each thread gets
+ *                          a disjoint key range, so that a read still follows
+ *                          the insert of the same key. Only the total time is
+ *                          reported.
+ * --checkpoint             afterwards, append the nodes changed by the
+ *                          inserts to the page file and save the index
+ *                          again, so that the next run starts from them
+ * --wal                    log the inserts to target_db_path + "_wal", after
+ *                          redoing those that a previous run logged since
+ *                          its last checkpoint. With --checkpoint, the log is
+ *                          emptied once the index is saved.
+ * --wal_commit_us          commit the log every this many microseconds
+ *                          (default 1000). With 0, every insert waits until
+ *                          it is durable, sharing the sync with the inserts
+ *                          of other threads.
+ * --huge_pages             copy the page file on load into memory on 2 MiB
+ *                          pages, instead of mapping it
  */
 int main(int argc, char* argv[]) {
   auto flags = parse_flags(argc, argv);
@@ -52,6 +76,17 @@ int main(int argc, char* argv[]) {
   size_t num_samples = 0;
   std::stringstream(num_samples_str) >> num_samples;
   std::cout << "num_samples= " << num_samples << std::endl;
+  std::string threads_str = get_with_default(flags, "threads", "1");
+  size_t num_threads = 1;
+  std::stringstream(threads_str) >> num_threads;
+  num_threads = std::max<size_t>(num_threads, 1);
+  std::cout << "threads= " << num_threads << std::endl;
+  bool checkpoint = get_boolean_flag(flags, "checkpoint");
+  bool use_wal = get_boolean_flag(flags, "wal");
+  std::string wal_commit_us_str = get_with_default(flags, "wal_commit_us", "1000");
+  long wal_commit_us = 1000;
+  std::stringstream(wal_commit_us_str) >> wal_commit_us;
+  bool huge_pages = get_boolean_flag(flags, "huge_pages");
 
   // Load keyset
   std::vector<char> query_types;  // r: read, w: write
@@ -87,7 +122,8 @@ int main(int argc, char* argv[]) {
   auto start_t = std::chrono::high_resolution_clock::now();
 
   // Load alex from file
-  alex::ReadPager<KEY_TYPE, PAYLOAD_TYPE> pager(target_db_path_page);
+  alex::ReadPager<KEY_TYPE, PAYLOAD_TYPE> pager(
+      target_db_path_page, huge_pages ? alex::PagerAccess::kHugePages : alex::PagerAccess::kDefault);
   alex::Alex<KEY_TYPE, PAYLOAD_TYPE> index(&pager);
   {
     std::ifstream ifs(target_db_path);
@@ -96,15 +132,25 @@ int main(int argc, char* argv[]) {
     std::cout << "Loaded from " << target_db_path << std::endl;
   }
 
-  // Issue queries and check answers
-  for (size_t t_idx = 0; t_idx < num_samples; t_idx++) {
+  // Redo what was logged since the checkpoint, then log on top of it
+  std::unique_ptr<alex::WriteAheadLog<KEY_TYPE, PAYLOAD_TYPE>> wal;
+  if (use_wal) {
+    std::string wal_path = target_db_path + "_wal";
+    wal.reset(new alex::WriteAheadLog<KEY_TYPE, PAYLOAD_TYPE>(wal_path, wal_commit_us));
+    size_t num_replayed = index.replay_wal(*wal);
+    std::cout << "Replayed " << num_replayed << " writes from " << wal_path << std::endl;
+    index.set_wal(wal.get());
+  }
+
+  // Issue a query and check its answer
+  auto run_query = [&](size_t t_idx) {
     // Query key and type (read/write)
     char type = query_types[t_idx];
     uint64_t key = queries[t_idx];
 
     if (type == 'r') {  // READ
-      PAYLOAD_TYPE* payload = index.get_payload(key);
-      if (!payload) {
+      PAYLOAD_TYPE payload;
+      if (!index.get_payload(key, &payload)) {
         printf("ERROR: not found key= %lu\n", key);
       }
     } else if (type == 'w') {  // WRITE
@@ -116,11 +162,94 @@ int main(int argc, char* argv[]) {
     } else {
       printf("ERROR: invalid query type= %c\n", type);
     }
+  };
+
+  DtlbCounter dtlb;
+  dtlb.enable();
+  if (num_threads == 1) {
+    for (size_t t_idx = 0; t_idx < num_samples; t_idx++) {
+      run_query(t_idx);
+
+      // Step milestone
+      if (t_idx + 1 == count_milestone || t_idx + 1 == num_samples) {
+        timestamps.push_back(report_t(t_idx, count_milestone, last_count_milestone, last_elapsed, start_t));    
+      }
+    }
+  } else if (num_samples > 0) {
+    // Split the key space at quantiles of the queried keys
+    std::vector<uint64_t> sorted_keys(queries.begin(), queries.begin() + num_samples);
+    std::sort(sorted_keys.begin(), sorted_keys.end());
+    std::vector<uint64_t> upper_keys;  // exclusive upper bound of each range but the last
+    for (size_t i = 1; i < num_threads; i++) {
+      upper_keys.push_back(sorted_keys[num_samples * i / num_threads]);
+    }
+    std::vector<std::vector<size_t>> thread_queries(num_threads);
+    for (size_t t_idx = 0; t_idx < num_samples; t_idx++) {
+      size_t range = std::upper_bound(upper_keys.begin(), upper_keys.end(), queries[t_idx]) - upper_keys.begin();
+      thread_queries[range].push_back(t_idx);
+    }
 
-    // Step milestone
-    if (t_idx + 1 == count_milestone || t_idx + 1 == num_samples) {
-      timestamps.push_back(report_t(t_idx, count_milestone, last_count_milestone, last_elapsed, start_t));    
+    index.set_concurrency_mode(alex::ConcurrencyMode::kMultiWriter);
+
+    auto queries_start_t = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+      threads.emplace_back([&, thread_idx]() {
+        for (size_t t_idx : thread_queries[thread_idx]) {
+          run_query(t_idx);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    auto queries_end_t = std::chrono::high_resolution_clock::now();
+    index.set_concurrency_mode(alex::ConcurrencyMode::kSingleThreaded);
+    double queries_elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(queries_end_t - queries_start_t).count();
+    std::cout << "threads= " << num_threads << ": "
+              << num_samples / queries_elapsed * 1e3 << " Mops/s, "
+              << queries_elapsed / num_samples * num_threads << " ns/op per thread"
+              << std::endl;
+    timestamps.push_back(report_t(num_samples - 1, count_milestone, last_count_milestone, last_elapsed, start_t));
+  }
+  dtlb.disable();
+  dtlb.report(std::cout, num_samples);
+
+  if (wal) {
+    wal->sync();
+    std::cout << "Logged " << wal->num_records() << " writes in " << wal->num_syncs()
+              << " commits" << std::endl;
+  }
+
+  // Persist the inserts. The new archive replaces the old one only once it
+  // is complete and durable, and the page file is only appended to.
+  if (checkpoint) {
+    auto checkpoint_start_t = std::chrono::high_resolution_clock::now();
+    size_t page_file_size = file_size(target_db_path_page);
+    std::string tmp_db_path = target_db_path + ".tmp";
+    {
+      std::ofstream ofs(tmp_db_path);
+      boost::archive::binary_oarchive oa(ofs);
+      oa << index;
+    }
+    if (!sync_file(tmp_db_path)) {
+      std::cerr << "Error syncing " << tmp_db_path << std::endl;
+      exit(1);
+    }
+    std::rename(tmp_db_path.c_str(), target_db_path.c_str());
+    if (wal) {
+      // The log may only be emptied once the rename is durable
+      sync_file(target_db_path.substr(0, target_db_path.rfind('/') + 1) + ".");
+      wal->reset();
     }
+    auto checkpoint_end_t = std::chrono::high_resolution_clock::now();
+    std::cout << "Checkpointed to " << target_db_path << " in "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     checkpoint_end_t - checkpoint_start_t).count() / 1e9
+              << " s" << std::endl;
+    // Changed data nodes are appended whole (see Alex::checkpoint)
+    std::cout << "Appended " << file_size(target_db_path_page) - page_file_size
+              << " bytes to " << target_db_path_page << std::endl;
   }
 
   // Write result to file
@@ -8,6 +8,8 @@
     ./kv_build --keys_file=../resources/fb_1M_uint64 --keys_file_type=sosd --total_num_keys=1000000 --db_path=tmp/alex/fb_1M_uint64
     ./kv_build --keys_file=../resources/gmm_k10_1M_uint64 --keys_file_type=sosd --total_num_keys=1000000 --db_path=tmp/alex/gmm_k10_1M_uint64
     ./kv_build --keys_file=../resources/fb_200M_uint64 --keys_file_type=sosd --total_num_keys=200000000 --db_path=tmp/alex/fb_200M_uint64
+    ./kv_build --keys_file=../resources/fb_200M_uint64 --keys_file_type=sosd --total_num_keys=200000000 --db_path=tmp/alex/fb_200M_uint64 --page_size=4096 --separate_payloads
+    ./kv_build --keys_file=../resources/fb_200M_uint64 --keys_file_type=sosd --total_num_keys=200000000 --db_path=tmp/alex/fb_200M_uint64 --streaming
  */
 
 #include "../core/alex.h"
@@ -59,12 +61,55 @@ void print_stat(alex::Alex<KEY_TYPE, PAYLOAD_TYPE>& index) {
   std::cout << "\tcost_computation_time: " << stats.cost_computation_time << std::endl;
 }
 
+// Serializes index, whose nodes are saved to db_path_page, to db_path and
+// checks that it loads again
+void save_and_test_load(alex::Alex<KEY_TYPE, PAYLOAD_TYPE>& index,
+                        const std::string& db_path,
+                        const std::string& db_path_page) {
+  // Serialize and save to file
+  {
+    auto save_start_time = std::chrono::high_resolution_clock::now();
+    std::ofstream ofs(db_path);
+    boost::archive::binary_oarchive oa(ofs);
+    oa << index;
+    auto save_end_time = std::chrono::high_resolution_clock::now();
+    auto save_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       save_end_time - save_start_time)
+                       .count();
+    std::cout << "Saved to " << db_path << " in " << save_time / 1e9 << " s" << std::endl;
+  }
+
+  // Test load alex from file
+  {
+    alex::ReadPager<KEY_TYPE, PAYLOAD_TYPE> new_pager(db_path_page);
+    alex::Alex<KEY_TYPE, PAYLOAD_TYPE> new_index(&new_pager);
+    std::ifstream ifs(db_path);
+    boost::archive::binary_iarchive ia(ifs);
+    ia >> new_index;
+    std::cout << "Tested loaded from " << db_path << std::endl;
+  }
+}
+
 /*
  * Required flags:
  * --keys_file              path to the file that contains keys
  * --keys_file_type         file type of keys_file (options: binary | text | sosd)
  * --total_num_keys         total number of keys in the keys file
  * --db_path                path to save built alex
+ *
+ * Optional flags:
+ * --page_size              keep node records that fit in a page of this size
+ *                          within one page (default: 0, records are packed)
+ * --separate_payloads      with --page_size, start the payloads of each data
+ *                          node on a page of their own
+ * --threads                bulk load, and save, independent subtrees on
+ *                          this many threads (default: 1)
+ * --streaming              bulk load straight from the mapped keys file,
+ *                          which must be sorted and of type binary or sosd,
+ *                          writing nodes as they are built instead of first
+ *                          reading and sorting all keys in memory
+ * --window_keys            with --streaming, number of keys bulk loaded in
+ *                          memory at a time (default: 4194304)
  */
 int main(int argc, char* argv[]) {
   auto flags = parse_flags(argc, argv);
@@ -73,6 +118,14 @@ int main(int argc, char* argv[]) {
   auto total_num_keys = stoi(get_required(flags, "total_num_keys"));
   std::string db_path = get_required(flags, "db_path");
   std::string db_path_page = db_path + "_page";  // TODO: Configurable
+  alex::FlatFileLayout file_layout;
+  std::stringstream(get_with_default(flags, "page_size", "0")) >> file_layout.page_size;
+  file_layout.separate_payloads = get_boolean_flag(flags, "separate_payloads");
+  int num_threads = stoi(get_with_default(flags, "threads", "1"));
+  bool streaming = get_boolean_flag(flags, "streaming");
+  int window_keys = stoi(get_with_default(
+      flags, "window_keys",
+      std::to_string(alex::Alex<KEY_TYPE, PAYLOAD_TYPE>::kDefaultStreamingWindowKeys)));
 
   // Prepare directory
   if (!fs::is_directory(db_path) || !fs::exists(db_path)) {
@@ -81,6 +134,40 @@ int main(int argc, char* argv[]) {
     std::cout << "Created directory " << db_path_p.parent_path() << std::endl;
   }
 
+  if (streaming) {
+    if (keys_file_type != "binary" && keys_file_type != "sosd") {
+      std::cerr << "--streaming needs --keys_file_type binary or sosd" << std::endl;
+      return 1;
+    }
+    MappedKeys<KEY_TYPE> keys(keys_file_path, total_num_keys, keys_file_type == "sosd");
+    if (keys.data() == nullptr) {
+      std::cerr << "Failed to map " << total_num_keys << " keys of " << keys_file_path
+                << std::endl;
+      return 1;
+    }
+    std::cout << "Mapped dataset of size " << total_num_keys << std::endl;
+
+    // Bulk load with the ranks as payloads, which are the positions in the
+    // sorted file
+    auto bulk_load_start_time = std::chrono::high_resolution_clock::now();
+    alex::WritePager<KEY_TYPE, PAYLOAD_TYPE> pager(db_path_page, file_layout);
+    alex::Alex<KEY_TYPE, PAYLOAD_TYPE> index(&pager);
+    index.set_num_save_threads(num_threads);
+    index.bulk_load_streaming(
+        keys.data(), total_num_keys,
+        [](int i) { return static_cast<PAYLOAD_TYPE>(i); }, window_keys,
+        num_threads);
+    auto bulk_load_end_time = std::chrono::high_resolution_clock::now();
+    auto bulk_load_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            bulk_load_end_time - bulk_load_start_time)
+                            .count();
+    std::cout << "Streaming bulk load completed in " << bulk_load_time / 1e9 << " s"
+              << std::endl;
+    print_stat(index);
+    save_and_test_load(index, db_path, db_path_page);
+    return 0;
+  }
+
   // Read keys from file
   auto keys = new KEY_TYPE[total_num_keys];
   if (keys_file_type == "binary") {
@@ -111,9 +198,10 @@ int main(int argc, char* argv[]) {
 
   // Create ALEX and bulk load
   auto bulk_load_start_time = std::chrono::high_resolution_clock::now();
-  alex::WritePager<KEY_TYPE, PAYLOAD_TYPE> pager(db_path_page);
+  alex::WritePager<KEY_TYPE, PAYLOAD_TYPE> pager(db_path_page, file_layout);
   alex::Alex<KEY_TYPE, PAYLOAD_TYPE> index(&pager);
-  index.bulk_load(values, total_num_keys);
+  index.set_num_save_threads(num_threads);
+  index.bulk_load(values, total_num_keys, num_threads);
   auto bulk_load_end_time = std::chrono::high_resolution_clock::now();
   auto bulk_load_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
                           bulk_load_end_time - bulk_load_start_time)
@@ -121,23 +209,7 @@ int main(int argc, char* argv[]) {
   std::cout << "Bulk load completed in " << bulk_load_time / 1e9 << " s" << std::endl;
   print_stat(index);
 
-  // Serialize and save to file
-  {
-    std::ofstream ofs(db_path);
-    boost::archive::binary_oarchive oa(ofs);
-    oa << index;
-    std::cout << "Saved to " << db_path << std::endl;
-  }
-
-  // Test load alex from file
-  {
-    alex::ReadPager<KEY_TYPE, PAYLOAD_TYPE> new_pager(db_path_page);
-    alex::Alex<KEY_TYPE, PAYLOAD_TYPE> new_index(&new_pager);
-    std::ifstream ifs(db_path);
-    boost::archive::binary_iarchive ia(ifs);
-    ia >> new_index;
-    std::cout << "Tested loaded from " << db_path << std::endl;
-  }
+  save_and_test_load(index, db_path, db_path_page);
 
   delete[] values;
 }
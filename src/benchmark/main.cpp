@@ -30,9 +30,11 @@
  * --lookup_distribution    lookup keys distribution (options: uniform or zipf)
  * --time_limit             time limit, in minutes
  * --print_batch_stats      whether to output stats for each batch
+ * --huge_pages             allocate the index through a HugePageAllocator, on
+ *                          2 MiB pages
  */
-int main(int argc, char* argv[]) {
-  auto flags = parse_flags(argc, argv);
+template <class Alloc>
+int run(const std::map<std::string, std::string>& flags) {
   std::string keys_file_path = get_required(flags, "keys_file");
   std::string keys_file_type = get_required(flags, "keys_file_type");
   auto init_num_keys = stoi(get_required(flags, "init_num_keys"));
@@ -65,7 +67,7 @@ int main(int argc, char* argv[]) {
   }
 
   // Create ALEX and bulk load
-  alex::Alex<KEY_TYPE, PAYLOAD_TYPE> index;
+  alex::Alex<KEY_TYPE, PAYLOAD_TYPE, alex::AlexCompare, Alloc> index(nullptr);
   std::sort(values, values + init_num_keys,
             [](auto const& a, auto const& b) { return a.first < b.first; });
   index.bulk_load(values, init_num_keys);
@@ -79,6 +81,7 @@ int main(int argc, char* argv[]) {
   double cumulative_insert_time = 0;
   double cumulative_lookup_time = 0;
 
+  DtlbCounter lookup_dtlb;
   auto workload_start_time = std::chrono::high_resolution_clock::now();
   int batch_no = 0;
   PAYLOAD_TYPE sum = 0;
@@ -100,6 +103,7 @@ int main(int argc, char* argv[]) {
                   << std::endl;
         return 1;
       }
+      lookup_dtlb.enable();
       auto lookups_start_time = std::chrono::high_resolution_clock::now();
       for (int j = 0; j < num_lookups_per_batch; j++) {
         KEY_TYPE key = lookup_keys[j];
@@ -109,6 +113,7 @@ int main(int argc, char* argv[]) {
         }
       }
       auto lookups_end_time = std::chrono::high_resolution_clock::now();
+      lookup_dtlb.disable();
       batch_lookup_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
                               lookups_end_time - lookups_start_time)
                               .count();
@@ -181,7 +186,18 @@ int main(int argc, char* argv[]) {
             << " inserts/sec,\t"
             << cumulative_operations / cumulative_time * 1e9 << " ops/sec"
             << std::endl;
+  std::cout << "Lookups: ";
+  lookup_dtlb.report(std::cout, cumulative_lookups);
 
   delete[] keys;
   delete[] values;
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  auto flags = parse_flags(argc, argv);
+  if (get_boolean_flag(flags, "huge_pages")) {
+    return run<alex::HugePageAllocator<std::pair<KEY_TYPE, PAYLOAD_TYPE>>>(flags);
+  }
+  return run<std::allocator<std::pair<KEY_TYPE, PAYLOAD_TYPE>>>(flags);
 }
@@ -1,6 +1,17 @@
 // Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
 #include "zipf.h"
 
 template <class T>
@@ -47,6 +58,162 @@ bool load_sosd_data(T data[], int length, const std::string& file_path) {
   return true;
 }
 
+// Keys of a binary or SOSD file mapped in memory instead of read into an
+// array, so that a sequential pass over them only keeps a few pages resident
+template <class T>
+class MappedKeys {
+ public:
+  // Maps the first length keys of the file, after the 8-byte key count of a
+  // SOSD file. data() is null if that fails.
+  MappedKeys(const std::string& file_path, int length, bool sosd) {
+    size_t header_size = sosd ? sizeof(uint64_t) : 0;
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    map_size_ = header_size + length * sizeof(T);
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= map_size_) {
+      void* addr = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        madvise(addr, map_size_, MADV_SEQUENTIAL);
+        addr_ = addr;
+        data_ = reinterpret_cast<const T*>(static_cast<char*>(addr) + header_size);
+      }
+    }
+    close(fd);
+  }
+
+  MappedKeys(const MappedKeys&) = delete;
+  MappedKeys& operator=(const MappedKeys&) = delete;
+
+  ~MappedKeys() {
+    if (addr_ != nullptr) {
+      munmap(addr_, map_size_);
+    }
+  }
+
+  const T* data() const { return data_; }
+
+ private:
+  void* addr_ = nullptr;
+  size_t map_size_ = 0;
+  const T* data_ = nullptr;
+};
+
+// Makes a written file durable before it replaces another one
+inline bool sync_file(const std::string& file_path) {
+  int fd = open(file_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool synced = (fsync(fd) == 0);
+  close(fd);
+  return synced;
+}
+
+// Size in bytes of a file, or 0 if it cannot be read
+inline size_t file_size(const std::string& file_path) {
+  struct stat statbuf;
+  if (stat(file_path.c_str(), &statbuf) != 0) {
+    return 0;
+  }
+  return static_cast<size_t>(statbuf.st_size);
+}
+
+// Counts the loads that miss the data TLB, on the calling thread and the
+// threads it creates afterwards, while enabled. Hardware counters are not
+// exposed by every kernel or hypervisor, in which case nothing is counted.
+class DtlbCounter {
+ public:
+  DtlbCounter() {
+    misses_fd_ = open_counter(PERF_COUNT_HW_CACHE_RESULT_MISS);
+    if (misses_fd_ < 0) {
+      error_ = errno;
+      return;
+    }
+    loads_fd_ = open_counter(PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+  }
+
+  DtlbCounter(const DtlbCounter&) = delete;
+  DtlbCounter& operator=(const DtlbCounter&) = delete;
+
+  ~DtlbCounter() {
+    if (misses_fd_ >= 0) {
+      close(misses_fd_);
+    }
+    if (loads_fd_ >= 0) {
+      close(loads_fd_);
+    }
+  }
+
+  void enable() { set_enabled(true); }
+  void disable() { set_enabled(false); }
+
+  // Prints the misses per operation and per load, or why they were not
+  // counted, and how much of the process's memory is on huge pages
+  void report(std::ostream& os, size_t num_ops) const {
+    if (misses_fd_ < 0) {
+      os << "dTLB misses: not counted (" << strerror(error_) << ")";
+    } else {
+      long long misses = read_counter(misses_fd_);
+      long long loads = read_counter(loads_fd_);
+      os << "dTLB misses: " << misses << ", " << (double) misses / num_ops << " per op";
+      if (loads > 0) {
+        os << ", " << 100.0 * misses / loads << "% of loads";
+      }
+    }
+    os << "; huge pages: " << (smaps_kb("AnonHugePages:") >> 10) << " MiB transparent, "
+       << (smaps_kb("Private_Hugetlb:") >> 10) << " MiB from the pool" << std::endl;
+  }
+
+ private:
+  static int open_counter(uint64_t result) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+  }
+
+  static long long read_counter(int fd) {
+    long long count = 0;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+      return 0;
+    }
+    return count;
+  }
+
+  // The field of /proc/self/smaps_rollup, in KiB
+  static size_t smaps_kb(const std::string& field) {
+    std::ifstream is("/proc/self/smaps_rollup");
+    std::string line;
+    while (std::getline(is, line)) {
+      if (line.compare(0, field.size(), field) == 0) {
+        return std::stoull(line.substr(field.size()));
+      }
+    }
+    return 0;
+  }
+
+  void set_enabled(bool enabled) {
+    for (int fd : {misses_fd_, loads_fd_}) {
+      if (fd >= 0) {
+        ioctl(fd, enabled ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+      }
+    }
+  }
+
+  int misses_fd_ = -1;
+  int loads_fd_ = -1;
+  int error_ = 0;
+};
+
 template <class T>
 T* get_search_keys(T array[], int num_keys, int num_searches) {
   std::mt19937_64 gen(std::random_device{}());
@@ -3,13 +3,18 @@
 
 /*
  * ALEX with key type T and payload type P, combined type V=std::pair<T, P>.
+ * An index instantiated with NodeStorage::kInMemory has no pager, which makes
+ * its lookups cheaper (see pager.h).
  * Iterating through keys is done using an "Iterator".
  * Iterating through tree nodes is done using a "NodeIterator".
  *
  * Core user-facing API of Alex:
  * - Alex()
  * - void bulk_load(V values[], int num_keys)
+ * - void bulk_load_streaming(T keys[], int num_keys, PayloadFn payload_of)
  * - void insert(T key, P payload)
+ * - size_t bulk_insert(V values[], int num_keys)  // sorted by key
+ * - bool update(T key, P payload)
  * - int erase_one(T key)
  * - int erase(T key)
  * - Iterator find(T key)  // for exact match
@@ -17,6 +22,8 @@
  * - Iterator end()
  * - Iterator lower_bound(T key)
  * - Iterator upper_bound(T key)
+ * - size_t scan(T lo, T hi, Callback callback)  // keys in [lo, hi)
+ * - size_t scan_n(T lo, size_t n, V out[])
  *
  * User-facing API of Iterator:
  * - void operator ++ ()  // post increment
@@ -38,6 +45,7 @@
 #include "alex_base.h"
 #include "alex_fanout_tree.h"
 #include "alex_nodes.h"
+#include "wal.h"
 
 // Whether we account for floating-point precision issues when traversing down
 // ALEX.
@@ -50,7 +58,8 @@ namespace alex {
 
 template <class T, class P, class Compare = AlexCompare,
           class Alloc = std::allocator<std::pair<T, P>>,
-          bool allow_duplicates = true>
+          bool allow_duplicates = true,
+          NodeStorage storage = NodeStorage::kPaged>
 class Alex {
   static_assert(std::is_arithmetic<T>::value, "ALEX key type must be numeric.");
   static_assert(std::is_same<Compare, AlexCompare>::value,
@@ -61,11 +70,9 @@ class Alex {
   typedef std::pair<T, P> V;
 
   // ALEX class aliases
-  typedef Alex<T, P, Compare, Alloc, allow_duplicates> self_type;
+  typedef Alex<T, P, Compare, Alloc, allow_duplicates, storage> self_type;
   typedef AlexModelNode<T, P, Alloc> model_node_type;
   typedef AlexDataNode<T, P, Compare, Alloc, allow_duplicates> data_node_type;
-  typedef Chunk<T, P, Compare, Alloc> chunk_type;
-  typedef DataChunk<T, P, Compare, Alloc> data_chunk_type;
 
   // Forward declaration for iterators
   class Iterator;
@@ -109,7 +116,7 @@ class Alex {
 
   /* Counters, useful for benchmarking and profiling */
   struct Stats {
-    int num_keys = 0;
+    mutable int num_keys = 0;
     int num_model_nodes = 0;  // num model nodes
     int num_data_nodes = 0;   // num data nodes
     int num_expand_and_scales = 0;
@@ -124,7 +131,7 @@ class Alex {
     long long num_model_node_split_pointers = 0;
     mutable long long num_node_lookups = 0;
     mutable long long num_lookups = 0;
-    long long num_inserts = 0;
+    mutable long long num_inserts = 0;
     double splitting_time = 0;
     double cost_computation_time = 0;
   };
@@ -204,17 +211,48 @@ class Alex {
   // expected number of OOD due to randomness by greater than the tolereance
   // factor.
   static const int kOutOfDomainToleranceFactor = 2;
+  // bulk_insert merges a group of values into its data node, rather than
+  // inserting them one at a time, once the data node holds fewer than this
+  // many keys per value. Merging copies every key of the node, at a small
+  // fraction of the cost of one insert.
+  static const int kBulkInsertMergeRatio = 4;
 
   Compare key_less_ = Compare();
   Alloc allocator_ = Alloc();
 
   // For serialization and lazy deserialization
   Pager<T, P>* pager_ = nullptr;
+  int num_save_threads_ = 1;  // see set_num_save_threads()
+  // Where serializing saves the nodes instead of pager_, see save_compacted()
+  Pager<T, P>* compact_pager_ = nullptr;
+
+  // Where writes are logged until the next checkpoint, see set_wal()
+  WriteAheadLog<T, P>* wal_ = nullptr;
+  // LSN of the last logged write that the index reflects
+  uint64_t wal_lsn_ = 0;
+
+  // Whether, and how, the index is shared between threads
+  ConcurrencyMode concurrency_mode_ = ConcurrencyMode::kSingleThreaded;
+  // Lookup statistics of concurrent readers, which are folded into stats_ by
+  // get_stats()
+  mutable ShardedCounter concurrent_num_lookups_;
+  mutable ShardedCounter concurrent_num_node_lookups_;
+  // In multi-writer mode, serializes structural modifications (see
+  // lock_structure()), and counts the effect of the other writes
+  std::mutex structure_mutex_;
+  mutable ShardedCounter concurrent_num_keys_;
+  mutable ShardedCounter concurrent_num_inserts_;
+  // Same for the keys outside the key domain, which are folded into istats_
+  ShardedCounter concurrent_num_keys_above_key_domain_;
+  ShardedCounter concurrent_num_keys_below_key_domain_;
+  // Makes the reorganizations of data nodes that inserts defer, see
+  // set_background_reorganization()
+  std::unique_ptr<BackgroundWorker> reorganizer_;
 
   /*** Constructors and setters ***/
 
  public:
-  Alex(Pager<T, P>* pager) : pager_(pager) {
+  Alex(Pager<T, P>* pager) : pager_(checked_pager(pager)) {
     // Set up root as empty data node
     auto empty_data_node = new (data_node_allocator().allocate(1))
         data_node_type(pager_, key_less_, allocator_);
@@ -225,7 +263,7 @@ class Alex {
   }
 
   Alex(Pager<T, P>* pager, const Compare& comp, const Alloc& alloc = Alloc())
-      : pager_(pager), key_less_(comp), allocator_(alloc) {
+      : pager_(checked_pager(pager)), key_less_(comp), allocator_(alloc) {
     // Set up root as empty data node
     auto empty_data_node = new (data_node_allocator().allocate(1))
         data_node_type(pager_, key_less_, allocator_);
@@ -235,7 +273,8 @@ class Alex {
     create_superroot();
   }
 
-  Alex(Pager<T, P>* pager, const Alloc& alloc) : pager_(pager), allocator_(alloc) {
+  Alex(Pager<T, P>* pager, const Alloc& alloc)
+      : pager_(checked_pager(pager)), allocator_(alloc) {
     // Set up root as empty data node
     auto empty_data_node = new (data_node_allocator().allocate(1))
         data_node_type(key_less_, allocator_);
@@ -246,11 +285,22 @@ class Alex {
   }
 
   ~Alex() {
-    for (NodeIterator node_it = NodeIterator(this); !node_it.is_end();
+    // Queued reorganizations still run on the tree
+    reorganizer_.reset();
+    // Nodes that were never recovered from the pager have nothing to free
+    for (NodeIterator node_it = NodeIterator(this, true); !node_it.is_end();
          node_it.next()) {
       delete_node(node_it.current());
     }
     delete_node(superroot_);
+    if (is_concurrent()) {
+      // Retired nodes refer to our allocator
+      EpochManager::instance().barrier();
+    }
+#if ALEX_NODE_ARENA
+    // Hand the slabs that held the nodes back to the kernel
+    NodeArena::instance().trim();
+#endif
   }
 
   // Initializes with range [first, last). The range does not need to be
@@ -259,7 +309,7 @@ class Alex {
   template <class InputIterator>
   explicit Alex(InputIterator first, InputIterator last, Pager<T, P>* pager, const Compare& comp,
                 const Alloc& alloc = Alloc())
-      : pager_(pager), key_less_(comp), allocator_(alloc) {
+      : pager_(checked_pager(pager)), key_less_(comp), allocator_(alloc) {
     std::vector<V> values;
     for (auto it = first; it != last; ++it) {
       values.push_back(*it);
@@ -278,7 +328,7 @@ class Alex {
   explicit Alex(InputIterator first, InputIterator last,
                 Pager<T, P>* pager,
                 const Alloc& alloc = Alloc())
-      : pager_(pager), allocator_(alloc) {
+      : pager_(checked_pager(pager)), allocator_(alloc) {
     std::vector<V> values;
     for (auto it = first; it != last; ++it) {
       values.push_back(*it);
@@ -301,11 +351,15 @@ class Alex {
         allocator_(other.allocator_) {
     superroot_ =
         static_cast<model_node_type*>(copy_tree_recursive(other.superroot_));
-    root_node_ = superroot_->children_[0]->get(pager_);
+    root_node_ = child_node(superroot_->children_[0]);
   }
 
   Alex& operator=(const self_type& other) {
     if (this != &other) {
+      // Queued reorganizations of the old tree still run
+      if (reorganizer_) {
+        reorganizer_.reset(new BackgroundWorker());
+      }
       for (NodeIterator node_it = NodeIterator(this); !node_it.is_end();
            node_it.next()) {
         delete_node(node_it.current());
@@ -321,7 +375,7 @@ class Alex {
       allocator_ = other.allocator_;
       superroot_ =
           static_cast<model_node_type*>(copy_tree_recursive(other.superroot_));
-      root_node_ = superroot_->children_[0]->get(pager_);
+      root_node_ = child_node(superroot_->children_[0]);
     }
     return *this;
   }
@@ -340,6 +394,14 @@ class Alex {
   }
 
  private:
+  // A kInMemory index cannot recover or save nodes through a pager
+  static Pager<T, P>* checked_pager(Pager<T, P>* pager) {
+    if (storage == NodeStorage::kInMemory && pager != nullptr) {
+      throw std::invalid_argument("An in-memory index does not use a pager");
+    }
+    return pager;
+  }
+
   // Deep copy of tree starting at given node
   AlexNode<T, P>* copy_tree_recursive(const AlexNode<T, P>* node) {
     if (!node) return nullptr;
@@ -351,11 +413,11 @@ class Alex {
           model_node_type(*static_cast<const model_node_type*>(node));
       int cur = 0;
       while (cur < node_copy->num_children_) {
-        AlexNode<T, P>* child_node = node_copy->children_[cur]->get(pager_);
+        AlexNode<T, P>* child_node = child_node(node_copy->children_[cur]);
         AlexNode<T, P>* child_node_copy = copy_tree_recursive(child_node);
         int repeats = 1 << child_node_copy->duplication_factor_;
         for (int i = cur; i < cur + repeats; i++) {
-          node_copy->children_[i] = new LazyAlexNode(child_node_copy, pager_);
+          node_copy->children_[i] = ChildRef<T, P>(child_node_copy);
         }
         cur += repeats;
       }
@@ -397,8 +459,182 @@ class Alex {
     params_.approximate_cost_computation = approximate_cost_computation;
   }
 
+  // In ConcurrencyMode::kSingleWriter, get_payload(key, &payload) may be
+  // called from any number of threads while one thread at a time calls
+  // insert() or erase(). Readers do not lock: they validate node versions and
+  // retry if a writer changed a node they looked at. In
+  // ConcurrencyMode::kMultiWriter, any number of threads may also call
+  // insert() and erase(). Writes that stay within a data node lock only that
+  // node, while splits, merges and root expansions are made one at a time.
+  // A concurrent write may move or free any payload, so lookups that return
+  // pointers or iterators into the index throw in both modes. All other
+  // methods, including bulk loading, serialization and this one, still
+  // require exclusive access.
+  void set_concurrency_mode(ConcurrencyMode mode) {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    // Readers in a concurrent mode only search the slots
+    if (mode != ConcurrencyMode::kSingleThreaded) {
+      for (NodeIterator node_it(this, true); !node_it.is_end();
+           node_it.next()) {
+        if (node_it.current()->is_leaf_) {
+          static_cast<data_node_type*>(node_it.current())->merge_delta();
+        }
+      }
+    }
+#endif
+    if (mode != ConcurrencyMode::kMultiWriter) {
+      reorganizer_.reset();
+    }
+    fold_key_domain_counts();
+    concurrency_mode_ = mode;
+  }
+
+  ConcurrencyMode get_concurrency_mode() const { return concurrency_mode_; }
+
+  // In ConcurrencyMode::kMultiWriter, lets an insert leave the expansion,
+  // retraining or split of its data node to a background thread, so that its
+  // latency does not depend on the cost of reorganizing the node. Until then,
+  // the node keeps taking inserts into its gaps past its expansion threshold,
+  // and only an insert into a node that is still 95% full reorganizes it
+  // itself. Readers see those keys like any other. Methods that require
+  // exclusive access, including this one, must not overlap with queued
+  // reorganizations either, so call wait_for_reorganization() before them.
+  // Leaving kMultiWriter disables background reorganization.
+  void set_background_reorganization(bool enabled) {
+    if (enabled && !is_multi_writer()) {
+      throw std::invalid_argument(
+          "Background reorganization requires ConcurrencyMode::kMultiWriter");
+    }
+    if (!enabled) {
+      reorganizer_.reset();
+    } else if (!reorganizer_) {
+      reorganizer_.reset(new BackgroundWorker());
+    }
+  }
+
+  bool get_background_reorganization() const { return reorganizer_ != nullptr; }
+
+  // Waits until the reorganizations that inserts deferred so far are made.
+  // Rethrows the first exception that one of them threw.
+  void wait_for_reorganization() {
+    if (reorganizer_) {
+      reorganizer_->drain();
+    }
+  }
+
+  // Serializing with a pager writes independent subtrees on this many
+  // threads, if the pager takes concurrent saves like WritePager does
+  void set_num_save_threads(int num_threads) { num_save_threads_ = num_threads; }
+
+  // Logs every insert, erase and update() to wal, so that replay_wal can redo
+  // them on top of the last checkpoint after a crash. Serializing the index
+  // saves the LSN of the last logged write with it, after which wal can be
+  // reset. Replay the log before setting it, and unset it with nullptr before
+  // it is destroyed. Copies of the index do not log. Payloads updated through
+  // pointers or iterators are not logged.
+  void set_wal(WriteAheadLog<T, P>* wal) {
+    // The index reflects everything logged so far, which it still has to
+    // save once the log is unset
+    wal_lsn_ = wal_lsn();
+    wal_ = wal;
+  }
+
+  // Redoes the writes logged in wal after the ones that the index was
+  // serialized with, and returns their number. Throws if wal was reset past
+  // those, i.e., writes since the checkpoint are missing. The replayed writes
+  // are not logged again.
+  size_t replay_wal(const WriteAheadLog<T, P>& wal) {
+    if (wal.base_lsn() > wal_lsn_) {
+      throw std::runtime_error("Write-ahead log starts at LSN " +
+                               std::to_string(wal.base_lsn() + 1) +
+                               ", after the checkpoint at LSN " +
+                               std::to_string(wal_lsn_));
+    }
+    WriteAheadLog<T, P>* current_wal = wal_;
+    wal_ = nullptr;
+    size_t num_replayed = 0;
+    try {
+      wal.replay(wal_lsn_, [this, &num_replayed](const WalRecord<T, P>& record) {
+        replay_write(record);
+        wal_lsn_ = record.lsn;
+        num_replayed++;
+      });
+    } catch (...) {
+      wal_ = current_wal;
+      throw;
+    }
+    wal_ = current_wal;
+    return num_replayed;
+  }
+
+  // LSN of the last logged write that the index reflects
+  uint64_t wal_lsn() const { return wal_ ? wal_->last_lsn() : wal_lsn_; }
+
+  // Saves the nodes to the pager and returns the offset of the root record.
+  // Only nodes that changed since they were last saved to, or recovered from,
+  // the pager are written, together with their ancestors, which is all that
+  // the first save writes. For an index loaded through a ReadPager, that
+  // appends the nodes changed by inserts, erases and splits to its file.
+  // Serializing the index calls this, then saves the returned offset, so that
+  // loading it again finds the changes. Payloads updated through pointers or
+  // iterators do not count as changes.
+  //
+  // Write amplification: a changed data node is written whole, however few of
+  // its keys changed, i.e. up to max_node_size bytes (16MB by default) for a
+  // single insert, plus a record for each model node above it. Records are
+  // only ever appended, so that a crash leaves the previous checkpoint valid,
+  // and the page file grows by that much with every checkpoint while keeping
+  // the records that it superseded. A smaller max node size bounds the
+  // amplification, and save_compacted writes a page file without the
+  // superseded records.
+  size_t checkpoint() {
+    std::unique_ptr<ThreadPool> pool;
+    if (num_save_threads_ > 1 && pager_->concurrent_saves()) {
+      pool.reset(new ThreadPool(num_save_threads_));
+    }
+    size_t root_offset = root_node_->save_flat(pager_, pool.get()).offset;
+    pager_->flush();
+    return root_offset;
+  }
+
+  // Writes every node to pager, which should write to a new page file, and
+  // returns the offset of the root record there. The file holds only the
+  // records of the index as it is now, however many checkpoints its own page
+  // file went through. The index keeps checkpointing to its own pager.
+  size_t compact(Pager<T, P>* pager) {
+    size_t root_offset = root_node_->copy_flat(pager).offset;
+    pager->flush();
+    return root_offset;
+  }
+
+  // Serializes the index to ar as if its pager were pager: the nodes go to
+  // pager through compact(), and loading ar needs a pager on that page file.
+  // Once both are durable, they can replace the archive and page file that
+  // the index was loaded from.
+  template <class Archive>
+  void save_compacted(Archive& ar, Pager<T, P>* pager) {
+    compact_pager_ = pager;
+    try {
+      ar << *this;
+    } catch (...) {
+      compact_pager_ = nullptr;
+      throw;
+    }
+    compact_pager_ = nullptr;
+  }
+
   /*** General helpers ***/
 
+  // The node that a child slot points to, recovered from the pager if needed.
+  // In a kInMemory index, every slot already holds its node.
+  forceinline AlexNode<T, P>* child_node(ChildRef<T, P> slot) const {
+    if constexpr (storage == NodeStorage::kInMemory) {
+      return slot.loaded();
+    } else {
+      return slot.get(pager_);
+    }
+  }
+
  public:
 // Return the data node that contains the key (if it exists).
 // Also optionally return the traversal path to the data node.
@@ -425,42 +661,73 @@ class Alex {
       if (traversal_path) {
         traversal_path->push_back({node, bucketID});
       }
-      cur = node->children_[bucketID]->get(pager_);
+      cur = child_node(node->children_[bucketID]);
       if (cur->is_leaf_) {
         stats_.num_node_lookups += cur->level_;
         auto leaf = static_cast<data_node_type*>(cur);
-        // Doesn't really matter if rounding is incorrect, we just want it to be
-        // fast.
-        // So we don't need to use std::round or std::lround.
-        int bucketID_prediction_rounded =
-            static_cast<int>(bucketID_prediction + 0.5);
-        double tolerance =
-            10 * std::numeric_limits<double>::epsilon() * bucketID_prediction;
-        // https://stackoverflow.com/questions/17333/what-is-the-most-effective-way-for-float-and-double-comparison
-        if (std::abs(bucketID_prediction - bucketID_prediction_rounded) <=
-            tolerance) {
-          if (bucketID_prediction_rounded <= bucketID_prediction) {
-            if (leaf->prev_leaf_ && leaf->prev_leaf_->last_key() >= key) {
-              if (traversal_path) {
-                // Correct the traversal path
-                correct_traversal_path(leaf, *traversal_path, true);
-              }
-              return leaf->prev_leaf_;
-            }
-          } else {
-            if (leaf->next_leaf_ && leaf->next_leaf_->first_key() <= key) {
-              if (traversal_path) {
-                // Correct the traversal path
-                correct_traversal_path(leaf, *traversal_path, false);
-              }
-              return leaf->next_leaf_;
-            }
+        data_node_type* neighbor;
+        int direction =
+            neighbor_leaf_direction(leaf, key, bucketID_prediction, &neighbor);
+        if (direction < 0) {
+          if (traversal_path) {
+            // Correct the traversal path
+            correct_traversal_path(leaf, *traversal_path, true);
+          }
+          return neighbor;
+        } else if (direction > 0) {
+          if (traversal_path) {
+            // Correct the traversal path
+            correct_traversal_path(leaf, *traversal_path, false);
           }
+          return neighbor;
         }
         return leaf;
       }
     }
   }
+
+  // A key whose bucket prediction in the leaf's parent falls on a bucket
+  // boundary may actually live in the neighboring leaf, due to floating point
+  // rounding. Returns -1 (or 1) if the key belongs to the previous (or next)
+  // leaf, which is then stored in *neighbor, and 0 if it belongs to leaf.
+  forceinline int neighbor_leaf_direction(data_node_type* leaf, const T& key,
+                                          double bucketID_prediction,
+                                          data_node_type** neighbor) const {
+    int side = bucket_boundary_side(bucketID_prediction);
+    if (side < 0) {
+      data_node_type* prev = prev_leaf(leaf, &key);
+      if (prev && prev->last_key() >= key) {
+        *neighbor = prev;
+        return -1;
+      }
+    } else if (side > 0) {
+      data_node_type* next = next_leaf(leaf, &key);
+      if (next && next->first_key() <= key) {
+        *neighbor = next;
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  // Returns -1 (or 1) if the bucket prediction lies just above (or below) a
+  // bucket boundary, so that the key may belong to the previous (or next)
+  // leaf, and 0 otherwise.
+  forceinline int bucket_boundary_side(double bucketID_prediction) const {
+    // Doesn't really matter if rounding is incorrect, we just want it to be
+    // fast.
+    // So we don't need to use std::round or std::lround.
+    int bucketID_prediction_rounded =
+        static_cast<int>(bucketID_prediction + 0.5);
+    double tolerance =
+        10 * std::numeric_limits<double>::epsilon() * bucketID_prediction;
+    // https://stackoverflow.com/questions/17333/what-is-the-most-effective-way-for-float-and-double-comparison
+    if (std::abs(bucketID_prediction - bucketID_prediction_rounded) <=
+        tolerance) {
+      return bucketID_prediction_rounded <= bucketID_prediction ? -1 : 1;
+    }
+    return 0;
+  }
 #else
   data_node_type* get_leaf(
       T key, std::vector<TraversalNode>* traversal_path = nullptr) const {
@@ -508,13 +775,13 @@ class Alex {
         }
         int correct_bucketID = start_bucketID - 1;
         tn.bucketID = correct_bucketID;
-        AlexNode<T, P>* cur = parent->children_[correct_bucketID]->get(pager_);
+        AlexNode<T, P>* cur = child_node(parent->children_[correct_bucketID]);
         while (!cur->is_leaf_) {
           auto node = static_cast<model_node_type*>(cur);
           traversal_path.push_back({node, node->num_children_ - 1});
-          cur = node->children_[node->num_children_ - 1]->get(pager_);
+          cur = child_node(node->children_[node->num_children_ - 1]);
         }
-        assert(cur == leaf->prev_leaf_);
+        assert(cur == prev_leaf(leaf));
       } else {
         tn.bucketID = start_bucketID - 1;
       }
@@ -535,13 +802,13 @@ class Alex {
         }
         int correct_bucketID = end_bucketID;
         tn.bucketID = correct_bucketID;
-        AlexNode<T, P>* cur = parent->children_[correct_bucketID]->get(pager_);
+        AlexNode<T, P>* cur = child_node(parent->children_[correct_bucketID]);
         while (!cur->is_leaf_) {
           auto node = static_cast<model_node_type*>(cur);
           traversal_path.push_back({node, 0});
-          cur = node->children_[0]->get(pager_);
+          cur = child_node(node->children_[0]);
         }
-        assert(cur == leaf->next_leaf_);
+        assert(cur == next_leaf(leaf));
       } else {
         tn.bucketID = end_bucketID;
       }
@@ -553,9 +820,11 @@ class Alex {
     AlexNode<T, P>* cur = root_node_;
 
     while (!cur->is_leaf_) {
-      cur = static_cast<model_node_type*>(cur)->children_[0]->get(pager_);
+      cur = child_node(static_cast<model_node_type*>(cur)->children_[0]);
     }
-    return static_cast<data_node_type*>(cur);
+    auto leaf = static_cast<data_node_type*>(cur);
+    leaf->merge_delta();
+    return leaf;
   }
 
   // Return right-most data node
@@ -564,9 +833,11 @@ class Alex {
 
     while (!cur->is_leaf_) {
       auto node = static_cast<model_node_type*>(cur);
-      cur = node->children_[node->num_children_ - 1]->get(pager_);
+      cur = child_node(node->children_[node->num_children_ - 1]);
     }
-    return static_cast<data_node_type*>(cur);
+    auto leaf = static_cast<data_node_type*>(cur);
+    leaf->merge_delta();
+    return leaf;
   }
 
   // Returns minimum key in the index
@@ -608,6 +879,323 @@ class Alex {
     }
   }
 
+  // The data node after (or before) leaf in key order, or nullptr if there is
+  // none. A data node recovered from a pager does not know its neighbors
+  // until they are first asked for: they are then found through its parents
+  // and linked, except in a concurrent mode, where they are found again on
+  // every call. key, if given, is one that leads get_leaf to leaf, for when
+  // leaf has no key of its own to be found by.
+  // Also merges the delta buffer of the data node it returns, for the
+  // iterators that go on to read its slots.
+  forceinline data_node_type* next_leaf(const data_node_type* leaf,
+                                        const T* key = nullptr) const {
+    data_node_type* next = leaf->next_leaf_;
+    if constexpr (storage == NodeStorage::kPaged) {
+      if (next == data_node_type::unlinked_leaf()) {
+        next = link_leaf(leaf, true, key);
+      }
+    }
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    if (next != nullptr) {
+      next->merge_delta();
+    }
+#endif
+    return next;
+  }
+
+  forceinline data_node_type* prev_leaf(const data_node_type* leaf,
+                                        const T* key = nullptr) const {
+    data_node_type* prev = leaf->prev_leaf_;
+    if constexpr (storage == NodeStorage::kPaged) {
+      if (prev == data_node_type::unlinked_leaf()) {
+        prev = link_leaf(leaf, false, key);
+      }
+    }
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    if (prev != nullptr) {
+      prev->merge_delta();
+    }
+#endif
+    return prev;
+  }
+
+  // An iterator that starts in the empty leaf that get_leaf(key) returned
+  // moves on to the next data node, which it could not find by the leaf's
+  // keys
+  void link_empty_leaf(const data_node_type* leaf, const T& key) const {
+    if (leaf->num_keys_ == 0) {
+      next_leaf(leaf, &key);
+    }
+  }
+
+  // Finds the neighbors that leaf does not know yet, before a structural
+  // modification replaces it. traversal_path ends at the parent of leaf.
+  void link_leaf_neighbors(data_node_type* leaf,
+                           const std::vector<TraversalNode>& traversal_path) {
+    if constexpr (storage == NodeStorage::kPaged) {
+      for (bool next : {false, true}) {
+        if ((next ? leaf->next_leaf_ : leaf->prev_leaf_) ==
+            data_node_type::unlinked_leaf()) {
+          std::vector<TraversalNode> path = traversal_path;
+          link_on_path(leaf, path, next, true);
+        }
+      }
+    }
+  }
+
+  data_node_type* link_leaf(const data_node_type* leaf, bool next,
+                            const T* key) const {
+    std::vector<TraversalNode> traversal_path;
+    if (!find_traversal_path(leaf, key, &traversal_path)) {
+      throw std::runtime_error("Data node is not reachable from the root");
+    }
+    return link_on_path(const_cast<data_node_type*>(leaf), traversal_path,
+                        next, !is_concurrent());
+  }
+
+  // Moves traversal_path, which ends at the parent of leaf, to the data node
+  // after (or before) leaf, and returns that node. With link, also links the
+  // two, then goes on linking the empty data nodes that follow, up to a
+  // non-empty one, since an iterator crossing them has no key to find them
+  // by.
+  data_node_type* link_on_path(data_node_type* leaf,
+                               std::vector<TraversalNode>& traversal_path,
+                               bool next, bool link) const {
+    data_node_type* neighbor = next ? next_leaf_on_path(leaf, traversal_path)
+                                    : prev_leaf_on_path(leaf, traversal_path);
+    data_node_type* cur = leaf;
+    data_node_type* found = neighbor;
+    while (link) {
+      if (next) {
+        cur->next_leaf_ = found;
+        if (found != nullptr) {
+          found->prev_leaf_ = cur;
+        }
+      } else {
+        cur->prev_leaf_ = found;
+        if (found != nullptr) {
+          found->next_leaf_ = cur;
+        }
+      }
+      if (found == nullptr || found->num_keys_ > 0 ||
+          (next ? found->next_leaf_ : found->prev_leaf_) !=
+              data_node_type::unlinked_leaf()) {
+        break;
+      }
+      cur = found;
+      found = next ? next_leaf_on_path(cur, traversal_path)
+                   : prev_leaf_on_path(cur, traversal_path);
+    }
+    return neighbor;
+  }
+
+  // Writes the traversal path from the superroot to leaf's parent. Finds
+  // leaf by its first key, or by key if it has none, or at either end of the
+  // index, and failing that by walking the nodes that are in memory, as the
+  // ancestors of leaf are. Returns false if leaf is not in the index.
+  bool find_traversal_path(const data_node_type* leaf, const T* key,
+                           std::vector<TraversalNode>* traversal_path) const {
+    if (leaf->num_keys_ > 0) {
+      if (traversal_path_by_key(leaf, leaf->first_key(), traversal_path)) {
+        return true;
+      }
+    } else if (key != nullptr) {
+      if (traversal_path_by_key(leaf, *key, traversal_path)) {
+        return true;
+      }
+    } else if (!key_less_(leaf->max_key_, leaf->min_key_)) {
+      // min_key_ is a key that leaf held
+      if (traversal_path_by_key(leaf, leaf->min_key_, traversal_path)) {
+        return true;
+      }
+    }
+    for (bool leftmost : {true, false}) {
+      traversal_path->assign(1, {superroot_, 0});
+      AlexNode<T, P>* cur = root_node_;
+      while (!cur->is_leaf_) {
+        auto node = static_cast<model_node_type*>(cur);
+        int bucketID = leftmost ? 0 : node->num_children_ - 1;
+        traversal_path->push_back({node, bucketID});
+        cur = child_node(node->children_[bucketID]);
+      }
+      if (cur == leaf) {
+        return true;
+      }
+    }
+    // Depth-first, through the children in memory only
+    traversal_path->assign(1, {superroot_, 0});
+    if (root_node_->is_leaf_) {
+      return root_node_ == leaf;
+    }
+    traversal_path->push_back({static_cast<model_node_type*>(root_node_), 0});
+    while (traversal_path->size() > 1) {
+      TraversalNode& tn = traversal_path->back();
+      if (tn.bucketID >= tn.node->num_children_) {
+        int repeats = 1 << tn.node->duplication_factor_;
+        traversal_path->pop_back();
+        traversal_path->back().bucketID += repeats;
+        continue;
+      }
+      AlexNode<T, P>* child = tn.node->children_[tn.bucketID].loaded();
+      if (child == leaf) {
+        return true;
+      } else if (child == nullptr) {
+        tn.bucketID++;
+      } else if (child->is_leaf_) {
+        tn.bucketID += 1 << child->duplication_factor_;
+      } else {
+        traversal_path->push_back({static_cast<model_node_type*>(child), 0});
+      }
+    }
+    return false;
+  }
+
+  // Writes the traversal path from the superroot to leaf's parent, where key
+  // leads get_leaf to leaf. Returns false if it does not.
+  bool traversal_path_by_key(const data_node_type* leaf, const T& key,
+                             std::vector<TraversalNode>* traversal_path) const {
+    traversal_path->assign(1, {superroot_, 0});
+    AlexNode<T, P>* cur = root_node_;
+    while (!cur->is_leaf_) {
+      auto node = static_cast<model_node_type*>(cur);
+      int bucketID = node->model_.predict(key);
+      bucketID =
+          std::min<int>(std::max<int>(bucketID, 0), node->num_children_ - 1);
+      traversal_path->push_back({node, bucketID});
+      cur = child_node(node->children_[bucketID]);
+    }
+    if (cur == leaf) {
+      return true;
+    } else if (traversal_path->size() == 1) {
+      return false;
+    }
+    // A key on a bucket boundary may lead to a neighbor of its leaf, see
+    // get_leaf
+    std::vector<TraversalNode> next_path = *traversal_path;
+    if (next_leaf_on_path(cur, next_path) == leaf) {
+      traversal_path->swap(next_path);
+      return true;
+    }
+    return prev_leaf_on_path(cur, *traversal_path) == leaf;
+  }
+
+  // Emits the keys of scan() and scan_n(), from the first key no less than
+  // lo, until one is not less than *hi (if hi is not null) or max_keys were
+  // emitted
+  template <class Emit>
+  size_t scan_leaves(const T& lo, const T* hi, size_t max_keys, Emit& emit) {
+    if (max_keys == 0) {
+      return 0;
+    }
+    stats_.num_lookups++;
+    std::vector<TraversalNode> traversal_path;
+    data_node_type* leaf = get_leaf(lo, &traversal_path);
+    int pos = leaf->find_lower(lo);
+    size_t num_keys = 0;
+    while (leaf != nullptr) {
+      // Keys of the leaf are at most max_key_, which is only an upper bound
+      // after erases
+      bool reaches_next_leaf =
+          (hi == nullptr) ? max_keys - num_keys > static_cast<size_t>(leaf->num_keys_)
+                          : key_less_(leaf->max_key_, *hi);
+      if (reaches_next_leaf) {
+        prefetch_next_leaf(leaf, traversal_path);
+      }
+      bool stopped;
+      int max_keys_in_leaf = static_cast<int>(
+          std::min<size_t>(max_keys - num_keys, std::numeric_limits<int>::max()));
+      num_keys += leaf->scan(pos, hi, max_keys_in_leaf, emit, &stopped);
+      if (stopped) {
+        break;
+      }
+      leaf = next_leaf_on_path(leaf, traversal_path);
+      if (leaf != nullptr) {
+        leaf->merge_delta();
+      }
+      pos = 0;
+    }
+    return num_keys;
+  }
+
+  // Moves traversal_path, which ends at the parent of leaf, to the next data
+  // node in key order, and returns that node, or nullptr if leaf is the last
+  // one. Unlike next_leaf_, does not depend on the data nodes being linked.
+  data_node_type* next_leaf_on_path(
+      AlexNode<T, P>* leaf, std::vector<TraversalNode>& traversal_path) const {
+    AlexNode<T, P>* node = leaf;
+    // The superroot at the front of the path only has the root as a child
+    while (traversal_path.size() > 1) {
+      TraversalNode& tn = traversal_path.back();
+      int repeats = 1 << node->duplication_factor_;
+      int next_bucketID = tn.bucketID - (tn.bucketID % repeats) + repeats;
+      if (next_bucketID < tn.node->num_children_) {
+        tn.bucketID = next_bucketID;
+        AlexNode<T, P>* cur = child_node(tn.node->children_[next_bucketID]);
+        while (!cur->is_leaf_) {
+          auto model = static_cast<model_node_type*>(cur);
+          traversal_path.push_back({model, 0});
+          cur = child_node(model->children_[0]);
+        }
+        return static_cast<data_node_type*>(cur);
+      }
+      node = tn.node;
+      traversal_path.pop_back();
+    }
+    return nullptr;
+  }
+
+  // Counterpart of next_leaf_on_path for the previous data node
+  data_node_type* prev_leaf_on_path(
+      AlexNode<T, P>* leaf, std::vector<TraversalNode>& traversal_path) const {
+    AlexNode<T, P>* node = leaf;
+    while (traversal_path.size() > 1) {
+      TraversalNode& tn = traversal_path.back();
+      int repeats = 1 << node->duplication_factor_;
+      int start_bucketID = tn.bucketID - (tn.bucketID % repeats);
+      if (start_bucketID > 0) {
+        tn.bucketID = start_bucketID - 1;
+        AlexNode<T, P>* cur = child_node(tn.node->children_[start_bucketID - 1]);
+        while (!cur->is_leaf_) {
+          auto model = static_cast<model_node_type*>(cur);
+          traversal_path.push_back({model, model->num_children_ - 1});
+          cur = child_node(model->children_[model->num_children_ - 1]);
+        }
+        return static_cast<data_node_type*>(cur);
+      }
+      node = tn.node;
+      traversal_path.pop_back();
+    }
+    return nullptr;
+  }
+
+  // Starts reading the data node that next_leaf_on_path would return, without
+  // loading it: the first lines of its slots if it is in memory, or its
+  // record if it is still in the pager
+  void prefetch_next_leaf(const AlexNode<T, P>* leaf,
+                          const std::vector<TraversalNode>& traversal_path) const {
+    const AlexNode<T, P>* node = leaf;
+    for (size_t level = traversal_path.size() - 1; level > 0; level--) {
+      const TraversalNode& tn = traversal_path[level];
+      int repeats = 1 << node->duplication_factor_;
+      int next_bucketID = tn.bucketID - (tn.bucketID % repeats) + repeats;
+      if (next_bucketID < tn.node->num_children_) {
+        ChildRef<T, P> slot = tn.node->children_[next_bucketID];
+        AlexNode<T, P>* next = slot.loaded();
+        while (next != nullptr && !next->is_leaf_) {
+          slot = static_cast<model_node_type*>(next)->children_[0];
+          next = slot.loaded();
+        }
+        if (next == nullptr) {
+          slot.prefetch(pager_);
+        } else {
+          static_cast<data_node_type*>(next)->prefetch_for_scan();
+        }
+        return;
+      }
+      node = tn.node;
+    }
+  }
+
   /*** Allocators and comparators ***/
 
  public:
@@ -624,21 +1212,308 @@ class Alex {
     return typename data_node_type::alloc_type(allocator_);
   }
 
+  bool is_concurrent() const {
+    return concurrency_mode_ != ConcurrencyMode::kSingleThreaded;
+  }
+
+  // Counterpart of get_leaf for concurrent readers. Starting from the
+  // superroot, reads the version of each child before validating its parent,
+  // so that the returned leaf was reachable for key at the time it was
+  // reached. Returns the leaf with its version and the bucket prediction made
+  // in its parent, or nullptr if a node changed on the way down, in which case
+  // the caller should restart.
+  data_node_type* get_leaf_optimistic(const T& key, uint64_t* leaf_version,
+                                      double* bucketID_prediction) const {
+    model_node_type* node = superroot_;
+    uint64_t version;
+    if (!node->lock_.read_lock(&version)) {
+      return nullptr;
+    }
+    while (true) {
+      // Read everything needed to pick the child before validating, since a
+      // writer may replace the children array under us
+      int num_children = node->num_children_;
+      ChildRef<T, P>* children = node->children_;
+      double prediction = node->model_.predict_double(key);
+      if (!node->lock_.validate(version)) {
+        return nullptr;
+      }
+      int bucketID = static_cast<int>(prediction);
+      bucketID = std::min<int>(std::max<int>(bucketID, 0), num_children - 1);
+      AlexNode<T, P>* child = child_node(children[bucketID]);
+      uint64_t child_version;
+      if (!child->lock_.read_lock(&child_version) ||
+          !node->lock_.validate(version)) {
+        return nullptr;
+      }
+      if (child->is_leaf_) {
+        *leaf_version = child_version;
+        *bucketID_prediction = prediction;
+        return static_cast<data_node_type*>(child);
+      }
+      node = static_cast<model_node_type*>(child);
+      version = child_version;
+    }
+  }
+
+  // Runs search on a snapshot of leaf, which was read at version. search
+  // returns a position in the snapshot. Returns false if the leaf changed in
+  // the meantime, otherwise sets *idx to the position, and copies its payload
+  // to *payload if there is a key at that position. The copy is made before
+  // the leaf is validated, since a writer may move or free the payload as
+  // soon as the leaf is unlocked. payload may be nullptr.
+  template <class Search>
+  bool search_leaf_snapshot(data_node_type* leaf, uint64_t version,
+                            Search& search, int* idx, P* payload) const {
+    data_node_type snapshot(*leaf, typename data_node_type::SnapshotTag());
+    if (!leaf->lock_.validate(version)) {
+      return false;
+    }
+    int pos = search(snapshot);
+    bool has_key = pos >= 0 && pos < snapshot.data_capacity_ &&
+                   snapshot.check_exists(pos);
+    P payload_copy = has_key && payload ? snapshot.get_payload(pos) : P();
+    if (!leaf->lock_.validate(version)) {
+      return false;
+    }
+    *idx = pos;
+    if (payload && has_key) {
+      *payload = payload_copy;
+    }
+    return true;
+  }
+
+  // Finds the leaf responsible for key without locking, like get_leaf. Returns
+  // the leaf and its version, or nullptr if a node changed on the way, in which
+  // case the caller should restart.
+  data_node_type* resolve_leaf_optimistic(const T& key,
+                                          uint64_t* leaf_version) const {
+    double bucketID_prediction;
+    data_node_type* leaf =
+        get_leaf_optimistic(key, leaf_version, &bucketID_prediction);
+#if ALEX_SAFE_LOOKUP
+    if (leaf == nullptr) {
+      return nullptr;
+    }
+    // Same correction as in get_leaf, on a snapshot of the neighbor
+    int side = bucket_boundary_side(bucketID_prediction);
+    if (side != 0) {
+      data_node_type* neighbor =
+          side < 0 ? prev_leaf(leaf, &key) : next_leaf(leaf, &key);
+      if (!leaf->lock_.validate(*leaf_version)) {
+        return nullptr;
+      }
+      uint64_t neighbor_version;
+      if (neighbor != nullptr) {
+        if (!neighbor->lock_.read_lock(&neighbor_version)) {
+          return nullptr;
+        }
+        data_node_type snapshot(*neighbor,
+                                typename data_node_type::SnapshotTag());
+        if (!neighbor->lock_.validate(neighbor_version)) {
+          return nullptr;
+        }
+        bool in_neighbor = side < 0 ? snapshot.last_key() >= key
+                                    : snapshot.first_key() <= key;
+        if (!neighbor->lock_.validate(neighbor_version)) {
+          return nullptr;
+        }
+        if (in_neighbor) {
+          *leaf_version = neighbor_version;
+          return neighbor;
+        }
+      }
+    }
+#endif
+    return leaf;
+  }
+
+  // Searches the leaf responsible for key on behalf of a concurrent reader,
+  // retrying until it gets a consistent result. Returns the leaf that was
+  // searched; see search_leaf_snapshot for search, idx and payload. The caller
+  // must hold an EpochGuard for as long as it uses the leaf.
+  template <class Search>
+  data_node_type* lookup_concurrent(const T& key, Search search, int* idx,
+                                    P* payload = nullptr) const {
+    concurrent_num_lookups_.add(1);
+    while (true) {
+      uint64_t version;
+      data_node_type* leaf = resolve_leaf_optimistic(key, &version);
+      if (leaf == nullptr ||
+          !search_leaf_snapshot(leaf, version, search, idx, payload)) {
+        cpu_relax();
+        continue;
+      }
+      concurrent_num_node_lookups_.add(leaf->level_);
+      return leaf;
+    }
+  }
+
+  bool is_multi_writer() const {
+    return concurrency_mode_ == ConcurrencyMode::kMultiWriter;
+  }
+
+  // For lookups that return a pointer or an iterator into the index, which a
+  // concurrent write may invalidate before the caller dereferences it
+  void require_single_threaded(const char* method) const {
+    if (is_concurrent()) {
+      throw std::logic_error(std::string(method) +
+                             " is only available in "
+                             "ConcurrencyMode::kSingleThreaded, concurrent "
+                             "readers use get_payload(key, &payload)");
+    }
+  }
+
+  // Returns the leaf responsible for key, write-locked and added to locks.
+  // Concurrent writers use this instead of get_leaf, since other writers may
+  // be changing the leaves that get_leaf would look at.
+  data_node_type* lock_leaf_for_write(const T& key, WriteLockSet* locks) const {
+    while (true) {
+      uint64_t version;
+      data_node_type* leaf = resolve_leaf_optimistic(key, &version);
+      if (leaf != nullptr && leaf->lock_.try_upgrade(version)) {
+        locks->adopt(&leaf->lock_);
+        return leaf;
+      }
+      cpu_relax();
+    }
+  }
+
+  // Changes to the structure of the tree, i.e., anything beyond modifying a
+  // single data node in place, are made by one writer at a time. Returns a
+  // lock that is only held in multi-writer mode. In-place writers must not
+  // hold a node lock while waiting for it, since the structural writer may
+  // need that node.
+  std::unique_lock<std::mutex> lock_structure() {
+    if (!is_multi_writer()) {
+      return std::unique_lock<std::mutex>();
+    }
+    std::unique_lock<std::mutex> lock(structure_mutex_);
+    // Structural decisions depend on the number of keys
+    stats_.num_keys += static_cast<int>(concurrent_num_keys_.take());
+    stats_.num_inserts += concurrent_num_inserts_.take();
+    fold_key_domain_counts();
+    return lock;
+  }
+
+  // Moves the counts of keys outside the key domain that multi-writer mode
+  // made through sharded counters to istats_
+  void fold_key_domain_counts() {
+    istats_.num_keys_above_key_domain +=
+        static_cast<int>(concurrent_num_keys_above_key_domain_.take());
+    istats_.num_keys_below_key_domain +=
+        static_cast<int>(concurrent_num_keys_below_key_domain_.take());
+  }
+
+  // Records that num_keys keys were inserted (or, if negative, erased) above
+  // or below the key domain. In multi-writer mode, this does not need the
+  // structure lock.
+  void count_keys_outside_domain(bool above, int num_keys) {
+    if (is_multi_writer()) {
+      (above ? concurrent_num_keys_above_key_domain_
+             : concurrent_num_keys_below_key_domain_)
+          .add(num_keys);
+    } else if (above) {
+      istats_.num_keys_above_key_domain += num_keys;
+    } else {
+      istats_.num_keys_below_key_domain += num_keys;
+    }
+  }
+
+  // Number of keys above the key domain, including those that concurrent
+  // writers counted but that were not folded into istats_ yet
+  int num_keys_above_key_domain() const {
+    return istats_.num_keys_above_key_domain +
+           (is_multi_writer()
+                ? static_cast<int>(concurrent_num_keys_above_key_domain_.sum())
+                : 0);
+  }
+
+  int num_keys_below_key_domain() const {
+    return istats_.num_keys_below_key_domain +
+           (is_multi_writer()
+                ? static_cast<int>(concurrent_num_keys_below_key_domain_.sum())
+                : 0);
+  }
+
+  // Records the effect of an insert or erase on the number of keys. In
+  // multi-writer mode, writers that only hold a data node lock count through
+  // sharded counters.
+  void count_keys_changed(int num_keys_delta, bool holds_structure_lock) {
+    if (is_multi_writer() && !holds_structure_lock) {
+      concurrent_num_keys_.add(num_keys_delta);
+      if (num_keys_delta > 0) {
+        concurrent_num_inserts_.add(num_keys_delta);
+      }
+    } else {
+      stats_.num_keys += num_keys_delta;
+      if (num_keys_delta > 0) {
+        stats_.num_inserts += num_keys_delta;
+      }
+    }
+  }
+
+  // Writes the traversal path from the superroot to leaf's parent, where leaf
+  // is the leaf responsible for key. Unlike get_leaf, only reads model nodes,
+  // which do not change outside of structural modifications, so this is safe
+  // while other writers modify data nodes.
+  void traversal_path_to(data_node_type* leaf, const T& key,
+                         std::vector<TraversalNode>* traversal_path) const {
+    bool found = traversal_path_by_key(leaf, key, traversal_path);
+    assert(found);
+    (void)found;
+  }
+
   typename model_node_type::pointer_alloc_type pointer_allocator() {
     return typename model_node_type::pointer_alloc_type(allocator_);
   }
 
+  typename model_node_type::wrapper_alloc_type wrapper_allocator() {
+    return typename model_node_type::wrapper_alloc_type(allocator_);
+  }
+
   void delete_node(AlexNode<T, P>* node) {
     if (node == nullptr) {
       return;
+    }
+    // The wrapper in its parent's record may still point to it
+    node->pin_record();
+    if (is_concurrent()) {
+      // Readers may still hold the node, tell them to restart and free it once
+      // they are gone
+      node->lock_.mark_obsolete();
+      auto data_alloc = data_node_allocator();
+      auto model_alloc = model_node_allocator();
+      EpochManager::instance().retire([=]() mutable {
+        bool in_place = node->record_ != nullptr;
+        if (node->is_leaf_) {
+          auto leaf = static_cast<data_node_type*>(node);
+          data_alloc.destroy(leaf);
+          if (!in_place) {
+            data_alloc.deallocate(leaf, 1);
+          }
+        } else {
+          auto model = static_cast<model_node_type*>(node);
+          model_alloc.destroy(model);
+          if (!in_place) {
+            model_alloc.deallocate(model, 1);
+          }
+        }
+      });
     } else if (node->is_leaf_) {
       // std::cout << "Destroying leaf " << node << std::endl;
+      bool in_place = node->record_ != nullptr;
       data_node_allocator().destroy(static_cast<data_node_type*>(node));
-      data_node_allocator().deallocate(static_cast<data_node_type*>(node), 1);
+      if (!in_place) {
+        data_node_allocator().deallocate(static_cast<data_node_type*>(node), 1);
+      }
     } else {
       // std::cout << "Destroying model " << node << std::endl;
+      bool in_place = node->record_ != nullptr;
       model_node_allocator().destroy(static_cast<model_node_type*>(node));
-      model_node_allocator().deallocate(static_cast<model_node_type*>(node), 1);
+      if (!in_place) {
+        model_node_allocator().deallocate(static_cast<model_node_type*>(node), 1);
+      }
     }
   }
 
@@ -654,10 +1529,19 @@ class Alex {
   // values should be the sorted array of key-payload pairs.
   // The number of elements should be num_keys.
   // The index must be empty when calling this method.
-  void bulk_load(const V values[], int num_keys) {
+  // With num_threads > 1, independent subtrees are built in parallel, which
+  // gives the same tree as a serial bulk load. The allocator must then be
+  // safe to use from several threads at once.
+  void bulk_load(const V values[], int num_keys, int num_threads = 1) {
     if (stats_.num_keys > 0 || num_keys <= 0) {
       return;
     }
+    std::unique_ptr<ThreadPool> pool;
+    BulkLoadContext context;
+    if (num_threads > 1) {
+      pool.reset(new ThreadPool(num_threads));
+      context.pool = pool.get();
+    }
     delete_node(root_node_);  // delete the empty root node from constructor
 
     stats_.num_keys = num_keys;
@@ -681,8 +1565,10 @@ class Alex {
         params_.approximate_cost_computation, &stats);
 
     // Recursively bulk load
-    bulk_load_node(values, num_keys, root_node_, num_keys,
+    bulk_load_node(values, num_keys, root_node_, num_keys, &context,
                    &root_data_node_model);
+    stats_.num_model_nodes += context.num_model_nodes;
+    stats_.num_data_nodes += context.num_data_nodes;
 
     if (root_node_->is_leaf_) {
       static_cast<data_node_type*>(root_node_)
@@ -696,6 +1582,64 @@ class Alex {
     link_all_data_nodes();
   }
 
+  // Keys of a streaming bulk load that are held in memory at a time
+  static constexpr int kDefaultStreamingWindowKeys = 1 << 22;
+
+  // Bulk loads the sorted array of num_keys keys, where keys[i] gets the
+  // payload payload_of(i), writing the nodes to the pager as they are built.
+  // keys would typically be a key file mapped in memory. At most window_keys
+  // key-payload pairs are materialized at once: model nodes split the key
+  // space until the keys of each part fit in the window, and each part is
+  // bulk loaded as by bulk_load, saved to the pager and freed. Only the model
+  // nodes above the parts stay in memory.
+  // The index must be empty and its pager a WritePager. Afterwards the index
+  // can only be serialized, and is used by loading it with a ReadPager.
+  template <class PayloadFn>
+  void bulk_load_streaming(const T keys[], int num_keys, PayloadFn payload_of,
+                           int window_keys = kDefaultStreamingWindowKeys,
+                           int num_threads = 1) {
+    if (stats_.num_keys > 0 || num_keys <= 0) {
+      return;
+    }
+    if (pager_ == nullptr) {
+      throw std::invalid_argument(
+          "bulk_load_streaming: the index has no pager to write nodes to");
+    }
+    StreamingBulkLoad<PayloadFn> load(keys, num_keys, payload_of,
+                                      std::max(window_keys, 1));
+    // A single distinct key cannot be split any further
+    if (num_keys <= load.window_keys ||
+        key_equal(keys[0], keys[num_keys - 1])) {
+      fill_window(&load, 0, num_keys);
+      bulk_load(load.window.data(), num_keys, num_threads);
+      return;
+    }
+    std::unique_ptr<ThreadPool> pool;
+    if (num_threads > 1) {
+      pool.reset(new ThreadPool(num_threads));
+      load.context.pool = pool.get();
+    }
+
+    // As in bulk_load, the root maps the keys to [0, 1]
+    T min_key = keys[0];
+    T max_key = keys[num_keys - 1];
+    LinearModel<T> root_model;
+    root_model.a_ = 1.0 / (max_key - min_key);
+    root_model.b_ = -1.0 * min_key * root_model.a_;
+    // The index stays empty if the keys turn out not to be sorted
+    AlexNode<T, P>* root = stream_model_node(&load, 0, num_keys, root_model, 0);
+    delete_node(root_node_);  // delete the empty root node from constructor
+    root_node_ = root;
+    stats_.num_keys = num_keys;
+    stats_.num_model_nodes += load.context.num_model_nodes;
+    stats_.num_data_nodes += load.context.num_data_nodes;
+
+    // The leaves are only in the pager, so neither the key domain nor the
+    // links between leaves can be computed by traversing them
+    create_superroot();
+    update_superroot_key_domain(min_key, max_key);
+  }
+
  private:
   // Only call this after creating a root node
   void create_superroot() {
@@ -705,7 +1649,7 @@ class Alex {
         model_node_type(static_cast<short>(root_node_->level_ - 1), pager_, allocator_);
     superroot_->num_children_ = 1;
     superroot_->children_ =
-        new (pointer_allocator().allocate(1)) LazyAlexNode<T, P>*[1];
+        new (pointer_allocator().allocate(1)) ChildRef<T, P>[1];
     update_superroot_pointer();
   }
 
@@ -714,8 +1658,13 @@ class Alex {
   // is a data node.
   void update_superroot_key_domain() {
     assert(stats_.num_inserts == 0 || root_node_->is_leaf_);
-    istats_.key_domain_min_ = get_min_key();
-    istats_.key_domain_max_ = get_max_key();
+    update_superroot_key_domain(get_min_key(), get_max_key());
+  }
+
+  // Same with the min/max keys already known
+  void update_superroot_key_domain(T min_key, T max_key) {
+    istats_.key_domain_min_ = min_key;
+    istats_.key_domain_max_ = max_key;
     istats_.num_keys_at_last_right_domain_resize = stats_.num_keys;
     istats_.num_keys_at_last_left_domain_resize = stats_.num_keys;
     istats_.num_keys_above_key_domain = 0;
@@ -727,10 +1676,21 @@ class Alex {
   }
 
   void update_superroot_pointer() {
-    superroot_->children_[0] = new LazyAlexNode(root_node_, pager_);
+    superroot_->children_[0] = ChildRef<T, P>(root_node_);
     superroot_->level_ = static_cast<short>(root_node_->level_ - 1);
   }
 
+  // State shared by the subtree builds of one bulk load, which may run in
+  // parallel
+  struct BulkLoadContext {
+    ThreadPool* pool = nullptr;  // null for a serial bulk load
+    std::atomic<int> num_model_nodes{0};
+    std::atomic<int> num_data_nodes{0};
+  };
+
+  // Subtrees of fewer keys are built by the thread that creates them
+  static constexpr int kParallelBulkLoadMinKeys = 1 << 16;
+
   // Recursively bulk load a single node.
   // Assumes node has already been trained to output [0, 1), has cost.
   // Figures out the optimal partitioning of children.
@@ -738,14 +1698,14 @@ class Alex {
   // data_node_model is what the node's model would be if it were a data node of
   // dense keys.
   void bulk_load_node(const V values[], int num_keys, AlexNode<T, P>*& node,
-                      int total_keys,
+                      int total_keys, BulkLoadContext* context,
                       const LinearModel<T>* data_node_model = nullptr) {
     // Automatically convert to data node when it is impossible to be better
     // than current cost
     if (num_keys <= derived_params_.max_data_node_slots *
                         data_node_type::kInitDensity_ &&
         (node->cost_ < kNodeLookupsWeight || node->model_.a_ == 0)) {
-      stats_.num_data_nodes++;
+      context->num_data_nodes++;
       auto data_node = new (data_node_allocator().allocate(1))
           data_node_type(node->level_, derived_params_.max_data_node_slots,
                          pager_,
@@ -769,7 +1729,7 @@ class Alex {
           values, num_keys, node, total_keys, used_fanout_tree_nodes,
           derived_params_.max_fanout, max_data_node_keys,
           params_.expected_insert_frac, params_.approximate_model_computation,
-          params_.approximate_cost_computation, key_less_);
+          params_.approximate_cost_computation, key_less_, context->pool);
     } else if (experimental_params_.fanout_selection_method == 1) {
       best_fanout_stats = fanout_tree::find_best_fanout_top_down<T, P>(
           values, num_keys, node, total_keys, used_fanout_tree_nodes,
@@ -785,7 +1745,7 @@ class Alex {
         num_keys > derived_params_.max_data_node_slots *
                        data_node_type::kInitDensity_) {
       // Convert to model node based on the output of the fanout tree
-      stats_.num_model_nodes++;
+      context->num_model_nodes++;
       auto model_node = new (model_node_allocator().allocate(1))
           model_node_type(node->level_, pager_, allocator_);
       if (best_fanout_tree_depth == 0) {
@@ -805,18 +1765,22 @@ class Alex {
             values, num_keys, node, total_keys, used_fanout_tree_nodes,
             best_fanout_tree_depth, max_data_node_keys,
             params_.expected_insert_frac, params_.approximate_model_computation,
-            params_.approximate_cost_computation);
+            params_.approximate_cost_computation, std::less<T>(), context->pool);
       }
       int fanout = 1 << best_fanout_tree_depth;
       model_node->model_.a_ = node->model_.a_ * fanout;
       model_node->model_.b_ = node->model_.b_ * fanout;
       model_node->num_children_ = fanout;
       model_node->children_ =
-          new (pointer_allocator().allocate(fanout)) LazyAlexNode<T, P>*[fanout];
+          new (pointer_allocator().allocate(fanout)) ChildRef<T, P>[fanout];
 
-      // Instantiate all the child nodes and recurse
+      // Instantiate all the child nodes and recurse. The children are
+      // independent, so large ones are built in parallel.
+      std::vector<AlexNode<T, P>*> child_nodes(used_fanout_tree_nodes.size());
+      TaskGroup group(context->pool);
       int cur = 0;
-      for (fanout_tree::FTNode& tree_node : used_fanout_tree_nodes) {
+      for (size_t c = 0; c < used_fanout_tree_nodes.size(); c++) {
+        const fanout_tree::FTNode& tree_node = used_fanout_tree_nodes[c];
         auto child_node = new (model_node_allocator().allocate(1))
             model_node_type(static_cast<short>(node->level_ + 1), pager_, allocator_);
         child_node->cost_ = tree_node.cost;
@@ -830,21 +1794,37 @@ class Alex {
             (right_value - node->model_.b_) / node->model_.a_;
         child_node->model_.a_ = 1.0 / (right_boundary - left_boundary);
         child_node->model_.b_ = -child_node->model_.a_ * left_boundary;
-        model_node->children_[cur] = new LazyAlexNode(child_node, pager_);
-        LinearModel<T> child_data_node_model(tree_node.a, tree_node.b);
-        AlexNode<T, P>* node_ptr = model_node->children_[cur]->get(pager_);
-        bulk_load_node(values + tree_node.left_boundary,
-                       tree_node.right_boundary - tree_node.left_boundary,
-                       node_ptr, total_keys,
-                       &child_data_node_model);
-        model_node->children_[cur] = new LazyAlexNode(node_ptr, pager_);
-        model_node->children_[cur]->get(pager_)->duplication_factor_ =
+        child_nodes[c] = child_node;
+        auto build_child = [this, values, total_keys, context, &tree_node,
+                            &child_nodes, c] {
+          LinearModel<T> child_data_node_model(tree_node.a, tree_node.b);
+          bulk_load_node(values + tree_node.left_boundary,
+                         tree_node.right_boundary - tree_node.left_boundary,
+                         child_nodes[c], total_keys, context,
+                         &child_data_node_model);
+        };
+        if (tree_node.right_boundary - tree_node.left_boundary >=
+            kParallelBulkLoadMinKeys) {
+          group.run(build_child);
+        } else {
+          build_child();
+        }
+        cur += repeats;
+      }
+      group.wait();
+
+      cur = 0;
+      for (size_t c = 0; c < used_fanout_tree_nodes.size(); c++) {
+        const fanout_tree::FTNode& tree_node = used_fanout_tree_nodes[c];
+        int repeats = 1 << (best_fanout_tree_depth - tree_node.level);
+        model_node->children_[cur] = ChildRef<T, P>(child_nodes[c]);
+        child_node(model_node->children_[cur])->duplication_factor_ =
             static_cast<uint8_t>(best_fanout_tree_depth - tree_node.level);
-        if (model_node->children_[cur]->get(pager_)->is_leaf_) {
-          static_cast<data_node_type*>(model_node->children_[cur]->get(pager_))
+        if (child_node(model_node->children_[cur])->is_leaf_) {
+          static_cast<data_node_type*>(child_node(model_node->children_[cur]))
               ->expected_avg_exp_search_iterations_ =
               tree_node.expected_avg_search_iterations;
-          static_cast<data_node_type*>(model_node->children_[cur]->get(pager_))
+          static_cast<data_node_type*>(child_node(model_node->children_[cur]))
               ->expected_avg_shifts_ = tree_node.expected_avg_shifts;
         }
         for (int i = cur + 1; i < cur + repeats; i++) {
@@ -857,7 +1837,7 @@ class Alex {
       node = model_node;
     } else {
       // Convert to data node
-      stats_.num_data_nodes++;
+      context->num_data_nodes++;
       auto data_node = new (data_node_allocator().allocate(1))
           data_node_type(node->level_, derived_params_.max_data_node_slots,
                          pager_,
@@ -870,6 +1850,198 @@ class Alex {
     }
   }
 
+  // State of a streaming bulk load
+  template <class PayloadFn>
+  struct StreamingBulkLoad {
+    StreamingBulkLoad(const T* keys_, int num_keys_, PayloadFn payload_of_,
+                      int window_keys_)
+        : keys(keys_),
+          num_keys(num_keys_),
+          payload_of(payload_of_),
+          window_keys(window_keys_) {}
+
+    const T* keys;
+    int num_keys;
+    PayloadFn payload_of;
+    int window_keys;
+    std::vector<V> window;  // key-payload pairs of the part being built
+    BulkLoadContext context;
+  };
+
+  // Materializes keys [begin, end) of a streaming bulk load in its window
+  template <class PayloadFn>
+  void fill_window(StreamingBulkLoad<PayloadFn>* load, int begin, int end) {
+    load->window.clear();
+    load->window.reserve(end - begin);
+    for (int i = begin; i < end; i++) {
+      // Every key is compared to its predecessor in exactly one window
+      if (i > 0 && key_less_(load->keys[i], load->keys[i - 1])) {
+        throw std::invalid_argument(
+            "bulk_load_streaming: keys are not sorted at index " +
+            std::to_string(i));
+      }
+      load->window.emplace_back(load->keys[i], load->payload_of(i));
+    }
+  }
+
+  // Builds the model node of keys [begin, end) of a streaming bulk load,
+  // whose key range node_model maps to [0, 1). Every child gets one slot.
+  template <class PayloadFn>
+  model_node_type* stream_model_node(StreamingBulkLoad<PayloadFn>* load,
+                                     int begin, int end,
+                                     const LinearModel<T>& node_model,
+                                     short level) {
+    int fanout = 2;
+    while (fanout < derived_params_.max_fanout &&
+           static_cast<long long>(fanout) * load->window_keys <
+               2LL * (end - begin)) {
+      fanout <<= 1;
+    }
+    load->context.num_model_nodes++;
+    auto model_node = new (model_node_allocator().allocate(1))
+        model_node_type(level, pager_, allocator_);
+    model_node->model_.a_ = node_model.a_ * fanout;
+    model_node->model_.b_ = node_model.b_ * fanout;
+    model_node->num_children_ = fanout;
+    model_node->children_ =
+        new (pointer_allocator().allocate(fanout)) ChildRef<T, P>[fanout];
+
+    const T* keys = load->keys;
+    int lo = begin;
+    int c = 0;
+    try {
+      for (; c < fanout; c++) {
+        // Lookups follow the same predictions to this child
+        int hi = static_cast<int>(
+            std::partition_point(keys + lo, keys + end,
+                                 [model_node, fanout, c](const T& key) {
+                                   int bucketID =
+                                       model_node->model_.predict(key);
+                                   return std::min<int>(
+                                              std::max<int>(bucketID, 0),
+                                              fanout - 1) <= c;
+                                 }) -
+            keys);
+        double left_value = static_cast<double>(c) / fanout;
+        double right_value = static_cast<double>(c + 1) / fanout;
+        double left_boundary = (left_value - node_model.b_) / node_model.a_;
+        double right_boundary = (right_value - node_model.b_) / node_model.a_;
+        LinearModel<T> child_model;
+        child_model.a_ = 1.0 / (right_boundary - left_boundary);
+        child_model.b_ = -child_model.a_ * left_boundary;
+        model_node->children_[c] =
+            stream_child(load, lo, hi, end - begin, child_model,
+                         static_cast<short>(level + 1));
+        lo = hi;
+      }
+    } catch (...) {
+      for (int i = 0; i < c; i++) {
+        delete_wrapped_subtree(model_node->children_[i]);
+      }
+      delete_node(model_node);
+      throw;
+    }
+    assert(lo == end);
+    return model_node;
+  }
+
+  // Builds the child of keys [begin, end) of a model node with
+  // num_parent_keys keys in a streaming bulk load, and returns its slot.
+  // A child with more keys than the window is streamed recursively and stays
+  // in memory, unless it could not split its parent's keys. Other children
+  // are bulk loaded from the window, saved to the pager and freed.
+  template <class PayloadFn>
+  ChildRef<T, P> stream_child(StreamingBulkLoad<PayloadFn>* load,
+                              int begin, int end, int num_parent_keys,
+                              const LinearModel<T>& child_model,
+                              short level) {
+    const T* keys = load->keys;
+    if (end - begin > load->window_keys && end - begin < num_parent_keys &&
+        !key_equal(keys[begin], keys[end - 1])) {
+      return ChildRef<T, P>(
+          stream_model_node(load, begin, end, child_model, level));
+    }
+    AlexNode<T, P>* child;
+    if (end == begin) {
+      load->context.num_data_nodes++;
+      auto data_node = new (data_node_allocator().allocate(1))
+          data_node_type(level, derived_params_.max_data_node_slots, pager_,
+                         key_less_, allocator_);
+      data_node->bulk_load(nullptr, 0);
+      child = data_node;
+    } else {
+      child = bulk_load_window(load, begin, end, child_model, level);
+    }
+    FlatRecordRef ref = child->save_flat(pager_, load->context.pool);
+    bool is_leaf = child->is_leaf_;
+    delete_subtree(child);
+    return ChildRef<T, P>::lazy(LazyAlexNode<T, P>::place_unloaded(
+        wrapper_allocator().allocate(1), ref.offset, ref.num_bytes, is_leaf,
+        pager_));
+  }
+
+  // Bulk loads keys [begin, end) of a streaming bulk load from the window
+  // into a subtree whose key range child_model maps to [0, 1), as bulk_load
+  // does for the whole index
+  template <class PayloadFn>
+  AlexNode<T, P>* bulk_load_window(StreamingBulkLoad<PayloadFn>* load,
+                                   int begin, int end,
+                                   const LinearModel<T>& child_model,
+                                   short level) {
+    fill_window(load, begin, end);
+    const V* values = load->window.data();
+    int num_keys = end - begin;
+    AlexNode<T, P>* node = new (model_node_allocator().allocate(1))
+        model_node_type(level, pager_, allocator_);
+    node->model_.a_ = child_model.a_;
+    node->model_.b_ = child_model.b_;
+    LinearModel<T> data_node_model;
+    data_node_type::build_model(values, num_keys, &data_node_model,
+                                params_.approximate_model_computation);
+    DataNodeStats stats;
+    node->cost_ = data_node_type::compute_expected_cost(
+        values, num_keys, data_node_type::kInitDensity_,
+        params_.expected_insert_frac, &data_node_model,
+        params_.approximate_cost_computation, &stats);
+    bulk_load_node(values, num_keys, node, load->num_keys, &load->context,
+                   &data_node_model);
+    if (node->is_leaf_) {
+      static_cast<data_node_type*>(node)->expected_avg_exp_search_iterations_ =
+          stats.num_search_iterations;
+      static_cast<data_node_type*>(node)->expected_avg_shifts_ =
+          stats.num_shifts;
+    }
+    return node;
+  }
+
+  // Frees a subtree built in memory together with the wrappers of its
+  // children, once nothing else refers to them
+  void delete_subtree(AlexNode<T, P>* node) {
+    if (!node->is_leaf_) {
+      auto model_node = static_cast<model_node_type*>(node);
+      for (int i = 0; i < model_node->num_children_; i++) {
+        if (i == 0 || model_node->children_[i] != model_node->children_[i - 1]) {
+          delete_wrapped_subtree(model_node->children_[i]);
+        }
+      }
+    }
+    delete_node(node);
+  }
+
+  // Same for the subtree under a child slot and the slot's wrapper. A
+  // subtree that is only in the pager has nothing else to free.
+  void delete_wrapped_subtree(ChildRef<T, P> child) {
+    AlexNode<T, P>* node = child.loaded();
+    if (node != nullptr) {
+      delete_subtree(node);
+    }
+    if (child.is_lazy()) {
+      auto alloc = wrapper_allocator();
+      alloc.destroy(child.wrapper());
+      alloc.deallocate(child.wrapper(), 1);
+    }
+  }
+
   // Caller needs to set the level, duplication factor, and neighbor pointers of
   // the returned data node
   data_node_type* bulk_load_leaf_node_from_existing(
@@ -919,24 +2091,26 @@ class Alex {
   // If you instead want an iterator to the left-most key with the input value,
   // use lower_bound()
   typename self_type::Iterator find(const T& key) {
+    require_single_threaded("find");
     stats_.num_lookups++;
     data_node_type* leaf = get_leaf(key);
     int idx = leaf->find_key(key);
     if (idx < 0) {
       return end();
     } else {
-      return Iterator(leaf, idx);
+      return Iterator(leaf, idx, this);
     }
   }
 
   typename self_type::ConstIterator find(const T& key) const {
+    require_single_threaded("find");
     stats_.num_lookups++;
     data_node_type* leaf = get_leaf(key);
     int idx = leaf->find_key(key);
     if (idx < 0) {
       return cend();
     } else {
-      return ConstIterator(leaf, idx);
+      return ConstIterator(leaf, idx, this);
     }
   }
 
@@ -952,36 +2126,44 @@ class Alex {
 
   // Returns an iterator to the first key no less than the input value
   typename self_type::Iterator lower_bound(const T& key) {
+    require_single_threaded("lower_bound");
     stats_.num_lookups++;
     data_node_type* leaf = get_leaf(key);
     int idx = leaf->find_lower(key);
-    return Iterator(leaf, idx);  // automatically handles the case where idx ==
-                                 // leaf->data_capacity
+    link_empty_leaf(leaf, key);
+    // Automatically handles the case where idx == leaf->data_capacity
+    return Iterator(leaf, idx, this);
   }
 
   typename self_type::ConstIterator lower_bound(const T& key) const {
+    require_single_threaded("lower_bound");
     stats_.num_lookups++;
     data_node_type* leaf = get_leaf(key);
     int idx = leaf->find_lower(key);
-    return ConstIterator(leaf, idx);  // automatically handles the case where
-                                      // idx == leaf->data_capacity
+    link_empty_leaf(leaf, key);
+    // Automatically handles the case where idx == leaf->data_capacity
+    return ConstIterator(leaf, idx, this);
   }
 
   // Returns an iterator to the first key greater than the input value
   typename self_type::Iterator upper_bound(const T& key) {
+    require_single_threaded("upper_bound");
     stats_.num_lookups++;
     data_node_type* leaf = get_leaf(key);
     int idx = leaf->find_upper(key);
-    return Iterator(leaf, idx);  // automatically handles the case where idx ==
-                                 // leaf->data_capacity
+    link_empty_leaf(leaf, key);
+    // Automatically handles the case where idx == leaf->data_capacity
+    return Iterator(leaf, idx, this);
   }
 
   typename self_type::ConstIterator upper_bound(const T& key) const {
+    require_single_threaded("upper_bound");
     stats_.num_lookups++;
     data_node_type* leaf = get_leaf(key);
     int idx = leaf->find_upper(key);
-    return ConstIterator(leaf, idx);  // automatically handles the case where
-                                      // idx == leaf->data_capacity
+    link_empty_leaf(leaf, key);
+    // Automatically handles the case where idx == leaf->data_capacity
+    return ConstIterator(leaf, idx, this);
   }
 
   std::pair<Iterator, Iterator> equal_range(const T& key) {
@@ -993,39 +2175,289 @@ class Alex {
                                                    upper_bound(key));
   }
 
+  // Calls callback(key, payload) on every key in [lo, hi), in order, and
+  // returns the number of keys. Faster than iterating from lower_bound(lo):
+  // data nodes are read a bitmap word at a time, and the next data node is
+  // prefetched while one is scanned. Data nodes are reached through their
+  // parents rather than through the links between them, so that a scan also
+  // works on an index loaded through a pager. Requires exclusive access, like
+  // iterators.
+  template <class Callback>
+  size_t scan(const T& lo, const T& hi, Callback callback) {
+    if (!key_less_(lo, hi)) {
+      return 0;
+    }
+    return scan_leaves(lo, &hi, std::numeric_limits<size_t>::max(), callback);
+  }
+
+  // Copies the first n key-payload pairs with keys no less than lo to out, in
+  // order, and returns how many were copied, which is less than n only at
+  // the end of the index. See scan().
+  size_t scan_n(const T& lo, size_t n, V* out) {
+    V* next = out;
+    auto copy = [&next](const T& key, const P& payload) {
+      *next++ = V(key, payload);
+    };
+    return scan_leaves(lo, nullptr, n, copy);
+  }
+
   // Directly returns a pointer to the payload found through find(key)
   // This avoids the overhead of creating an iterator
   // Returns null pointer if there is no exact match of the key
   P* get_payload(const T& key) const {
+    require_single_threaded("get_payload");
     stats_.num_lookups++;
     data_node_type* leaf = get_leaf(key);
-    int idx = leaf->find_key(key);
-    if (idx < 0) {
-      return nullptr;
-    } else {
-      return &(leaf->get_payload(idx));
+    return leaf->find_payload(key);
+  }
+
+  // Copies the payload found through find(key) to *payload, and returns
+  // whether there was an exact match of the key. Unlike the lookups that
+  // return a pointer, may be called by concurrent readers.
+  bool get_payload(const T& key, P* payload) const {
+    if (is_concurrent()) {
+      EpochGuard guard(true);
+      int idx;
+      lookup_concurrent(
+          key, [&key](data_node_type& node) { return node.find_key(key); },
+          &idx, payload);
+      return idx >= 0;
+    }
+    stats_.num_lookups++;
+    P* found = get_leaf(key)->find_payload(key);
+    if (found == nullptr) {
+      return false;
+    }
+    *payload = *found;
+    return true;
+  }
+
+  // Number of distinct pages of size page_size that get_payload(key) reads:
+  // the nodes and child pointers on the path to the leaf, the key slots that
+  // the search visits and the payload. With a pager, these are the pages of
+  // the page file that a cold lookup has to read. Loads nodes like a lookup,
+  // but is not counted as one. Only for statistics.
+  size_t count_lookup_pages(const T& key, size_t page_size = 4096) const {
+    std::vector<uintptr_t> pages;
+    auto touch = [&pages, page_size](const void* addr, size_t num_bytes) {
+      uintptr_t first = reinterpret_cast<uintptr_t>(addr) / page_size;
+      uintptr_t last = (reinterpret_cast<uintptr_t>(addr) + num_bytes - 1) / page_size;
+      for (uintptr_t page = first; page <= last; page++) {
+        pages.push_back(page);
+      }
+    };
+    AlexNode<T, P>* cur = root_node_;
+    while (!cur->is_leaf_) {
+      auto node = static_cast<model_node_type*>(cur);
+      touch(node, sizeof(model_node_type));
+      int bucketID = node->model_.predict(key);
+      bucketID =
+          std::min<int>(std::max<int>(bucketID, 0), node->num_children_ - 1);
+      touch(node->children_ + bucketID, sizeof(ChildRef<T, P>));
+      if (node->children_[bucketID].is_lazy()) {
+        touch(node->children_[bucketID].wrapper(), sizeof(LazyAlexNode<T, P>));
+      }
+      cur = child_node(node->children_[bucketID]);
+    }
+    auto leaf = static_cast<data_node_type*>(cur);
+    touch(leaf, sizeof(data_node_type));
+    leaf->trace_find_key(key, touch);
+    std::sort(pages.begin(), pages.end());
+    return std::unique(pages.begin(), pages.end()) - pages.begin();
+  }
+
+  // Batched version of get_payload: sets out[i] to get_payload(keys[i]).
+  // Keys move through the tree together, a group at a time. At every hop the
+  // next node of each key in the group is prefetched before any of them is
+  // dereferenced, so that the cache misses of different keys overlap instead
+  // of being paid one after another.
+  void get_payloads(const T* keys, size_t n, P** out) const {
+    require_single_threaded("get_payloads");
+    for (size_t begin = 0; begin < n; begin += kLookupBatchSize) {
+      size_t group_size = std::min(kLookupBatchSize, n - begin);
+      get_payloads_group(keys + begin, group_size, out + begin);
+    }
+  }
+
+ private:
+  // Number of keys in flight in get_payloads. Large enough to cover memory
+  // latency, small enough for the per-key state to stay in L1.
+  static constexpr size_t kLookupBatchSize = 16;
+
+  void get_payloads_group(const T* keys, size_t n, P** out) const {
+    AlexNode<T, P>* nodes[kLookupBatchSize];
+    ChildRef<T, P> slots[kLookupBatchSize];
+    double bucketID_predictions[kLookupBatchSize];
+    stats_.num_lookups += n;
+
+    // Walk model nodes one level at a time
+    bool has_model_nodes = !root_node_->is_leaf_;
+    for (size_t i = 0; i < n; i++) {
+      nodes[i] = root_node_;
+      bucketID_predictions[i] = 0;
+    }
+    while (has_model_nodes) {
+      for (size_t i = 0; i < n; i++) {
+        slots[i] = ChildRef<T, P>();
+        if (nodes[i]->is_leaf_) {
+          continue;
+        }
+        auto node = static_cast<model_node_type*>(nodes[i]);
+        double bucketID_prediction = node->model_.predict_double(keys[i]);
+        int bucketID = static_cast<int>(bucketID_prediction);
+        bucketID =
+            std::min<int>(std::max<int>(bucketID, 0), node->num_children_ - 1);
+        bucketID_predictions[i] = bucketID_prediction;
+        slots[i] = node->children_[bucketID];
+        __builtin_prefetch(slots[i].target());
+      }
+      // Overlap the reads of children that are not loaded yet
+      if (pager_ != nullptr) {
+        for (size_t i = 0; i < n; i++) {
+          if (slots[i]) {
+            slots[i].prefetch(pager_);
+          }
+        }
+      }
+      has_model_nodes = false;
+      for (size_t i = 0; i < n; i++) {
+        if (!slots[i]) {
+          continue;
+        }
+        nodes[i] = child_node(slots[i]);
+        // What lookups read starts on the second cache line of a node
+        __builtin_prefetch(reinterpret_cast<char*>(nodes[i]) + 64);
+        __builtin_prefetch(reinterpret_cast<char*>(nodes[i]) + 128);
+        has_model_nodes = true;
+      }
+    }
+
+    // Predict and prefetch the key slot in each leaf, then search
+    for (size_t i = 0; i < n; i++) {
+      auto leaf = static_cast<data_node_type*>(nodes[i]);
+      stats_.num_node_lookups += leaf->level_;
+#if ALEX_SAFE_LOOKUP
+      if (leaf != root_node_) {
+        data_node_type* neighbor;
+        if (neighbor_leaf_direction(leaf, keys[i], bucketID_predictions[i],
+                                    &neighbor) != 0) {
+          leaf = neighbor;
+        }
+        nodes[i] = leaf;
+      }
+#endif
+      int predicted_pos = leaf->predict_position(keys[i]);
+#if ALEX_DATA_NODE_SEP_ARRAYS
+      __builtin_prefetch(leaf->key_slots_ + predicted_pos);
+#else
+      __builtin_prefetch(leaf->data_slots_ + predicted_pos);
+#endif
+    }
+    for (size_t i = 0; i < n; i++) {
+      auto leaf = static_cast<data_node_type*>(nodes[i]);
+      out[i] = leaf->find_payload(keys[i]);
     }
   }
 
+ public:
+  // A point lookup that can be suspended whenever it would wait for I/O, see
+  // resume_lookup and AsyncLookupScheduler
+  struct AsyncLookup {
+    T key;
+    AlexNode<T, P>* node = nullptr;  // deepest node reached, null before root
+    double bucketID_prediction = 0;  // made in node's parent
+    bool leaf_resolved = false;      // node is the leaf that holds key
+  };
+
+  // Advances lookup as far as possible without blocking on the pager. Returns
+  // true once the lookup is done, with *payload set as by get_payload.
+  // Otherwise the lookup needs a node record or a page of a leaf that is not
+  // in memory, which the pager has started reading, and should be resumed
+  // later. Like get_payload, only for an index that is not shared between
+  // threads.
+  bool resume_lookup(AsyncLookup* lookup, P** payload) const {
+    require_single_threaded("resume_lookup");
+    if (lookup->node == nullptr) {
+      stats_.num_lookups++;
+      lookup->node = root_node_;
+    }
+    while (!lookup->node->is_leaf_) {
+      auto node = static_cast<model_node_type*>(lookup->node);
+      double bucketID_prediction = node->model_.predict_double(lookup->key);
+      int bucketID = static_cast<int>(bucketID_prediction);
+      bucketID =
+          std::min<int>(std::max<int>(bucketID, 0), node->num_children_ - 1);
+      AlexNode<T, P>* child = node->children_[bucketID].try_get(pager_);
+      if (child == nullptr) {
+        return false;
+      }
+      lookup->node = child;
+      lookup->bucketID_prediction = bucketID_prediction;
+    }
+    auto leaf = static_cast<data_node_type*>(lookup->node);
+    if (!lookup->leaf_resolved) {
+      stats_.num_node_lookups += leaf->level_;
+#if ALEX_SAFE_LOOKUP
+      if (leaf != root_node_) {
+        data_node_type* neighbor;
+        if (neighbor_leaf_direction(leaf, lookup->key,
+                                    lookup->bucketID_prediction,
+                                    &neighbor) != 0) {
+          leaf = neighbor;
+        }
+        lookup->node = leaf;
+      }
+#endif
+      lookup->leaf_resolved = true;
+    }
+    // The search starts at the predicted slot, so waiting for its pages
+    // covers the common case
+    if (pager_ != nullptr) {
+      int predicted_pos = leaf->predict_position(lookup->key);
+#if ALEX_DATA_NODE_SEP_ARRAYS
+      bool key_ready = pager_->try_access(
+          reinterpret_cast<char*>(leaf->key_slots_ + predicted_pos), sizeof(T));
+      bool payload_ready = pager_->try_access(
+          reinterpret_cast<char*>(leaf->payload_slots_ + predicted_pos),
+          sizeof(P));
+      if (!key_ready || !payload_ready) {
+        return false;
+      }
+#else
+      if (!pager_->try_access(
+              reinterpret_cast<char*>(leaf->data_slots_ + predicted_pos),
+              sizeof(V))) {
+        return false;
+      }
+#endif
+    }
+    *payload = leaf->find_payload(lookup->key);
+    return true;
+  }
+
+ public:
   // Looks for the last key no greater than the input value
   // Conceptually, this is equal to the last key before upper_bound()
   typename self_type::Iterator find_last_no_greater_than(const T& key) {
     stats_.num_lookups++;
     data_node_type* leaf = get_leaf(key);
+    leaf->merge_delta();
     const int idx = leaf->upper_bound(key) - 1;
     if (idx >= 0) {
-      return Iterator(leaf, idx);
+      return Iterator(leaf, idx, this);
     }
 
     // Edge case: need to check previous data node(s)
+    data_node_type* prev = prev_leaf(leaf, &key);
     while (true) {
-      if (leaf->prev_leaf_ == nullptr) {
-        return Iterator(leaf, 0);
+      if (prev == nullptr) {
+        return Iterator(leaf, 0, this);
       }
-      leaf = leaf->prev_leaf_;
+      leaf = prev;
       if (leaf->num_keys_ > 0) {
-        return Iterator(leaf, leaf->last_pos());
+        return Iterator(leaf, leaf->last_pos(), this);
       }
+      prev = prev_leaf(leaf);
     }
   }
 
@@ -1035,30 +2467,28 @@ class Alex {
   P* get_payload_last_no_greater_than(const T& key) {
     stats_.num_lookups++;
     data_node_type* leaf = get_leaf(key);
+    leaf->merge_delta();
     const int idx = leaf->upper_bound(key) - 1;
     if (idx >= 0) {
       return &(leaf->get_payload(idx));
     }
 
     // Edge case: Need to check previous data node(s)
+    data_node_type* prev = prev_leaf(leaf, &key);
     while (true) {
-      if (leaf->prev_leaf_ == nullptr) {
+      if (prev == nullptr) {
         return &(leaf->get_payload(leaf->first_pos()));
       }
-      leaf = leaf->prev_leaf_;
+      leaf = prev;
       if (leaf->num_keys_ > 0) {
         return &(leaf->get_payload(leaf->last_pos()));
       }
+      prev = prev_leaf(leaf);
     }
   }
 
   typename self_type::Iterator begin() {
-    AlexNode<T, P>* cur = root_node_;
-
-    while (!cur->is_leaf_) {
-      cur = static_cast<model_node_type*>(cur)->children_[0]->get(pager_);
-    }
-    return Iterator(static_cast<data_node_type*>(cur), 0);
+    return Iterator(first_data_node(), 0, this);
   }
 
   typename self_type::Iterator end() {
@@ -1069,12 +2499,7 @@ class Alex {
   }
 
   typename self_type::ConstIterator cbegin() const {
-    AlexNode<T, P>* cur = root_node_;
-
-    while (!cur->is_leaf_) {
-      cur = static_cast<model_node_type*>(cur)->children_[0]->get(pager_);
-    }
-    return ConstIterator(static_cast<data_node_type*>(cur), 0);
+    return ConstIterator(first_data_node(), 0, this);
   }
 
   typename self_type::ConstIterator cend() const {
@@ -1085,14 +2510,8 @@ class Alex {
   }
 
   typename self_type::ReverseIterator rbegin() {
-    AlexNode<T, P>* cur = root_node_;
-
-    while (!cur->is_leaf_) {
-      auto model_node = static_cast<model_node_type*>(cur);
-      cur = model_node->children_[model_node->num_children_ - 1]->get(pager_);
-    }
-    auto data_node = static_cast<data_node_type*>(cur);
-    return ReverseIterator(data_node, data_node->data_capacity_ - 1);
+    data_node_type* data_node = last_data_node();
+    return ReverseIterator(data_node, data_node->data_capacity_ - 1, this);
   }
 
   typename self_type::ReverseIterator rend() {
@@ -1103,14 +2522,8 @@ class Alex {
   }
 
   typename self_type::ConstReverseIterator crbegin() const {
-    AlexNode<T, P>* cur = root_node_;
-
-    while (!cur->is_leaf_) {
-      auto model_node = static_cast<model_node_type*>(cur);
-      cur = model_node->children_[model_node->num_children_ - 1]->get(pager_);
-    }
-    auto data_node = static_cast<data_node_type*>(cur);
-    return ConstReverseIterator(data_node, data_node->data_capacity_ - 1);
+    data_node_type* data_node = last_data_node();
+    return ConstReverseIterator(data_node, data_node->data_capacity_ - 1, this);
   }
 
   typename self_type::ConstReverseIterator crend() const {
@@ -1134,6 +2547,65 @@ class Alex {
     }
   }
 
+  // Inserts the num_keys values, which must be sorted by key, as insert()
+  // would, and returns the number inserted. The values are grouped by the
+  // data node they fall in, and a large enough group is merged with the keys
+  // of its data node in one pass into new data nodes that replace it, split
+  // once if the keys do not fit in one. Smaller groups, values outside the
+  // key domain, and all values in a concurrent mode are inserted one at a
+  // time.
+  size_t bulk_insert(const V values[], int num_keys) {
+    for (int i = 1; i < num_keys; i++) {
+      if (key_less_(values[i].first, values[i - 1].first)) {
+        throw std::invalid_argument("bulk_insert: the values are not sorted");
+      }
+    }
+    size_t num_inserted = 0;
+    int i = 0;
+    while (i < num_keys) {
+      const T& key = values[i].first;
+      if (is_concurrent() || key > istats_.key_domain_max_ ||
+          key < istats_.key_domain_min_) {
+        num_inserted += insert(values[i++]).second;
+        continue;
+      }
+      // The values that go to leaf are the ones up to the first that does
+      // not, found by doubling the step and then bisecting
+      data_node_type* leaf = get_leaf(key);
+      auto goes_to_leaf = [&](int j) {
+        return !(values[j].first > istats_.key_domain_max_) &&
+               get_leaf(values[j].first) == leaf;
+      };
+      int last = i;      // values[i..last] go to leaf
+      int end = num_keys;  // values[end] does not
+      for (int step = 1; last + step < num_keys; step *= 2) {
+        if (!goes_to_leaf(last + step)) {
+          end = last + step;
+          break;
+        }
+        last += step;
+      }
+      while (end - last > 1) {
+        int mid = last + (end - last) / 2;
+        if (goes_to_leaf(mid)) {
+          last = mid;
+        } else {
+          end = mid;
+        }
+      }
+      int num_values = end - i;
+      if (num_values * kBulkInsertMergeRatio < leaf->num_keys_) {
+        for (; i < end; i++) {
+          num_inserted += insert(values[i]).second;
+        }
+      } else {
+        num_inserted += merge_into_leaf(leaf, values + i, num_values);
+        i = end;
+      }
+    }
+    return num_inserted;
+  }
+
   // This will NOT do an update of an existing key.
   // To perform an update or read-modify-write, do a lookup and modify the
   // payload's value.
@@ -1142,136 +2614,253 @@ class Alex {
   // Insert does not happen if duplicates are not allowed and duplicate is
   // found.
   std::pair<Iterator, bool> insert(const T& key, const P& payload) {
+    // Nodes we replace must outlive the locks we hold on them
+    EpochGuard guard(is_concurrent());
+
     // If enough keys fall outside the key domain, expand the root to expand the
-    // key domain
-    if (key > istats_.key_domain_max_) {
-      istats_.num_keys_above_key_domain++;
-      if (should_expand_right()) {
-        expand_root(key, false);  // expand to the right
-      }
-    } else if (key < istats_.key_domain_min_) {
-      istats_.num_keys_below_key_domain++;
-      if (should_expand_left()) {
-        expand_root(key, true);  // expand to the left
+    // key domain. Concurrent writers only take the structure lock to expand,
+    // and check again once they hold it.
+    if (key > istats_.key_domain_max_ || key < istats_.key_domain_min_) {
+      bool above = key > istats_.key_domain_max_;
+      count_keys_outside_domain(above, 1);
+      if (above ? should_expand_right() : should_expand_left()) {
+        auto structure_lock = lock_structure();
+        if (key > istats_.key_domain_max_ && should_expand_right()) {
+          expand_root(key, false);  // expand to the right
+        } else if (key < istats_.key_domain_min_ && should_expand_left()) {
+          expand_root(key, true);  // expand to the left
+        }
       }
     }
 
-    data_node_type* leaf = get_leaf(key);
-
-    // Nonzero fail flag means that the insert did not happen
-    std::pair<int, int> ret = leaf->insert(key, payload);
+    WriteLockSet locks(is_concurrent());
+    data_node_type* leaf =
+        is_multi_writer() ? lock_leaf_for_write(key, &locks) : get_leaf(key);
+    locks.add(&leaf->lock_);
+
+    // Nonzero fail flag means that the insert did not happen. Optimistic
+    // readers do not see the delta buffer, so it is only used when there are
+    // none.
+    bool was_pending = leaf->reorganization_pending_;
+    std::pair<int, int> ret = leaf->insert(key, payload, !is_concurrent(),
+                                           reorganizer_ != nullptr);
     int fail = ret.first;
     int insert_pos = ret.second;
+    if (!was_pending && leaf->reorganization_pending_) {
+      // The leaf took the key, and leaves its reorganization to the
+      // background worker
+      reorganizer_->submit([this, key] { reorganize_in_background(key); });
+    }
     if (fail == -1) {
       // Duplicate found and duplicates not allowed
-      return {Iterator(leaf, insert_pos), false};
+      return {Iterator(leaf, insert_pos, this), false};
+    }
+
+    std::unique_lock<std::mutex> structure_lock;
+    if (fail && is_multi_writer()) {
+      // Escalate to a structural modification. Another writer may split the
+      // leaf while we wait, so find it again and retry.
+      locks.release();
+      structure_lock = lock_structure();
+      leaf = lock_leaf_for_write(key, &locks);
+      ret = leaf->insert(key, payload);
+      fail = ret.first;
+      insert_pos = ret.second;
+      if (fail == -1) {
+        return {Iterator(leaf, insert_pos, this), false};
+      }
     }
 
     // If no insert, figure out what to do with the data node to decrease the
     // cost
     if (fail) {
       std::vector<TraversalNode> traversal_path;
-      get_leaf(key, &traversal_path);
-      model_node_type* parent = traversal_path.back().node;
-
+      model_node_type* parent =
+          begin_leaf_reorganization(leaf, key, &traversal_path, &locks);
       while (fail) {
-        auto start_time = std::chrono::high_resolution_clock::now();
-        stats_.num_expand_and_scales += leaf->num_resizes_;
-
-        if (parent == superroot_) {
-          update_superroot_key_domain();
-        }
-        int bucketID = parent->model_.predict(key);
-        bucketID = std::min<int>(std::max<int>(bucketID, 0),
-                                 parent->num_children_ - 1);
-        std::vector<fanout_tree::FTNode> used_fanout_tree_nodes;
-
-        int fanout_tree_depth = 1;
-        if (experimental_params_.splitting_policy_method == 0 || fail >= 2) {
-          // always split in 2. No extra work required here
-        } else if (experimental_params_.splitting_policy_method == 1) {
-          // decide between no split (i.e., expand and retrain) or splitting in
-          // 2
-          fanout_tree_depth = fanout_tree::find_best_fanout_existing_node<T, P>(
-              parent, bucketID, stats_.num_keys, used_fanout_tree_nodes, 2, pager_);
-        } else if (experimental_params_.splitting_policy_method == 2) {
-          // use full fanout tree to decide fanout
-          fanout_tree_depth = fanout_tree::find_best_fanout_existing_node<T, P>(
-              parent, bucketID, stats_.num_keys, used_fanout_tree_nodes,
-              derived_params_.max_fanout, pager_);
-        }
-        int best_fanout = 1 << fanout_tree_depth;
-        stats_.cost_computation_time +=
-            std::chrono::duration_cast<std::chrono::nanoseconds>(
-                std::chrono::high_resolution_clock::now() - start_time)
-                .count();
-
-        if (fanout_tree_depth == 0) {
-          // expand existing data node and retrain model
-          leaf->resize(data_node_type::kMinDensity_, true,
-                       leaf->is_append_mostly_right(),
-                       leaf->is_append_mostly_left());
-          fanout_tree::FTNode& tree_node = used_fanout_tree_nodes[0];
-          leaf->cost_ = tree_node.cost;
-          leaf->expected_avg_exp_search_iterations_ =
-              tree_node.expected_avg_search_iterations;
-          leaf->expected_avg_shifts_ = tree_node.expected_avg_shifts;
-          leaf->reset_stats();
-          stats_.num_expand_and_retrains++;
-        } else {
-          // split data node: always try to split sideways/upwards, only split
-          // downwards if necessary
-          bool reuse_model = (fail == 3);
-          if (experimental_params_.allow_splitting_upwards) {
-            // allow splitting upwards
-            assert(experimental_params_.splitting_policy_method != 2);
-            int stop_propagation_level = best_split_propagation(traversal_path);
-            if (stop_propagation_level <= superroot_->level_) {
-              parent = split_downwards(parent, bucketID, fanout_tree_depth,
-                                       used_fanout_tree_nodes, reuse_model);
-            } else {
-              split_upwards(key, stop_propagation_level, traversal_path,
-                            reuse_model, &parent);
-            }
-          } else {
-            // either split sideways or downwards
-            bool should_split_downwards =
-                (parent->num_children_ * best_fanout /
-                         (1 << leaf->duplication_factor_) >
-                     derived_params_.max_fanout ||
-                 parent->level_ == superroot_->level_);
-            if (should_split_downwards) {
-              parent = split_downwards(parent, bucketID, fanout_tree_depth,
-                                       used_fanout_tree_nodes, reuse_model);
-            } else {
-              split_sideways(parent, bucketID, fanout_tree_depth,
-                             used_fanout_tree_nodes, reuse_model);
-            }
-          }
-          leaf = static_cast<data_node_type*>(parent->get_child_node(key));
-        }
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration = end_time - start_time;
-        stats_.splitting_time +=
-            std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
-                .count();
+        leaf = reorganize_leaf(leaf, key, fail, traversal_path, &parent,
+                               &locks);
 
         // Try again to insert the key
-        ret = leaf->insert(key, payload);
+        ret = leaf->insert(key, payload, !is_concurrent());
         fail = ret.first;
         insert_pos = ret.second;
         if (fail == -1) {
           // Duplicate found and duplicates not allowed
-          return {Iterator(leaf, insert_pos), false};
+          return {Iterator(leaf, insert_pos, this), false};
         }
       }
     }
-    stats_.num_inserts++;
-    stats_.num_keys++;
-    return {Iterator(leaf, insert_pos), true};
+    log_write(WalOp::kInsert, key, payload);
+    count_keys_changed(1, structure_lock.owns_lock());
+    return {Iterator(leaf, insert_pos, this), true};
+  }
+
+  // Sets the payload that get_payload(key) points to. Returns false if there
+  // is no such key. Unlike a write through that pointer, the update is logged
+  // and saved by the next checkpoint.
+  bool update(const T& key, const P& payload) {
+    EpochGuard guard(is_concurrent());
+    WriteLockSet locks(is_concurrent());
+    data_node_type* leaf =
+        is_multi_writer() ? lock_leaf_for_write(key, &locks) : get_leaf(key);
+    locks.add(&leaf->lock_);
+    P* slot = leaf->find_payload(key);
+    if (slot == nullptr) {
+      return false;
+    }
+    leaf->mark_dirty();
+    *slot = payload;
+    log_write(WalOp::kUpdate, key, payload);
+    return true;
   }
 
  private:
+  // Prepares to replace or retrain leaf, the data node responsible for key:
+  // finds the traversal path to it and locks the model nodes that may change.
+  // Returns the parent of leaf. In multi-writer mode, the caller holds the
+  // structure lock and the lock of leaf.
+  model_node_type* begin_leaf_reorganization(
+      data_node_type* leaf, const T& key,
+      std::vector<TraversalNode>* traversal_path, WriteLockSet* locks) {
+    // Splits and expansions copy the slots only
+    leaf->merge_delta();
+    traversal_path_to(leaf, key, traversal_path);
+    // The data nodes that replace leaf are linked to its neighbors
+    link_leaf_neighbors(leaf, *traversal_path);
+    model_node_type* parent = traversal_path->back().node;
+    // Splitting changes the parent's children, and splitting upwards may
+    // change any node on the path
+    if (experimental_params_.allow_splitting_upwards) {
+      for (const TraversalNode& tn : *traversal_path) {
+        locks->add(&tn.node->lock_);
+      }
+    } else {
+      locks->add(&parent->lock_);
+    }
+    return parent;
+  }
+
+  // Makes room in leaf, whose insert of key failed with fail flag fail, by
+  // expanding and retraining it or by splitting it. Returns the data node that
+  // is now responsible for key, and its parent through parent_ptr, which
+  // holds the parent of leaf on entry.
+  data_node_type* reorganize_leaf(
+      data_node_type* leaf, const T& key, int fail,
+      const std::vector<TraversalNode>& traversal_path,
+      model_node_type** parent_ptr, WriteLockSet* locks) {
+    model_node_type* parent = *parent_ptr;
+    auto start_time = std::chrono::high_resolution_clock::now();
+    stats_.num_expand_and_scales += leaf->num_resizes_;
+
+    if (parent == superroot_) {
+      update_superroot_key_domain();
+    }
+    int bucketID = parent->model_.predict(key);
+    bucketID = std::min<int>(std::max<int>(bucketID, 0),
+                             parent->num_children_ - 1);
+    std::vector<fanout_tree::FTNode> used_fanout_tree_nodes;
+
+    int fanout_tree_depth = 1;
+    if (experimental_params_.splitting_policy_method == 0 || fail >= 2) {
+      // always split in 2. No extra work required here
+    } else if (experimental_params_.splitting_policy_method == 1) {
+      // decide between no split (i.e., expand and retrain) or splitting in 2
+      fanout_tree_depth = fanout_tree::find_best_fanout_existing_node<data_node_type>(
+          parent, bucketID, stats_.num_keys, used_fanout_tree_nodes, 2, pager_);
+    } else if (experimental_params_.splitting_policy_method == 2) {
+      // use full fanout tree to decide fanout
+      fanout_tree_depth = fanout_tree::find_best_fanout_existing_node<data_node_type>(
+          parent, bucketID, stats_.num_keys, used_fanout_tree_nodes,
+          derived_params_.max_fanout, pager_);
+    }
+    int best_fanout = 1 << fanout_tree_depth;
+    stats_.cost_computation_time +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::high_resolution_clock::now() - start_time)
+            .count();
+
+    if (fanout_tree_depth == 0) {
+      // expand existing data node and retrain model
+      leaf->resize(data_node_type::kMinDensity_, true,
+                   leaf->is_append_mostly_right(),
+                   leaf->is_append_mostly_left());
+      fanout_tree::FTNode& tree_node = used_fanout_tree_nodes[0];
+      leaf->cost_ = tree_node.cost;
+      leaf->expected_avg_exp_search_iterations_ =
+          tree_node.expected_avg_search_iterations;
+      leaf->expected_avg_shifts_ = tree_node.expected_avg_shifts;
+      leaf->reset_stats();
+      leaf->reorganization_pending_ = false;
+      stats_.num_expand_and_retrains++;
+    } else {
+      // split data node: always try to split sideways/upwards, only split
+      // downwards if necessary
+      bool reuse_model = (fail == 3);
+      if (experimental_params_.allow_splitting_upwards) {
+        // allow splitting upwards
+        assert(experimental_params_.splitting_policy_method != 2);
+        int stop_propagation_level = best_split_propagation(traversal_path);
+        if (stop_propagation_level <= superroot_->level_) {
+          parent = split_downwards(parent, bucketID, fanout_tree_depth,
+                                   used_fanout_tree_nodes, reuse_model);
+        } else {
+          split_upwards(key, stop_propagation_level, traversal_path,
+                        reuse_model, &parent);
+        }
+      } else {
+        // either split sideways or downwards
+        bool should_split_downwards =
+            (parent->num_children_ * best_fanout /
+                     (1 << leaf->duplication_factor_) >
+                 derived_params_.max_fanout ||
+             parent->level_ == superroot_->level_);
+        if (should_split_downwards) {
+          parent = split_downwards(parent, bucketID, fanout_tree_depth,
+                                   used_fanout_tree_nodes, reuse_model);
+        } else {
+          split_sideways(parent, bucketID, fanout_tree_depth,
+                         used_fanout_tree_nodes, reuse_model);
+        }
+      }
+      leaf = static_cast<data_node_type*>(parent->get_child_node(key));
+      locks->add(&parent->lock_);
+      locks->add(&leaf->lock_);
+    }
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto duration = end_time - start_time;
+    stats_.splitting_time +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+            .count();
+
+    *parent_ptr = parent;
+    return leaf;
+  }
+
+  // Runs on the background worker: makes the reorganization that an insert
+  // deferred in the data node responsible for key, unless that node has been
+  // reorganized since
+  void reorganize_in_background(const T& key) {
+    EpochGuard guard(true);
+    auto structure_lock = lock_structure();
+    WriteLockSet locks(true);
+    data_node_type* leaf = lock_leaf_for_write(key, &locks);
+    if (!leaf->reorganization_pending_) {
+      return;
+    }
+    leaf->reorganization_pending_ = false;
+    int reorganization = leaf->reorganization_needed(true);
+    if (reorganization == data_node_type::kNeedsExpansion_) {
+      leaf->expand();
+    } else if (reorganization != 0) {
+      std::vector<TraversalNode> traversal_path;
+      model_node_type* parent =
+          begin_leaf_reorganization(leaf, key, &traversal_path, &locks);
+      reorganize_leaf(leaf, key, reorganization, traversal_path, &parent,
+                      &locks);
+    }
+  }
+
   // Our criteria for when to expand the root, thereby expanding the key domain.
   // We want to strike a balance between expanding too aggressively and too
   // slowly.
@@ -1282,26 +2871,26 @@ class Alex {
   // expect from randomness alone.
   bool should_expand_right() const {
     return (!root_node_->is_leaf_ &&
-            ((istats_.num_keys_above_key_domain >= kMinOutOfDomainKeys &&
-              istats_.num_keys_above_key_domain >=
+            ((num_keys_above_key_domain() >= kMinOutOfDomainKeys &&
+              num_keys_above_key_domain() >=
                   kOutOfDomainToleranceFactor *
                       (stats_.num_keys /
                            istats_.num_keys_at_last_right_domain_resize -
                        1)) ||
-             istats_.num_keys_above_key_domain >= kMaxOutOfDomainKeys));
+             num_keys_above_key_domain() >= kMaxOutOfDomainKeys));
   }
 
   // Similar to should_expand_right, but for insertions to the left of the key
   // domain.
   bool should_expand_left() const {
     return (!root_node_->is_leaf_ &&
-            ((istats_.num_keys_below_key_domain >= kMinOutOfDomainKeys &&
-              istats_.num_keys_below_key_domain >=
+            ((num_keys_below_key_domain() >= kMinOutOfDomainKeys &&
+              num_keys_below_key_domain() >=
                   kOutOfDomainToleranceFactor *
                       (stats_.num_keys /
                            istats_.num_keys_at_last_left_domain_resize -
                        1)) ||
-             istats_.num_keys_below_key_domain >= kMaxOutOfDomainKeys));
+             num_keys_below_key_domain() >= kMaxOutOfDomainKeys));
   }
 
   // When splitting upwards, find best internal node to propagate upwards to.
@@ -1317,7 +2906,7 @@ class Alex {
     std::vector<SplitDecisionCosts> traversal_costs;
     for (const TraversalNode& tn : traversal_path) {
       double stop_cost;
-      AlexNode<T, P>* next = tn.node->children_[tn.bucketID]->get(pager_);
+      AlexNode<T, P>* next = child_node(tn.node->children_[tn.bucketID]);
       if (next->duplication_factor_ > 0) {
         stop_cost = 0;
       } else {
@@ -1368,6 +2957,11 @@ class Alex {
   // a new root node.
   void expand_root(T key, bool expand_left) {
     auto root = static_cast<model_node_type*>(root_node_);
+    WriteLockSet locks(is_concurrent());
+    locks.add(&superroot_->lock_);
+    locks.add(&root->lock_);
+    // Some of the outermost data node's keys move to new data nodes
+    locks.add(&(expand_left ? first_data_node() : last_data_node())->lock_);
 
     // Find the new bounds of the key domain.
     // Need to be careful to avoid overflows in the key type.
@@ -1430,7 +3024,7 @@ class Alex {
 
       int new_num_children = root->num_children_ * expansion_factor;
       auto new_children = new (pointer_allocator().allocate(new_num_children))
-          LazyAlexNode<T, P>*[new_num_children];
+          ChildRef<T, P>[new_num_children];
       int copy_start;
       if (expand_left) {
         copy_start = new_num_children - root->num_children_;
@@ -1445,7 +3039,7 @@ class Alex {
       for (int i = 0; i < root->num_children_; i++) {
         new_children[copy_start + i] = root->children_[i];
       }
-      pointer_allocator().deallocate(root->children_, root->num_children_);
+      root->free_children();
       root->children_ = new_children;
       root->num_children_ = new_num_children;
     } else {
@@ -1459,12 +3053,12 @@ class Alex {
       }
       new_root->num_children_ = expansion_factor;
       new_root->children_ = new (pointer_allocator().allocate(expansion_factor))
-          LazyAlexNode<T, P>*[expansion_factor];
+          ChildRef<T, P>[expansion_factor];
       if (expand_left) {
-        new_root->children_[expansion_factor - 1] = new LazyAlexNode(root, pager_);
+        new_root->children_[expansion_factor - 1] = ChildRef<T, P>(root);
         new_nodes_start = 0;
       } else {
-        new_root->children_[0] = new LazyAlexNode(root, pager_);
+        new_root->children_[0] = ChildRef<T, P>(root);
         new_nodes_start = 1;
       }
       new_nodes_end = new_nodes_start + expansion_factor - 1;
@@ -1493,9 +3087,14 @@ class Alex {
     assert(root->num_children_ % n == 0);
     auto new_node_duplication_factor =
         static_cast<uint8_t>(log_2_round_down(n));
+    // Keys are reassigned by the bucket that the root predicts for them, so
+    // that they go to the data node that traversals reach. Boundaries by key
+    // value, such as the old domain bound, can be off by a rounding error.
+    int first_moved_pos;
     if (expand_left) {
-      T left_boundary_value = istats_.key_domain_min_;
-      int left_boundary = outermost_node->lower_bound(left_boundary_value);
+      int left_boundary =
+          first_pos_in_bucket(outermost_node, root->model_, new_nodes_end);
+      first_moved_pos = left_boundary;
       data_node_type* next = outermost_node;
       for (int i = new_nodes_end; i > new_nodes_start; i -= n) {
         if (i <= in_bounds_new_nodes_start) {
@@ -1506,8 +3105,8 @@ class Alex {
         if (i - n <= in_bounds_new_nodes_start) {
           left_boundary = 0;
         } else {
-          left_boundary_value -= domain_size;
-          left_boundary = outermost_node->lower_bound(left_boundary_value);
+          left_boundary =
+              first_pos_in_bucket(outermost_node, root->model_, i - n);
         }
         data_node_type* new_node = bulk_load_leaf_node_from_existing(
             outermost_node, left_boundary, right_boundary, true);
@@ -1519,12 +3118,13 @@ class Alex {
         new_node->next_leaf_ = next;
         next = new_node;
         for (int j = i - 1; j >= i - n; j--) {
-          root->children_[j] = new LazyAlexNode(new_node, pager_);
+          root->children_[j] = ChildRef<T, P>(new_node);
         }
       }
     } else {
-      T right_boundary_value = istats_.key_domain_max_;
-      int right_boundary = outermost_node->lower_bound(right_boundary_value);
+      int right_boundary =
+          first_pos_in_bucket(outermost_node, root->model_, new_nodes_start);
+      first_moved_pos = right_boundary;
       data_node_type* prev = nullptr;
       for (int i = new_nodes_start; i < new_nodes_end; i += n) {
         if (i >= in_bounds_new_nodes_end) {
@@ -1535,8 +3135,8 @@ class Alex {
         if (i + n >= in_bounds_new_nodes_end) {
           right_boundary = outermost_node->data_capacity_;
         } else {
-          right_boundary_value += domain_size;
-          right_boundary = outermost_node->lower_bound(right_boundary_value);
+          right_boundary =
+              first_pos_in_bucket(outermost_node, root->model_, i + n);
         }
         data_node_type* new_node = bulk_load_leaf_node_from_existing(
             outermost_node, left_boundary, right_boundary, true);
@@ -1548,7 +3148,7 @@ class Alex {
         new_node->prev_leaf_ = prev;
         prev = new_node;
         for (int j = i; j < i + n; j++) {
-          root->children_[j] = new LazyAlexNode(new_node, pager_);
+          root->children_[j] = ChildRef<T, P>(new_node);
         }
       }
     }
@@ -1556,16 +3156,21 @@ class Alex {
     // Connect leaf nodes and remove reassigned keys from outermost pre-existing
     // node.
     if (expand_left) {
-      outermost_node->erase_range(new_domain_min, istats_.key_domain_min_);
+      if (first_moved_pos > 0) {
+        outermost_node->erase_range(new_domain_min,
+                                    outermost_node->get_key(first_moved_pos));
+      }
       auto last_new_leaf =
-          static_cast<data_node_type*>(root->children_[new_nodes_end - 1]->get(pager_));
+          static_cast<data_node_type*>(child_node(root->children_[new_nodes_end - 1]));
       outermost_node->prev_leaf_ = last_new_leaf;
       last_new_leaf->next_leaf_ = outermost_node;
     } else {
-      outermost_node->erase_range(istats_.key_domain_max_, new_domain_max,
-                                  true);
+      if (first_moved_pos < outermost_node->data_capacity_) {
+        outermost_node->erase_range(outermost_node->get_key(first_moved_pos),
+                                    new_domain_max, true);
+      }
       auto first_new_leaf =
-          static_cast<data_node_type*>(root->children_[new_nodes_start]->get(pager_));
+          static_cast<data_node_type*>(child_node(root->children_[new_nodes_start]));
       outermost_node->next_leaf_ = first_new_leaf;
       first_new_leaf->prev_leaf_ = outermost_node;
     }
@@ -1574,6 +3179,23 @@ class Alex {
     istats_.key_domain_max_ = new_domain_max;
   }
 
+  // Position of the first slot of node whose key model predicts in bucketID or
+  // a later one. Gaps hold the key that follows them, so the slots are sorted.
+  int first_pos_in_bucket(const data_node_type* node,
+                          const LinearModel<T>& model, int bucketID) const {
+    int left = 0;
+    int right = node->data_capacity_;
+    while (left < right) {
+      int mid = left + (right - left) / 2;
+      if (model.predict_double(node->get_key(mid)) >= bucketID) {
+        right = mid;
+      } else {
+        left = mid + 1;
+      }
+    }
+    return left;
+  }
+
   // Splits downwards in the manner determined by the fanout tree and updates
   // the pointers of the parent.
   // If no fanout tree is provided, then splits downward in two. Returns the
@@ -1582,7 +3204,7 @@ class Alex {
       model_node_type* parent, int bucketID, int fanout_tree_depth,
       std::vector<fanout_tree::FTNode>& used_fanout_tree_nodes,
       bool reuse_model) {
-    auto leaf = static_cast<data_node_type*>(parent->children_[bucketID]->get(pager_));
+    auto leaf = static_cast<data_node_type*>(child_node(parent->children_[bucketID]));
     stats_.num_downward_splits++;
     stats_.num_downward_split_keys += leaf->num_keys_;
 
@@ -1593,7 +3215,7 @@ class Alex {
     new_node->duplication_factor_ = leaf->duplication_factor_;
     new_node->num_children_ = fanout;
     new_node->children_ =
-        new (pointer_allocator().allocate(fanout)) LazyAlexNode<T, P>*[fanout];
+        new (pointer_allocator().allocate(fanout)) ChildRef<T, P>[fanout];
 
     int repeats = 1 << leaf->duplication_factor_;
     int start_bucketID =
@@ -1621,7 +3243,7 @@ class Alex {
     stats_.num_data_nodes--;
     stats_.num_model_nodes++;
     for (int i = start_bucketID; i < end_bucketID; i++) {
-      parent->children_[i] = new LazyAlexNode(new_node, pager_);
+      parent->children_[i] = ChildRef<T, P>(new_node);
     }
     if (parent == superroot_) {
       root_node_ = new_node;
@@ -1637,7 +3259,7 @@ class Alex {
                       int fanout_tree_depth,
                       std::vector<fanout_tree::FTNode>& used_fanout_tree_nodes,
                       bool reuse_model) {
-    auto leaf = static_cast<data_node_type*>(parent->children_[bucketID]->get(pager_));
+    auto leaf = static_cast<data_node_type*>(child_node(parent->children_[bucketID]));
     stats_.num_sideways_splits++;
     stats_.num_sideways_split_keys += leaf->num_keys_;
 
@@ -1733,10 +3355,10 @@ class Alex {
         static_cast<uint8_t>(duplication_factor - 1);
 
     for (int i = start_bucketID; i < mid_bucketID; i++) {
-      parent->children_[i] = new LazyAlexNode(left_leaf, pager_);
+      parent->children_[i] = ChildRef<T, P>(left_leaf);
     }
     for (int i = mid_bucketID; i < end_bucketID; i++) {
-      parent->children_[i] = new LazyAlexNode(right_leaf, pager_);
+      parent->children_[i] = ChildRef<T, P>(right_leaf);
     }
     link_data_nodes(old_node, left_leaf, right_leaf);
   }
@@ -1807,7 +3429,7 @@ class Alex {
         prev_leaf->next_leaf_ = child_node;
       }
       for (int i = cur; i < cur + child_node_repeats; i++) {
-        parent->children_[i] = new LazyAlexNode(child_node, pager_);
+        parent->children_[i] = ChildRef<T, P>(child_node);
       }
       cur += child_node_repeats;
       prev_leaf = child_node;
@@ -1818,6 +3440,173 @@ class Alex {
     }
   }
 
+  // Appends the data nodes of the subtree rooted at node, in key order
+  void collect_data_nodes(AlexNode<T, P>* node,
+                          std::vector<data_node_type*>* leaves) {
+    if (node->is_leaf_) {
+      leaves->push_back(static_cast<data_node_type*>(node));
+      return;
+    }
+    auto model_node = static_cast<model_node_type*>(node);
+    int cur = 0;
+    while (cur < model_node->num_children_) {
+      AlexNode<T, P>* child = child_node(model_node->children_[cur]);
+      collect_data_nodes(child, leaves);
+      cur += 1 << child->duplication_factor_;
+    }
+  }
+
+  // Replaces leaf by data nodes bulk loaded with its keys merged with the
+  // sorted values, all of which get_leaf sends to leaf. The merged keys go to
+  // one data node if they fit, or else are split over a power of 2 of them
+  // that divide the key space of leaf evenly, as a split does. They take the
+  // slots of leaf in its parent if it has enough, or else the slots of a new
+  // model node that replaces leaf. A part whose keys still do not fit in a
+  // data node, as skewed keys may not, is bulk loaded into a subtree of its
+  // own. Returns the number of values inserted.
+  int merge_into_leaf(data_node_type* leaf, const V values[],
+                      int num_values) {
+    std::vector<V> merged;
+    int num_inserted = leaf->merge_sorted(
+        values, num_values, &merged, [this](const V& value) {
+          log_write(WalOp::kInsert, value.first, value.second);
+        });
+    if (num_inserted == 0) {
+      return 0;
+    }
+    count_keys_changed(num_inserted, false);
+    int num_keys = static_cast<int>(merged.size());
+
+    std::vector<TraversalNode> traversal_path;
+    traversal_path_to(leaf, values[0].first, &traversal_path);
+    link_leaf_neighbors(leaf, traversal_path);
+    model_node_type* parent = traversal_path.back().node;
+    int repeats = 1 << leaf->duplication_factor_;
+    int start_bucketID = traversal_path.back().bucketID -
+                         (traversal_path.back().bucketID % repeats);
+
+    int max_data_node_keys = static_cast<int>(
+        derived_params_.max_data_node_slots * data_node_type::kInitDensity_);
+    int log2_fanout = 0;
+    while ((num_keys >> log2_fanout) > max_data_node_keys &&
+           (2 << log2_fanout) <= derived_params_.max_fanout) {
+      log2_fanout++;
+    }
+    int fanout = 1 << log2_fanout;
+
+    // The new data nodes go in the buckets [start_bucketID, end_bucketID) of
+    // new_parent
+    model_node_type* new_parent = parent;
+    int parent_start_bucketID = start_bucketID;
+    int end_bucketID = start_bucketID + repeats;
+    if (fanout > repeats) {
+      stats_.num_downward_splits++;
+      stats_.num_downward_split_keys += leaf->num_keys_;
+      new_parent = new (model_node_allocator().allocate(1))
+          model_node_type(leaf->level_, pager_, allocator_);
+      new_parent->duplication_factor_ = leaf->duplication_factor_;
+      new_parent->num_children_ = fanout;
+      new_parent->children_ =
+          new (pointer_allocator().allocate(fanout)) ChildRef<T, P>[fanout];
+      double left_boundary_value =
+          (start_bucketID - parent->model_.b_) / parent->model_.a_;
+      double right_boundary_value =
+          (end_bucketID - parent->model_.b_) / parent->model_.a_;
+      new_parent->model_.a_ =
+          1.0 / (right_boundary_value - left_boundary_value) * fanout;
+      new_parent->model_.b_ = -new_parent->model_.a_ * left_boundary_value;
+      stats_.num_model_nodes++;
+      start_bucketID = 0;
+      end_bucketID = fanout;
+    } else if (fanout > 1) {
+      stats_.num_sideways_splits++;
+      stats_.num_sideways_split_keys += leaf->num_keys_;
+    }
+
+    int child_repeats = (end_bucketID - start_bucketID) / fanout;
+    data_node_type* prev_leaf = leaf->prev_leaf_;
+    int left = 0;
+    for (int bucketID = start_bucketID; bucketID < end_bucketID;
+         bucketID += child_repeats) {
+      int right = left;
+      if (bucketID + child_repeats == end_bucketID) {
+        right = num_keys;
+      } else {
+        while (right < num_keys &&
+               new_parent->model_.predict(merged[right].first) <
+                   bucketID + child_repeats) {
+          right++;
+        }
+      }
+      AlexNode<T, P>* child;
+      std::vector<data_node_type*> child_leaves;
+      if (right - left <= max_data_node_keys ||
+          key_equal(merged[left].first, merged[right - 1].first)) {
+        // Equal keys cannot be split, so they stay in one data node however
+        // many there are
+        auto data_node = new (data_node_allocator().allocate(1))
+            data_node_type(static_cast<short>(new_parent->level_ + 1),
+                           derived_params_.max_data_node_slots, pager_,
+                           key_less_, allocator_);
+        data_node->bulk_load(merged.data() + left, right - left, nullptr,
+                             params_.approximate_model_computation);
+        data_node->cost_ =
+            data_node->compute_expected_cost(leaf->frac_inserts());
+        stats_.num_data_nodes++;
+        child = data_node;
+        child_leaves.push_back(data_node);
+      } else {
+        // The keys of a skewed part do not fit in one data node, so the part
+        // is bulk loaded into a subtree, which splits them as bulk_load would
+        child = new (model_node_allocator().allocate(1)) model_node_type(
+            static_cast<short>(new_parent->level_ + 1), pager_, allocator_);
+        double left_value =
+            (bucketID - new_parent->model_.b_) / new_parent->model_.a_;
+        double right_value = (bucketID + child_repeats - new_parent->model_.b_) /
+                             new_parent->model_.a_;
+        child->model_.a_ = 1.0 / (right_value - left_value);
+        child->model_.b_ = -child->model_.a_ * left_value;
+        BulkLoadContext context;
+        bulk_load_node(merged.data() + left, right - left, child, num_keys,
+                       &context);
+        stats_.num_model_nodes += context.num_model_nodes;
+        stats_.num_data_nodes += context.num_data_nodes;
+        collect_data_nodes(child, &child_leaves);
+      }
+      child->duplication_factor_ =
+          static_cast<uint8_t>(log_2_round_down(child_repeats));
+      for (int i = bucketID; i < bucketID + child_repeats; i++) {
+        new_parent->children_[i] = ChildRef<T, P>(child);
+      }
+      for (data_node_type* data_node : child_leaves) {
+        data_node->prev_leaf_ = prev_leaf;
+        if (prev_leaf != nullptr) {
+          prev_leaf->next_leaf_ = data_node;
+        }
+        prev_leaf = data_node;
+      }
+      left = right;
+    }
+    prev_leaf->next_leaf_ = leaf->next_leaf_;
+    if (leaf->next_leaf_ != nullptr) {
+      leaf->next_leaf_->prev_leaf_ = prev_leaf;
+    }
+
+    if (new_parent != parent) {
+      for (int i = parent_start_bucketID; i < parent_start_bucketID + repeats;
+           i++) {
+        parent->children_[i] = ChildRef<T, P>(new_parent);
+      }
+    }
+    if (parent == superroot_) {
+      root_node_ = child_node(superroot_->children_[0]);
+      update_superroot_pointer();
+    }
+    delete_node(leaf);
+    stats_.num_data_nodes--;
+    return num_inserted;
+  }
+
   // Splits the data node in two and propagates the split upwards along the
   // traversal path.
   // Of the two newly created data nodes, returns the one that key falls into.
@@ -1833,7 +3622,7 @@ class Alex {
     const TraversalNode& parent_path_node = traversal_path.back();
     model_node_type* parent = parent_path_node.node;
     auto leaf = static_cast<data_node_type*>(
-        parent->children_[parent_path_node.bucketID]->get(pager_));
+        child_node(parent->children_[parent_path_node.bucketID]));
     int leaf_repeats = 1 << (leaf->duplication_factor_);
     int leaf_start_bucketID =
         parent_path_node.bucketID - (parent_path_node.bucketID % leaf_repeats);
@@ -1935,9 +3724,9 @@ class Alex {
       // If one of the resulting halves will only have one child pointer, we
       // should "pull up" that child
       bool pull_up_left_child = false, pull_up_right_child = false;
-      AlexNode<T, P>* left_half_first_child = cur_node->children_[0]->get(pager_);
+      AlexNode<T, P>* left_half_first_child = child_node(cur_node->children_[0]);
       AlexNode<T, P>* right_half_first_child =
-          cur_node->children_[cur_node->num_children_ / 2]->get(pager_);
+          child_node(cur_node->children_[cur_node->num_children_ / 2]);
       if (double_left_half &&
           (1 << right_half_first_child->duplication_factor_) ==
               cur_node->num_children_ / 2) {
@@ -1971,15 +3760,15 @@ class Alex {
         left_split->num_children_ = cur_node->num_children_;
         left_split->children_ =
             new (pointer_allocator().allocate(left_split->num_children_))
-                LazyAlexNode<T, P>*[left_split->num_children_];
+                ChildRef<T, P>[left_split->num_children_];
         left_split->model_.a_ = cur_node->model_.a_ * 2;
         left_split->model_.b_ = cur_node->model_.b_ * 2;
         int cur = 0;
         while (cur < cur_node->num_children_ / 2) {
-          AlexNode<T, P>* cur_child = cur_node->children_[cur]->get(pager_);
+          AlexNode<T, P>* cur_child = child_node(cur_node->children_[cur]);
           int cur_child_repeats = 1 << cur_child->duplication_factor_;
           for (int i = 2 * cur; i < 2 * (cur + cur_child_repeats); i++) {
-            left_split->children_[i] = new LazyAlexNode(cur_child, pager_);
+            left_split->children_[i] = ChildRef<T, P>(cur_child);
           }
           cur_child->duplication_factor_++;
           cur += cur_child_repeats;
@@ -1987,13 +3776,13 @@ class Alex {
         assert(cur == cur_node->num_children_ / 2);
 
         if (pull_up_right_child) {
-          next_right_split = cur_node->children_[cur_node->num_children_ / 2]->get(pager_);
+          next_right_split = child_node(cur_node->children_[cur_node->num_children_ / 2]);
           next_right_split->level_ = cur_node->level_;
         } else {
           right_split->num_children_ = cur_node->num_children_ / 2;
           right_split->children_ =
               new (pointer_allocator().allocate(right_split->num_children_))
-                  LazyAlexNode<T, P>*[right_split->num_children_];
+                  ChildRef<T, P>[right_split->num_children_];
           right_split->model_.a_ = cur_node->model_.a_;
           right_split->model_.b_ =
               cur_node->model_.b_ - cur_node->num_children_ / 2;
@@ -2015,10 +3804,10 @@ class Alex {
         int end_bucketID =
             start_bucketID + repeats;  // first bucket with next child
         for (int i = start_bucketID; i < mid_bucketID; i++) {
-          left_split->children_[i] = new LazyAlexNode(prev_left_split, pager_);
+          left_split->children_[i] = ChildRef<T, P>(prev_left_split);
         }
         for (int i = mid_bucketID; i < end_bucketID; i++) {
-          left_split->children_[i] = new LazyAlexNode(prev_right_split, pager_);
+          left_split->children_[i] = ChildRef<T, P>(prev_right_split);
         }
         next_left_split = left_split;
       } else {
@@ -2028,13 +3817,13 @@ class Alex {
           *new_parent = right_split;
         }
         if (pull_up_left_child) {
-          next_left_split = cur_node->children_[0]->get(pager_);
+          next_left_split = child_node(cur_node->children_[0]);
           next_left_split->level_ = cur_node->level_;
         } else {
           left_split->num_children_ = cur_node->num_children_ / 2;
           left_split->children_ =
               new (pointer_allocator().allocate(left_split->num_children_))
-                  LazyAlexNode<T, P>*[left_split->num_children_];
+                  ChildRef<T, P>[left_split->num_children_];
           left_split->model_.a_ = cur_node->model_.a_;
           left_split->model_.b_ = cur_node->model_.b_;
           int j = 0;
@@ -2048,18 +3837,18 @@ class Alex {
         right_split->num_children_ = cur_node->num_children_;
         right_split->children_ =
             new (pointer_allocator().allocate(right_split->num_children_))
-                LazyAlexNode<T, P>*[right_split->num_children_];
+                ChildRef<T, P>[right_split->num_children_];
         right_split->model_.a_ = cur_node->model_.a_ * 2;
         right_split->model_.b_ =
             (cur_node->model_.b_ - cur_node->num_children_ / 2) * 2;
         int cur = cur_node->num_children_ / 2;
         while (cur < cur_node->num_children_) {
-          AlexNode<T, P>* cur_child = cur_node->children_[cur]->get(pager_);
+          AlexNode<T, P>* cur_child = child_node(cur_node->children_[cur]);
           int cur_child_repeats = 1 << cur_child->duplication_factor_;
           int right_child_idx = cur - cur_node->num_children_ / 2;
           for (int i = 2 * right_child_idx;
                i < 2 * (right_child_idx + cur_child_repeats); i++) {
-            right_split->children_[i] = new LazyAlexNode(cur_child, pager_);
+            right_split->children_[i] = ChildRef<T, P>(cur_child);
           }
           cur_child->duplication_factor_++;
           cur += cur_child_repeats;
@@ -2076,10 +3865,10 @@ class Alex {
         int end_bucketID =
             start_bucketID + repeats;  // first bucket with next child
         for (int i = start_bucketID; i < mid_bucketID; i++) {
-          right_split->children_[i] = new LazyAlexNode(prev_left_split, pager_);
+          right_split->children_[i] = ChildRef<T, P>(prev_left_split);
         }
         for (int i = mid_bucketID; i < end_bucketID; i++) {
-          right_split->children_[i] = new LazyAlexNode(prev_right_split, pager_);
+          right_split->children_[i] = ChildRef<T, P>(prev_right_split);
         }
         next_right_split = right_split;
       }
@@ -2150,10 +3939,10 @@ class Alex {
     int end_bucketID =
         start_bucketID + repeats;  // first bucket with next child
     for (int i = start_bucketID; i < mid_bucketID; i++) {
-      top_node->children_[i] = new LazyAlexNode(prev_left_split, pager_);
+      top_node->children_[i] = ChildRef<T, P>(prev_left_split);
     }
     for (int i = mid_bucketID; i < end_bucketID; i++) {
-      top_node->children_[i] = new LazyAlexNode(prev_right_split, pager_);
+      top_node->children_[i] = ChildRef<T, P>(prev_right_split);
     }
 
     for (auto node : to_delete) {
@@ -2168,33 +3957,43 @@ class Alex {
  public:
   // Erases the left-most key with the given key value
   int erase_one(const T& key) {
-    data_node_type* leaf = get_leaf(key);
-    int num_erased = leaf->erase_one(key);
-    stats_.num_keys -= num_erased;
-    if (leaf->num_keys_ == 0) {
-      merge(leaf, key);
-    }
-    if (key > istats_.key_domain_max_) {
-      istats_.num_keys_above_key_domain -= num_erased;
-    } else if (key < istats_.key_domain_min_) {
-      istats_.num_keys_below_key_domain -= num_erased;
+    EpochGuard guard(is_concurrent());
+    data_node_type* leaf;
+    int num_erased;
+    bool leaf_empty;
+    {
+      WriteLockSet locks(is_concurrent());
+      leaf = is_multi_writer() ? lock_leaf_for_write(key, &locks)
+                               : get_leaf(key);
+      locks.add(&leaf->lock_);
+      num_erased = leaf->erase_one(key);
+      if (num_erased > 0) {
+        log_write(WalOp::kEraseOne, key);
+      }
+      leaf_empty = (leaf->num_keys_ == 0);
     }
+    after_erase(leaf, key, num_erased, leaf_empty);
     return num_erased;
   }
 
   // Erases all keys with a certain key value
   int erase(const T& key) {
-    data_node_type* leaf = get_leaf(key);
-    int num_erased = leaf->erase(key);
-    stats_.num_keys -= num_erased;
-    if (leaf->num_keys_ == 0) {
-      merge(leaf, key);
-    }
-    if (key > istats_.key_domain_max_) {
-      istats_.num_keys_above_key_domain -= num_erased;
-    } else if (key < istats_.key_domain_min_) {
-      istats_.num_keys_below_key_domain -= num_erased;
+    EpochGuard guard(is_concurrent());
+    data_node_type* leaf;
+    int num_erased;
+    bool leaf_empty;
+    {
+      WriteLockSet locks(is_concurrent());
+      leaf = is_multi_writer() ? lock_leaf_for_write(key, &locks)
+                               : get_leaf(key);
+      locks.add(&leaf->lock_);
+      num_erased = leaf->erase(key);
+      if (num_erased > 0) {
+        log_write(WalOp::kErase, key);
+      }
+      leaf_empty = (leaf->num_keys_ == 0);
     }
+    after_erase(leaf, key, num_erased, leaf_empty);
     return num_erased;
   }
 
@@ -2203,17 +4002,20 @@ class Alex {
     if (it.is_end()) {
       return;
     }
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    it.resolve();
+#endif
+    EpochGuard guard(is_concurrent());
     T key = it.key();
-    it.cur_leaf_->erase_one_at(it.cur_idx_);
-    stats_.num_keys--;
-    if (it.cur_leaf_->num_keys_ == 0) {
-      merge(it.cur_leaf_, key);
-    }
-    if (key > istats_.key_domain_max_) {
-      istats_.num_keys_above_key_domain--;
-    } else if (key < istats_.key_domain_min_) {
-      istats_.num_keys_below_key_domain--;
+    bool leaf_empty;
+    {
+      WriteLockSet locks(is_concurrent());
+      locks.add(&it.cur_leaf_->lock_);
+      log_write(WalOp::kEraseAt, key, it.payload());
+      it.cur_leaf_->erase_one_at(it.cur_idx_);
+      leaf_empty = (it.cur_leaf_->num_keys_ == 0);
     }
+    after_erase(it.cur_leaf_, key, 1, leaf_empty);
   }
 
   // Removes all elements
@@ -2231,26 +4033,85 @@ class Alex {
   }
 
  private:
+  // Logs a write, if there is a log. Writers call this while they hold the
+  // lock on the leaf they changed, so that writes to the same key are logged
+  // in the order in which they were made.
+  void log_write(WalOp op, const T& key, const P& payload = P()) {
+    if (wal_ != nullptr) {
+      wal_->log(op, key, payload);
+    }
+  }
+
+  void replay_write(const WalRecord<T, P>& record) {
+    switch (record.op) {
+      case WalOp::kInsert:
+        insert(record.key, record.payload);
+        break;
+      case WalOp::kErase:
+        erase(record.key);
+        break;
+      case WalOp::kEraseOne:
+        erase_one(record.key);
+        break;
+      case WalOp::kEraseAt: {
+        // The first of the keys with the same value whose payload matches,
+        // as the iterator may have pointed to any of them
+        Iterator it = lower_bound(record.key);
+        Iterator first = it;
+        while (!it.is_end() && key_equal(it.key(), record.key) &&
+               memcmp(&it.payload(), &record.payload, sizeof(P)) != 0) {
+          ++it;
+        }
+        if (it.is_end() || !key_equal(it.key(), record.key)) {
+          it = first;
+        }
+        if (!it.is_end() && key_equal(it.key(), record.key)) {
+          erase(it);
+        }
+        break;
+      }
+      case WalOp::kUpdate:
+        update(record.key, record.payload);
+        break;
+    }
+  }
+
+  // Bookkeeping after num_erased keys with value key were erased from leaf
+  void after_erase(data_node_type* leaf, const T& key, int num_erased,
+                   bool leaf_empty) {
+    count_keys_changed(-num_erased, false);
+    if (leaf_empty) {
+      merge(leaf, key);
+    }
+    if (key > istats_.key_domain_max_ || key < istats_.key_domain_min_) {
+      count_keys_outside_domain(key > istats_.key_domain_max_, -num_erased);
+    }
+  }
+
   // Try to merge empty leaf, which can be traversed to by looking up key
   // This may cause the parent node to merge up into its own parent
   void merge(data_node_type* leaf, T key) {
-    // first save the complete path down to data node
-    std::vector<TraversalNode> traversal_path;
-    auto leaf_dup = get_leaf(key, &traversal_path);
-    // We might need to correct the traversal path in edge cases
-    if (leaf_dup != leaf) {
-      if (leaf_dup->prev_leaf_ == leaf) {
-        correct_traversal_path(leaf, traversal_path, true);
-      } else if (leaf_dup->next_leaf_ == leaf) {
-        correct_traversal_path(leaf, traversal_path, false);
-      } else {
-        assert(false);
+    auto structure_lock = lock_structure();
+    WriteLockSet locks(is_concurrent());
+    if (is_multi_writer()) {
+      // Other writers may have refilled or replaced the leaf since the caller
+      // released it
+      leaf = lock_leaf_for_write(key, &locks);
+      if (leaf->num_keys_ != 0) {
         return;
       }
     }
+    // first save the complete path down to data node
+    std::vector<TraversalNode> traversal_path;
+    traversal_path_to(leaf, key, &traversal_path);
     if (traversal_path.size() == 1) {
       return;
     }
+    link_leaf_neighbors(leaf, traversal_path);
+    locks.add(&leaf->lock_);
+    for (const TraversalNode& tn : traversal_path) {
+      locks.add(&tn.node->lock_);
+    }
     int path_pos = static_cast<int>(traversal_path.size()) - 1;
     TraversalNode tn = traversal_path[path_pos];
     model_node_type* parent = tn.node;
@@ -2270,13 +4131,13 @@ class Alex {
         data_node_type* adjacent_leaf = nullptr;
 
         // check if adjacent node is a leaf
-        if (adjacent_to_right && parent->children_[end_bucketID]->get(pager_)->is_leaf_) {
+        if (adjacent_to_right && child_node(parent->children_[end_bucketID])->is_leaf_) {
           adjacent_leaf =
-              static_cast<data_node_type*>(parent->children_[end_bucketID]->get(pager_));
+              static_cast<data_node_type*>(child_node(parent->children_[end_bucketID]));
         } else if (!adjacent_to_right &&
-                   parent->children_[start_bucketID - 1]->get(pager_)->is_leaf_) {
+                   child_node(parent->children_[start_bucketID - 1])->is_leaf_) {
           adjacent_leaf = static_cast<data_node_type*>(
-              parent->children_[start_bucketID - 1]->get(pager_));
+              child_node(parent->children_[start_bucketID - 1]));
         } else {
           break;  // unable to merge with sibling leaf
         }
@@ -2286,18 +4147,28 @@ class Alex {
           break;  // unable to merge with sibling leaf
         }
 
-        // merge with adjacent leaf
-        for (int i = start_bucketID; i < end_bucketID; i++) {
-          parent->children_[i] = new LazyAlexNode(adjacent_leaf, pager_);
+        // merge with adjacent leaf. The slots of the adjacent leaf are
+        // rewritten too, since they may still reference it through the
+        // wrapper that loaded it, and a run of slots must be identical.
+        locks.add(&adjacent_leaf->lock_);
+        int merged_start_bucketID =
+            adjacent_to_right ? start_bucketID : start_bucketID - repeats;
+        for (int i = merged_start_bucketID;
+             i < merged_start_bucketID + (repeats << 1); i++) {
+          parent->children_[i] = ChildRef<T, P>(adjacent_leaf);
         }
+        // A leaf merged into may not know its neighbor on the other side, in
+        // which case neither does that neighbor
         if (adjacent_to_right) {
           adjacent_leaf->prev_leaf_ = leaf->prev_leaf_;
-          if (leaf->prev_leaf_) {
+          if (leaf->prev_leaf_ &&
+              leaf->prev_leaf_ != data_node_type::unlinked_leaf()) {
             leaf->prev_leaf_->next_leaf_ = adjacent_leaf;
           }
         } else {
           adjacent_leaf->next_leaf_ = leaf->next_leaf_;
-          if (leaf->next_leaf_) {
+          if (leaf->next_leaf_ &&
+              leaf->next_leaf_ != data_node_type::unlinked_leaf()) {
             leaf->next_leaf_->prev_leaf_ = adjacent_leaf;
           }
         }
@@ -2330,7 +4201,7 @@ class Alex {
         int start_bucketID = bucketID - (bucketID % repeats);
         int end_bucketID = start_bucketID + repeats;
         for (int i = start_bucketID; i < end_bucketID; i++) {
-          parent->children_[i] = new LazyAlexNode(leaf, pager_);
+          parent->children_[i] = ChildRef<T, P>(leaf);
         }
       } else {
         break;  // unable to merge up
@@ -2342,7 +4213,7 @@ class Alex {
 
  public:
   // Number of elements
-  size_t size() const { return static_cast<size_t>(stats_.num_keys); }
+  size_t size() const { return static_cast<size_t>(get_stats().num_keys); }
 
   // True if there are no elements
   bool empty() const { return (size() == 0); }
@@ -2384,7 +4255,13 @@ class Alex {
   int num_leaves() const { return stats_.num_data_nodes; };
 
   // Return a const reference to the current statistics
-  const struct Stats& get_stats() const { return stats_; }
+  const struct Stats& get_stats() const {
+    stats_.num_lookups += concurrent_num_lookups_.take();
+    stats_.num_node_lookups += concurrent_num_node_lookups_.take();
+    stats_.num_keys += static_cast<int>(concurrent_num_keys_.take());
+    stats_.num_inserts += concurrent_num_inserts_.take();
+    return stats_;
+  }
 
   /*** Debugging ***/
 
@@ -2415,15 +4292,16 @@ class Alex {
           }
         }
 
-        node_stack.push(node->children_[node->num_children_ - 1]->get(pager_));
+        node_stack.push(child_node(node->children_[node->num_children_ - 1]));
         for (int i = node->num_children_ - 2; i >= 0; i--) {
-          if (node->children_[i] != node->children_[i + 1] && node->children_[i]->get(pager_) != node->children_[i + 1]->get(pager_)) {
-            node_stack.push(node->children_[i]->get(pager_));
+          if (node->children_[i] != node->children_[i + 1] && child_node(node->children_[i]) != child_node(node->children_[i + 1])) {
+            node_stack.push(child_node(node->children_[i]));
           }
         }
       } else {
         if (validate_data_nodes) {
           auto node = static_cast<data_node_type*>(cur);
+          node->merge_delta();
           if (!node->validate_structure(true)) {
             std::cout << "[Data node invalid structure]"
                       << " node addr: " << node
@@ -2435,10 +4313,10 @@ class Alex {
             }
           }
           if (node->num_keys_ > 0) {
-            data_node_type* prev_nonempty_leaf = node->prev_leaf_;
+            data_node_type* prev_nonempty_leaf = prev_leaf(node);
             while (prev_nonempty_leaf != nullptr &&
                    prev_nonempty_leaf->num_keys_ == 0) {
-              prev_nonempty_leaf = prev_nonempty_leaf->prev_leaf_;
+              prev_nonempty_leaf = prev_leaf(prev_nonempty_leaf);
             }
             if (prev_nonempty_leaf) {
               T last_in_prev_leaf = prev_nonempty_leaf->last_key();
@@ -2458,10 +4336,10 @@ class Alex {
                 }
               }
             }
-            data_node_type* next_nonempty_leaf = node->next_leaf_;
+            data_node_type* next_nonempty_leaf = next_leaf(node);
             while (next_nonempty_leaf != nullptr &&
                    next_nonempty_leaf->num_keys_ == 0) {
-              next_nonempty_leaf = next_nonempty_leaf->next_leaf_;
+              next_nonempty_leaf = next_leaf(next_nonempty_leaf);
             }
             if (next_nonempty_leaf) {
               T first_in_next_leaf = next_nonempty_leaf->first_key();
@@ -2498,10 +4376,21 @@ class Alex {
     int cur_bitmap_idx_ = 0;  // current position in bitmap
     uint64_t cur_bitmap_data_ = 0;  // caches the relevant data in the current
                                     // bitmap position
+    const self_type* index_ = nullptr;  // finds the neighbors of leaves
 
     Iterator() {}
 
-    Iterator(data_node_type* leaf, int idx) : cur_leaf_(leaf), cur_idx_(idx) {
+    Iterator(data_node_type* leaf, int idx, const self_type* index)
+        : cur_leaf_(leaf), cur_idx_(idx), index_(index) {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+      // Positions the iterator in the bitmap, which merges the delta buffer,
+      // only once it is advanced, so that the iterators that insert() returns
+      // do not merge the buffer every time
+      if (leaf != nullptr && (in_delta() || leaf->num_delta_ > 0)) {
+        cur_bitmap_idx_ = -1;
+        return;
+      }
+#endif
       initialize();
     }
 
@@ -2509,10 +4398,13 @@ class Alex {
         : cur_leaf_(other.cur_leaf_),
           cur_idx_(other.cur_idx_),
           cur_bitmap_idx_(other.cur_bitmap_idx_),
-          cur_bitmap_data_(other.cur_bitmap_data_) {}
+          cur_bitmap_data_(other.cur_bitmap_data_),
+          index_(other.index_) {}
 
     Iterator(const ReverseIterator& other)
-        : cur_leaf_(other.cur_leaf_), cur_idx_(other.cur_idx_) {
+        : cur_leaf_(other.cur_leaf_),
+          cur_idx_(other.cur_idx_),
+          index_(other.index_) {
       initialize();
     }
 
@@ -2522,37 +4414,89 @@ class Alex {
         cur_leaf_ = other.cur_leaf_;
         cur_bitmap_idx_ = other.cur_bitmap_idx_;
         cur_bitmap_data_ = other.cur_bitmap_data_;
+        index_ = other.index_;
       }
       return *this;
     }
 
     Iterator& operator++() {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+      resolve();
+#endif
       advance();
       return *this;
     }
 
     Iterator operator++(int) {
       Iterator tmp = *this;
-      advance();
+      ++*this;
       return tmp;
     }
 
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    // Whether the iterator points into the delta buffer of its leaf, like the
+    // one insert() returns for a key it put there
+    bool in_delta() const { return cur_idx_ < -1; }
+
+    // Whether the iterator has yet to be positioned in the bitmap, see
+    // resolve()
+    bool unresolved() const { return cur_bitmap_idx_ < 0; }
+
+    // Merges the delta buffer of the leaf, so that the iterator can move on
+    // through its slots, and moves the iterator to where its key went.
+    // Advancing or converting the iterator does this first; other iterators
+    // into the same leaf are invalid afterwards.
+    void resolve() {
+      if (unresolved()) {
+        initialize();
+      }
+    }
+
+    Iterator resolved() const {
+      Iterator it(*this);
+      it.resolve();
+      return it;
+    }
+
+    V& delta_entry() const {
+      return cur_leaf_->delta_slots_[data_node_type::delta_slot(cur_idx_)];
+    }
+#endif
+
 #if ALEX_DATA_NODE_SEP_ARRAYS
     // Does not return a reference because keys and payloads are stored
     // separately.
     // If possible, use key() and payload() instead.
     V operator*() const {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+      if (in_delta()) return delta_entry();
+#endif
       return std::make_pair(cur_leaf_->key_slots_[cur_idx_],
                             cur_leaf_->payload_slots_[cur_idx_]);
     }
 #else
     // If data node stores key-payload pairs contiguously, return reference to V
-    V& operator*() const { return cur_leaf_->data_slots_[cur_idx_]; }
+    V& operator*() const {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+      if (in_delta()) return delta_entry();
+#endif
+      return cur_leaf_->data_slots_[cur_idx_];
+    }
 #endif
 
-    const T& key() const { return cur_leaf_->get_key(cur_idx_); }
+    const T& key() const {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+      if (in_delta()) return delta_entry().first;
+#endif
+      return cur_leaf_->get_key(cur_idx_);
+    }
 
-    P& payload() const { return cur_leaf_->get_payload(cur_idx_); }
+    P& payload() const {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+      if (in_delta()) return delta_entry().second;
+#endif
+      return cur_leaf_->get_payload(cur_idx_);
+    }
 
     bool is_end() const { return cur_leaf_ == nullptr; }
 
@@ -2565,9 +4509,12 @@ class Alex {
    private:
     void initialize() {
       if (!cur_leaf_) return;
+#if ALEX_DATA_NODE_DELTA_BUFFER
+      cur_idx_ = cur_leaf_->merge_delta(cur_idx_);
+#endif
       assert(cur_idx_ >= 0);
       if (cur_idx_ >= cur_leaf_->data_capacity_) {
-        cur_leaf_ = cur_leaf_->next_leaf_;
+        cur_leaf_ = index_->next_leaf(cur_leaf_);
         cur_idx_ = 0;
         if (!cur_leaf_) return;
       }
@@ -2579,14 +4526,14 @@ class Alex {
       int bit_pos = cur_idx_ - (cur_bitmap_idx_ << 6);
       cur_bitmap_data_ &= ~((1ULL << bit_pos) - 1);
 
-      (*this)++;
+      advance();
     }
 
     forceinline void advance() {
       while (cur_bitmap_data_ == 0) {
         cur_bitmap_idx_++;
         if (cur_bitmap_idx_ >= cur_leaf_->bitmap_size_) {
-          cur_leaf_ = cur_leaf_->next_leaf_;
+          cur_leaf_ = index_->next_leaf(cur_leaf_);
           cur_idx_ = 0;
           if (cur_leaf_ == nullptr) {
             return;
@@ -2608,11 +4555,12 @@ class Alex {
     int cur_bitmap_idx_ = 0;  // current position in bitmap
     uint64_t cur_bitmap_data_ = 0;  // caches the relevant data in the current
                                     // bitmap position
+    const self_type* index_ = nullptr;  // finds the neighbors of leaves
 
     ConstIterator() {}
 
-    ConstIterator(const data_node_type* leaf, int idx)
-        : cur_leaf_(leaf), cur_idx_(idx) {
+    ConstIterator(const data_node_type* leaf, int idx, const self_type* index)
+        : cur_leaf_(leaf), cur_idx_(idx), index_(index) {
       initialize();
     }
 
@@ -2620,21 +4568,33 @@ class Alex {
         : cur_leaf_(other.cur_leaf_),
           cur_idx_(other.cur_idx_),
           cur_bitmap_idx_(other.cur_bitmap_idx_),
-          cur_bitmap_data_(other.cur_bitmap_data_) {}
+          cur_bitmap_data_(other.cur_bitmap_data_),
+          index_(other.index_) {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+      if (other.unresolved()) {
+        *this = ConstIterator(other.resolved());
+      }
+#endif
+    }
 
     ConstIterator(const ConstIterator& other)
         : cur_leaf_(other.cur_leaf_),
           cur_idx_(other.cur_idx_),
           cur_bitmap_idx_(other.cur_bitmap_idx_),
-          cur_bitmap_data_(other.cur_bitmap_data_) {}
+          cur_bitmap_data_(other.cur_bitmap_data_),
+          index_(other.index_) {}
 
     ConstIterator(const ReverseIterator& other)
-        : cur_leaf_(other.cur_leaf_), cur_idx_(other.cur_idx_) {
+        : cur_leaf_(other.cur_leaf_),
+          cur_idx_(other.cur_idx_),
+          index_(other.index_) {
       initialize();
     }
 
     ConstIterator(const ConstReverseIterator& other)
-        : cur_leaf_(other.cur_leaf_), cur_idx_(other.cur_idx_) {
+        : cur_leaf_(other.cur_leaf_),
+          cur_idx_(other.cur_idx_),
+          index_(other.index_) {
       initialize();
     }
 
@@ -2644,6 +4604,7 @@ class Alex {
         cur_leaf_ = other.cur_leaf_;
         cur_bitmap_idx_ = other.cur_bitmap_idx_;
         cur_bitmap_data_ = other.cur_bitmap_data_;
+        index_ = other.index_;
       }
       return *this;
     }
@@ -2689,7 +4650,7 @@ class Alex {
       if (!cur_leaf_) return;
       assert(cur_idx_ >= 0);
       if (cur_idx_ >= cur_leaf_->data_capacity_) {
-        cur_leaf_ = cur_leaf_->next_leaf_;
+        cur_leaf_ = index_->next_leaf(cur_leaf_);
         cur_idx_ = 0;
         if (!cur_leaf_) return;
       }
@@ -2708,7 +4669,7 @@ class Alex {
       while (cur_bitmap_data_ == 0) {
         cur_bitmap_idx_++;
         if (cur_bitmap_idx_ >= cur_leaf_->bitmap_size_) {
-          cur_leaf_ = cur_leaf_->next_leaf_;
+          cur_leaf_ = index_->next_leaf(cur_leaf_);
           cur_idx_ = 0;
           if (cur_leaf_ == nullptr) {
             return;
@@ -2730,11 +4691,12 @@ class Alex {
     int cur_bitmap_idx_ = 0;  // current position in bitmap
     uint64_t cur_bitmap_data_ = 0;  // caches the relevant data in the current
                                     // bitmap position
+    const self_type* index_ = nullptr;  // finds the neighbors of leaves
 
     ReverseIterator() {}
 
-    ReverseIterator(data_node_type* leaf, int idx)
-        : cur_leaf_(leaf), cur_idx_(idx) {
+    ReverseIterator(data_node_type* leaf, int idx, const self_type* index)
+        : cur_leaf_(leaf), cur_idx_(idx), index_(index) {
       initialize();
     }
 
@@ -2742,10 +4704,20 @@ class Alex {
         : cur_leaf_(other.cur_leaf_),
           cur_idx_(other.cur_idx_),
           cur_bitmap_idx_(other.cur_bitmap_idx_),
-          cur_bitmap_data_(other.cur_bitmap_data_) {}
+          cur_bitmap_data_(other.cur_bitmap_data_),
+          index_(other.index_) {}
 
     ReverseIterator(const Iterator& other)
-        : cur_leaf_(other.cur_leaf_), cur_idx_(other.cur_idx_) {
+        : cur_leaf_(other.cur_leaf_),
+          cur_idx_(other.cur_idx_),
+          index_(other.index_) {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+      if (other.unresolved()) {
+        Iterator resolved = other.resolved();
+        cur_leaf_ = resolved.cur_leaf_;
+        cur_idx_ = resolved.cur_idx_;
+      }
+#endif
       initialize();
     }
 
@@ -2755,6 +4727,7 @@ class Alex {
         cur_leaf_ = other.cur_leaf_;
         cur_bitmap_idx_ = other.cur_bitmap_idx_;
         cur_bitmap_data_ = other.cur_bitmap_data_;
+        index_ = other.index_;
       }
       return *this;
     }
@@ -2802,7 +4775,7 @@ class Alex {
       if (!cur_leaf_) return;
       assert(cur_idx_ >= 0);
       if (cur_idx_ >= cur_leaf_->data_capacity_) {
-        cur_leaf_ = cur_leaf_->next_leaf_;
+        cur_leaf_ = index_->next_leaf(cur_leaf_);
         cur_idx_ = 0;
         if (!cur_leaf_) return;
       }
@@ -2821,7 +4794,7 @@ class Alex {
       while (cur_bitmap_data_ == 0) {
         cur_bitmap_idx_--;
         if (cur_bitmap_idx_ < 0) {
-          cur_leaf_ = cur_leaf_->prev_leaf_;
+          cur_leaf_ = index_->prev_leaf(cur_leaf_);
           if (cur_leaf_ == nullptr) {
             cur_idx_ = 0;
             return;
@@ -2845,11 +4818,12 @@ class Alex {
     int cur_bitmap_idx_ = 0;  // current position in bitmap
     uint64_t cur_bitmap_data_ = 0;  // caches the relevant data in the current
                                     // bitmap position
+    const self_type* index_ = nullptr;  // finds the neighbors of leaves
 
     ConstReverseIterator() {}
 
-    ConstReverseIterator(const data_node_type* leaf, int idx)
-        : cur_leaf_(leaf), cur_idx_(idx) {
+    ConstReverseIterator(const data_node_type* leaf, int idx, const self_type* index)
+        : cur_leaf_(leaf), cur_idx_(idx), index_(index) {
       initialize();
     }
 
@@ -2857,21 +4831,34 @@ class Alex {
         : cur_leaf_(other.cur_leaf_),
           cur_idx_(other.cur_idx_),
           cur_bitmap_idx_(other.cur_bitmap_idx_),
-          cur_bitmap_data_(other.cur_bitmap_data_) {}
+          cur_bitmap_data_(other.cur_bitmap_data_),
+          index_(other.index_) {}
 
     ConstReverseIterator(const ReverseIterator& other)
         : cur_leaf_(other.cur_leaf_),
           cur_idx_(other.cur_idx_),
           cur_bitmap_idx_(other.cur_bitmap_idx_),
-          cur_bitmap_data_(other.cur_bitmap_data_) {}
+          cur_bitmap_data_(other.cur_bitmap_data_),
+          index_(other.index_) {}
 
     ConstReverseIterator(const Iterator& other)
-        : cur_leaf_(other.cur_leaf_), cur_idx_(other.cur_idx_) {
+        : cur_leaf_(other.cur_leaf_),
+          cur_idx_(other.cur_idx_),
+          index_(other.index_) {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+      if (other.unresolved()) {
+        Iterator resolved = other.resolved();
+        cur_leaf_ = resolved.cur_leaf_;
+        cur_idx_ = resolved.cur_idx_;
+      }
+#endif
       initialize();
     }
 
     ConstReverseIterator(const ConstIterator& other)
-        : cur_leaf_(other.cur_leaf_), cur_idx_(other.cur_idx_) {
+        : cur_leaf_(other.cur_leaf_),
+          cur_idx_(other.cur_idx_),
+          index_(other.index_) {
       initialize();
     }
 
@@ -2881,6 +4868,7 @@ class Alex {
         cur_leaf_ = other.cur_leaf_;
         cur_bitmap_idx_ = other.cur_bitmap_idx_;
         cur_bitmap_data_ = other.cur_bitmap_data_;
+        index_ = other.index_;
       }
       return *this;
     }
@@ -2928,7 +4916,7 @@ class Alex {
       if (!cur_leaf_) return;
       assert(cur_idx_ >= 0);
       if (cur_idx_ >= cur_leaf_->data_capacity_) {
-        cur_leaf_ = cur_leaf_->next_leaf_;
+        cur_leaf_ = index_->next_leaf(cur_leaf_);
         cur_idx_ = 0;
         if (!cur_leaf_) return;
       }
@@ -2947,7 +4935,7 @@ class Alex {
       while (cur_bitmap_data_ == 0) {
         cur_bitmap_idx_--;
         if (cur_bitmap_idx_ < 0) {
-          cur_leaf_ = cur_leaf_->prev_leaf_;
+          cur_leaf_ = index_->prev_leaf(cur_leaf_);
           if (cur_leaf_ == nullptr) {
             cur_idx_ = 0;
             return;
@@ -2964,25 +4952,24 @@ class Alex {
     }
   };
 
-  // Iterates through all nodes with pre-order traversal
+  // Iterates through all nodes with pre-order traversal. With loaded_only,
+  // skips the subtrees that are not in memory instead of recovering them.
   class NodeIterator {
    public:
     const self_type* index_;
     AlexNode<T, P>* cur_node_;
     std::stack<AlexNode<T, P>*> node_stack_;  // helps with traversal
     Pager<T, P>* pager_;
+    bool loaded_only_;
 
     // Start with root as cur and all children of root in stack
-    explicit NodeIterator(const self_type* index)
-        : index_(index), cur_node_(index->root_node_), pager_(index->pager_) {
+    explicit NodeIterator(const self_type* index, bool loaded_only = false)
+        : index_(index),
+          cur_node_(index->root_node_),
+          pager_(index->pager_),
+          loaded_only_(loaded_only) {
       if (cur_node_ && !cur_node_->is_leaf_) {
-        auto node = static_cast<model_node_type*>(cur_node_);
-        node_stack_.push(node->children_[node->num_children_ - 1]->get(pager_));
-        for (int i = node->num_children_ - 2; i >= 0; i--) {
-          if (node->children_[i] != node->children_[i + 1] && node->children_[i]->get(pager_) != node->children_[i + 1]->get(pager_)) {
-            node_stack_.push(node->children_[i]->get(pager_));
-          }
-        }
+        push_children(static_cast<model_node_type*>(cur_node_));
       }
     }
 
@@ -2998,39 +4985,92 @@ class Alex {
       node_stack_.pop();
 
       if (!cur_node_->is_leaf_) {
-        auto node = static_cast<model_node_type*>(cur_node_);
-        node_stack_.push(node->children_[node->num_children_ - 1]->get(pager_));
-        for (int i = node->num_children_ - 2; i >= 0; i--) {
-          if (node->children_[i] != node->children_[i + 1] && node->children_[i]->get(pager_) != node->children_[i + 1]->get(pager_)) {
-            node_stack_.push(node->children_[i]->get(pager_));
-          }
-        }
+        push_children(static_cast<model_node_type*>(cur_node_));
       }
 
       return cur_node_;
     }
 
     bool is_end() const { return cur_node_ == nullptr; }
+
+   private:
+    AlexNode<T, P>* child(model_node_type* node, int i) const {
+      return loaded_only_ ? node->children_[i].loaded()
+                          : node->children_[i].get(pager_);
+    }
+
+    // Pushes the distinct children of node, the first one last
+    void push_children(model_node_type* node) {
+      AlexNode<T, P>* prev = child(node, node->num_children_ - 1);
+      if (prev != nullptr) {
+        node_stack_.push(prev);
+      }
+      for (int i = node->num_children_ - 2; i >= 0; i--) {
+        if (node->children_[i] == node->children_[i + 1]) {
+          continue;
+        }
+        AlexNode<T, P>* cur = child(node, i);
+        if (cur != nullptr && cur != prev) {
+          node_stack_.push(cur);
+        }
+        prev = cur;
+      }
+    }
   };
 
  private:
   friend class boost::serialization::access;
   template<class Archive>
-  void serialize(Archive & ar, const unsigned int version __attribute__((unused)))
+  void serialize(Archive & ar, const unsigned int version)
   {
     // std::cout << "In Alex::save" << std::endl;
     
     // TODO: register templates in their header file
     ar.template register_type<model_node_type>();
     ar.template register_type<data_node_type>();
-    ar.template register_type<chunk_type>();
-    ar.template register_type<data_chunk_type>();
+    get_stats();  // folds in lookup statistics of concurrent readers
+    if (Archive::is_saving::value) {
+      wal_lsn_ = wal_lsn();
+    }
 
-    // Recursive node structure
-    // std::cout << "  Alex -> root_node_" << std::endl;
-    ar & root_node_;
-    // std::cout << "  Alex -> superroot_" << std::endl;
-    ar & superroot_;
+    // Recursive node structure. With a pager, the nodes go to the pager as
+    // flat records and the archive only keeps the offset of the root record;
+    // otherwise the archive holds the whole tree.
+    bool has_pager = (pager_ != nullptr || compact_pager_ != nullptr);
+    ar & has_pager;
+    if (has_pager) {
+      size_t root_offset = 0;
+      double superroot_a = 0;
+      double superroot_b = 0;
+      if (Archive::is_saving::value) {
+        // std::cout << "  Alex -> root record" << std::endl;
+        root_offset = compact_pager_ ? compact(compact_pager_) : checkpoint();
+        superroot_a = superroot_->model_.a_;
+        superroot_b = superroot_->model_.b_;
+      }
+      ar & root_offset;
+      ar & superroot_a;
+      ar & superroot_b;
+      if (Archive::is_loading::value) {
+        if (pager_ == nullptr) {
+          throw std::runtime_error("The index was saved through a pager and needs one to load");
+        }
+        for (NodeIterator node_it = NodeIterator(this, true); !node_it.is_end();
+             node_it.next()) {
+          delete_node(node_it.current());
+        }
+        pager_->warm_up(root_offset);
+        root_node_ = LazyAlexNode<T, P>::recover_node(pager_, root_offset);
+        create_superroot();
+        superroot_->model_.a_ = superroot_a;
+        superroot_->model_.b_ = superroot_b;
+      }
+    } else {
+      // std::cout << "  Alex -> root_node_" << std::endl;
+      ar & root_node_;
+      // std::cout << "  Alex -> superroot_" << std::endl;
+      ar & superroot_;
+    }
 
     // Primitives
     // std::cout << "  Alex -> primitives" << std::endl;
@@ -3067,19 +5107,33 @@ class Alex {
     ar & istats_.num_keys_below_key_domain;
     ar & istats_.num_keys_at_last_right_domain_resize;
     ar & istats_.num_keys_at_last_left_domain_resize;
+    // Archives of version 0 predate the write-ahead log
+    if (version >= 1) {
+      ar & wal_lsn_;
+    }
 
     // ar & key_less_;
     // ar & allocator_;
 
-    // Serialize node chunky data once
-    // std::cout << "  Alex -> data chunks" << std::endl;
-    // for (NodeIterator node_it = NodeIterator(this); !node_it.is_end(); node_it.next()) {
-    //   AlexNode<T, P>* node = node_it.current();
-    //   node->serialize_with_pager(ar, pager_);
-    // }
-
-    // // Link cousin pointers (TODO: test to confirm)
-    // link_all_data_nodes();
+    // Archives do not hold the links between data nodes. With a pager, data
+    // nodes find their neighbors when they are first asked for; otherwise
+    // the whole tree is in memory already.
+    if (Archive::is_loading::value && !has_pager) {
+      link_all_data_nodes();
+    }
   }
 };
 }  // namespace alex
+
+// Version 1 saves the LSN of the write-ahead log
+namespace boost {
+namespace serialization {
+template <class T, class P, class Compare, class Alloc, bool allow_duplicates,
+          alex::NodeStorage storage>
+struct version<alex::Alex<T, P, Compare, Alloc, allow_duplicates, storage>> {
+  typedef mpl::int_<1> type;
+  typedef mpl::integral_c_tag tag;
+  BOOST_STATIC_CONSTANT(int, value = version::type::value);
+};
+}  // namespace serialization
+}  // namespace boost
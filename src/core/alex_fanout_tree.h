@@ -11,6 +11,7 @@
 
 #include "alex_base.h"
 #include "alex_nodes.h"
+#include "thread_pool.h"
 
 namespace alex {
 
@@ -32,6 +33,9 @@ struct FTNode {
   int num_keys = 0;
 };
 
+// Levels of fewer keys are not worth evaluating in parallel
+constexpr int kParallelMinKeys = 1 << 16;
+
 /*** Helpers ***/
 
 // Collect all used fanout tree nodes and sort them
@@ -110,6 +114,8 @@ static double merge_nodes_upwards(
 // used_fanout_tree_nodes.
 // Assumes node has already been trained to produce a CDF value in the range [0,
 // 1).
+// With a pool, the tree nodes of a large level are evaluated in parallel. Their
+// costs are still added up in order, so the result does not depend on it.
 template <class T, class P, class Compare = std::less<T>>
 double compute_level(const std::pair<T, P> values[], int num_keys,
                      const AlexNode<T, P>* node, int total_keys,
@@ -117,16 +123,14 @@ double compute_level(const std::pair<T, P> values[], int num_keys,
                      int max_data_node_keys, double expected_insert_frac = 0,
                      bool approximate_model_computation = true,
                      bool approximate_cost_computation = false,
-                     Compare key_less = Compare()) {
+                     Compare key_less = Compare(), ThreadPool* pool = nullptr) {
   int fanout = 1 << level;
   double cost = 0.0;
   double a = node->model_.a_ * fanout;
   double b = node->model_.b_ * fanout;
-  int left_boundary = 0;
-  int right_boundary = 0;
+  std::vector<int> boundaries(fanout + 1, 0);
   for (int i = 0; i < fanout; i++) {
-    left_boundary = right_boundary;
-    right_boundary =
+    int right_boundary =
         i == fanout - 1
             ? num_keys
             : static_cast<int>(
@@ -140,10 +144,18 @@ double compute_level(const std::pair<T, P> values[], int num_keys,
            static_cast<int>(a * values[right_boundary].first + b) <= i) {
       right_boundary++;
     }
+    boundaries[i + 1] = right_boundary;
+  }
+
+  size_t first_tree_node = used_fanout_tree_nodes.size();
+  used_fanout_tree_nodes.resize(first_tree_node + fanout);
+  auto compute_tree_node = [&](int i) {
+    int left_boundary = boundaries[i];
+    int right_boundary = boundaries[i + 1];
+    FTNode& tree_node = used_fanout_tree_nodes[first_tree_node + i];
     if (left_boundary == right_boundary) {
-      used_fanout_tree_nodes.push_back(
-          {level, i, 0, left_boundary, right_boundary, false, 0, 0, 0, 0, 0});
-      continue;
+      tree_node = {level, i, 0, left_boundary, right_boundary, false, 0, 0, 0, 0, 0};
+      return;
     }
     LinearModel<T> model;
     AlexDataNode<T, P>::build_model(values + left_boundary,
@@ -161,13 +173,34 @@ double compute_level(const std::pair<T, P> values[], int num_keys,
       node_cost += kNodeLookupsWeight;
     }
 
-    cost += node_cost * (right_boundary - left_boundary) / num_keys;
-
-    used_fanout_tree_nodes.push_back(
-        {level, i, node_cost, left_boundary, right_boundary, false,
-         stats.num_search_iterations, stats.num_shifts, model.a_, model.b_,
-         right_boundary - left_boundary});
+    tree_node = {level, i, node_cost, left_boundary, right_boundary, false,
+                 stats.num_search_iterations, stats.num_shifts, model.a_, model.b_,
+                 right_boundary - left_boundary};
+  };
+  if (pool != nullptr && num_keys >= kParallelMinKeys) {
+    // A few tasks per thread, so that uneven key ranges balance out
+    int num_tasks = std::min(fanout, 4 * pool->num_threads());
+    TaskGroup group(pool);
+    for (int t = 0; t < num_tasks; t++) {
+      group.run([&compute_tree_node, t, num_tasks, fanout] {
+        for (int i = fanout * t / num_tasks; i < fanout * (t + 1) / num_tasks; i++) {
+          compute_tree_node(i);
+        }
+      });
+    }
+    group.wait();
+  } else {
+    for (int i = 0; i < fanout; i++) {
+      compute_tree_node(i);
+    }
+  }
+  for (int i = 0; i < fanout; i++) {
+    const FTNode& tree_node = used_fanout_tree_nodes[first_tree_node + i];
+    if (tree_node.num_keys > 0) {
+      cost += tree_node.cost * tree_node.num_keys / num_keys;
+    }
   }
+
   double traversal_cost =
       kNodeLookupsWeight +
       (kModelSizeWeight * fanout *
@@ -188,7 +221,8 @@ std::pair<int, double> find_best_fanout_bottom_up(
     int total_keys, std::vector<FTNode>& used_fanout_tree_nodes, int max_fanout,
     int max_data_node_keys, double expected_insert_frac = 0,
     bool approximate_model_computation = true,
-    bool approximate_cost_computation = false, Compare key_less = Compare()) {
+    bool approximate_cost_computation = false, Compare key_less = Compare(),
+    ThreadPool* pool = nullptr) {
   // Repeatedly add levels to the fanout tree until the overall cost of each
   // level starts to increase
   int best_level = 0;
@@ -204,7 +238,7 @@ std::pair<int, double> find_best_fanout_bottom_up(
     double cost = compute_level<T, P, Compare>(
         values, num_keys, node, total_keys, new_level, fanout_tree_level,
         max_data_node_keys, expected_insert_frac, approximate_model_computation,
-        approximate_cost_computation, key_less);
+        approximate_cost_computation, key_less, pool);
     fanout_costs.push_back(cost);
     if (fanout_costs.size() >= 3 &&
         fanout_costs[fanout_costs.size() - 1] >
@@ -343,15 +377,15 @@ std::pair<int, double> find_best_fanout_top_down(
 // This mirrors the logic of finding the best fanout "bottom-up" when bulk
 // loading.
 // Returns the depth of the best fanout tree.
-template <class T, class P>
-int find_best_fanout_existing_node(const AlexModelNode<T, P>* parent,
+template <class data_node_type, class T, class P, class Alloc>
+int find_best_fanout_existing_node(const AlexModelNode<T, P, Alloc>* parent,
                                    int bucketID, int total_keys,
                                    std::vector<FTNode>& used_fanout_tree_nodes,
                                    int max_fanout,
                                    Pager<T, P>* pager) {
   // Repeatedly add levels to the fanout tree until the overall cost of each
   // level starts to increase
-  auto node = static_cast<AlexDataNode<T, P>*>(parent->children_[bucketID]->get(pager));
+  auto node = static_cast<data_node_type*>(parent->children_[bucketID].get(pager));
   int num_keys = node->num_keys_;
   int best_level = 0;
   double best_cost = std::numeric_limits<double>::max();
@@ -390,7 +424,7 @@ int find_best_fanout_existing_node(const AlexModelNode<T, P>* parent,
       }
       int num_actual_keys = 0;
       LinearModel<T> model;
-      typename AlexDataNode<T, P>::const_iterator_type it(node, left_boundary);
+      typename data_node_type::const_iterator_type it(node, left_boundary);
       LinearModelBuilder<T> builder(&model);
       for (int j = 0; it.cur_idx_ < right_boundary && !it.is_end(); it++, j++) {
         builder.add(it.key(), j);
@@ -401,9 +435,9 @@ int find_best_fanout_existing_node(const AlexModelNode<T, P>* parent,
       double empirical_insert_frac = node->frac_inserts();
       DataNodeStats stats;
       double node_cost =
-          AlexDataNode<T, P>::compute_expected_cost_from_existing(
+          data_node_type::compute_expected_cost_from_existing(
               node, left_boundary, right_boundary,
-              AlexDataNode<T, P>::kInitDensity_, empirical_insert_frac, &model,
+              data_node_type::kInitDensity_, empirical_insert_frac, &model,
               &stats);
 
       cost += node_cost * num_actual_keys / num_keys;
@@ -417,7 +451,7 @@ int find_best_fanout_existing_node(const AlexModelNode<T, P>* parent,
     double traversal_cost =
         kNodeLookupsWeight +
         (kModelSizeWeight * fanout *
-         (sizeof(AlexDataNode<T, P>) + sizeof(void*)) * total_keys / num_keys);
+         (sizeof(data_node_type) + sizeof(void*)) * total_keys / num_keys);
     cost += traversal_cost;
     fanout_costs.push_back(cost);
     // stop after expanding fanout increases cost twice in a row
@@ -11,7 +11,12 @@
 #pragma once
 
 #include "alex_base.h"
-#include "chunk.h"
+#include "concurrency.h"
+#include "flat_node.h"
+#include "huge_pages.h"
+#include "node_arena.h"
+#include "simd_search.h"
+#include "thread_pool.h"
 
 #if ALEX_DATA_NODE_SEP_ARRAYS
 #define ALEX_DATA_NODE_KEY_AT(i) key_slots_[i]
@@ -27,6 +32,14 @@
 // pre-Haswell), set this to 0.
 #define ALEX_USE_LZCNT 1
 
+// Whether data nodes keep a small sorted buffer of inserted keys that would
+// otherwise have shifted a long run of slots, and move them into the slots
+// in bulk (see AlexDataNode::merge_delta). The buffer is part of the data
+// node, so a page file must be read by a build with the same setting.
+#ifndef ALEX_DATA_NODE_DELTA_BUFFER
+#define ALEX_DATA_NODE_DELTA_BUFFER 0
+#endif
+
 namespace alex {
 
 // For debugging
@@ -38,6 +51,31 @@ int adn_ar_count = 0;
 template <class T, class P>
 class AlexNode {
  public:
+  // Could be either the expected or empirical cost, depending on how this field
+  // is used
+  double cost_ = 0.0;
+
+  Pager<T, P>* pager_ = pager_;
+
+  // Header of the record in the pager that this object was constructed in
+  // (see flat_node.h), if any, in which case it must be destroyed but not
+  // deallocated
+  FlatNodeHeader* record_ = nullptr;
+
+  // Where the record of this node was last saved to or recovered from (see
+  // save_flat), and a hash of its header fields and child runs. A data node
+  // forgets it when its keys change.
+  const Pager<T, P>* saved_pager_ = nullptr;
+  FlatRecordRef saved_ref_ = {0, 0};
+  uint64_t saved_hash_ = 0;
+
+  // Versions the node for optimistic readers when the index is shared between
+  // threads, see concurrency.h
+  VersionLock lock_;
+
+  // The fields that traversals read come last, so that they share the second
+  // cache line of a model node with its children (see AlexModelNode)
+
   // Whether this node is a leaf (data) node
   bool is_leaf_ = false;
 
@@ -53,47 +91,90 @@ class AlexNode {
   // Both model nodes and data nodes nodes use models
   LinearModel<T> model_;
 
-  // Could be either the expected or empirical cost, depending on how this field
-  // is used
-  double cost_ = 0.0;
+  AlexNode() = default;
+  explicit AlexNode(short level, Pager<T, P>* pager) : pager_(pager), level_(level) {}
+  AlexNode(short level, bool is_leaf, Pager<T, P>* pager) : pager_(pager), is_leaf_(is_leaf), level_(level) {}
+  virtual ~AlexNode() = default;
+
+  // Writes this node, and recursively its children, as records into pager.
+  // Returns where this node's record went. Nodes that did not change since
+  // they were last saved to, or recovered from, pager keep their records, so
+  // saving again only writes the changed nodes and their ancestors. With a
+  // pool, and a pager that takes concurrent saves, subtrees are written in
+  // parallel.
+  FlatRecordRef save_flat(Pager<T, P>* pager, ThreadPool* pool = nullptr) {
+    return resave_flat_record(pager, save_flat_children(pager, pool));
+  }
+
+  // Writes the records of this node and of all nodes below it to pager,
+  // whether they changed or not, and returns where this node's record went.
+  // Unlike save_flat, the nodes still remember the records they were last
+  // saved to, so this copies the tree to another page file without changing
+  // where it is checkpointed to.
+  FlatRecordRef copy_flat(Pager<T, P>* pager) {
+    return save_flat_record(pager, copy_flat_children(pager));
+  }
+
+  // Writes this node's record with the given child runs, unless pager already
+  // has it
+  FlatRecordRef resave_flat_record(Pager<T, P>* pager,
+                                   const std::vector<FlatChildRun>& runs) {
+    uint64_t hash = flat_hash(runs.data(), runs.size());
+    if (saved_pager_ == pager && saved_hash_ == hash) {
+      return saved_ref_;
+    }
+    FlatRecordRef ref = save_flat_record(pager, runs);
+    remember_saved(pager, ref, hash);
+    return ref;
+  }
+
+  void remember_saved(const Pager<T, P>* pager, FlatRecordRef ref,
+                      uint64_t hash) {
+    saved_pager_ = pager;
+    saved_ref_ = ref;
+    saved_hash_ = hash;
+  }
+
+  // Hash of what the record of this node holds apart from a data node's
+  // slots, which mark_dirty accounts for instead
+  uint64_t flat_hash(const FlatChildRun* runs, size_t num_runs) const {
+    FlatNodeHeader header = {};
+    to_flat_header(&header);
+    uint64_t hash = flat_hash_bytes(&header, sizeof(header));
+    return flat_hash_bytes(runs, num_runs * sizeof(FlatChildRun), hash);
+  }
+
+  // Writes the records of all nodes below this one. The records of a node's
+  // children are written one after another, after those of their own
+  // descendants, so that siblings end up next to each other in the file.
+  // Returns the runs of children to store in this node's record.
+  virtual std::vector<FlatChildRun> save_flat_children(Pager<T, P>* pager,
+                                                       ThreadPool* pool) = 0;
+
+  // Same for copy_flat, which writes every record below this node
+  virtual std::vector<FlatChildRun> copy_flat_children(Pager<T, P>* pager) = 0;
+
+  // Writes this node's record, once save_flat_children returned runs
+  virtual FlatRecordRef save_flat_record(
+      Pager<T, P>* pager, const std::vector<FlatChildRun>& runs) = 0;
 
-  Pager<T, P>* pager_ = pager_;
-  Chunk<T, P>* chunk_ = nullptr;
-  virtual Chunk<T, P>* to_chunk() {
-    if (chunk_ == nullptr) {
-      chunk_ = new Chunk<T, P>();
-    }
-    return chunk_;
-  }
-  virtual void consume_chunk(Chunk<T, P>* chunk __attribute__((unused))) {
-    return;
-  }
-  template<class Archive>
-  void serialize_with_pager(Archive & ar, Pager<T, P>* pager) {
-    pager_ = pager;
-    if (Archive::is_saving::value) {
-      Chunk<T, P>* chunk = this->to_chunk();
-      ar & chunk;
-    } else if (Archive::is_loading::value) {
-      Chunk<T, P>* chunk = nullptr;
-      ar & chunk;
-      if (chunk->continue_load_from_pager(pager_)) {
-        this->consume_chunk(chunk);
-      }
-    }
-  }
+  // The size in bytes of all member variables in this class
+  virtual long long node_size() const = 0;
 
-  AlexNode() = default;
-  explicit AlexNode(short level, Pager<T, P>* pager) : level_(level), pager_(pager) {}
-  AlexNode(short level, bool is_leaf, Pager<T, P>* pager) : is_leaf_(is_leaf), level_(level), pager_(pager) {}
-  virtual ~AlexNode() {
-    if (chunk_ != nullptr) {
-      delete chunk_;
+  // Keeps the node cache from evicting this node back to its record, which
+  // would lose whatever changed since it was recovered
+  void pin_record() {
+    if (record_ != nullptr) {
+      record_->flags |= kFlatRecordPinned;
     }
   }
 
-  // The size in bytes of all member variables in this class
-  virtual long long node_size() const = 0;
+  // Called before the slots of a data node change. Its records are then
+  // stale, so the node must stay in memory and be saved again.
+  void mark_dirty() {
+    pin_record();
+    saved_pager_ = nullptr;
+  }
 
  private:
   friend class boost::serialization::access;
@@ -107,6 +188,30 @@ class AlexNode {
     ar & model_;
     ar & cost_;
   }
+
+ protected:
+  // Helpers for the common part of node records
+  void to_flat_header(FlatNodeHeader* header) const {
+    header->is_leaf = is_leaf_;
+    header->duplication_factor = duplication_factor_;
+    header->level = level_;
+    header->model_a = model_.a_;
+    header->model_b = model_.b_;
+    header->cost = cost_;
+  }
+
+  void from_flat_header(FlatNodeHeader* header, Pager<T, P>* pager) {
+    is_leaf_ = header->is_leaf;
+    duplication_factor_ = header->duplication_factor;
+    level_ = header->level;
+    model_.a_ = header->model_a;
+    model_.b_ = header->model_b;
+    cost_ = header->cost;
+    pager_ = pager;
+    record_ = header;
+    // A fresh node, whatever happened to nodes recovered from the record before
+    record_->flags = 0;
+  }
 };
 
 template <class T, class P, class Alloc = std::allocator<std::pair<T, P>>>
@@ -125,13 +230,28 @@ private:
   // For convenience
   typedef AlexModelNode<T, P, Alloc> model_node_type;
   typedef AlexDataNode<T, P, Compare, Alloc, allow_duplicates> data_node_type;
-  typedef Chunk<T, P, Compare, Alloc> chunk_type;
-  typedef DataChunk<T, P, Compare, Alloc> data_chunk_type;
+
+  static constexpr size_t kNoOffset = std::numeric_limits<size_t>::max();
+
+  // States of lazy loading. Exactly one thread moves the wrapper from
+  // kUnloaded to kLoading, recovers the node and publishes it in node_.
+  static constexpr uint8_t kUnloaded = 0;
+  static constexpr uint8_t kLoading = 1;
+  static constexpr uint8_t kLoaded = 2;
 
   // Invariant: if node_ is null, rcv_offset_ must be defined.
-  AlexNode<T, P>* node_ = nullptr;
-  size_t rcv_offset_ = std::numeric_limits<size_t>::max();
-  size_t rcv_length_ = 0;
+  std::atomic<AlexNode<T, P>*> node_{nullptr};
+  size_t rcv_offset_ = kNoOffset;  // offset of the node record in the pager
+  size_t rcv_num_bytes_ = 0;       // size of the node record, 0 if unknown
+  bool rcv_is_leaf_ = false;       // whether the record is a data node's
+  std::atomic<uint8_t> state_{kUnloaded};
+
+  // Whether a recovered data node was accessed since the node cache's clock
+  // hand last passed it, and whether the hand evicted it
+  static constexpr uint8_t kHot = 0;
+  static constexpr uint8_t kCold = 1;
+  static constexpr uint8_t kEvicted = 2;
+  std::atomic<uint8_t> heat_{kHot};
 
   // To allocate node during serialization
   Pager<T, P>* pager_ = nullptr;  // Only for serialize/save
@@ -141,31 +261,215 @@ public:
   // Set pager to non-null to enable lazy load 
   explicit LazyAlexNode(AlexNode<T, P>* node, Pager<T, P>* pager) : node_(node), pager_(pager) {
     has_pager_ = (pager_ != nullptr);
+    if (node != nullptr) {
+      state_.store(kLoaded, std::memory_order_relaxed);
+      // Accesses through this wrapper are not seen by the node cache, which
+      // must not consider the node cold
+      node->pin_record();
+    }
   }
   ~LazyAlexNode() = default;
+
+  // Safe to call from many threads at once: the node is recovered only once,
+  // and threads that lose the race wait for it instead of recovering it again
   AlexNode<T, P>* get(Pager<T, P>* pager) {
-    if (node_ == nullptr && rcv_length_ > 0) {
-      this->recover(pager);
-      assert(node_ != nullptr);
+    AlexNode<T, P>* node = node_.load(std::memory_order_acquire);
+    if (node == nullptr && rcv_offset_ != kNoOffset) {
+      node = this->recover(pager);
+      assert(node != nullptr);
+    }
+    if (heat_.load(std::memory_order_relaxed) != kHot) {
+      this->touch(node, pager);
+    }
+    return node;
+  }
+
+  // Like get, but does not wait for the pager: returns nullptr if the record
+  // is not in memory yet, in which case the pager has started reading it.
+  // Only for an index that is not shared between threads.
+  AlexNode<T, P>* try_get(Pager<T, P>* pager) {
+    AlexNode<T, P>* node = node_.load(std::memory_order_acquire);
+    if (node == nullptr && rcv_offset_ != kNoOffset) {
+      char* record = pager->try_load_record(rcv_offset_, rcv_num_bytes_);
+      if (record == nullptr) {
+        return nullptr;
+      }
+      node = this->recover(pager, record);
+    }
+    if (heat_.load(std::memory_order_relaxed) != kHot) {
+      this->touch(node, pager);
     }
-    return node_;
+    return node;
   }
+
+  // Constructs an unloaded wrapper at addr, which will recover the record at
+  // rcv_offset on first access
+  static LazyAlexNode* place_unloaded(void* addr, size_t rcv_offset,
+                                      size_t rcv_num_bytes, bool rcv_is_leaf,
+                                      Pager<T, P>* pager) {
+    auto wrapper = new (addr) LazyAlexNode(nullptr, pager);
+    wrapper->rcv_offset_ = rcv_offset;
+    wrapper->rcv_num_bytes_ = rcv_num_bytes;
+    wrapper->rcv_is_leaf_ = rcv_is_leaf;
+    return wrapper;
+  }
+
+  // The node if it is in memory, without recovering it otherwise
+  AlexNode<T, P>* loaded() const {
+    return node_.load(std::memory_order_acquire);
+  }
+
+  // Whether the node is not in memory but its record, of known size, was
+  // saved through pager. Saving the parent then only refers to the record.
+  bool saved_in(const Pager<T, P>* pager) const {
+    return loaded() == nullptr && rcv_offset_ != kNoOffset &&
+           rcv_num_bytes_ > 0 && pager_ == pager;
+  }
+
+  // Where the record is, as a child run of the parent's record
+  FlatChildRun saved_run(uint32_t num_slots) const {
+    return {rcv_offset_, rcv_num_bytes_, num_slots,
+            static_cast<uint32_t>(rcv_is_leaf_)};
+  }
+
+  // Lets the pager start reading the node record if the node is not loaded
+  // yet, so that several records can be in flight before get() waits on them
+  void prefetch(Pager<T, P>* pager) {
+    if (pager != nullptr && rcv_num_bytes_ > 0 &&
+        state_.load(std::memory_order_relaxed) == kUnloaded) {
+      pager->prefetch_record(rcv_offset_, rcv_num_bytes_);
+    }
+  }
+
+  // Materializes the node whose record starts at rcv_offset and is
+  // rcv_num_bytes long (0 if unknown). The node object is constructed inside
+  // the record, and its arrays alias the record.
+  static AlexNode<T, P>* recover_node(Pager<T, P>* pager, size_t rcv_offset,
+                                      size_t rcv_num_bytes = 0) {
+    return from_record(pager->load_record(rcv_offset, rcv_num_bytes), pager,
+                       rcv_offset);
+  }
+
+  // Materializes the node whose record, loaded from rcv_offset, is at record
+  static AlexNode<T, P>* from_record(char* record, Pager<T, P>* pager,
+                                     size_t rcv_offset) {
+    auto header = reinterpret_cast<const FlatNodeHeader*>(record);
+    AlexNode<T, P>* node;
+    const FlatChildRun* runs = nullptr;
+    size_t num_runs = 0;
+    if (header->magic == kFlatModelNodeMagic) {
+      node = model_node_type::from_flat(record, pager);
+      auto model_header = reinterpret_cast<const FlatModelNodeHeader*>(record);
+      runs = reinterpret_cast<const FlatChildRun*>(record + model_header->runs_offset);
+      num_runs = model_header->num_runs;
+    } else if (header->magic == kFlatDataNodeMagic) {
+      node = data_node_type::from_flat(record, pager);
+    } else {
+      throw std::runtime_error("Corrupted node record at offset " +
+                               std::to_string(rcv_offset));
+    }
+    // Saving the node to pager again writes nothing until it changes
+    node->remember_saved(pager, {rcv_offset, header->record_size},
+                         node->flat_hash(runs, num_runs));
+    return node;
+  }
+
+  // Saves the node record if needed and returns where it went
+  FlatRecordRef save_flat(Pager<T, P>* pager, ThreadPool* pool = nullptr) {
+    return get(pager_)->save_flat(pager, pool);
+  }
+
+  // Called by the node cache's clock hand on a wrapper that recovered a data
+  // node. Evicts the node if it was not accessed since the last visit and
+  // still holds what was recovered from its record: its arrays, the bulk of
+  // the record, are handed back to the pager and read again from the file on
+  // the next access. The node object itself stays valid, so readers that
+  // still hold it are not disturbed.
+  static NodeCache::Visit evict_if_cold(void* entry) {
+    auto wrapper = static_cast<LazyAlexNode*>(entry);
+    auto leaf = static_cast<data_node_type*>(
+        wrapper->node_.load(std::memory_order_acquire));
+    if (leaf == nullptr || leaf->record_ == nullptr) {
+      return NodeCache::Visit::kPinned;  // the wrapper was placed again
+    }
+    uint8_t heat = kHot;
+    if (wrapper->heat_.compare_exchange_strong(heat, kCold,
+                                               std::memory_order_relaxed)) {
+      return NodeCache::Visit::kKeep;  // second chance
+    }
+    // Writers pin the node while they hold its lock
+    if (!leaf->lock_.try_write_lock()) {
+      return NodeCache::Visit::kKeep;
+    }
+    NodeCache::Visit visit;
+    heat = kCold;
+    if (leaf->record_->flags & kFlatRecordPinned) {
+      visit = NodeCache::Visit::kPinned;
+    } else if (!wrapper->heat_.compare_exchange_strong(
+                   heat, kEvicted, std::memory_order_relaxed)) {
+      visit = NodeCache::Visit::kKeep;  // accessed in the meantime
+    } else {
+      auto header = reinterpret_cast<FlatDataNodeHeader<T>*>(leaf->record_);
+      wrapper->pager_->discard(reinterpret_cast<char*>(header) + header->bitmap_offset,
+                               header->node.record_size - header->bitmap_offset);
+      visit = NodeCache::Visit::kEvicted;
+    }
+    leaf->lock_.write_unlock();
+    return visit;
+  }
+
 private:
-  void recover(Pager<T, P>* pager) {
-    assert(rcv_offset_ != std::numeric_limits<size_t>::max());
-    assert(rcv_length_ > 0);
+  // Uses record if the caller already loaded it
+  AlexNode<T, P>* recover(Pager<T, P>* pager, char* record = nullptr) {
+    assert(rcv_offset_ != kNoOffset);
     assert(has_pager_);
-    pager_ = pager;  // Unnecessary
-    char* serial_str_begin = pager->load_char(rcv_offset_);
-    boost::iostreams::basic_array_source<char> device(serial_str_begin, rcv_length_);
-    boost::iostreams::stream<boost::iostreams::basic_array_source<char>> s(device);
-    boost::archive::binary_iarchive ia(s);
-    ia.register_type<model_node_type>();
-    ia.register_type<data_node_type>();
-    ia.register_type<chunk_type>();
-    ia.register_type<data_chunk_type>();
-    ia >> node_;
-    node_->serialize_with_pager(ia, pager);
+    int num_waits = 0;
+    while (true) {
+      uint8_t state = kUnloaded;
+      if (state_.compare_exchange_strong(state, kLoading,
+                                         std::memory_order_acquire)) {
+        AlexNode<T, P>* node;
+        try {
+          node = record != nullptr
+                     ? from_record(record, pager, rcv_offset_)
+                     : recover_node(pager, rcv_offset_, rcv_num_bytes_);
+        } catch (...) {
+          // Let a waiting thread try again
+          state_.store(kUnloaded, std::memory_order_release);
+          throw;
+        }
+        node_.store(node, std::memory_order_release);
+        state_.store(kLoaded, std::memory_order_release);
+        this->admit(node, pager);
+        return node;
+      }
+      // Another thread is recovering the node, which takes about as long as
+      // reading its record
+      AlexNode<T, P>* node = node_.load(std::memory_order_acquire);
+      if (node != nullptr) {
+        return node;
+      } else if (++num_waits < 64) {
+        cpu_relax();
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  // Hands a data node that now occupies memory to the pager's node cache
+  void admit(AlexNode<T, P>* node, Pager<T, P>* pager) {
+    NodeCache* cache = pager->node_cache();
+    if (node->is_leaf_ && cache != nullptr) {
+      cache->admit(this, node->record_->record_size, &evict_if_cold);
+    }
+  }
+
+  // Records an access for the node cache's clock hand. The first access after
+  // an eviction brings the node back into the cache.
+  void touch(AlexNode<T, P>* node, Pager<T, P>* pager) {
+    if (heat_.exchange(kHot, std::memory_order_relaxed) == kEvicted) {
+      this->admit(node, pager);
+    }
   }
 
 private:
@@ -174,32 +478,17 @@ private:
   template<class Archive>
   void save(Archive & ar, const unsigned int version __attribute__((unused))) const {
     ar << has_pager_;
+    AlexNode<T, P>* node = node_.load(std::memory_order_relaxed);
     if (!has_pager_) {
       // Continue serialize recursion
       // std::cout << "LazyAlexNode::save" << std::endl;
-      ar << node_;
+      ar << node;
     } else {
-      // Save partial to prepare for lazy load
-      // First, turn the node into bytes
-      assert(node_ != nullptr);
-      std::string serial_str;
-      boost::iostreams::back_insert_device<std::string> inserter(serial_str);
-      boost::iostreams::stream<boost::iostreams::back_insert_device<std::string> > s(inserter);
-      boost::archive::binary_oarchive oa(s);
-      oa.register_type<model_node_type>();
-      oa.register_type<data_node_type>();
-      oa.register_type<chunk_type>();
-      oa.register_type<data_chunk_type>();
-      oa << node_;
-      node_->serialize_with_pager(oa, pager_);
-      s.flush();
-
-      // Allocate these bytes on pager
-      size_t rcv_offset = pager_->save_char(serial_str.c_str(), serial_str.length());
-      size_t rcv_length = serial_str.length();
+      // Save the subtree as records to prepare for lazy load
+      assert(node != nullptr);
+      size_t rcv_offset = node->save_flat(pager_).offset;
       ar << rcv_offset;
-      ar << rcv_length;
-      // std::cout << "LazyAlexNode::save::lazy, rcv_offset= " << rcv_offset << ", rcv_length= " << rcv_length << std::endl;
+      // std::cout << "LazyAlexNode::save::lazy, rcv_offset= " << rcv_offset << std::endl;
     }
   }
   template<class Archive>
@@ -208,32 +497,127 @@ private:
     if (!has_pager_) {
       // Continue serialize recursion
       // std::cout << "LazyAlexNode::load" << std::endl;
-      ar >> node_;
+      AlexNode<T, P>* node;
+      ar >> node;
+      node_.store(node, std::memory_order_relaxed);
+      state_.store(kLoaded, std::memory_order_relaxed);
     } else {
       // Load only the offset
       ar >> rcv_offset_;
-      ar >> rcv_length_;
-      // std::cout << "LazyAlexNode::load::lazy, rcv_offset_= " << rcv_offset_ << ", rcv_length_= " << rcv_length_ << std::endl;
+      // std::cout << "LazyAlexNode::load::lazy, rcv_offset_= " << rcv_offset_ << std::endl;
     }
   }
   BOOST_SERIALIZATION_SPLIT_MEMBER()
 };
 
+// A child slot of a model node, one word wide. A child that is in memory is
+// referenced directly, so that traversing a model node reads the child's
+// address from the slot without another dependent load. A child that may
+// still be only in the pager is referenced through the LazyAlexNode that
+// recovers it, tagged in the lowest bit.
+template <class T, class P>
+class ChildRef {
+ public:
+  ChildRef() = default;
+
+  // Like a LazyAlexNode, keeps the node cache from evicting node, since
+  // accesses through the slot are not seen by the cache
+  explicit ChildRef(AlexNode<T, P>* node)
+      : bits_(reinterpret_cast<uintptr_t>(node)) {
+    if (node != nullptr) {
+      node->pin_record();
+    }
+  }
+
+  static ChildRef lazy(LazyAlexNode<T, P>* wrapper) {
+    ChildRef ref;
+    ref.bits_ = reinterpret_cast<uintptr_t>(wrapper) | kLazyTag;
+    return ref;
+  }
+
+  explicit operator bool() const { return bits_ != 0; }
+  bool operator==(const ChildRef& other) const { return bits_ == other.bits_; }
+  bool operator!=(const ChildRef& other) const { return bits_ != other.bits_; }
+
+  bool is_lazy() const { return (bits_ & kLazyTag) != 0; }
+  LazyAlexNode<T, P>* wrapper() const {
+    return reinterpret_cast<LazyAlexNode<T, P>*>(bits_ & ~kLazyTag);
+  }
+  // What a traversal reads next: the node, or the wrapper that leads to it
+  const void* target() const {
+    return reinterpret_cast<const void*>(bits_ & ~kLazyTag);
+  }
+
+  // Same as the LazyAlexNode methods, for either kind of slot
+  AlexNode<T, P>* get(Pager<T, P>* pager) const {
+    return is_lazy() ? wrapper()->get(pager) : direct();
+  }
+  AlexNode<T, P>* try_get(Pager<T, P>* pager) const {
+    return is_lazy() ? wrapper()->try_get(pager) : direct();
+  }
+  AlexNode<T, P>* loaded() const {
+    return is_lazy() ? wrapper()->loaded() : direct();
+  }
+  bool saved_in(const Pager<T, P>* pager) const {
+    return is_lazy() && wrapper()->saved_in(pager);
+  }
+  FlatChildRun saved_run(uint32_t num_slots) const {
+    return wrapper()->saved_run(num_slots);
+  }
+  void prefetch(Pager<T, P>* pager) const {
+    if (is_lazy()) {
+      wrapper()->prefetch(pager);
+    }
+  }
+
+ private:
+  static constexpr uintptr_t kLazyTag = 1;
+
+  AlexNode<T, P>* direct() const {
+    return reinterpret_cast<AlexNode<T, P>*>(bits_);
+  }
+
+  uintptr_t bits_ = 0;
+};
+
+// Model nodes start on a cache line, so that what a traversal reads, the
+// model, the number of children and the address of their slots, is on a
+// single line (the second).
 template <class T, class P, class Alloc>
-class AlexModelNode : public AlexNode<T, P> {
+class alignas(64) AlexModelNode : public AlexNode<T, P> {
  public:
   typedef AlexModelNode<T, P, Alloc> self_type;
+#if ALEX_NODE_ARENA
+  typedef typename NodeAllocator<Alloc, self_type>::type alloc_type;
+  typedef typename NodeAllocator<Alloc, ChildRef<T, P>>::type pointer_alloc_type;
+  typedef typename NodeAllocator<Alloc, LazyAlexNode<T, P>>::type
+      wrapper_alloc_type;
+#else
   typedef typename Alloc::template rebind<self_type>::other alloc_type;
-  typedef typename Alloc::template rebind<LazyAlexNode<T, P>*>::other
+  typedef typename Alloc::template rebind<ChildRef<T, P>>::other
       pointer_alloc_type;
+  typedef typename Alloc::template rebind<LazyAlexNode<T, P>>::other
+      wrapper_alloc_type;
+#endif
 
   const Alloc& allocator_;
 
   // Number of logical children. Must be a power of 2
   int num_children_ = 0;
 
-  // Array of pointers to children
-  LazyAlexNode<T, P>** children_ = nullptr;
+  // Array of child slots
+  ChildRef<T, P>* children_ = nullptr;
+
+  // Boost allocates the nodes it loads with the class's operator new, if
+  // there is one, and otherwise without regard for the alignment
+  static void* operator new(size_t size) {
+    return ::operator new(size, std::align_val_t(alignof(self_type)));
+  }
+  static void operator delete(void* ptr) {
+    ::operator delete(ptr, std::align_val_t(alignof(self_type)));
+  }
+  static void* operator new(size_t, void* ptr) { return ptr; }
+  static void operator delete(void*, void*) {}
 
   explicit AlexModelNode(Pager<T, P>* pager = nullptr, const Alloc& alloc = Alloc())
       : AlexNode<T, P>(0, false, pager), allocator_(alloc) {}
@@ -245,24 +629,37 @@ class AlexModelNode : public AlexNode<T, P> {
     if (children_ == nullptr) {
       return;
     }
-    pointer_allocator().deallocate(children_, num_children_);
+    free_children();
   }
 
   AlexModelNode(const self_type& other)
       : AlexNode<T, P>(other),
         allocator_(other.allocator_),
         num_children_(other.num_children_) {
+    this->record_ = nullptr;
+    this->saved_pager_ = nullptr;
     children_ = new (pointer_allocator().allocate(other.num_children_))
-        LazyAlexNode<T, P>*[other.num_children_];
+        ChildRef<T, P>[other.num_children_];
     std::copy(other.children_, other.children_ + other.num_children_,
               children_);
   }
 
+  // Releases the array of children. Concurrent readers may still be
+  // traversing the array, so it is retired rather than freed right away.
+  void free_children() {
+    ChildRef<T, P>* children = children_;
+    int num_children = num_children_;
+    pointer_alloc_type alloc = pointer_allocator();
+    EpochManager::instance().retire([=]() mutable {
+      alloc.deallocate(children, num_children);
+    });
+  }
+
   // Given a key, traverses to the child node responsible for that key
   inline AlexNode<T, P>* get_child_node(const T& key) {
     int bucketID = this->model_.predict(key);
     bucketID = std::min<int>(std::max<int>(bucketID, 0), num_children_ - 1);
-    return children_[bucketID]->get(AlexNode<T, P>::pager_);
+    return children_[bucketID].get(AlexNode<T, P>::pager_);
   }
 
   // Expand by a power of 2 by creating duplicates of all existing child
@@ -275,19 +672,19 @@ class AlexModelNode : public AlexNode<T, P> {
     int expansion_factor = 1 << log2_expansion_factor;
     int num_new_children = num_children_ * expansion_factor;
     auto new_children = new (pointer_allocator().allocate(num_new_children))
-        LazyAlexNode<T, P>*[num_new_children];
+        ChildRef<T, P>[num_new_children];
     int cur = 0;
     while (cur < num_children_) {
-      AlexNode<T, P>* cur_child = children_[cur]->get(AlexNode<T, P>::pager_);
+      AlexNode<T, P>* cur_child = children_[cur].get(AlexNode<T, P>::pager_);
       int cur_child_repeats = 1 << cur_child->duplication_factor_;
       for (int i = expansion_factor * cur;
            i < expansion_factor * (cur + cur_child_repeats); i++) {
-        new_children[i] = new LazyAlexNode(cur_child, AlexNode<T, P>::pager_);
+        new_children[i] = ChildRef<T, P>(cur_child);
       }
       cur_child->duplication_factor_ += log2_expansion_factor;
       cur += cur_child_repeats;
     }
-    pointer_allocator().deallocate(children_, num_children_);
+    free_children();
     children_ = new_children;
     num_children_ = num_new_children;
     this->model_.expand(expansion_factor);
@@ -304,6 +701,139 @@ class AlexModelNode : public AlexNode<T, P> {
     return size;
   }
 
+  /*** Flat records ***/
+
+  std::vector<FlatChildRun> save_flat_children(Pager<T, P>* pager,
+                                               ThreadPool* pool) override {
+    // Identical consecutive child pointers are stored once as a run. A child
+    // whose record is already in the pager, and which may no longer be in
+    // memory, is not saved again (see Alex::bulk_load_streaming).
+    auto unsaved_child = [this, pager](int i) -> AlexNode<T, P>* {
+      return children_[i].saved_in(pager) ? nullptr
+                                           : children_[i].get(this->pager_);
+    };
+    std::vector<AlexNode<T, P>*> distinct_children;
+    std::vector<FlatChildRun> runs;
+    int cur = 0;
+    while (cur < num_children_) {
+      AlexNode<T, P>* cur_child = unsaved_child(cur);
+      int end = cur + 1;
+      while (end < num_children_ &&
+             (children_[end] == children_[cur] ||
+              (cur_child != nullptr && unsaved_child(end) == cur_child))) {
+        end++;
+      }
+      uint32_t num_slots = static_cast<uint32_t>(end - cur);
+      distinct_children.push_back(cur_child);
+      if (cur_child == nullptr) {
+        runs.push_back(children_[cur].saved_run(num_slots));
+      } else {
+        runs.push_back({0, 0, num_slots,
+                        static_cast<uint32_t>(cur_child->is_leaf_)});
+      }
+      cur = end;
+    }
+
+    // Grandchildren first, so that the children's offsets are known. The
+    // subtrees of model children are independent of each other.
+    std::vector<std::vector<FlatChildRun>> child_runs(distinct_children.size());
+    TaskGroup group(pager->concurrent_saves() ? pool : nullptr);
+    for (size_t r = 0; r < distinct_children.size(); r++) {
+      AlexNode<T, P>* child = distinct_children[r];
+      if (child != nullptr && !child->is_leaf_) {
+        group.run([pager, pool, child, &child_runs, r] {
+          child_runs[r] = child->save_flat_children(pager, pool);
+        });
+      }
+    }
+    group.wait();
+    for (size_t r = 0; r < runs.size(); r++) {
+      if (distinct_children[r] == nullptr) {
+        continue;
+      }
+      FlatRecordRef child = distinct_children[r]->resave_flat_record(pager, child_runs[r]);
+      runs[r].offset = child.offset;
+      runs[r].num_bytes = child.num_bytes;
+    }
+    return runs;
+  }
+
+  std::vector<FlatChildRun> copy_flat_children(Pager<T, P>* pager) override {
+    std::vector<FlatChildRun> runs;
+    int cur = 0;
+    while (cur < num_children_) {
+      AlexNode<T, P>* child = children_[cur].get(this->pager_);
+      int end = cur + 1;
+      while (end < num_children_ &&
+             (children_[end] == children_[cur] ||
+              children_[end].get(this->pager_) == child)) {
+        end++;
+      }
+      FlatRecordRef ref = child->copy_flat(pager);
+      runs.push_back({ref.offset, ref.num_bytes, static_cast<uint32_t>(end - cur),
+                      static_cast<uint32_t>(child->is_leaf_)});
+      cur = end;
+    }
+    return runs;
+  }
+
+  FlatRecordRef save_flat_record(Pager<T, P>* pager,
+                                 const std::vector<FlatChildRun>& runs) override {
+    FlatRecordLayout layout;
+    size_t header_offset = layout.reserve(sizeof(FlatModelNodeHeader),
+                                          alignof(FlatModelNodeHeader));
+    size_t object_offset = layout.reserve(sizeof(self_type), alignof(self_type));
+    size_t runs_offset = layout.reserve(runs.size() * sizeof(FlatChildRun),
+                                        alignof(FlatChildRun));
+
+    std::vector<char> record(layout.size(), 0);
+    auto header = reinterpret_cast<FlatModelNodeHeader*>(record.data() + header_offset);
+    header->node.magic = kFlatModelNodeMagic;
+    header->node.object_size = sizeof(self_type);
+    header->node.record_size = record.size();
+    header->node.object_offset = object_offset;
+    this->to_flat_header(&header->node);
+    header->num_children = num_children_;
+    header->num_runs = static_cast<int32_t>(runs.size());
+    header->runs_offset = runs_offset;
+    std::copy(runs.begin(), runs.end(),
+              reinterpret_cast<FlatChildRun*>(record.data() + runs_offset));
+    return {pager->save_record(record.data(), record.size()), record.size()};
+  }
+
+  // Constructs the node inside its record. The record only holds the runs of
+  // children: their slots are built in memory, so that the record's pages
+  // are not copied on write, and the wrappers of the children live as long
+  // as the pager. Children stay unloaded until they are first accessed.
+  static self_type* from_flat(char* record, Pager<T, P>* pager) {
+    auto header = reinterpret_cast<FlatModelNodeHeader*>(record);
+    if (header->node.magic != kFlatModelNodeMagic ||
+        header->node.object_size != sizeof(self_type) ||
+        header->node.object_offset % alignof(self_type) != 0) {
+      throw std::runtime_error("Model node record was written with a different node layout");
+    }
+    auto node = new (record + header->node.object_offset) self_type(pager);
+    node->from_flat_header(&header->node, pager);
+    node->num_children_ = header->num_children;
+    node->children_ = new (node->pointer_allocator().allocate(
+        header->num_children)) ChildRef<T, P>[header->num_children];
+    auto runs = reinterpret_cast<const FlatChildRun*>(record + header->runs_offset);
+    char* wrapper_addr = static_cast<char*>(pager->allocate_recovered(
+        header->num_runs * sizeof(LazyAlexNode<T, P>)));
+    int cur = 0;
+    for (int r = 0; r < header->num_runs; r++) {
+      auto wrapper = LazyAlexNode<T, P>::place_unloaded(
+          wrapper_addr, runs[r].offset, runs[r].num_bytes, runs[r].is_leaf != 0,
+          pager);
+      wrapper_addr += sizeof(LazyAlexNode<T, P>);
+      for (uint32_t i = 0; i < runs[r].num_slots; i++) {
+        node->children_[cur++] = ChildRef<T, P>::lazy(wrapper);
+      }
+    }
+    assert(cur == node->num_children_);
+    return node;
+  }
+
   // Helpful for debugging
   bool validate_structure(bool verbose = false) const {
     if (num_children_ == 0) {
@@ -337,11 +867,12 @@ class AlexModelNode : public AlexNode<T, P> {
       return false;
     }
 
-    LazyAlexNode<T, P>* cur_child = children_[0];
+    ChildRef<T, P> cur_ref = children_[0];
+    AlexNode<T, P>* cur_child = cur_ref.get(this->pager_);
     int cur_repeats = 1;
     int i;
     for (i = 1; i < num_children_; i++) {
-      if (children_[i] == cur_child) {
+      if (children_[i] == cur_ref) {
         cur_repeats++;
       } else {
         if (cur_repeats != (1 << cur_child->duplication_factor_)) {
@@ -352,7 +883,7 @@ class AlexModelNode : public AlexNode<T, P> {
                       << ", parent addr: " << this
                       << ", parent level: " << this->level_
                       << ", parent num children: " << num_children_
-                      << ", child addr: " << children_[i - cur_repeats]
+                      << ", child addr: " << children_[i - cur_repeats].target()
                       << ", child pointer indexes: [" << i - cur_repeats << ", "
                       << i << ")" << std::endl;
           }
@@ -378,7 +909,8 @@ class AlexModelNode : public AlexNode<T, P> {
           }
           return false;
         }
-        cur_child = children_[i];
+        cur_ref = children_[i];
+        cur_child = cur_ref.get(this->pager_);
         cur_repeats = 1;
       }
     }
@@ -390,7 +922,7 @@ class AlexModelNode : public AlexNode<T, P> {
                   << ", parent addr: " << this
                   << ", parent level: " << this->level_
                   << ", parent num children: " << num_children_
-                  << ", child addr: " << children_[i - cur_repeats]
+                  << ", child addr: " << children_[i - cur_repeats].target()
                   << ", child pointer indexes: [" << i - cur_repeats << ", "
                   << i << ")" << std::endl;
       }
@@ -431,7 +963,7 @@ class AlexModelNode : public AlexNode<T, P> {
  private:
   friend class boost::serialization::access;
   template<class Archive>
-  void serialize(Archive & ar, const unsigned int version __attribute__((unused)))
+  void serialize(Archive & ar, const unsigned int version)
   {
     // if (++amn_ar_count % 1000 == 0) std::cout << "In AlexModelNode::serialize [" << amn_ar_count << "]" << std::endl;
     ar & boost::serialization::base_object<AlexNode<T, P>>(*this);
@@ -439,10 +971,21 @@ class AlexModelNode : public AlexNode<T, P> {
     ar & num_children_;
     if (Archive::is_loading::value) {
       children_ = new (pointer_allocator().allocate(num_children_))
-          LazyAlexNode<T, P>*[num_children_];
+          ChildRef<T, P>[num_children_];
     }
     for (int i = 0; i < num_children_; ++i) {
-      ar & children_[i];
+      if (version >= 1) {
+        AlexNode<T, P>* child = children_[i].loaded();
+        ar & child;
+        if (Archive::is_loading::value) {
+          children_[i] = ChildRef<T, P>(child);
+        }
+      } else {
+        // Version 0 archived a LazyAlexNode per slot
+        LazyAlexNode<T, P>* wrapper = nullptr;
+        ar & wrapper;
+        children_[i] = ChildRef<T, P>::lazy(wrapper);
+      }
     }
   }
 };
@@ -467,7 +1010,11 @@ class AlexDataNode : public AlexNode<T, P> {
  public:
   typedef std::pair<T, P> V;
   typedef AlexDataNode<T, P, Compare, Alloc, allow_duplicates> self_type;
+#if ALEX_NODE_ARENA
+  typedef typename NodeAllocator<Alloc, self_type>::type alloc_type;
+#else
   typedef typename Alloc::template rebind<self_type>::other alloc_type;
+#endif
   typedef typename Alloc::template rebind<T>::other key_alloc_type;
   typedef typename Alloc::template rebind<P>::other payload_alloc_type;
   typedef typename Alloc::template rebind<V>::other value_alloc_type;
@@ -483,9 +1030,16 @@ class AlexDataNode : public AlexNode<T, P> {
   typedef Iterator<> iterator_type;
   typedef Iterator<const self_type, const P, const V> const_iterator_type;
 
+  // Neighbors in key order. Records do not store them, so the links of a node
+  // recovered from a pager start out as unlinked_leaf() until the index finds
+  // the neighbor through the parents (see Alex::next_leaf).
   self_type* next_leaf_ = nullptr;
   self_type* prev_leaf_ = nullptr;
 
+  static self_type* unlinked_leaf() {
+    return reinterpret_cast<self_type*>(alignof(self_type));
+  }
+
 #if ALEX_DATA_NODE_SEP_ARRAYS
   T* key_slots_ = nullptr;  // holds keys
   P* payload_slots_ =
@@ -494,9 +1048,13 @@ class AlexDataNode : public AlexNode<T, P> {
   V* data_slots_ = nullptr;  // holds key-payload pairs
 #endif
   bool loaded_from_mmap_ = false;
+  // An insert with defer went past a point where the node should be
+  // reorganized, and left the reorganization to the caller
+  bool reorganization_pending_ = false;
 
   int data_capacity_ = 0;  // size of key/data_slots array
-  int num_keys_ = 0;  // number of filled key/data slots (as opposed to gaps)
+  int num_keys_ = 0;  // number of filled key/data slots (as opposed to gaps),
+                     // plus the keys in the delta buffer
 
   // Bitmap: each uint64_t represents 64 positions in reverse order
   // (i.e., each uint64_t is "read" from the right-most bit to the left-most
@@ -513,6 +1071,9 @@ class AlexDataNode : public AlexNode<T, P> {
   static constexpr double kMinDensity_ = 0.6;  // density after expanding, also
                                                // determines the contraction
                                                // threshold
+  static constexpr double kMaxDeferredDensity_ =
+      0.95;  // density up to which inserts with defer keep filling a node that
+             // should be reorganized
   double expansion_threshold_ = 1;  // expand after m_num_keys is >= this number
   double contraction_threshold_ =
       0;  // contract after m_num_keys is < this number
@@ -551,6 +1112,34 @@ class AlexDataNode : public AlexNode<T, P> {
   // Placed at the end of the key/data slots if there are gaps after the max key
   static constexpr T kEndSentinel_ = std::numeric_limits<T>::max();
 
+  // Keys whose insert would have shifted more than kDeltaMinShifts_ slots,
+  // sorted, with equal keys in the order they were inserted in. Only inserts
+  // and point lookups (find_payload) use the buffer as is: the operations
+  // that need the keys in their slots merge it first. The buffer takes two
+  // cache lines.
+  static constexpr int kDeltaSlots_ = std::max<int>(128 / sizeof(V), 2);
+  static constexpr int kDeltaMinShifts_ = 128;
+#if ALEX_DATA_NODE_DELTA_BUFFER
+  V delta_slots_[kDeltaSlots_];
+  int num_delta_ = 0;
+#endif
+
+  // Whether searches for keys of type K use the vector kernels of
+  // simd_search.h, which need the keys in an array of their own
+  template <class K>
+  static constexpr bool simd_searchable() {
+    return ALEX_DATA_NODE_SEP_ARRAYS && SimdKeys<T>::kSupported &&
+           std::is_same<T, K>::value && std::is_same<Compare, AlexCompare>::value;
+  }
+
+  // Key slots next to the predicted position that a search compares in one go
+  // before it falls back to exponential search
+  static constexpr int kSimdSearchWindow = 8;
+
+  // Binary search stops halving a range once it has this many key slots, and
+  // counts the keys in it with the kernel instead
+  static constexpr int kSimdScanSlots = 16;
+
   /*** Constructors and destructors ***/
 
   explicit AlexDataNode(Pager<T, P>* pager = nullptr, const Compare& comp = Compare(),
@@ -609,6 +1198,8 @@ class AlexDataNode : public AlexNode<T, P> {
         expected_avg_exp_search_iterations_(
             other.expected_avg_exp_search_iterations_),
         expected_avg_shifts_(other.expected_avg_shifts_) {
+    this->record_ = nullptr;
+    this->saved_pager_ = nullptr;
 #if ALEX_DATA_NODE_SEP_ARRAYS
     key_slots_ = new (key_allocator().allocate(other.data_capacity_))
         T[other.data_capacity_];
@@ -627,6 +1218,41 @@ class AlexDataNode : public AlexNode<T, P> {
     bitmap_ = new (bitmap_allocator().allocate(other.bitmap_size_))
         uint64_t[other.bitmap_size_];
     std::copy(other.bitmap_, other.bitmap_ + other.bitmap_size_, bitmap_);
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    std::copy(other.delta_slots_, other.delta_slots_ + other.num_delta_,
+              delta_slots_);
+    num_delta_ = other.num_delta_;
+#endif
+  }
+
+  // Tag for the snapshot constructor
+  struct SnapshotTag {};
+
+  // Shallow copy that shares the slot arrays and bitmap of other and never
+  // frees them. Concurrent readers search such a snapshot instead of the node
+  // itself, so that a writer resizing the node cannot change the capacity or
+  // arrays under them, and so that their lookups do not write to the node.
+  AlexDataNode(const self_type& other, SnapshotTag)
+      : AlexNode<T, P>(other),
+        key_less_(other.key_less_),
+        allocator_(other.allocator_),
+        next_leaf_(other.next_leaf_),
+        prev_leaf_(other.prev_leaf_),
+#if ALEX_DATA_NODE_SEP_ARRAYS
+        key_slots_(other.key_slots_),
+        payload_slots_(other.payload_slots_),
+#else
+        data_slots_(other.data_slots_),
+#endif
+        loaded_from_mmap_(true),
+        data_capacity_(other.data_capacity_),
+        num_keys_(other.num_keys_),
+        bitmap_(other.bitmap_),
+        bitmap_size_(other.bitmap_size_),
+        max_key_(other.max_key_),
+        min_key_(other.min_key_) {
+    this->record_ = nullptr;
+    this->saved_pager_ = nullptr;
   }
 
   /*** Allocators ***/
@@ -716,6 +1342,10 @@ class AlexDataNode : public AlexNode<T, P> {
   // key/data_slots
   int num_keys_in_range(int left, int right) const {
     assert(left >= 0 && left <= right && right <= data_capacity_);
+    if (left == right) {
+      // Also keeps an empty range at the end from reading past the bitmap
+      return 0;
+    }
     int num_keys = 0;
     int left_bitmap_idx = left >> 6;
     int right_bitmap_idx = right >> 6;
@@ -797,6 +1427,11 @@ class AlexDataNode : public AlexNode<T, P> {
 
     void initialize() {
       cur_bitmap_idx_ = cur_idx_ >> 6;
+      if (cur_bitmap_idx_ >= node_->bitmap_size_) {
+        // Starts past the last slot, e.g., at the right boundary of a split
+        cur_idx_ = -1;
+        return;
+      }
       cur_bitmap_data_ = node_->bitmap_[cur_bitmap_idx_];
 
       // Zero out extra bits
@@ -1517,6 +2152,42 @@ class AlexDataNode : public AlexNode<T, P> {
     contraction_threshold_ = data_capacity_ * kMinDensity_;
   }
 
+  // Writes the keys of the node merged with the sorted values to *merged, in
+  // one pass, for bulk loading the nodes that replace this one. As with
+  // insert(), a value goes after the keys equal to it, or is left out if
+  // duplicates are not allowed, as is a value equal to an earlier one. Calls
+  // on_insert(value) on each value that is taken and returns their number.
+  template <class OnInsert>
+  int merge_sorted(const V values[], int num_values, std::vector<V>* merged,
+                   OnInsert&& on_insert) {
+    merge_delta();
+    merged->clear();
+    merged->reserve(num_keys_ + num_values);
+    int num_taken = 0;
+    auto take = [&](const V& value) {
+      if (!allow_duplicates && !merged->empty() &&
+          key_equal(merged->back().first, value.first)) {
+        return;
+      }
+      merged->push_back(value);
+      on_insert(value);
+      num_taken++;
+    };
+    int i = 0;
+    if (num_keys_ > 0) {
+      for (const_iterator_type it(this, 0); !it.is_end(); it++) {
+        while (i < num_values && key_less_(values[i].first, it.key())) {
+          take(values[i++]);
+        }
+        merged->emplace_back(it.key(), it.payload());
+      }
+    }
+    while (i < num_values) {
+      take(values[i++]);
+    }
+    return num_taken;
+  }
+
   static void build_model(const V* values, int num_keys, LinearModel<T>* model,
                           bool use_sampling = false) {
     if (use_sampling) {
@@ -1628,10 +2299,82 @@ class AlexDataNode : public AlexNode<T, P> {
     return position;
   }
 
+  // Calls touch(addr, num_bytes) for every key slot that find_key(key) reads,
+  // and for the payload of the key if it is found. Only for statistics.
+  template <class Touch>
+  void trace_find_key(const T& key, Touch&& touch) const {
+    int m = predict_position(key);
+    int bound = 1;
+    int l, r;
+    touch(&ALEX_DATA_NODE_KEY_AT(m), sizeof(T));
+    if (key_greater(ALEX_DATA_NODE_KEY_AT(m), key)) {
+      int size = m;
+      while (bound < size) {
+        touch(&ALEX_DATA_NODE_KEY_AT(m - bound), sizeof(T));
+        if (!key_greater(ALEX_DATA_NODE_KEY_AT(m - bound), key)) {
+          break;
+        }
+        bound *= 2;
+      }
+      l = m - std::min<int>(bound, size);
+      r = m - bound / 2;
+    } else {
+      int size = data_capacity_ - m;
+      while (bound < size) {
+        touch(&ALEX_DATA_NODE_KEY_AT(m + bound), sizeof(T));
+        if (!key_lessequal(ALEX_DATA_NODE_KEY_AT(m + bound), key)) {
+          break;
+        }
+        bound *= 2;
+      }
+      l = m + bound / 2;
+      r = m + std::min<int>(bound, size);
+    }
+    while (l < r) {
+      int mid = l + (r - l) / 2;
+      touch(&ALEX_DATA_NODE_KEY_AT(mid), sizeof(T));
+      if (key_lessequal(ALEX_DATA_NODE_KEY_AT(mid), key)) {
+        l = mid + 1;
+      } else {
+        r = mid;
+      }
+    }
+    int pos = l - 1;
+    if (pos >= 0) {
+      touch(&ALEX_DATA_NODE_KEY_AT(pos), sizeof(T));
+      if (key_equal(ALEX_DATA_NODE_KEY_AT(pos), key)) {
+        touch(&ALEX_DATA_NODE_PAYLOAD_AT(pos), sizeof(P));
+      }
+    }
+  }
+
   // Searches for the last non-gap position equal to key
   // If no positions equal to key, returns -1
+  // A key that is still in the delta buffer is merged into the slots first
   int find_key(const T& key) {
     num_lookups_++;
+    if (find_delta(key) >= 0) {
+      merge_delta();
+    }
+    return find_key_in_slots(key);
+  }
+
+  // Pointer to the payload of the last key equal to key, which is in the
+  // delta buffer if it has one. Unlike find_key, leaves the buffer as it is.
+  // Returns nullptr if there is no such key.
+  P* find_payload(const T& key) {
+    num_lookups_++;
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    int slot = find_delta(key);
+    if (slot >= 0) {
+      return &delta_slots_[slot].second;
+    }
+#endif
+    int pos = find_key_in_slots(key);
+    return (pos < 0) ? nullptr : &get_payload(pos);
+  }
+
+  int find_key_in_slots(const T& key) {
     int predicted_pos = predict_position(key);
 
     // The last key slot with a certain value is guaranteed to be a real key
@@ -1647,7 +2390,9 @@ class AlexDataNode : public AlexNode<T, P> {
   // Searches for the first non-gap position no less than key
   // Returns position in range [0, data_capacity]
   // Compare with lower_bound()
+  // Like find_upper, merges the delta buffer first
   int find_lower(const T& key) {
+    merge_delta();
     num_lookups_++;
     int predicted_pos = predict_position(key);
 
@@ -1659,6 +2404,7 @@ class AlexDataNode : public AlexNode<T, P> {
   // Returns position in range [0, data_capacity]
   // Compare with upper_bound()
   int find_upper(const T& key) {
+    merge_delta();
     num_lookups_++;
     int predicted_pos = predict_position(key);
 
@@ -1666,6 +2412,72 @@ class AlexDataNode : public AlexNode<T, P> {
     return get_next_filled_position(pos, false);
   }
 
+  // Calls emit(key, payload) on the keys from position pos on, in order,
+  // until a key is not less than *end_key (if end_key is not null) or
+  // max_keys keys were emitted. Returns the number of keys emitted, and sets
+  // *stopped if the scan ended before the end of the node. The bitmap is read
+  // a word at a time: if the word's last key is below *end_key and its
+  // popcount is within max_keys, all of its keys are emitted in a tzcnt loop
+  // without further checks. Keys still in the delta buffer are not emitted.
+  template <class Emit>
+  int scan(int pos, const T* end_key, int max_keys, Emit& emit, bool* stopped) {
+    *stopped = false;
+    int num_emitted = 0;
+    if (pos >= data_capacity_ || max_keys <= 0) {
+      *stopped = (max_keys <= 0);
+      return 0;
+    }
+    int word_idx = pos >> 6;
+    uint64_t word = bitmap_[word_idx] & (~0ULL << (pos & 63));
+    while (true) {
+      while (word == 0) {
+        if (++word_idx >= bitmap_size_) {
+          return num_emitted;
+        }
+        word = bitmap_[word_idx];
+      }
+      int base = word_idx << 6;
+      int num_in_word = static_cast<int>(_mm_popcnt_u64(word));
+      int last = base + 63 - __builtin_clzll(word);
+      if (num_in_word > max_keys - num_emitted ||
+          (end_key != nullptr && !key_less(ALEX_DATA_NODE_KEY_AT(last), *end_key))) {
+        // The scan ends in this word
+        for (; word != 0; word = remove_rightmost_one(word)) {
+          int i = base + __builtin_ctzll(word);
+          if (end_key != nullptr && !key_less(ALEX_DATA_NODE_KEY_AT(i), *end_key)) {
+            break;
+          }
+          emit(ALEX_DATA_NODE_KEY_AT(i), ALEX_DATA_NODE_PAYLOAD_AT(i));
+          if (++num_emitted == max_keys) {
+            break;
+          }
+        }
+        *stopped = true;
+        return num_emitted;
+      }
+      for (; word != 0; word = remove_rightmost_one(word)) {
+        int i = base + __builtin_ctzll(word);
+        emit(ALEX_DATA_NODE_KEY_AT(i), ALEX_DATA_NODE_PAYLOAD_AT(i));
+      }
+      num_emitted += num_in_word;
+      if (num_emitted == max_keys) {
+        *stopped = true;
+        return num_emitted;
+      }
+    }
+  }
+
+  // Prefetches the start of the bitmap and of the slots, which a scan of the
+  // node reads first
+  void prefetch_for_scan() const {
+    __builtin_prefetch(bitmap_);
+    __builtin_prefetch(&ALEX_DATA_NODE_KEY_AT(0));
+    __builtin_prefetch(reinterpret_cast<const char*>(&ALEX_DATA_NODE_KEY_AT(0)) + 64);
+#if ALEX_DATA_NODE_SEP_ARRAYS
+    __builtin_prefetch(&ALEX_DATA_NODE_PAYLOAD_AT(0));
+#endif
+  }
+
   // Finds position to insert a key.
   // First returned value takes prediction into account.
   // Second returned value is first valid position (i.e., upper_bound of key).
@@ -1732,6 +2544,10 @@ class AlexDataNode : public AlexNode<T, P> {
   // Returns position in range [0, data_capacity]
   template <class K>
   inline int exponential_search_upper_bound(int m, const K& key) {
+    int pos;
+    if (search_near<true>(m, key, &pos)) {
+      return pos;
+    }
     // Continue doubling the bound until it contains the upper bound. Then use
     // binary search.
     int bound = 1;
@@ -1763,6 +2579,19 @@ class AlexDataNode : public AlexNode<T, P> {
   // Returns position in range [l, r]
   template <class K>
   inline int binary_search_upper_bound(int l, int r, const K& key) const {
+#if ALEX_DATA_NODE_SEP_ARRAYS
+    if constexpr (simd_searchable<K>()) {
+      while (r - l > kSimdScanSlots) {
+        int mid = l + (r - l) / 2;
+        if (key_lessequal(ALEX_DATA_NODE_KEY_AT(mid), key)) {
+          l = mid + 1;
+        } else {
+          r = mid;
+        }
+      }
+      return l + simd_count_below<true>(key_slots_ + l, r - l, key);
+    }
+#endif
     while (l < r) {
       int mid = l + (r - l) / 2;
       if (key_lessequal(ALEX_DATA_NODE_KEY_AT(mid), key)) {
@@ -1789,6 +2618,10 @@ class AlexDataNode : public AlexNode<T, P> {
   // Returns position in range [0, data_capacity]
   template <class K>
   inline int exponential_search_lower_bound(int m, const K& key) {
+    int pos;
+    if (search_near<false>(m, key, &pos)) {
+      return pos;
+    }
     // Continue doubling the bound until it contains the lower bound. Then use
     // binary search.
     int bound = 1;
@@ -1819,6 +2652,19 @@ class AlexDataNode : public AlexNode<T, P> {
   // Returns position in range [l, r]
   template <class K>
   inline int binary_search_lower_bound(int l, int r, const K& key) const {
+#if ALEX_DATA_NODE_SEP_ARRAYS
+    if constexpr (simd_searchable<K>()) {
+      while (r - l > kSimdScanSlots) {
+        int mid = l + (r - l) / 2;
+        if (key_greaterequal(ALEX_DATA_NODE_KEY_AT(mid), key)) {
+          r = mid;
+        } else {
+          l = mid + 1;
+        }
+      }
+      return l + simd_count_below<false>(key_slots_ + l, r - l, key);
+    }
+#endif
     while (l < r) {
       int mid = l + (r - l) / 2;
       if (key_greaterequal(ALEX_DATA_NODE_KEY_AT(mid), key)) {
@@ -1830,6 +2676,49 @@ class AlexDataNode : public AlexNode<T, P> {
     return l;
   }
 
+  // Looks for the upper bound (kUpper) or lower bound of key among the
+  // kSimdSearchWindow slots on the side of m where the exponential search
+  // would go. If the bound is there, sets *pos to it, counts the iterations
+  // that the exponential search would have made, which the cost model
+  // compares with its expectation, and returns true.
+  template <bool kUpper, class K>
+  inline bool search_near(int m, const K& key, int* pos) {
+#if ALEX_DATA_NODE_SEP_ARRAYS
+    if constexpr (simd_searchable<K>()) {
+      bool at_or_below = kUpper ? key_lessequal(ALEX_DATA_NODE_KEY_AT(m), key)
+                                : key_less(ALEX_DATA_NODE_KEY_AT(m), key);
+      if (at_or_below) {
+        // The bound is after m. The search would double the bound while it
+        // is less than the distance to the bound.
+        int size = data_capacity_ - m;
+        int n = std::min(kSimdSearchWindow, size);
+        int count = simd_count_below<kUpper>(key_slots_ + m, n, key);
+        if (count == n && n < size) {
+          return false;
+        }
+        *pos = m + count;
+        num_exp_search_iterations_ += (count > 1) ? log_2_round_down(count - 1) + 1 : 0;
+      } else {
+        // The bound is at or before m. The search would double the bound
+        // while it is no more than the distance, and less than m.
+        int start = std::max(m - kSimdSearchWindow, 0);
+        int count = simd_count_below<kUpper>(key_slots_ + start, m - start, key);
+        if (count == 0 && start > 0) {
+          return false;
+        }
+        *pos = start + count;
+        int max_bound = std::min(m - *pos, m - 1);
+        num_exp_search_iterations_ += (max_bound >= 1) ? log_2_round_down(max_bound) + 1 : 0;
+      }
+      return true;
+    }
+#endif
+    (void)m;
+    (void)key;
+    (void)pos;
+    return false;
+  }
+
   /*** Inserts and resizes ***/
 
   // Whether empirical cost deviates significantly from expected cost
@@ -1847,6 +2736,41 @@ class AlexDataNode : public AlexNode<T, P> {
     return shifts_per_insert() > 100 || expected_avg_shifts_ > 100;
   }
 
+  // Returned by reorganization_needed if the node only needs to expand
+  static constexpr int kNeedsExpansion_ = 4;
+
+  // Whether the node should be reorganized before the next insert: one of the
+  // fail flags of insert() below, kNeedsExpansion_, or 0 if not. Checking for
+  // catastrophic cost before the node is full is optional.
+  int reorganization_needed(bool check_catastrophe) const {
+    if (check_catastrophe && catastrophic_cost()) {
+      return 2;
+    }
+
+    // Check if node is full (based on expansion_threshold)
+    if (num_keys_ >= expansion_threshold_) {
+      if (significant_cost_deviation()) {
+        return 1;
+      }
+      if (catastrophic_cost()) {
+        return 2;
+      }
+      if (num_keys_ > max_slots_ * kMinDensity_) {
+        return 3;
+      }
+      return kNeedsExpansion_;
+    }
+    return 0;
+  }
+
+  // Expands the node to kMinDensity_ without retraining its model
+  void expand() {
+    bool keep_left = is_append_mostly_right();
+    bool keep_right = is_append_mostly_left();
+    resize(kMinDensity_, false, keep_left, keep_right);
+    num_resizes_++;
+  }
+
   // First value in returned pair is fail flag:
   // 0 if successful insert (possibly with automatic expansion).
   // 1 if no insert because of significant cost deviation.
@@ -1857,28 +2781,29 @@ class AlexDataNode : public AlexNode<T, P> {
   // Second value in returned pair is position of inserted key, or of the
   // already-existing key.
   // -1 if no insertion.
-  std::pair<int, int> insert(const T& key, const P& payload) {
+  //
+  // With use_delta, a key that would shift more than kDeltaMinShifts_ slots
+  // goes to the delta buffer instead, and its position is delta_position() of
+  // its slot there.
+  //
+  // With defer, a node that should be reorganized (or expanded) still takes
+  // the key while it is below kMaxDeferredDensity_, and sets
+  // reorganization_pending_ instead.
+  std::pair<int, int> insert(const T& key, const P& payload,
+                             bool use_delta = false, bool defer = false) {
+    this->mark_dirty();
     // Periodically check for catastrophe
-    if (num_inserts_ % 64 == 0 && catastrophic_cost()) {
-      return {2, -1};
-    }
-
-    // Check if node is full (based on expansion_threshold)
-    if (num_keys_ >= expansion_threshold_) {
-      if (significant_cost_deviation()) {
-        return {1, -1};
-      }
-      if (catastrophic_cost()) {
-        return {2, -1};
-      }
-      if (num_keys_ > max_slots_ * kMinDensity_) {
-        return {3, -1};
+    int reorganization = reorganization_needed(num_inserts_ % 64 == 0);
+    if (reorganization != 0) {
+      if (defer && num_keys_ < data_capacity_ * kMaxDeferredDensity_ &&
+          num_keys_ < data_capacity_ - 1) {
+        reorganization_pending_ = true;
+      } else if (reorganization != kNeedsExpansion_) {
+        return {reorganization, -1};
+      } else {
+        expand();
+        reorganization_pending_ = false;
       }
-      // Expand
-      bool keep_left = is_append_mostly_right();
-      bool keep_right = is_append_mostly_left();
-      resize(kMinDensity_, false, keep_left, keep_right);
-      num_resizes_++;
     }
 
     // Insert
@@ -1889,12 +2814,25 @@ class AlexDataNode : public AlexNode<T, P> {
       return {-1, upper_bound_pos - 1};
     }
     int insertion_position = positions.first;
-    if (insertion_position < data_capacity_ &&
-        !check_exists(insertion_position)) {
+    int delta_match = find_delta(key);
+    if (delta_match >= 0 && !allow_duplicates) {
+      return {-1, delta_position(delta_match)};
+    }
+    if (delta_match >= 0) {
+      // Keeps equal keys in the order they were inserted
+      insertion_position = insert_delta(key, payload);
+    } else if (insertion_position < data_capacity_ &&
+               !check_exists(insertion_position)) {
       insert_element_at(key, payload, insertion_position);
     } else {
-      insertion_position =
-          insert_using_shifts(key, payload, insertion_position);
+      int gap_pos = closest_gap(insertion_position);
+      if (ALEX_DATA_NODE_DELTA_BUFFER && use_delta &&
+          std::abs(gap_pos - insertion_position) > kDeltaMinShifts_) {
+        insertion_position = insert_delta(key, payload);
+      } else {
+        insertion_position =
+            insert_using_shifts(key, payload, insertion_position, gap_pos);
+      }
     }
 
     // Update stats
@@ -1917,6 +2855,8 @@ class AlexDataNode : public AlexNode<T, P> {
     if (num_keys_ == 0) {
       return;
     }
+    this->mark_dirty();
+    merge_delta();
 
     int new_data_capacity =
         std::max(static_cast<int>(num_keys_ / target_density), num_keys_ + 1);
@@ -2019,13 +2959,32 @@ class AlexDataNode : public AlexNode<T, P> {
 #endif
     }
 
+    if (!loaded_from_mmap_) {
+      // Concurrent readers may still be searching the old arrays
+      int old_data_capacity = data_capacity_;
+      int old_bitmap_size = bitmap_size_;
+      uint64_t* old_bitmap = bitmap_;
+      bitmap_alloc_type bitmap_alloc = bitmap_allocator();
 #if ALEX_DATA_NODE_SEP_ARRAYS
-    key_allocator().deallocate(key_slots_, data_capacity_);
-    payload_allocator().deallocate(payload_slots_, data_capacity_);
+      T* old_key_slots = key_slots_;
+      P* old_payload_slots = payload_slots_;
+      key_alloc_type key_alloc = key_allocator();
+      payload_alloc_type payload_alloc = payload_allocator();
+      EpochManager::instance().retire([=]() mutable {
+        key_alloc.deallocate(old_key_slots, old_data_capacity);
+        payload_alloc.deallocate(old_payload_slots, old_data_capacity);
+        bitmap_alloc.deallocate(old_bitmap, old_bitmap_size);
+      });
 #else
-    value_allocator().deallocate(data_slots_, data_capacity_);
+      V* old_data_slots = data_slots_;
+      value_alloc_type value_alloc = value_allocator();
+      EpochManager::instance().retire([=]() mutable {
+        value_alloc.deallocate(old_data_slots, old_data_capacity);
+        bitmap_alloc.deallocate(old_bitmap, old_bitmap_size);
+      });
 #endif
-    bitmap_allocator().deallocate(bitmap_, bitmap_size_);
+    }
+    loaded_from_mmap_ = false;
 
     data_capacity_ = new_data_capacity;
     bitmap_size_ = new_bitmap_size;
@@ -2075,9 +3034,12 @@ class AlexDataNode : public AlexNode<T, P> {
 
   // Insert key into pos, shifting as necessary in the range [left, right)
   // Returns the actual position of insertion
-  int insert_using_shifts(const T& key, P payload, int pos) {
+  // gap_pos is closest_gap(pos), if the caller already found it
+  int insert_using_shifts(const T& key, P payload, int pos, int gap_pos = -1) {
     // Find the closest gap
-    int gap_pos = closest_gap(pos);
+    if (gap_pos < 0) {
+      gap_pos = closest_gap(pos);
+    }
     set_bit(gap_pos);
     if (gap_pos >= pos) {
       for (int i = gap_pos; i > pos; i--) {
@@ -2284,6 +3246,265 @@ class AlexDataNode : public AlexNode<T, P> {
   }
 #endif
 
+  /*** Delta buffer ***/
+
+  // The positions that insert() returns for keys in the delta buffer are
+  // below -1, so that they are told apart from slots and from no insertion
+  static int delta_position(int slot) { return -2 - slot; }
+
+  static bool is_delta_position(int pos) { return pos < -1; }
+
+  static int delta_slot(int pos) { return -2 - pos; }
+
+  // Slot of the last key equal to key in the delta buffer, or -1
+  int find_delta(const T& key) const {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    for (int slot = num_delta_ - 1; slot >= 0; slot--) {
+      if (key_equal(delta_slots_[slot].first, key)) {
+        return slot;
+      }
+    }
+#else
+    (void)key;
+#endif
+    return -1;
+  }
+
+  // Adds key to the delta buffer, after merging the buffer if it is full.
+  // Returns delta_position() of its slot.
+  int insert_delta(const T& key, const P& payload) {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    if (num_delta_ == kDeltaSlots_) {
+      merge_delta();
+    }
+    int slot = num_delta_;
+    while (slot > 0 && key_less(key, delta_slots_[slot - 1].first)) {
+      delta_slots_[slot] = delta_slots_[slot - 1];
+      slot--;
+    }
+    delta_slots_[slot] = V(key, payload);
+    num_delta_++;
+    return delta_position(slot);
+#else
+    (void)key;
+    (void)payload;
+    assert(false);
+    return -1;
+#endif
+  }
+
+  // Moves the keys of the delta buffer into the slots. Keys whose insert
+  // positions are close together are merged as one run (see merge_delta_run),
+  // so that a buffer of keys spread over the node does not rewrite the slots
+  // between them. Returns where the key at track_pos, a position like those
+  // insert() returns, is afterwards.
+  int merge_delta(int track_pos = -1) {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    if (num_delta_ == 0) {
+      return track_pos;
+    }
+    this->mark_dirty();
+    int first = 0;
+    int last_pos = upper_bound(delta_slots_[0].first);
+    for (int slot = 1; slot <= num_delta_; slot++) {
+      int pos = (slot < num_delta_) ? upper_bound(delta_slots_[slot].first)
+                                    : data_capacity_;
+      if (slot == num_delta_ || pos - last_pos > 2 * kDeltaMinShifts_) {
+        track_pos = merge_delta_run(first, slot, track_pos);
+        first = slot;
+      }
+      last_pos = pos;
+    }
+    num_delta_ = 0;
+#endif
+    return track_pos;
+  }
+
+  // Moves the keys in slots [first, last) of the delta buffer into the slots.
+  // Rather than shifting once per key, merges them with the slots in one pass
+  // that moves each slot it passes at most once, towards the side where the
+  // node has a gap for each of them closer, like closest_gap does for a single
+  // key. A run for which neither side has enough gaps is inserted using
+  // shifts. Returns where the key at track_pos is afterwards.
+  int merge_delta_run(int first, int last, int track_pos) {
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    int num_moved = last - first;
+    // One past the num_moved-th gap from the insert position of the largest
+    // key on
+    int right_pos = upper_bound(delta_slots_[last - 1].first);
+    int end = right_pos;
+    int right_gaps = 0;
+    while (right_gaps < num_moved && end < data_capacity_) {
+      right_gaps += !check_exists(end++);
+    }
+    bool use_right = (right_gaps == num_moved);
+    // The num_moved-th gap before the insert position of the smallest key,
+    // looked for no further than the right side needs
+    int left_pos = upper_bound(delta_slots_[first].first);
+    int begin = left_pos;
+    int left_gaps = 0;
+    while (left_gaps < num_moved && begin > 0 &&
+           (!use_right || left_pos - begin < end - right_pos)) {
+      left_gaps += !check_exists(--begin);
+    }
+    if (left_gaps == num_moved) {
+      return merge_delta_run_left(first, last, begin, track_pos);
+    } else if (use_right) {
+      return merge_delta_run_right(first, last, end, track_pos);
+    }
+    return insert_delta_run_using_shifts(first, last, track_pos);
+#else
+    (void)first;
+    (void)last;
+    return track_pos;
+#endif
+  }
+
+  // Merges the keys in slots [first, last) of the delta buffer from the right,
+  // moving the greater keys in the slots right into the gaps before end
+  int merge_delta_run_right(int first, int last, int end, int track_pos) {
+    int new_pos = track_pos;
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    int src = end - 1;  // next slot to move
+    int dst = end - 1;  // next slot to fill
+    int slot = last - 1;
+    // There is room for the remaining keys between src and dst, since all the
+    // gaps are passed before src reaches a key that is no greater than the
+    // largest buffered key
+    while (slot >= first) {
+      if (src >= 0 && !check_exists(src)) {
+        src--;
+        continue;
+      }
+      // Buffered keys go after the keys in the slots that are equal to them
+      if (src >= 0 &&
+          key_less(delta_slots_[slot].first, ALEX_DATA_NODE_KEY_AT(src))) {
+        if (src == track_pos) {
+          new_pos = dst;
+        }
+        ALEX_DATA_NODE_KEY_AT(dst) = ALEX_DATA_NODE_KEY_AT(src);
+        ALEX_DATA_NODE_PAYLOAD_AT(dst) = ALEX_DATA_NODE_PAYLOAD_AT(src);
+        num_shifts_ += dst - src;
+        src--;
+      } else {
+        if (delta_position(slot) == track_pos) {
+          new_pos = dst;
+        }
+        ALEX_DATA_NODE_KEY_AT(dst) = delta_slots_[slot].first;
+        ALEX_DATA_NODE_PAYLOAD_AT(dst) = delta_slots_[slot].second;
+        slot--;
+      }
+      set_bit(dst);
+      dst--;
+    }
+    // The slots that were moved out of become gaps, which, like the gaps
+    // before them, hold the first key that was merged
+    for (int i = dst; i > src; i--) {
+      unset_bit(i);
+    }
+    for (int i = dst; i >= 0 && !check_exists(i); i--) {
+      ALEX_DATA_NODE_KEY_AT(i) = ALEX_DATA_NODE_KEY_AT(dst + 1);
+    }
+#else
+    (void)first;
+    (void)last;
+    (void)end;
+#endif
+    return new_pos;
+  }
+
+  // Counterpart of merge_delta_run_right, which moves the keys in the slots
+  // that are no greater than the smallest buffered key left into the gaps
+  // from begin on
+  int merge_delta_run_left(int first, int last, int begin, int track_pos) {
+    int new_pos = track_pos;
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    int src = begin;  // next slot to move
+    int dst = begin;  // next slot to fill
+    int slot = first;
+    while (slot < last) {
+      if (src < data_capacity_ && !check_exists(src)) {
+        src++;
+        continue;
+      }
+      if (src < data_capacity_ &&
+          !key_less(delta_slots_[slot].first, ALEX_DATA_NODE_KEY_AT(src))) {
+        if (src == track_pos) {
+          new_pos = dst;
+        }
+        ALEX_DATA_NODE_KEY_AT(dst) = ALEX_DATA_NODE_KEY_AT(src);
+        ALEX_DATA_NODE_PAYLOAD_AT(dst) = ALEX_DATA_NODE_PAYLOAD_AT(src);
+        num_shifts_ += src - dst;
+        src++;
+      } else {
+        if (delta_position(slot) == track_pos) {
+          new_pos = dst;
+        }
+        ALEX_DATA_NODE_KEY_AT(dst) = delta_slots_[slot].first;
+        ALEX_DATA_NODE_PAYLOAD_AT(dst) = delta_slots_[slot].second;
+        slot++;
+      }
+      set_bit(dst);
+      dst++;
+    }
+    // The slots that were moved out of become gaps, which hold the next key
+    // in the slots, and so do the gaps before begin if the first merged key
+    // is a new one
+    for (int i = dst; i < src; i++) {
+      unset_bit(i);
+    }
+    if (dst < data_capacity_) {
+      int next_pos = get_next_filled_position(dst, false);
+      T next_key = (next_pos < data_capacity_) ? ALEX_DATA_NODE_KEY_AT(next_pos)
+                                               : kEndSentinel_;
+      for (int i = dst; i < next_pos; i++) {
+        ALEX_DATA_NODE_KEY_AT(i) = next_key;
+      }
+    }
+    for (int i = begin - 1; i >= 0 && !check_exists(i); i--) {
+      ALEX_DATA_NODE_KEY_AT(i) = ALEX_DATA_NODE_KEY_AT(begin);
+    }
+#else
+    (void)first;
+    (void)last;
+    (void)begin;
+#endif
+    return new_pos;
+  }
+
+  // Counterpart of merge_delta_run that inserts the keys one at a time
+  int insert_delta_run_using_shifts(int first, int last, int track_pos) {
+    int new_pos = track_pos;
+#if ALEX_DATA_NODE_DELTA_BUFFER
+    for (int slot = first; slot < last; slot++) {
+      const T& key = delta_slots_[slot].first;
+      int pos = find_insert_position(key).first;
+      if (pos < data_capacity_ && !check_exists(pos)) {
+        insert_element_at(key, delta_slots_[slot].second, pos);
+      } else {
+        int gap_pos = closest_gap(pos);
+        // The slots between pos and the gap move by one towards the gap
+        if (new_pos >= 0 && gap_pos >= pos && pos <= new_pos &&
+            new_pos < gap_pos) {
+          new_pos++;
+        } else if (new_pos >= 0 && gap_pos < pos && gap_pos < new_pos &&
+                   new_pos < pos) {
+          new_pos--;
+        }
+        pos = insert_using_shifts(key, delta_slots_[slot].second, pos,
+                                  gap_pos);
+      }
+      if (delta_position(slot) == track_pos) {
+        new_pos = pos;
+      }
+    }
+#else
+    (void)first;
+    (void)last;
+#endif
+    return new_pos;
+  }
+
   /*** Deletes ***/
 
   // Erase the left-most key with the input value
@@ -2301,6 +3522,7 @@ class AlexDataNode : public AlexNode<T, P> {
 
   // Erase the key at the given position
   void erase_one_at(int pos) {
+    this->mark_dirty();
     T next_key;
     if (pos == data_capacity_ - 1) {
       next_key = kEndSentinel_;
@@ -2329,9 +3551,11 @@ class AlexDataNode : public AlexNode<T, P> {
   // Returns the number of keys erased (there may be multiple keys with the same
   // value)
   int erase(const T& key) {
+    merge_delta();
     int pos = upper_bound(key);
 
     if (pos == 0 || !key_equal(ALEX_DATA_NODE_KEY_AT(pos - 1), key)) return 0;
+    this->mark_dirty();
 
     // Erase preceding positions until we reach a key with smaller value
     int num_erased = 0;
@@ -2361,6 +3585,8 @@ class AlexDataNode : public AlexNode<T, P> {
   // Erase keys with value between start key (inclusive) and end key.
   // Returns the number of keys erased.
   int erase_range(T start_key, T end_key, bool end_key_inclusive = false) {
+    this->mark_dirty();
+    merge_delta();
     int pos;
     if (end_key_inclusive) {
       pos = upper_bound(end_key);
@@ -2511,6 +3737,9 @@ class AlexDataNode : public AlexNode<T, P> {
     ar & boost::serialization::base_object<AlexNode<T, P>>(*this);
     // ar & key_less_;
     // ar & allocator_;
+    if (Archive::is_saving::value) {
+      merge_delta();
+    }
     
     // std::cout << "AlexDataNode::arrays" << std::endl;
     ar & data_capacity_;
@@ -2540,33 +3769,139 @@ class AlexDataNode : public AlexNode<T, P> {
     // ar & next_leaf_;  // AlexDataNode
     // ar & prev_leaf_;  // AlexDataNode
   }
-public:
-  Chunk<T, P>* to_chunk() override {
-    if (AlexNode<T, P>::chunk_ == nullptr) {
-      #if ALEX_DATA_NODE_SEP_ARRAYS
-      AlexNode<T, P>::chunk_ = new DataChunk<T, P>(
-                AlexNode<T, P>::pager_, data_capacity_, bitmap_size_,
-                bitmap_, key_slots_, payload_slots_);
-      #else
-      AlexNode<T, P>::chunk_ = new DataChunk<T, P>(
-                AlexNode<T, P>::pager_, data_capacity_, bitmap_size_,
-                bitmap_, data_slots_);
-      #endif
-    }
-    return AlexNode<T, P>::chunk_;
-  }
-  void consume_chunk(Chunk<T, P>* chunk) override {
-    AlexNode<T, P>::chunk_ = chunk;
-    DataChunk<T, P>* data_chunk = (DataChunk<T, P>*) chunk;  // HACK
-    #if ALEX_DATA_NODE_SEP_ARRAYS
-    key_slots_ = data_chunk->key_slots_;
-    payload_slots_ = data_chunk->payload_slots_;
-    #else
-    data_slots_ = data_chunk->data_slots_;
-    #endif
-    bitmap_ = data_chunk->bitmap_;
-    loaded_from_mmap_ = data_chunk->has_pager_;
-    return;
+
+  /*** Flat records ***/
+
+ public:
+  std::vector<FlatChildRun> save_flat_children(
+      Pager<T, P>* pager __attribute__((unused)),
+      ThreadPool* pool __attribute__((unused))) override {
+    return {};
+  }
+
+  std::vector<FlatChildRun> copy_flat_children(
+      Pager<T, P>* pager __attribute__((unused))) override {
+    return {};
+  }
+
+  // Header, object, bitmap and keys are contiguous, which is what a lookup
+  // reads. The payloads follow, on pages of their own if the file layout asks
+  // for it.
+  FlatRecordRef save_flat_record(
+      Pager<T, P>* pager,
+      const std::vector<FlatChildRun>& runs __attribute__((unused))) override {
+    merge_delta();
+    FlatRecordLayout layout;
+    size_t header_offset = layout.reserve(sizeof(FlatDataNodeHeader<T>),
+                                          alignof(FlatDataNodeHeader<T>));
+    size_t object_offset = layout.reserve(sizeof(self_type), alignof(self_type));
+    size_t bitmap_offset = layout.reserve(bitmap_size_ * sizeof(uint64_t),
+                                          alignof(uint64_t));
+#if ALEX_DATA_NODE_SEP_ARRAYS
+    size_t key_slots_offset = layout.reserve(data_capacity_ * sizeof(T), alignof(T));
+    FlatFileLayout file_layout = pager->file_layout();
+    size_t payload_alignment = alignof(P);
+    if (file_layout.page_size > 0 && file_layout.separate_payloads) {
+      payload_alignment = file_layout.page_size;
+    }
+    size_t payload_slots_offset = layout.reserve(data_capacity_ * sizeof(P), payload_alignment);
+#else
+    size_t key_slots_offset = layout.reserve(data_capacity_ * sizeof(V), alignof(V));
+    size_t payload_slots_offset = 0;
+#endif
+
+    std::vector<char> record(layout.size(), 0);
+    auto header = reinterpret_cast<FlatDataNodeHeader<T>*>(record.data() + header_offset);
+    header->node.magic = kFlatDataNodeMagic;
+    header->node.object_size = sizeof(self_type);
+    header->node.record_size = record.size();
+    header->node.object_offset = object_offset;
+    this->to_flat_header(&header->node);
+    header->data_capacity = data_capacity_;
+    header->num_keys = num_keys_;
+    header->bitmap_size = bitmap_size_;
+    header->max_slots = max_slots_;
+    header->expansion_threshold = expansion_threshold_;
+    header->contraction_threshold = contraction_threshold_;
+    header->num_shifts = num_shifts_;
+    header->num_exp_search_iterations = num_exp_search_iterations_;
+    header->num_lookups = num_lookups_;
+    header->num_inserts = num_inserts_;
+    header->num_resizes = num_resizes_;
+    header->num_right_out_of_bounds_inserts = num_right_out_of_bounds_inserts_;
+    header->num_left_out_of_bounds_inserts = num_left_out_of_bounds_inserts_;
+    header->max_key = max_key_;
+    header->min_key = min_key_;
+    header->expected_avg_exp_search_iterations = expected_avg_exp_search_iterations_;
+    header->expected_avg_shifts = expected_avg_shifts_;
+    header->bitmap_offset = bitmap_offset;
+    header->key_slots_offset = key_slots_offset;
+    header->payload_slots_offset = payload_slots_offset;
+    std::copy(bitmap_, bitmap_ + bitmap_size_,
+              reinterpret_cast<uint64_t*>(record.data() + bitmap_offset));
+#if ALEX_DATA_NODE_SEP_ARRAYS
+    std::copy(key_slots_, key_slots_ + data_capacity_,
+              reinterpret_cast<T*>(record.data() + key_slots_offset));
+    std::copy(payload_slots_, payload_slots_ + data_capacity_,
+              reinterpret_cast<P*>(record.data() + payload_slots_offset));
+#else
+    std::copy(data_slots_, data_slots_ + data_capacity_,
+              reinterpret_cast<V*>(record.data() + key_slots_offset));
+#endif
+    return {pager->save_record(record.data(), record.size()), record.size()};
+  }
+
+  // Constructs the node inside its record, with slots and bitmap pointing
+  // into the record.
+  static self_type* from_flat(char* record, Pager<T, P>* pager) {
+    auto header = reinterpret_cast<FlatDataNodeHeader<T>*>(record);
+    assert(header->node.magic == kFlatDataNodeMagic);
+
+    if (header->node.object_size != sizeof(self_type)) {
+      throw std::runtime_error("Data node record was written with a different node layout");
+    }
+    auto node = new (record + header->node.object_offset)
+        self_type(header->node.level, header->max_slots, pager);
+    node->from_flat_header(&header->node, pager);
+    node->data_capacity_ = header->data_capacity;
+    node->num_keys_ = header->num_keys;
+    node->bitmap_size_ = header->bitmap_size;
+    node->expansion_threshold_ = header->expansion_threshold;
+    node->contraction_threshold_ = header->contraction_threshold;
+    node->num_shifts_ = header->num_shifts;
+    node->num_exp_search_iterations_ = header->num_exp_search_iterations;
+    node->num_lookups_ = header->num_lookups;
+    node->num_inserts_ = header->num_inserts;
+    node->num_resizes_ = header->num_resizes;
+    node->num_right_out_of_bounds_inserts_ = header->num_right_out_of_bounds_inserts;
+    node->num_left_out_of_bounds_inserts_ = header->num_left_out_of_bounds_inserts;
+    node->max_key_ = header->max_key;
+    node->min_key_ = header->min_key;
+    node->expected_avg_exp_search_iterations_ = header->expected_avg_exp_search_iterations;
+    node->expected_avg_shifts_ = header->expected_avg_shifts;
+    node->bitmap_ = reinterpret_cast<uint64_t*>(record + header->bitmap_offset);
+#if ALEX_DATA_NODE_SEP_ARRAYS
+    node->key_slots_ = reinterpret_cast<T*>(record + header->key_slots_offset);
+    node->payload_slots_ = reinterpret_cast<P*>(record + header->payload_slots_offset);
+#else
+    node->data_slots_ = reinterpret_cast<V*>(record + header->key_slots_offset);
+#endif
+    node->next_leaf_ = unlinked_leaf();
+    node->prev_leaf_ = unlinked_leaf();
+    node->loaded_from_mmap_ = true;
+    return node;
   }
 };
-}
+}  // namespace alex
+
+// Version 1 archives the children of a model node instead of their wrappers
+namespace boost {
+namespace serialization {
+template <class T, class P, class Alloc>
+struct version<alex::AlexModelNode<T, P, Alloc>> {
+  typedef mpl::int_<1> type;
+  typedef mpl::integral_c_tag tag;
+  BOOST_STATIC_CONSTANT(int, value = version::type::value);
+};
+}  // namespace serialization
+}  // namespace boost
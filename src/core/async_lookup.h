@@ -0,0 +1,107 @@
+/* This file contains a scheduler that keeps many point lookups on a
+ * storage-backed ALEX in flight from a single thread.
+ *
+ * A lookup runs until it needs a node record or a page of a leaf that is not
+ * in memory (see Alex::resume_lookup). The pager starts reading it and the
+ * lookup is suspended, so the thread moves on to other lookups instead of
+ * blocking, and the reads of different lookups overlap. Suspended lookups are
+ * resumed round-robin until their data is in memory, and each completed lookup
+ * invokes its callback.
+ *
+ * A scheduler belongs to one thread. The index must not be modified while
+ * lookups are in flight.
+ */
+
+#pragma once
+
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "alex.h"
+
+namespace alex {
+
+template <class T, class P, class Compare = AlexCompare,
+          class Alloc = std::allocator<std::pair<T, P>>,
+          bool allow_duplicates = true>
+class AsyncLookupScheduler {
+ public:
+  typedef Alex<T, P, Compare, Alloc, allow_duplicates> index_type;
+
+  // Receives the key and a pointer to its payload, or nullptr if not found
+  typedef std::function<void(const T&, P*)> Callback;
+
+  static constexpr size_t kDefaultMaxInFlight = 64;
+
+  explicit AsyncLookupScheduler(const index_type* index,
+                                size_t max_in_flight = kDefaultMaxInFlight)
+      : index_(index), max_in_flight_(std::max<size_t>(max_in_flight, 1)) {
+    pending_.reserve(max_in_flight_);
+  }
+
+  // Starts a lookup of key. If it completes without waiting for I/O, callback
+  // runs right away, otherwise during a later call to submit, poll or drain.
+  // Waits for a lookup to complete if max_in_flight are already suspended.
+  void submit(const T& key, Callback callback) {
+    while (pending_.size() >= max_in_flight_) {
+      if (poll() == 0) {
+        std::this_thread::yield();
+      }
+    }
+    Pending pending;
+    pending.lookup.key = key;
+    P* payload;
+    if (index_->resume_lookup(&pending.lookup, &payload)) {
+      callback(key, payload);
+      return;
+    }
+    pending.callback = std::move(callback);
+    pending_.push_back(std::move(pending));
+  }
+
+  // Resumes every suspended lookup once. Returns the number that completed.
+  size_t poll() {
+    size_t num_completed = 0;
+    size_t i = 0;
+    while (i < pending_.size()) {
+      P* payload;
+      if (!index_->resume_lookup(&pending_[i].lookup, &payload)) {
+        i++;
+        continue;
+      }
+      // Callbacks may submit more lookups, so leave pending_ consistent first
+      Pending done = std::move(pending_[i]);
+      pending_[i] = std::move(pending_.back());
+      pending_.pop_back();
+      num_completed++;
+      done.callback(done.lookup.key, payload);
+    }
+    return num_completed;
+  }
+
+  // Runs until every submitted lookup completed. The pager does not notify
+  // when a read finishes, so this polls, yielding between rounds that made
+  // no progress.
+  void drain() {
+    while (!pending_.empty()) {
+      if (poll() == 0) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  size_t num_in_flight() const { return pending_.size(); }
+
+ private:
+  struct Pending {
+    typename index_type::AsyncLookup lookup;
+    Callback callback;
+  };
+
+  const index_type* index_;
+  size_t max_in_flight_;
+  std::vector<Pending> pending_;
+};
+
+}  // namespace alex
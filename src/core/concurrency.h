@@ -0,0 +1,478 @@
+/* This file contains the synchronization primitives used when an ALEX index is
+ * shared between threads (see Alex::set_concurrency_mode):
+ * - VersionLock: a per-node optimistic lock. Writers lock a node and bump its
+ *   version when they unlock it; readers never write to the node, they read
+ *   its version before and after looking at it and retry if it changed.
+ * - EpochManager: epoch-based reclamation. Memory that optimistic readers may
+ *   still be looking at (replaced nodes, slot arrays of a resized data node)
+ *   is retired instead of freed, and freed once every thread that could have
+ *   seen it has left its operation.
+ * - ShardedCounter: a statistics counter that readers on different cores can
+ *   increment without contending on a single cache line.
+ * - BackgroundWorker: a thread that runs queued maintenance tasks in order,
+ *   such as the node reorganizations that Alex::set_background_reorganization
+ *   takes off the insert path.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace alex {
+
+enum class ConcurrencyMode {
+  // No synchronization, the index must not be shared between threads
+  kSingleThreaded,
+  // Any number of threads may run lookups while one thread at a time modifies
+  // the index
+  kSingleWriter,
+  // Any number of threads may run lookups and modifications. Modifications
+  // that stay within a data node only lock that node.
+  kMultiWriter,
+};
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Optimistic lock: a version number whose lowest bit doubles as the write lock.
+// A node marked obsolete has been unlinked from the tree, so readers that reach
+// it must restart from the root.
+class VersionLock {
+ public:
+  VersionLock() = default;
+  // Copies of a node are new nodes, so they start out unlocked
+  VersionLock(const VersionLock&) {}
+  VersionLock& operator=(const VersionLock&) { return *this; }
+
+  // Waits until the node is unlocked and stores its version. Returns false if
+  // the node is obsolete.
+  bool read_lock(uint64_t* version) const {
+    uint64_t v = word_.load(std::memory_order_acquire);
+    while (v & kLockedBit) {
+      cpu_relax();
+      v = word_.load(std::memory_order_acquire);
+    }
+    *version = v;
+    return !(v & kObsoleteBit);
+  }
+
+  // True if the node did not change since read_lock returned version
+  bool validate(uint64_t version) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return word_.load(std::memory_order_relaxed) == version;
+  }
+
+  void write_lock() {
+    uint64_t v = word_.load(std::memory_order_relaxed);
+    while (true) {
+      if (v & kLockedBit) {
+        cpu_relax();
+        v = word_.load(std::memory_order_relaxed);
+      } else if (word_.compare_exchange_weak(v, v | kLockedBit,
+                                             std::memory_order_acquire)) {
+        break;
+      }
+    }
+    // Keep the writes to the node from becoming visible before the lock bit
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  // Locks the node only if that does not require waiting
+  bool try_write_lock() {
+    uint64_t v = word_.load(std::memory_order_relaxed);
+    return !(v & (kLockedBit | kObsoleteBit)) && try_upgrade(v);
+  }
+
+  // Locks the node if it is still at version, which read_lock returned.
+  // Returns false if the node changed in the meantime.
+  bool try_upgrade(uint64_t version) {
+    if (!word_.compare_exchange_strong(version, version | kLockedBit,
+                                       std::memory_order_acquire)) {
+      return false;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+  }
+
+  // Clears the lock bit and increments the version
+  void write_unlock() {
+    word_.fetch_add(kVersionIncrement - kLockedBit, std::memory_order_release);
+  }
+
+  // Must hold the write lock
+  void mark_obsolete() {
+    word_.fetch_or(kObsoleteBit, std::memory_order_relaxed);
+  }
+
+ private:
+  static constexpr uint64_t kLockedBit = 1;
+  static constexpr uint64_t kObsoleteBit = 2;
+  static constexpr uint64_t kVersionIncrement = 4;
+
+  std::atomic<uint64_t> word_{0};
+};
+
+// Locks a set of nodes for the duration of a modification, and unlocks them
+// all when destroyed. Adding a lock twice is a no-op. Does nothing if
+// disabled, which is the case in single-threaded mode.
+class WriteLockSet {
+ public:
+  explicit WriteLockSet(bool enabled) : enabled_(enabled) {}
+  WriteLockSet(const WriteLockSet&) = delete;
+  WriteLockSet& operator=(const WriteLockSet&) = delete;
+  ~WriteLockSet() { release(); }
+
+  void add(VersionLock* lock) {
+    if (!enabled_) {
+      return;
+    }
+    for (VersionLock* held : locks_) {
+      if (held == lock) {
+        return;
+      }
+    }
+    lock->write_lock();
+    locks_.push_back(lock);
+  }
+
+  // Takes over a lock that the caller already holds
+  void adopt(VersionLock* lock) {
+    if (enabled_) {
+      locks_.push_back(lock);
+    }
+  }
+
+  void release() {
+    for (VersionLock* held : locks_) {
+      held->write_unlock();
+    }
+    locks_.clear();
+  }
+
+ private:
+  bool enabled_;
+  std::vector<VersionLock*> locks_;
+};
+
+// Process-wide epoch-based reclamation. Every thread that reads or modifies a
+// shared index does so between enter() and exit() (see EpochGuard). Each call
+// to retire() advances the global epoch; the retired memory is freed once
+// every thread inside an operation has entered it after that.
+// Threads that never touch a shared index never register, so when there are
+// none, retired memory is freed immediately.
+class EpochManager {
+ public:
+  static constexpr int kMaxThreads = 256;
+
+  static EpochManager& instance() {
+    static EpochManager manager;
+    return manager;
+  }
+
+  // Index of the calling thread's slot, in [0, kMaxThreads)
+  int thread_id() { return local().slot; }
+
+  void enter() {
+    ThreadState& state = local();
+    if (state.depth++ > 0) {
+      return;
+    }
+    std::atomic<uint64_t>& announced = slots_[state.slot].epoch;
+    uint64_t epoch = global_epoch_.load(std::memory_order_seq_cst);
+    while (true) {
+      announced.store(epoch, std::memory_order_seq_cst);
+      // If the epoch advanced before our announcement became visible, a
+      // concurrent retire() may have missed us, so announce again
+      uint64_t current = global_epoch_.load(std::memory_order_seq_cst);
+      if (current == epoch) {
+        break;
+      }
+      epoch = current;
+    }
+  }
+
+  void exit() {
+    ThreadState& state = local();
+    if (--state.depth > 0) {
+      return;
+    }
+    slots_[state.slot].epoch.store(kInactive, std::memory_order_release);
+  }
+
+  // Frees memory through deleter once no thread can still be reading it.
+  // deleter may itself call retire().
+  template <class Deleter>
+  void retire(Deleter&& deleter) {
+    // Orders the caller's unlinking of the memory before the check, so that a
+    // thread registering concurrently cannot see the memory still linked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (num_slots_.load(std::memory_order_relaxed) == 0) {
+      deleter();
+      return;
+    }
+    uint64_t epoch = global_epoch_.fetch_add(1, std::memory_order_seq_cst);
+    std::vector<std::function<void()>> ready;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      uint64_t min_epoch = min_active_epoch();
+      if (epoch < min_epoch) {
+        ready.emplace_back(std::forward<Deleter>(deleter));
+      } else {
+        retired_.emplace_back(epoch, std::forward<Deleter>(deleter));
+      }
+      collect(min_epoch, &ready);
+    }
+    for (auto& fn : ready) {
+      fn();
+    }
+  }
+
+  // Waits for the threads that are currently inside an operation, then frees
+  // everything retired so far
+  void barrier() {
+    while (true) {
+      global_epoch_.fetch_add(1, std::memory_order_seq_cst);
+      std::vector<std::function<void()>> ready;
+      bool done;
+      {
+        std::lock_guard<std::mutex> guard(mutex_);
+        collect(min_active_epoch(), &ready);
+        done = retired_.empty();
+      }
+      for (auto& fn : ready) {
+        fn();
+      }
+      if (done) {
+        return;
+      }
+      std::this_thread::yield();
+    }
+  }
+
+ private:
+  static constexpr uint64_t kInactive = std::numeric_limits<uint64_t>::max();
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{kInactive};
+    std::atomic<bool> in_use{false};
+  };
+
+  // Per-thread registration, released when the thread exits
+  struct ThreadState {
+    int slot = -1;
+    int depth = 0;
+
+    ~ThreadState() {
+      if (slot >= 0) {
+        EpochManager& manager = instance();
+        manager.slots_[slot].epoch.store(kInactive, std::memory_order_release);
+        manager.slots_[slot].in_use.store(false, std::memory_order_release);
+      }
+    }
+  };
+
+  ThreadState& local() {
+    thread_local ThreadState state;
+    if (state.slot < 0) {
+      state.slot = claim_slot();
+    }
+    return state;
+  }
+
+  int claim_slot() {
+    while (true) {
+      for (int i = 0; i < kMaxThreads; i++) {
+        bool expected = false;
+        if (!slots_[i].in_use.load(std::memory_order_relaxed) &&
+            slots_[i].in_use.compare_exchange_strong(expected, true)) {
+          int num_slots = num_slots_.load();
+          while (num_slots < i + 1 &&
+                 !num_slots_.compare_exchange_weak(num_slots, i + 1)) {
+          }
+          return i;
+        }
+      }
+      std::this_thread::yield();  // more than kMaxThreads live threads
+    }
+  }
+
+  uint64_t min_active_epoch() const {
+    uint64_t min_epoch = kInactive;
+    int num_slots = num_slots_.load(std::memory_order_acquire);
+    for (int i = 0; i < num_slots; i++) {
+      min_epoch =
+          std::min(min_epoch, slots_[i].epoch.load(std::memory_order_seq_cst));
+    }
+    return min_epoch;
+  }
+
+  // Must hold mutex_. Moves the deleters that are safe to run into ready.
+  void collect(uint64_t min_epoch, std::vector<std::function<void()>>* ready) {
+    while (!retired_.empty() && retired_.front().first < min_epoch) {
+      ready->push_back(std::move(retired_.front().second));
+      retired_.pop_front();
+    }
+  }
+
+  Slot slots_[kMaxThreads];
+  std::atomic<int> num_slots_{0};  // high-water mark of claimed slots
+  std::atomic<uint64_t> global_epoch_{1};
+  std::mutex mutex_;
+  // In increasing order of epoch
+  std::deque<std::pair<uint64_t, std::function<void()>>> retired_;
+};
+
+// Keeps the calling thread inside an operation on a shared index for the
+// lifetime of the guard. Does nothing if disabled.
+class EpochGuard {
+ public:
+  explicit EpochGuard(bool enabled) : enabled_(enabled) {
+    if (enabled_) {
+      EpochManager::instance().enter();
+    }
+  }
+  EpochGuard(const EpochGuard&) = delete;
+  EpochGuard& operator=(const EpochGuard&) = delete;
+  ~EpochGuard() {
+    if (enabled_) {
+      EpochManager::instance().exit();
+    }
+  }
+
+ private:
+  bool enabled_;
+};
+
+// Counter incremented by many threads and read rarely. Each thread adds to a
+// stripe of its own, so increments do not bounce a cache line between cores.
+class ShardedCounter {
+ public:
+  ShardedCounter() = default;
+  ShardedCounter(const ShardedCounter&) {}
+  ShardedCounter& operator=(const ShardedCounter&) { return *this; }
+
+  void add(long long n) {
+    stripes_[EpochManager::instance().thread_id() % kNumStripes]
+        .value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  // Returns the sum of all increments since the last call to take(), without
+  // resetting it. Concurrent increments may or may not be included.
+  long long sum() const {
+    long long sum = 0;
+    for (const auto& stripe : stripes_) {
+      sum += stripe.value.load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  // Returns the sum of all increments since the last call
+  long long take() {
+    long long sum = 0;
+    for (auto& stripe : stripes_) {
+      sum += stripe.value.exchange(0, std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+ private:
+  static constexpr int kNumStripes = 64;
+
+  struct alignas(64) Stripe {
+    std::atomic<long long> value{0};
+  };
+
+  Stripe stripes_[kNumStripes];
+};
+
+// A single thread that runs submitted tasks one at a time, in the order they
+// were submitted. The tasks queued when the worker is destroyed still run.
+class BackgroundWorker {
+ public:
+  BackgroundWorker() : thread_([this] { work(); }) {}
+  BackgroundWorker(const BackgroundWorker&) = delete;
+  BackgroundWorker& operator=(const BackgroundWorker&) = delete;
+
+  ~BackgroundWorker() {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      stopping_ = true;
+    }
+    work_cv_.notify_one();
+    thread_.join();
+  }
+
+  void submit(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      tasks_.push_back(std::move(task));
+    }
+    work_cv_.notify_one();
+  }
+
+  // Waits until every task submitted so far finished. Rethrows the first
+  // exception that one of them threw since the last call.
+  void drain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cv_.wait(lock, [this] { return tasks_.empty() && !busy_; });
+    if (error_) {
+      std::exception_ptr error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+
+ private:
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      work_cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+      std::function<void()> task = std::move(tasks_.front());
+      tasks_.pop_front();
+      busy_ = true;
+      lock.unlock();
+      try {
+        task();
+      } catch (...) {
+        lock.lock();
+        if (!error_) {
+          error_ = std::current_exception();
+        }
+        lock.unlock();
+      }
+      lock.lock();
+      busy_ = false;
+      if (tasks_.empty()) {
+        idle_cv_.notify_all();
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable idle_cv_;
+  std::deque<std::function<void()>> tasks_;
+  bool busy_ = false;
+  bool stopping_ = false;
+  std::exception_ptr error_;
+  // Started last, once the members it uses are initialized
+  std::thread thread_;
+};
+
+}  // namespace alex
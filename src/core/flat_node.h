@@ -0,0 +1,139 @@
+/* This file describes the fixed-layout records that nodes are written to in a
+ * page file. A record is self-contained and interpreted in place: the reader
+ * only does pointer arithmetic on the mapped bytes, then constructs the node
+ * object inside a slot reserved in the record itself.
+ *
+ * Model node record:
+ *   FlatModelNodeHeader | node object | FlatChildRun[num_runs]
+ * Data node record:
+ *   FlatDataNodeHeader | node object | bitmap | keys | payloads
+ *
+ * All offsets stored in a header are relative to the start of the record,
+ * except FlatChildRun::offset which is the page-file offset of the child
+ * record. The layout depends on the in-memory size of the node classes, so a
+ * page file can only be read by a binary built with the same node layout.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+
+namespace alex {
+
+// Every record starts on a cache line boundary in the page file.
+constexpr size_t kFlatRecordAlignment = 64;
+
+constexpr uint32_t kFlatModelNodeMagic = 0x324d4c41;  // "ALM2"
+constexpr uint32_t kFlatDataNodeMagic = 0x4e444c41;   // "ALDN"
+
+// Set on a loaded record whose node was modified since it was recovered, or
+// is referenced from outside its parent's record, which keeps the node cache
+// from evicting it
+constexpr uint32_t kFlatRecordPinned = 1;
+
+// How a WritePager places records in the page file
+struct FlatFileLayout {
+  // If non-zero, a record that fits in a page does not straddle a page
+  // boundary, and a larger record starts on one. Otherwise records are only
+  // aligned to kFlatRecordAlignment.
+  size_t page_size = 0;
+  // With page_size set and separate key and payload arrays, a data node's
+  // payloads start on a page of their own, so that its header, bitmap and
+  // keys are packed into as few pages as possible
+  bool separate_payloads = false;
+};
+
+inline size_t flat_align_up(size_t n, size_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+// Fields common to both node types, mirrors AlexNode
+struct FlatNodeHeader {
+  uint32_t magic;
+  uint32_t object_size;  // bytes reserved for the in-memory node object
+  uint64_t record_size;
+  uint64_t object_offset;
+  uint8_t is_leaf;
+  uint8_t duplication_factor;
+  int16_t level;
+  uint32_t flags;        // kFlatRecord*, only set in memory, zero in the file
+  double model_a;
+  double model_b;
+  double cost;
+};
+
+// Where a record was saved in the page file
+struct FlatRecordRef {
+  uint64_t offset;
+  uint64_t num_bytes;
+};
+
+// A run of identical child pointers in a model node
+struct FlatChildRun {
+  uint64_t offset;     // page-file offset of the child record
+  uint64_t num_bytes;  // size of the child record
+  uint32_t num_slots;  // number of consecutive child slots pointing to it
+  uint32_t is_leaf;    // whether the child is a data node
+};
+
+struct FlatModelNodeHeader {
+  FlatNodeHeader node;
+  int32_t num_children;
+  int32_t num_runs;
+  uint64_t runs_offset;  // FlatChildRun[num_runs]
+};
+
+template <class T>
+struct FlatDataNodeHeader {
+  FlatNodeHeader node;
+  int32_t data_capacity;
+  int32_t num_keys;
+  int32_t bitmap_size;
+  int32_t max_slots;
+  double expansion_threshold;
+  double contraction_threshold;
+  int64_t num_shifts;
+  int64_t num_exp_search_iterations;
+  int32_t num_lookups;
+  int32_t num_inserts;
+  int32_t num_resizes;
+  int32_t num_right_out_of_bounds_inserts;
+  int32_t num_left_out_of_bounds_inserts;
+  T max_key;
+  T min_key;
+  double expected_avg_exp_search_iterations;
+  double expected_avg_shifts;
+  uint64_t bitmap_offset;
+  uint64_t key_slots_offset;      // or data_slots_offset without separate arrays
+  uint64_t payload_slots_offset;
+};
+
+// FNV-1a, to tell whether a node still matches the record it was saved to
+inline uint64_t flat_hash_bytes(const void* data, size_t n,
+                                uint64_t hash = 0xcbf29ce484222325ULL) {
+  auto bytes = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < n; i++) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Assigns aligned, non-overlapping byte ranges inside a record under
+// construction.
+class FlatRecordLayout {
+ public:
+  size_t reserve(size_t num_bytes, size_t alignment) {
+    size_ = flat_align_up(size_, alignment);
+    size_t offset = size_;
+    size_ += num_bytes;
+    return offset;
+  }
+
+  size_t size() const { return flat_align_up(size_, kFlatRecordAlignment); }
+
+ private:
+  size_t size_ = 0;
+};
+
+}  // namespace alex
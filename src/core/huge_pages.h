@@ -0,0 +1,279 @@
+/* This file contains the allocator that places the nodes and arrays of an
+ * index on 2 MiB pages, so that lookups spread over many nodes miss the TLB
+ * less often (see HugePageAllocator, and PagerAccess::kHugePages for an index
+ * that is read from a page file).
+ *
+ * Huge pages come from the pool reserved through vm.nr_hugepages while it has
+ * pages left, then from transparent huge pages requested with
+ * madvise(MADV_HUGEPAGE), which the kernel backs with 4 KiB pages when it has
+ * no free 2 MiB ones or transparent huge pages are disabled.
+ *
+ * Allocations of up to NodeArena::kMaxPooledBytes go to a NodeArena whose
+ * slabs are advised to use transparent huge pages. Larger ones, up to almost
+ * a huge page, are packed in 4 KiB granules into regions of one huge page
+ * each, and the rest get a mapping of their own.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+#include "node_arena.h"
+
+namespace alex {
+
+constexpr size_t kHugePageBytes = 2 << 20;
+
+// Maps num_bytes, rounded up to whole huge pages, on a huge page boundary.
+// The pool is not tried again once it failed to provide a mapping. Throws
+// std::bad_alloc if the mapping fails.
+inline void* map_huge_pages(size_t num_bytes) {
+  static std::atomic<bool> pool_exhausted{false};
+  size_t map_bytes = (num_bytes + kHugePageBytes - 1) / kHugePageBytes * kHugePageBytes;
+  if (!pool_exhausted.load(std::memory_order_relaxed)) {
+    void* addr = mmap(nullptr, map_bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) {
+      return addr;
+    }
+    pool_exhausted.store(true, std::memory_order_relaxed);
+  }
+  void* addr = map_aligned_pages(map_bytes, kHugePageBytes);
+  madvise(addr, map_bytes, MADV_HUGEPAGE);
+  return addr;
+}
+
+// num_bytes must be what addr was mapped with
+inline void unmap_huge_pages(void* addr, size_t num_bytes) {
+  munmap(addr, (num_bytes + kHugePageBytes - 1) / kHugePageBytes * kHugePageBytes);
+}
+
+class HugePageHeap {
+ public:
+  static constexpr size_t kGranuleBytes = 4096;
+  static constexpr size_t kGranulesPerRegion = kHugePageBytes / kGranuleBytes;
+  // The first granule of a region holds its header
+  static constexpr size_t kMaxRegionBytes = (kGranulesPerRegion - 1) * kGranuleBytes;
+
+  // Shared by all indexes and never destroyed, like NodeArena::instance()
+  static HugePageHeap& instance() {
+    static HugePageHeap* heap = new HugePageHeap();
+    return *heap;
+  }
+
+  HugePageHeap(const HugePageHeap&) = delete;
+  HugePageHeap& operator=(const HugePageHeap&) = delete;
+
+  void* allocate(size_t num_bytes, size_t alignment) {
+    if (num_bytes <= NodeArena::kMaxPooledBytes &&
+        alignment <= NodeArena::kMaxPooledAlignment) {
+      return NodeArena::huge_page_instance().allocate(num_bytes, alignment);
+    }
+    if (num_bytes > kMaxRegionBytes || alignment > kGranuleBytes) {
+      return map_huge_pages(num_bytes);
+    }
+    return allocate_granules(num_granules(num_bytes));
+  }
+
+  // num_bytes and alignment must be what ptr was allocated with
+  void deallocate(void* ptr, size_t num_bytes, size_t alignment) {
+    if (ptr == nullptr) {
+      return;
+    }
+    if (num_bytes <= NodeArena::kMaxPooledBytes &&
+        alignment <= NodeArena::kMaxPooledAlignment) {
+      NodeArena::huge_page_instance().deallocate(ptr, num_bytes, alignment);
+    } else if (num_bytes > kMaxRegionBytes || alignment > kGranuleBytes) {
+      unmap_huge_pages(ptr, num_bytes);
+    } else {
+      deallocate_granules(ptr, num_granules(num_bytes));
+    }
+  }
+
+  // Unmaps the empty slabs and region kept for future allocations
+  void trim() {
+    NodeArena::huge_page_instance().trim();
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (spare_ != nullptr) {
+      unmap_huge_pages(spare_, kHugePageBytes);
+      spare_ = nullptr;
+    }
+  }
+
+ private:
+  // Header in the first granule of every region
+  struct Region {
+    Region* prev = nullptr;
+    Region* next = nullptr;
+    size_t num_free = kGranulesPerRegion - 1;
+    size_t max_free_run = kGranulesPerRegion - 1;  // longest run of free granules
+    uint64_t used[kGranulesPerRegion / 64] = {1};  // the header's granule is used
+  };
+  static_assert(sizeof(Region) <= kGranuleBytes, "region header exceeds a granule");
+
+  HugePageHeap() = default;
+
+  static size_t num_granules(size_t num_bytes) {
+    return (num_bytes + kGranuleBytes - 1) / kGranuleBytes;
+  }
+
+  static bool is_used(const Region* region, size_t g) {
+    return (region->used[g / 64] >> (g % 64)) & 1;
+  }
+
+  static void mark(Region* region, size_t first, size_t n, bool used) {
+    for (size_t g = first; g < first + n; g++) {
+      if (used) {
+        region->used[g / 64] |= uint64_t(1) << (g % 64);
+      } else {
+        region->used[g / 64] &= ~(uint64_t(1) << (g % 64));
+      }
+    }
+  }
+
+  // The first granule of the first run of n free granules, or of the longest
+  // run with n = 0, whose length is stored in *run_length
+  static size_t find_run(const Region* region, size_t n, size_t* run_length) {
+    size_t best_first = 0;
+    size_t best_length = 0;
+    size_t first = 0;
+    size_t length = 0;
+    for (size_t g = 1; g < kGranulesPerRegion; g++) {
+      if (is_used(region, g)) {
+        length = 0;
+        continue;
+      }
+      if (length++ == 0) {
+        first = g;
+      }
+      if (length > best_length) {
+        best_first = first;
+        best_length = length;
+        if (n > 0 && length == n) {
+          break;
+        }
+      }
+    }
+    *run_length = best_length;
+    return best_first;
+  }
+
+  void* allocate_granules(size_t n) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    Region* region = regions_;
+    while (region != nullptr && region->max_free_run < n) {
+      region = region->next;
+    }
+    if (region == nullptr) {
+      region = spare_ ? spare_ : new (map_huge_pages(kHugePageBytes)) Region();
+      spare_ = nullptr;
+      push(region);
+    }
+    size_t run_length;
+    size_t first = find_run(region, n, &run_length);
+    mark(region, first, n, true);
+    region->num_free -= n;
+    find_run(region, 0, &region->max_free_run);
+    if (region->num_free == 0) {
+      unlink(region);  // full
+    }
+    return reinterpret_cast<char*>(region) + first * kGranuleBytes;
+  }
+
+  void deallocate_granules(void* ptr, size_t n) {
+    Region* region = reinterpret_cast<Region*>(reinterpret_cast<uintptr_t>(ptr) &
+                                               ~(kHugePageBytes - 1));
+    size_t first = (static_cast<char*>(ptr) - reinterpret_cast<char*>(region)) / kGranuleBytes;
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (region->num_free == 0) {
+      push(region);
+    }
+    mark(region, first, n, false);
+    region->num_free += n;
+    find_run(region, 0, &region->max_free_run);
+    if (region->num_free == kGranulesPerRegion - 1) {
+      unlink(region);
+      if (spare_ == nullptr) {
+        spare_ = region;
+      } else {
+        unmap_huge_pages(region, kHugePageBytes);
+      }
+    }
+  }
+
+  void push(Region* region) {
+    region->prev = nullptr;
+    region->next = regions_;
+    if (regions_ != nullptr) {
+      regions_->prev = region;
+    }
+    regions_ = region;
+  }
+
+  void unlink(Region* region) {
+    if (region->prev != nullptr) {
+      region->prev->next = region->next;
+    } else if (regions_ == region) {
+      regions_ = region->next;
+    }
+    if (region->next != nullptr) {
+      region->next->prev = region->prev;
+    }
+    region->prev = nullptr;
+    region->next = nullptr;
+  }
+
+  std::mutex mutex_;          // guards the regions
+  Region* regions_ = nullptr;  // regions with free granules
+  Region* spare_ = nullptr;    // an empty region, kept for reuse
+};
+
+// Stateless allocator on HugePageHeap::instance(), to pass as the Alloc of an
+// index. The nodes, child slot arrays and lazy wrappers of such an index are
+// also allocated through it rather than from NodeArena::instance().
+template <class U>
+class HugePageAllocator {
+ public:
+  typedef U value_type;
+  typedef U* pointer;
+  typedef const U* const_pointer;
+  typedef U& reference;
+  typedef const U& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <class V>
+  struct rebind {
+    typedef HugePageAllocator<V> other;
+  };
+
+  HugePageAllocator() = default;
+  template <class V>
+  HugePageAllocator(const HugePageAllocator<V>&) {}
+
+  U* allocate(size_t n) {
+    return static_cast<U*>(
+        HugePageHeap::instance().allocate(n * sizeof(U), alignof(U)));
+  }
+
+  void deallocate(U* ptr, size_t n) {
+    HugePageHeap::instance().deallocate(ptr, n * sizeof(U), alignof(U));
+  }
+
+  void destroy(U* ptr) { ptr->~U(); }
+
+  bool operator==(const HugePageAllocator&) const { return true; }
+  bool operator!=(const HugePageAllocator&) const { return false; }
+};
+
+template <class V, class U>
+struct NodeAllocator<HugePageAllocator<V>, U> {
+  typedef HugePageAllocator<U> type;
+};
+
+}  // namespace alex
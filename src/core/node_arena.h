@@ -0,0 +1,317 @@
+/* This file contains the slab allocator that holds the small objects of an
+ * index: node objects, arrays of child slots and the wrappers of children
+ * that are only in a pager (see ALEX_NODE_ARENA).
+ *
+ * Objects are grouped by size class into slabs of kSlabBytes, which are
+ * mapped from the kernel on demand and aligned to their size, so that the
+ * slab of an object is found by masking its address. Each slab keeps its own
+ * free list and count of live objects. A slab whose last object is freed is
+ * unmapped, except for one per size class that is kept for the next
+ * allocation, so tearing down an index hands its memory back as whole slabs
+ * instead of leaving a fragmented heap behind.
+ *
+ * Allocations larger than kMaxPooledBytes, or more strictly aligned than
+ * kMaxPooledAlignment, go to the global operator new.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Whether node objects, child slot arrays and lazy wrappers are allocated
+// from the NodeArena rather than through the index's Alloc. Key and payload
+// arrays always use Alloc.
+#ifndef ALEX_NODE_ARENA
+#define ALEX_NODE_ARENA 1
+#endif
+
+namespace alex {
+
+// Maps num_bytes of anonymous memory starting at a multiple of alignment, a
+// power of two, by trimming a larger mapping. Throws std::bad_alloc if the
+// mapping fails.
+inline void* map_aligned_pages(size_t num_bytes, size_t alignment) {
+  void* addr = mmap(nullptr, num_bytes + alignment, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  uintptr_t begin = reinterpret_cast<uintptr_t>(addr);
+  uintptr_t aligned = (begin + alignment - 1) & ~(alignment - 1);
+  if (aligned > begin) {
+    munmap(addr, aligned - begin);
+  }
+  uintptr_t end = begin + num_bytes + alignment;
+  if (end > aligned + num_bytes) {
+    munmap(reinterpret_cast<void*>(aligned + num_bytes),
+           end - aligned - num_bytes);
+  }
+  return reinterpret_cast<void*>(aligned);
+}
+
+class NodeArena {
+ public:
+  static constexpr size_t kSlabBytes = 2 << 20;
+  static constexpr size_t kMaxPooledBytes = 64 << 10;
+  static constexpr size_t kMaxPooledAlignment = 64;
+
+  // Shared by all indexes. Never destroyed, since memory retired by the
+  // EpochManager may be freed during exit.
+  static NodeArena& instance() {
+    static NodeArena* arena = new NodeArena(false);
+    return *arena;
+  }
+
+  // An arena whose slabs are advised to be backed by transparent huge pages,
+  // for the indexes that allocate through a HugePageAllocator
+  static NodeArena& huge_page_instance() {
+    static NodeArena* arena = new NodeArena(true);
+    return *arena;
+  }
+
+  NodeArena(const NodeArena&) = delete;
+  NodeArena& operator=(const NodeArena&) = delete;
+
+  void* allocate(size_t num_bytes, size_t alignment) {
+    int c = size_class(num_bytes, alignment);
+    if (c < 0) {
+      return ::operator new(num_bytes, std::align_val_t(std::max(
+                                           alignment, sizeof(void*))));
+    }
+    SizeClass& size_class = classes_[c];
+    std::lock_guard<std::mutex> guard(size_class.mutex);
+    Slab* slab = size_class.partial;
+    if (slab == nullptr) {
+      slab = size_class.empty ? size_class.empty : new_slab();
+      size_class.empty = nullptr;
+      push(&size_class.partial, slab);
+    }
+    void* ptr;
+    if (slab->free_list != nullptr) {
+      ptr = slab->free_list;
+      slab->free_list = *static_cast<void**>(ptr);
+    } else {
+      ptr = slab->bump;
+      slab->bump += size_class.object_bytes;
+    }
+    slab->num_live++;
+    if (slab->free_list == nullptr &&
+        slab->bump + size_class.object_bytes > slab_end(slab)) {
+      unlink(&size_class.partial, slab);  // full
+    }
+    return ptr;
+  }
+
+  // num_bytes and alignment must be what ptr was allocated with
+  void deallocate(void* ptr, size_t num_bytes, size_t alignment) {
+    if (ptr == nullptr) {
+      return;
+    }
+    int c = size_class(num_bytes, alignment);
+    if (c < 0) {
+      ::operator delete(ptr, std::align_val_t(std::max(
+                                 alignment, sizeof(void*))));
+      return;
+    }
+    SizeClass& size_class = classes_[c];
+    Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(ptr) &
+                                         ~(kSlabBytes - 1));
+    std::lock_guard<std::mutex> guard(size_class.mutex);
+    bool was_full = (slab->free_list == nullptr &&
+                     slab->bump + size_class.object_bytes > slab_end(slab));
+    *static_cast<void**>(ptr) = slab->free_list;
+    slab->free_list = ptr;
+    slab->num_live--;
+    if (was_full) {
+      push(&size_class.partial, slab);
+    }
+    if (slab->num_live == 0) {
+      unlink(&size_class.partial, slab);
+      if (size_class.empty == nullptr) {
+        reset(slab);
+        size_class.empty = slab;
+      } else {
+        release_slab(slab);
+      }
+    }
+  }
+
+  // Unmaps the empty slabs kept for future allocations
+  void trim() {
+    for (SizeClass& size_class : classes_) {
+      std::lock_guard<std::mutex> guard(size_class.mutex);
+      if (size_class.empty != nullptr) {
+        release_slab(size_class.empty);
+        size_class.empty = nullptr;
+      }
+    }
+  }
+
+  // Bytes of slabs currently mapped
+  size_t num_mapped_bytes() const {
+    return num_slabs_.load(std::memory_order_relaxed) * kSlabBytes;
+  }
+
+ private:
+  // Header at the start of every slab
+  struct alignas(kMaxPooledAlignment) Slab {
+    Slab* prev = nullptr;
+    Slab* next = nullptr;
+    void* free_list = nullptr;  // freed objects, linked through their first word
+    char* bump = nullptr;       // objects from here on were never allocated
+    size_t num_live = 0;
+  };
+
+  struct SizeClass {
+    size_t object_bytes = 0;
+    size_t alignment = 0;    // of every object in the class's slabs
+    std::mutex mutex;
+    Slab* partial = nullptr;  // slabs with room for another object
+    Slab* empty = nullptr;    // a slab without live objects, kept for reuse
+  };
+
+  // Sizes of 2^k and 1.5 * 2^k bytes, from 16 bytes to kMaxPooledBytes
+  explicit NodeArena(bool huge_pages)
+      : huge_pages_(huge_pages), classes_(num_size_classes()) {
+    size_t c = 0;
+    for (size_t size = 16; size <= kMaxPooledBytes; size *= 2) {
+      classes_[c++].object_bytes = size;
+      if (size + size / 2 <= kMaxPooledBytes) {
+        classes_[c++].object_bytes = size + size / 2;
+      }
+    }
+    for (SizeClass& size_class : classes_) {
+      // Objects start at multiples of their size after the header
+      size_class.alignment = std::min(
+          size_class.object_bytes & (~size_class.object_bytes + 1),
+          kMaxPooledAlignment);
+    }
+  }
+
+  static size_t num_size_classes() {
+    size_t n = 0;
+    for (size_t size = 16; size <= kMaxPooledBytes; size *= 2) {
+      n += (size + size / 2 <= kMaxPooledBytes) ? 2 : 1;
+    }
+    return n;
+  }
+
+  // The smallest class that fits, or -1 if the allocation is not pooled
+  int size_class(size_t num_bytes, size_t alignment) const {
+    if (num_bytes > kMaxPooledBytes || alignment > kMaxPooledAlignment) {
+      return -1;
+    }
+    for (size_t c = 0; c < classes_.size(); c++) {
+      if (classes_[c].object_bytes >= num_bytes &&
+          classes_[c].alignment >= alignment) {
+        return static_cast<int>(c);
+      }
+    }
+    return -1;
+  }
+
+  static char* slab_end(Slab* slab) {
+    return reinterpret_cast<char*>(slab) + kSlabBytes;
+  }
+
+  static void reset(Slab* slab) {
+    slab->free_list = nullptr;
+    slab->bump = reinterpret_cast<char*>(slab + 1);
+    slab->num_live = 0;
+  }
+
+  Slab* new_slab() {
+    void* addr = map_aligned_pages(kSlabBytes, kSlabBytes);
+    if (huge_pages_) {
+      madvise(addr, kSlabBytes, MADV_HUGEPAGE);
+    }
+    num_slabs_.fetch_add(1, std::memory_order_relaxed);
+    auto slab = new (addr) Slab();
+    reset(slab);
+    return slab;
+  }
+
+  void release_slab(Slab* slab) {
+    munmap(slab, kSlabBytes);
+    num_slabs_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  static void push(Slab** list, Slab* slab) {
+    slab->prev = nullptr;
+    slab->next = *list;
+    if (*list != nullptr) {
+      (*list)->prev = slab;
+    }
+    *list = slab;
+  }
+
+  static void unlink(Slab** list, Slab* slab) {
+    if (slab->prev != nullptr) {
+      slab->prev->next = slab->next;
+    } else if (*list == slab) {
+      *list = slab->next;
+    }
+    if (slab->next != nullptr) {
+      slab->next->prev = slab->prev;
+    }
+    slab->prev = nullptr;
+    slab->next = nullptr;
+  }
+
+  bool huge_pages_;
+  std::vector<SizeClass> classes_;
+  std::atomic<size_t> num_slabs_{0};
+};
+
+// Stateless allocator on NodeArena::instance(). Constructible from any
+// allocator, which it ignores, so that it can replace a rebound Alloc.
+template <class U>
+class NodeArenaAllocator {
+ public:
+  typedef U value_type;
+  typedef U* pointer;
+  typedef const U* const_pointer;
+  typedef U& reference;
+  typedef const U& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <class V>
+  struct rebind {
+    typedef NodeArenaAllocator<V> other;
+  };
+
+  NodeArenaAllocator() = default;
+  template <class A>
+  explicit NodeArenaAllocator(const A&) {}
+
+  U* allocate(size_t n) {
+    return static_cast<U*>(
+        NodeArena::instance().allocate(n * sizeof(U), alignof(U)));
+  }
+
+  void deallocate(U* ptr, size_t n) {
+    NodeArena::instance().deallocate(ptr, n * sizeof(U), alignof(U));
+  }
+
+  void destroy(U* ptr) { ptr->~U(); }
+
+  bool operator==(const NodeArenaAllocator&) const { return true; }
+  bool operator!=(const NodeArenaAllocator&) const { return false; }
+};
+
+// The allocator of node objects, child slot arrays and lazy wrappers of U for
+// an index that allocates through Alloc
+template <class Alloc, class U>
+struct NodeAllocator {
+  typedef NodeArenaAllocator<U> type;
+};
+
+}  // namespace alex
@@ -0,0 +1,115 @@
+/* This file contains the cache that bounds the memory taken by data nodes that
+ * were lazily recovered from a page file (see ReadPager::set_node_cache_budget).
+ *
+ * Every data node recovered by a LazyAlexNode is admitted with the size of its
+ * record. When the recovered records exceed the budget, a CLOCK hand sweeps
+ * over them: a node that was accessed since the last sweep gets a second
+ * chance, and a cold node that is still exactly what was read from its record
+ * is evicted, i.e. its wrapper goes back to holding only the record offset and
+ * the record's pages are handed back to the kernel. Nodes that were modified,
+ * linked to their cousins or referenced from elsewhere are pinned and leave
+ * the cache for good. Model nodes are never admitted, so the inner levels of
+ * the tree always stay in memory.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <algorithm>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+namespace alex {
+
+class NodeCache {
+ public:
+  // What the clock hand did to an entry
+  enum class Visit {
+    kKeep,     // accessed recently, or in use right now
+    kEvicted,  // back to its offset form
+    kPinned,   // can no longer be evicted
+  };
+
+  // Visits the entry under the clock hand, see LazyAlexNode::evict_if_cold
+  typedef Visit (*VisitFunction)(void* entry);
+
+  static constexpr size_t kUnlimited = std::numeric_limits<size_t>::max();
+
+  // Evicts right away if the admitted nodes already exceed the new budget
+  void set_budget(size_t num_bytes) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    budget_ = num_bytes;
+    evict_over_budget(0);
+  }
+
+  size_t budget() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return budget_;
+  }
+
+  // Bytes of the records of the admitted nodes that are still evictable
+  size_t resident_bytes() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return resident_bytes_;
+  }
+
+  long long num_evictions() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return num_evictions_;
+  }
+
+  // Tracks a freshly recovered node, whose record is num_bytes long, and
+  // evicts other nodes if it does not fit in the budget
+  void admit(void* entry, size_t num_bytes, VisitFunction visit) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    evict_over_budget(num_bytes);
+    entries_.push_back({entry, num_bytes, visit});
+    resident_bytes_ += num_bytes;
+  }
+
+ private:
+  struct Entry {
+    void* entry;
+    size_t num_bytes;
+    VisitFunction visit;
+  };
+
+  // Must hold mutex_. Evicts until num_bytes more fit in the budget. Gives up
+  // after two full turns of the hand, which means that everything left is in
+  // use.
+  void evict_over_budget(size_t num_bytes) {
+    size_t num_visits = 0;
+    size_t max_visits = 2 * entries_.size();
+    while (resident_bytes_ + std::min(num_bytes, budget_) > budget_ &&
+           !entries_.empty() && num_visits < max_visits) {
+      if (hand_ >= entries_.size()) {
+        hand_ = 0;
+      }
+      Entry& cur = entries_[hand_];
+      Visit visit = cur.visit(cur.entry);
+      num_visits++;
+      if (visit == Visit::kKeep) {
+        hand_++;
+        continue;
+      }
+      if (visit == Visit::kEvicted) {
+        num_evictions_++;
+      }
+      resident_bytes_ -= cur.num_bytes;
+      // The last entry takes the place of the removed one, and is the next to
+      // be visited
+      cur = entries_.back();
+      entries_.pop_back();
+    }
+  }
+
+  std::mutex mutex_;
+  std::vector<Entry> entries_;
+  size_t hand_ = 0;
+  size_t budget_ = kUnlimited;
+  size_t resident_bytes_ = 0;
+  long long num_evictions_ = 0;
+};
+
+}  // namespace alex
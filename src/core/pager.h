@@ -1,14 +1,50 @@
 #include <algorithm>
+#include <atomic>
+#include <errno.h>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "flat_node.h"
+#include "huge_pages.h"
+#include "node_cache.h"
 
 namespace alex {
+
+// How a ReadPager expects its file to be accessed, which trades startup time
+// against the latency of the first queries
+enum class PagerAccess {
+  kDefault,     // the kernel's readahead heuristics
+  kRandom,      // no readahead, for point lookups on a cold file
+  kSequential,  // aggressive readahead, for scans
+  kPopulate,    // read the whole file when it is mapped
+  kWarmInner,   // read the records of the upper model node levels on load
+  kHugePages,   // copy the whole file into memory on huge pages on load
+};
+
+// Where the nodes of an Alex index live, fixed at compile time. kPaged nodes
+// may be recovered lazily from a pager and evicted by its node cache. A
+// kInMemory index has no pager, so lookups follow child pointers without
+// checking whether the child must be recovered, or telling the node cache
+// that it was accessed.
+enum class NodeStorage {
+  kPaged,
+  kInMemory,
+};
+
 template<class T, class P>
 class Pager {
 public:
@@ -36,6 +72,25 @@ public:
     throw std::logic_error("Not implemented: save_char");
   }
 
+  // Saves a node record (see flat_node.h), aligned to kFlatRecordAlignment
+  virtual size_t save_record(const char* arr __attribute__((unused)), size_t n __attribute__((unused))) {
+    throw std::logic_error("Not implemented: save_record");
+  }
+
+  // Makes everything saved so far visible to readers of the file
+  virtual void flush() {}
+
+  // Whether save_record may be called from several threads at once
+  virtual bool concurrent_saves() const { return false; }
+
+  // Where save_record places records, which save_flat also follows inside
+  // each record
+  virtual FlatFileLayout file_layout() const { return FlatFileLayout(); }
+
+  // Called when an index is loaded, before its root record at root_offset is
+  // recovered
+  virtual void warm_up(size_t root_offset __attribute__((unused))) {}
+
   virtual T* load_t(size_t offset __attribute__((unused))) {
     throw std::logic_error("Not implemented: load_t");
   }
@@ -55,24 +110,121 @@ public:
   virtual char* load_char(size_t offset __attribute__((unused))) {
     throw std::logic_error("Not implemented: load_char");
   }
+
+  // Returns a writable view of the whole node record at offset, which is
+  // num_bytes long as returned by save_flat, or 0 if the size is not known
+  virtual char* load_record(size_t offset __attribute__((unused)), size_t num_bytes __attribute__((unused))) {
+    throw std::logic_error("Not implemented: load_record");
+  }
+
+  // Hints that the record at offset will be loaded soon
+  virtual void prefetch_record(size_t offset __attribute__((unused)), size_t num_bytes __attribute__((unused))) {}
+
+  // Like load_record, but returns nullptr instead of waiting for I/O, after
+  // starting to read what is missing. Pagers that cannot tell block instead.
+  virtual char* try_load_record(size_t offset, size_t num_bytes) {
+    return load_record(offset, num_bytes);
+  }
+
+  // Returns true if [addr, addr + n) of a loaded record can be accessed
+  // without waiting for I/O. Otherwise starts reading it and returns false.
+  virtual bool try_access(const char* addr __attribute__((unused)), size_t n __attribute__((unused))) {
+    return true;
+  }
+
+  // Cache that bounds the memory of recovered data nodes, if the pager has one
+  virtual NodeCache* node_cache() { return nullptr; }
+
+  // Hints that [addr, addr + n), a part of a loaded record that still holds
+  // what was read from the file, will not be accessed soon
+  virtual void discard(char* addr __attribute__((unused)), size_t n __attribute__((unused))) {}
+
+  // Memory for what recovering a record builds beside the record itself, such
+  // as the wrappers of a model node's children. Like the records, it lives as
+  // long as the pager.
+  void* allocate_recovered(size_t num_bytes) {
+    num_bytes = flat_align_up(num_bytes, alignof(std::max_align_t));
+    std::lock_guard<std::mutex> guard(recovered_mutex_);
+    if (num_bytes > kRecoveredBlockSize) {
+      // A block of its own, which leaves the current block to the others
+      recovered_blocks_.emplace(recovered_blocks_.begin(), new char[num_bytes]);
+      return recovered_blocks_.front().get();
+    }
+    if (num_bytes > kRecoveredBlockSize - recovered_used_) {
+      recovered_blocks_.emplace_back(new char[kRecoveredBlockSize]);
+      recovered_used_ = 0;
+    }
+    char* addr = recovered_blocks_.back().get() + recovered_used_;
+    recovered_used_ += num_bytes;
+    return addr;
+  }
+
+private:
+  static constexpr size_t kRecoveredBlockSize = 64 << 10;
+
+  std::mutex recovered_mutex_;
+  std::vector<std::unique_ptr<char[]>> recovered_blocks_;
+  size_t recovered_used_ = kRecoveredBlockSize;
 };
 
+// Writes records to a page file, from several threads at once if need be
+// (see AlexNode::save_flat). Every thread packs its records into a buffer
+// that mirrors an extent of the file, which it reserved with an atomic bump of
+// the file size, and writes the whole buffer with one pwrite once the extent
+// is full. The records of a thread thus stay contiguous, and what is left at
+// the end of an extent remains a hole of zeros.
 template<class T, class P>
 class WritePager : public Pager<T, P> {
 private:
-  std::ofstream file_;
-  size_t current_size_;
+  // Extents are at least this large and aligned to this, or to the page size
+  static constexpr size_t kExtentSize = 4 << 20;
+  static constexpr size_t kExtentAlignment = 4096;
+
+  // A thread's extent and the buffer that holds it until it is written
+  struct Shard {
+    size_t offset = 0;   // of the extent in the file
+    size_t used = 0;     // bytes of the extent filled so far
+    size_t written = 0;  // bytes of the extent written to the file so far
+    char* buffer = nullptr;
+  };
+
+  int fd_;
+  FlatFileLayout file_layout_;
+  size_t extent_size_;
+  size_t extent_alignment_;
+  std::atomic<size_t> current_size_{0};  // end of the last reservation
+  uint64_t id_;  // tells pagers apart in the threads' cached shards
+  std::mutex mutex_;  // guards the shards below
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::unordered_map<std::thread::id, Shard*> thread_shards_;
+
 public:
   typedef std::pair<T, P> V;
 
-  explicit WritePager(std::string filename)
-    : file_(filename, std::ios::trunc | std::ios::out | std::ios::binary),
-      current_size_(0) {
-    std::cerr << "WritePager: opened " << filename << std::endl;
+  explicit WritePager(std::string filename, FlatFileLayout file_layout = FlatFileLayout())
+    : file_layout_(file_layout) {
+    this->fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (this->fd_ < 0) {
+      std::cerr << "Error opening " << filename << std::endl;
+      exit(1);
+    }
+    this->extent_alignment_ = std::max(kExtentAlignment, file_layout_.page_size);
+    this->extent_size_ = flat_align_up(kExtentSize, this->extent_alignment_);
+    static std::atomic<uint64_t> next_id{1};
+    this->id_ = next_id.fetch_add(1);
+    std::cerr << "WritePager: opened " << filename << ", page_size= " << file_layout_.page_size
+              << ", separate_payloads= " << file_layout_.separate_payloads << std::endl;
   }
-  
+
+  WritePager(const WritePager&) = delete;
+  WritePager& operator=(const WritePager&) = delete;
+
   virtual ~WritePager() {
-    this->file_.close();
+    flush();
+    for (auto& shard : this->shards_) {
+      free(shard->buffer);
+    }
+    close(this->fd_);
   }
 
   size_t save_t(const T* arr, size_t n) override {
@@ -95,14 +247,133 @@ public:
     return save_inner<char>(arr, n);
   }
 
+  size_t save_record(const char* arr, size_t n) override {
+    Shard* shard = this->shard();
+    size_t start = place_record(shard->offset + shard->used, n) - shard->offset;
+    if (shard->buffer == nullptr || start + n > this->extent_size_) {
+      if (n > this->extent_size_ / 4) {
+        // Would waste too much of an extent, goes to the file right away
+        size_t offset = reserve(n, kFlatRecordAlignment);
+        write_at(arr, n, offset);
+        return offset;
+      }
+      next_extent(shard);
+      start = place_record(shard->offset, n) - shard->offset;
+    }
+    memset(shard->buffer + shard->used, 0, start - shard->used);
+    memcpy(shard->buffer + start, arr, n);
+    shard->used = start + n;
+    return shard->offset + start;
+  }
+
+  // Writes out what the threads buffered. Not safe to call while records are
+  // being saved.
+  void flush() override {
+    std::lock_guard<std::mutex> guard(this->mutex_);
+    for (auto& shard : this->shards_) {
+      write_shard(shard.get());
+    }
+  }
+
+  FlatFileLayout file_layout() const override {
+    return this->file_layout_;
+  }
+
+  bool concurrent_saves() const override { return true; }
+
+  // Bytes reserved in the file so far
+  size_t size() const { return this->current_size_.load(); }
+
+private:
+  // Where a record of n bytes goes if the file ends at offset
+  size_t place_record(size_t offset, size_t n) const {
+    offset = flat_align_up(offset, kFlatRecordAlignment);
+    size_t page_size = this->file_layout_.page_size;
+    if (page_size > 0 && offset % page_size + n > page_size) {
+      offset = flat_align_up(offset, page_size);
+    }
+    return offset;
+  }
+
+  // Atomically appends n bytes, aligned to alignment and placed like a record
+  // if the alignment is kFlatRecordAlignment, to the file. Returns their
+  // offset.
+  size_t reserve(size_t n, size_t alignment) {
+    size_t end = this->current_size_.load(std::memory_order_relaxed);
+    size_t offset;
+    do {
+      offset = (alignment == kFlatRecordAlignment)
+                   ? place_record(end, n)
+                   : flat_align_up(end, alignment);
+    } while (!this->current_size_.compare_exchange_weak(end, offset + n));
+    return offset;
+  }
+
+  // The calling thread's shard, which the thread caches
+  Shard* shard() {
+    thread_local uint64_t cached_id = 0;
+    thread_local Shard* cached_shard = nullptr;
+    if (cached_id != this->id_) {
+      std::lock_guard<std::mutex> guard(this->mutex_);
+      Shard*& shard = this->thread_shards_[std::this_thread::get_id()];
+      if (shard == nullptr) {
+        this->shards_.emplace_back(new Shard());
+        shard = this->shards_.back().get();
+      }
+      cached_id = this->id_;
+      cached_shard = shard;
+    }
+    return cached_shard;
+  }
+
+  // Writes the current extent of shard and reserves the next one
+  void next_extent(Shard* shard) {
+    if (shard->buffer == nullptr) {
+      shard->buffer = static_cast<char*>(aligned_alloc(kExtentAlignment, this->extent_size_));
+      if (shard->buffer == nullptr) {
+        throw std::bad_alloc();
+      }
+    } else {
+      std::lock_guard<std::mutex> guard(this->mutex_);
+      write_shard(shard);
+    }
+    shard->offset = reserve(this->extent_size_, this->extent_alignment_);
+    shard->used = 0;
+    shard->written = 0;
+  }
+
+  // Must hold mutex_. Writes what shard buffered since its last write, from
+  // the start of the block it begins in.
+  void write_shard(Shard* shard) {
+    if (shard->used == shard->written) {
+      return;
+    }
+    size_t begin = shard->written / kExtentAlignment * kExtentAlignment;
+    write_at(shard->buffer + begin, shard->used - begin, shard->offset + begin);
+    shard->written = shard->used;
+  }
+
   template<class K>
   size_t save_inner(const K* arr, size_t n) {
-    size_t offset = this->current_size_;
-    this->file_.write(reinterpret_cast<const char*>(arr), n * sizeof(K));
-    this->current_size_ += n * sizeof(K);
-    // std::cout << "Saving " << n << " * " << sizeof(K) << ", first= " << arr[0] << ", cur= " << this->current_size_ << std::endl;
+    size_t offset = reserve(n * sizeof(K), alignof(K));
+    write_at(reinterpret_cast<const char*>(arr), n * sizeof(K), offset);
     return offset;
   }
+
+  void write_at(const char* buffer, size_t n, size_t offset) {
+    size_t done = 0;
+    while (done < n) {
+      ssize_t ret = pwrite(this->fd_, buffer + done, n - done, offset + done);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("pwrite failed at offset " + std::to_string(offset + done) +
+                                 ": " + strerror(errno));
+      }
+      done += ret;
+    }
+  }
 };
 
 template<class T, class P>
@@ -111,11 +382,23 @@ private:
   int fd_;
   size_t file_size_;
   void* begin_addr_;
+  NodeCache node_cache_;
+  PagerAccess access_;
+  int warm_up_levels_;
+
+  // Records saved through this pager go after the mapped part of the file
+  std::mutex append_mutex_;
+  size_t append_end_;
+  bool appended_ = false;  // since the last flush
 
 public:
   typedef std::pair<T, P> V;
 
-  explicit ReadPager(std::string filename) {
+  // With kWarmInner, warm_up reads the model nodes of the first
+  // warm_up_levels levels, all of them if negative
+  explicit ReadPager(std::string filename, PagerAccess access = PagerAccess::kDefault,
+                     int warm_up_levels = -1)
+    : access_(access), warm_up_levels_(warm_up_levels) {
     // Open file
     int fd = open(filename.c_str(), O_RDWR);
     if (fd < 0) {
@@ -133,12 +416,23 @@ public:
 
     // Mmap to get begin address
     void* begin_addr = nullptr;
-    if (file_size > 0) {
-      begin_addr = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (file_size > 0 && access == PagerAccess::kHugePages) {
+      begin_addr = copy_to_huge_pages(fd, file_size);
+    } else if (file_size > 0) {
+      int flags = MAP_PRIVATE;
+      if (access == PagerAccess::kPopulate) {
+        flags |= MAP_POPULATE;
+      }
+      begin_addr = mmap(NULL, file_size, PROT_READ | PROT_WRITE, flags, fd, 0);
       if (begin_addr == MAP_FAILED) {
         std::cerr << "Error mmap data" << std::endl;
         exit(1);
       }
+      if (access == PagerAccess::kRandom) {
+        madvise(begin_addr, file_size, MADV_RANDOM);
+      } else if (access == PagerAccess::kSequential) {
+        madvise(begin_addr, file_size, MADV_SEQUENTIAL);
+      }
     } else {
       std::cerr << "Warning: mmap file is empty" << std::endl;
     }
@@ -147,11 +441,14 @@ public:
     this->fd_ = fd;
     this->file_size_ = file_size;
     this->begin_addr_ = begin_addr;
+    this->append_end_ = flat_align_up(file_size, 4096);
     std::cerr << "ReadPager: fd_= " << fd_ << ", file_size_= " << file_size_ << ", begin_addr_= " << begin_addr_ << std::endl;
   }
 
   virtual ~ReadPager() {
-    if (this->begin_addr_ != NULL) {
+    if (this->begin_addr_ != NULL && this->access_ == PagerAccess::kHugePages) {
+      unmap_huge_pages(this->begin_addr_, this->file_size_);
+    } else if (this->begin_addr_ != NULL) {
       munmap(this->begin_addr_, this->file_size_);
     }
     if (this->fd_ != -1) {
@@ -179,10 +476,405 @@ public:
     return load_inner<char>(offset);
   }
 
+  // The mapping is private and writable, so the record can host its node
+  virtual char* load_record(size_t offset, size_t num_bytes __attribute__((unused))) override {
+    return load_inner<char>(offset);
+  }
+
+  // Starts paging in the record so that the first access does not block on
+  // it, which lets the reads of several records overlap
+  void prefetch_record(size_t offset, size_t num_bytes) override {
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t begin = offset / page_size * page_size;
+    size_t end = std::min(flat_align_up(offset + num_bytes, page_size), this->file_size_);
+    if (begin < end) {
+      madvise((char*) this->begin_addr_ + begin, end - begin, MADV_WILLNEED);
+    }
+  }
+
+  // Only the part of the record that recovery touches has to be resident:
+  // all of a model node record, but only the header and object of a data
+  // node, whose arrays are checked with try_access as they are searched
+  char* try_load_record(size_t offset, size_t num_bytes __attribute__((unused))) override {
+    char* record = load_inner<char>(offset);
+    size_t header_size = std::max(sizeof(FlatModelNodeHeader), sizeof(FlatDataNodeHeader<T>));
+    if (!try_access(record, header_size)) {
+      return nullptr;
+    }
+    auto header = reinterpret_cast<const FlatNodeHeader*>(record);
+    size_t needed = header->record_size;
+    if (header->magic == kFlatDataNodeMagic) {
+      needed = reinterpret_cast<const FlatDataNodeHeader<T>*>(record)->bitmap_offset;
+    }
+    return try_access(record, needed) ? record : nullptr;
+  }
+
+  // Checks residency with mincore, which also counts pages that are in the
+  // page cache but not yet mapped into this process
+  bool try_access(const char* addr, size_t n) override {
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    uintptr_t begin = reinterpret_cast<uintptr_t>(addr) / page_size * page_size;
+    uintptr_t end = flat_align_up(reinterpret_cast<uintptr_t>(addr) + n, page_size);
+    size_t num_pages = (end - begin) / page_size;
+    unsigned char small_vec[16];
+    std::vector<unsigned char> large_vec;
+    unsigned char* vec = small_vec;
+    if (num_pages > sizeof(small_vec)) {
+      large_vec.resize(num_pages);
+      vec = large_vec.data();
+    }
+    if (mincore(reinterpret_cast<void*>(begin), end - begin, vec) != 0) {
+      return true;  // let the access fault the pages in
+    }
+    for (size_t i = 0; i < num_pages; i++) {
+      if (!(vec[i] & 1)) {
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_WILLNEED);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  NodeCache* node_cache() override {
+    return &this->node_cache_;
+  }
+
+  // Appends the record to the file, past the mapping, so that an index
+  // loaded through this pager can save what changed (see Alex::checkpoint).
+  // The record cannot be loaded through this pager, only by a pager that
+  // opens the file afterwards.
+  size_t save_record(const char* arr, size_t n) override {
+    std::lock_guard<std::mutex> guard(this->append_mutex_);
+    size_t offset = flat_align_up(this->append_end_, kFlatRecordAlignment);
+    size_t done = 0;
+    while (done < n) {
+      ssize_t ret = pwrite(this->fd_, arr + done, n - done, offset + done);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("pwrite failed at offset " + std::to_string(offset + done) +
+                                 ": " + strerror(errno));
+      }
+      done += ret;
+    }
+    this->append_end_ = offset + n;
+    this->appended_ = true;
+    return offset;
+  }
+
+  // Makes the appended records durable
+  void flush() override {
+    std::lock_guard<std::mutex> guard(this->append_mutex_);
+    if (this->appended_ && fdatasync(this->fd_) != 0) {
+      throw std::runtime_error(std::string("fdatasync failed: ") + strerror(errno));
+    }
+    this->appended_ = false;
+  }
+
+  bool concurrent_saves() const override { return true; }
+
+  // With kWarmInner, reads the model node records one level at a time, as
+  // the runs in each record tell which children are model nodes. The reads of
+  // a level are all started before waiting on any of them.
+  void warm_up(size_t root_offset) override {
+    if (this->access_ != PagerAccess::kWarmInner || this->begin_addr_ == nullptr) {
+      return;
+    }
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    std::vector<FlatRecordRef> level = {{root_offset, 0}};
+    for (int l = 0; !level.empty() && l != this->warm_up_levels_; l++) {
+      for (const FlatRecordRef& ref : level) {
+        if (ref.num_bytes > 0) {
+          prefetch_record(ref.offset, ref.num_bytes);
+        }
+      }
+      std::vector<FlatRecordRef> next_level;
+      for (const FlatRecordRef& ref : level) {
+        char* record = load_inner<char>(ref.offset);
+        auto header = reinterpret_cast<const FlatModelNodeHeader*>(record);
+        if (header->node.magic != kFlatModelNodeMagic) {
+          continue;  // the root is a data node
+        }
+        // Fault the pages in, rather than leaving them to the first queries
+        volatile char sink;
+        for (size_t i = 0; i < header->node.record_size; i += page_size) {
+          sink = record[i];
+        }
+        (void) sink;
+        auto runs = reinterpret_cast<const FlatChildRun*>(record + header->runs_offset);
+        for (int r = 0; r < header->num_runs; r++) {
+          if (!runs[r].is_leaf) {
+            next_level.push_back({runs[r].offset, runs[r].num_bytes});
+          }
+        }
+      }
+      level.swap(next_level);
+    }
+  }
+
+  // Bounds the bytes of data node records recovered through this pager that
+  // stay in memory. Cold nodes that were not modified are evicted and
+  // recovered again on their next access, so payloads must not be updated
+  // through pointers or iterators while a budget is set.
+  void set_node_cache_budget(size_t num_bytes) {
+    this->node_cache_.set_budget(num_bytes);
+  }
+
+  // The mapping is private, so dropping the pages reverts them to the file
+  // contents, which by contract is what they hold already. A copy on huge
+  // pages would be zeroed instead, so it is kept whole.
+  void discard(char* addr, size_t n) override {
+    if (this->access_ == PagerAccess::kHugePages) {
+      return;
+    }
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    uintptr_t begin = flat_align_up(reinterpret_cast<uintptr_t>(addr), page_size);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(addr) + n) / page_size * page_size;
+    if (begin < end) {
+      madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+    }
+  }
+
   template<class K>
   K* load_inner(size_t offset) {
     // Only arithmetic, no loading yet
     return reinterpret_cast<K*>((char*) this->begin_addr_ + offset);
   }
+
+private:
+  // Reads the file into anonymous memory on huge pages, which is private and
+  // writable like the mapping of the other access modes
+  static void* copy_to_huge_pages(int fd, size_t file_size) {
+    void* addr = nullptr;
+    try {
+      addr = map_huge_pages(file_size);
+    } catch (const std::bad_alloc&) {
+      std::cerr << "Error mapping huge pages" << std::endl;
+      exit(1);
+    }
+    size_t done = 0;
+    while (done < file_size) {
+      ssize_t ret = pread(fd, (char*) addr + done, file_size - done, done);
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        std::cerr << "Error reading data" << std::endl;
+        exit(1);
+      }
+      done += ret;
+    }
+    return addr;
+  }
+};
+
+// Reads each node record with pread into memory owned by the pager, instead of
+// mapping the file. Only the bytes of records that are actually recovered are
+// read, in a single request per record, and the file contents never go
+// through the page cache with direct_io. Records stay in memory until the
+// pager is destroyed, so this pager has no node cache.
+template<class T, class P>
+class PreadReadPager : public Pager<T, P> {
+private:
+  // Records are read into chunks of this size, larger records get a buffer of
+  // their own
+  static constexpr size_t kChunkSize = 4 << 20;
+  // O_DIRECT requires offsets, sizes and buffers aligned to the logical block
+  // size, which is at most a page on the devices we care about
+  static constexpr size_t kDirectAlignment = 4096;
+
+  int fd_;
+  size_t file_size_;
+  size_t alignment_;  // of file offsets and sizes of every read
+
+  std::mutex mutex_;  // guards the buffers below
+  std::vector<char*> buffers_;
+  char* chunk_cur_ = nullptr;
+  char* chunk_end_ = nullptr;
+
+  std::atomic<long long> num_reads_{0};
+  std::atomic<long long> num_bytes_read_{0};
+
+public:
+  typedef std::pair<T, P> V;
+
+  explicit PreadReadPager(std::string filename, bool direct_io = false) {
+    int flags = O_RDONLY;
+    if (direct_io) {
+      flags |= O_DIRECT;
+    }
+    int fd = open(filename.c_str(), flags);
+    if (fd < 0) {
+      std::cerr << "Error opening " << filename << std::endl;
+      exit(1);
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+      std::cerr << "Error obtaining fstat" << std::endl;
+      exit(1);
+    }
+
+    this->fd_ = fd;
+    this->file_size_ = sb.st_size;
+    this->alignment_ = direct_io ? kDirectAlignment : kFlatRecordAlignment;
+    std::cerr << "PreadReadPager: fd_= " << fd_ << ", file_size_= " << file_size_ << ", direct_io= " << direct_io << std::endl;
+  }
+
+  virtual ~PreadReadPager() {
+    for (char* buffer : this->buffers_) {
+      free(buffer);
+    }
+    if (this->fd_ != -1) {
+      close(this->fd_);
+    }
+  }
+
+  // Reads the record into a buffer whose offset modulo alignment_ matches the
+  // file, so the record keeps the alignment of its fields
+  virtual char* load_record(size_t offset, size_t num_bytes) override {
+    if (num_bytes == 0) {
+      num_bytes = read_record_size(offset);
+    }
+    size_t begin = offset / this->alignment_ * this->alignment_;
+    size_t end = flat_align_up(offset + num_bytes, this->alignment_);
+    char* buffer = allocate(end - begin);
+    read_fully(buffer, begin, end - begin);
+    return buffer + (offset - begin);
+  }
+
+  // Lets the kernel read ahead into the page cache. Has no effect with
+  // direct_io, where each record is read synchronously on first access.
+  void prefetch_record(size_t offset, size_t num_bytes) override {
+    posix_fadvise(this->fd_, offset, num_bytes, POSIX_FADV_WILLNEED);
+  }
+
+  // Copies the record only if it is in the page cache already, otherwise
+  // starts reading it ahead. Blocks with direct_io, and for records of
+  // unknown size.
+  char* try_load_record(size_t offset, size_t num_bytes) override {
+#ifdef RWF_NOWAIT
+    if (this->alignment_ != kFlatRecordAlignment || num_bytes == 0) {
+      return load_record(offset, num_bytes);
+    }
+    size_t begin = offset / this->alignment_ * this->alignment_;
+    size_t end = flat_align_up(offset + num_bytes, this->alignment_);
+    char* buffer = allocate(end - begin);
+    size_t done = 0;
+    while (done < end - begin) {
+      struct iovec iov = {buffer + done, end - begin - done};
+      ssize_t ret = preadv2(this->fd_, &iov, 1, begin + done, RWF_NOWAIT);
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret < 0 && errno == EAGAIN) {
+        release(buffer, end - begin);
+        prefetch_record(begin + done, end - begin - done);
+        return nullptr;
+      }
+      if (ret <= 0) {
+        // Not supported by the file system, or at the end of the file
+        read_fully(buffer + done, begin + done, end - begin - done);
+        return buffer + (offset - begin);
+      }
+      done += ret;
+    }
+    this->num_reads_.fetch_add(1, std::memory_order_relaxed);
+    this->num_bytes_read_.fetch_add(end - begin, std::memory_order_relaxed);
+    return buffer + (offset - begin);
+#else
+    return load_record(offset, num_bytes);
+#endif
+  }
+
+  long long num_reads() const { return this->num_reads_.load(); }
+
+  long long num_bytes_read() const { return this->num_bytes_read_.load(); }
+
+private:
+  // For records saved before their size was known to the parent, which is
+  // the case for the root and for nodes referenced from a boost archive
+  size_t read_record_size(size_t offset) {
+    size_t begin = offset / this->alignment_ * this->alignment_;
+    size_t size = flat_align_up(offset + sizeof(FlatNodeHeader), this->alignment_) - begin;
+    void* probe = nullptr;
+    if (posix_memalign(&probe, this->alignment_, size) != 0) {
+      throw std::bad_alloc();
+    }
+    FlatNodeHeader header;
+    try {
+      read_fully(static_cast<char*>(probe), begin, size);
+      memcpy(&header, static_cast<char*>(probe) + (offset - begin), sizeof(header));
+    } catch (...) {
+      free(probe);
+      throw;
+    }
+    free(probe);
+    return header.record_size;
+  }
+
+  // Returns n bytes aligned to alignment_, n being a multiple of it
+  char* allocate(size_t n) {
+    std::lock_guard<std::mutex> guard(this->mutex_);
+    if (n > kChunkSize / 4) {
+      return new_buffer(n);
+    }
+    if (this->chunk_cur_ == nullptr || this->chunk_cur_ + n > this->chunk_end_) {
+      this->chunk_cur_ = new_buffer(kChunkSize);
+      this->chunk_end_ = this->chunk_cur_ + kChunkSize;
+    }
+    char* buffer = this->chunk_cur_;
+    this->chunk_cur_ += n;
+    return buffer;
+  }
+
+  // Gives back the memory that the last call to allocate returned, if nothing
+  // was allocated since
+  void release(char* buffer, size_t n) {
+    std::lock_guard<std::mutex> guard(this->mutex_);
+    if (buffer + n == this->chunk_cur_) {
+      this->chunk_cur_ = buffer;
+    } else if (!this->buffers_.empty() && this->buffers_.back() == buffer) {
+      free(buffer);
+      this->buffers_.pop_back();
+    }
+  }
+
+  // Must hold mutex_
+  char* new_buffer(size_t n) {
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, this->alignment_, n) != 0) {
+      throw std::bad_alloc();
+    }
+    this->buffers_.push_back(static_cast<char*>(buffer));
+    return static_cast<char*>(buffer);
+  }
+
+  // Reads [offset, offset + n) of the file into buffer. The range may extend
+  // past the end of the file by less than alignment_, which reads as zeros.
+  void read_fully(char* buffer, size_t offset, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+      ssize_t ret = pread(this->fd_, buffer + done, n - done, offset + done);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("pread failed at offset " + std::to_string(offset + done) +
+                                 ": " + strerror(errno));
+      }
+      if (ret == 0) {
+        if (offset + done < this->file_size_) {
+          throw std::runtime_error("Unexpected end of file at offset " + std::to_string(offset + done));
+        }
+        memset(buffer + done, 0, n - done);
+        break;
+      }
+      done += ret;
+    }
+    this->num_reads_.fetch_add(1, std::memory_order_relaxed);
+    this->num_bytes_read_.fetch_add(n, std::memory_order_relaxed);
+  }
 };
 }  // namespace alex
\ No newline at end of file
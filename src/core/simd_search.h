@@ -0,0 +1,199 @@
+/* This file contains the vector kernels that data nodes use to search their
+ * key slots (see AlexDataNode::exponential_search_upper_bound).
+ *
+ * Key slots are sorted, with gaps holding the key of the next slot, so the
+ * offset of a lower or upper bound in a short range of slots is the number of
+ * keys in the range that are below the search key. A kernel counts them 8
+ * keys per instruction with AVX-512, or 4 with AVX2, and stops at the first
+ * vector that is not entirely below.
+ *
+ * The kernels are chosen at compile time from the instruction sets that the
+ * compiler targets (-march=native in the default build). Only 64-bit integer
+ * and double keys have kernels. Define ALEX_SIMD_SEARCH to 0 to always use
+ * the scalar search.
+ */
+
+#pragma once
+
+#include <immintrin.h>
+#include <stdint.h>
+
+#ifndef ALEX_SIMD_SEARCH
+#define ALEX_SIMD_SEARCH 1
+#endif
+
+namespace alex {
+
+// Loads and compares vectors of keys of type T. kSupported is false for key
+// types without a kernel.
+template <class T>
+struct SimdKeys {
+  static constexpr bool kSupported = false;
+};
+
+#if ALEX_SIMD_SEARCH && defined(__AVX512F__)
+
+template <>
+struct SimdKeys<uint64_t> {
+  static constexpr bool kSupported = true;
+  static constexpr int kWidth = 8;
+  typedef __m512i vector;
+
+  static vector broadcast(uint64_t key) { return _mm512_set1_epi64(key); }
+
+  // Bit i is set if keys[i] is below key, for i < n. Slots from n on are not
+  // read.
+  template <bool kInclusive>
+  static unsigned below(const uint64_t* keys, int n, vector key) {
+    __mmask8 valid = (n >= kWidth) ? 0xFF : static_cast<__mmask8>((1u << n) - 1);
+    __m512i v = _mm512_maskz_loadu_epi64(valid, keys);
+    return kInclusive ? _mm512_mask_cmple_epu64_mask(valid, v, key)
+                      : _mm512_mask_cmplt_epu64_mask(valid, v, key);
+  }
+};
+
+template <>
+struct SimdKeys<int64_t> {
+  static constexpr bool kSupported = true;
+  static constexpr int kWidth = 8;
+  typedef __m512i vector;
+
+  static vector broadcast(int64_t key) { return _mm512_set1_epi64(key); }
+
+  template <bool kInclusive>
+  static unsigned below(const int64_t* keys, int n, vector key) {
+    __mmask8 valid = (n >= kWidth) ? 0xFF : static_cast<__mmask8>((1u << n) - 1);
+    __m512i v = _mm512_maskz_loadu_epi64(valid, keys);
+    return kInclusive ? _mm512_mask_cmple_epi64_mask(valid, v, key)
+                      : _mm512_mask_cmplt_epi64_mask(valid, v, key);
+  }
+};
+
+template <>
+struct SimdKeys<double> {
+  static constexpr bool kSupported = true;
+  static constexpr int kWidth = 8;
+  typedef __m512d vector;
+
+  static vector broadcast(double key) { return _mm512_set1_pd(key); }
+
+  template <bool kInclusive>
+  static unsigned below(const double* keys, int n, vector key) {
+    __mmask8 valid = (n >= kWidth) ? 0xFF : static_cast<__mmask8>((1u << n) - 1);
+    __m512d v = _mm512_maskz_loadu_pd(valid, keys);
+    return kInclusive ? _mm512_mask_cmp_pd_mask(valid, v, key, _CMP_LE_OQ)
+                      : _mm512_mask_cmp_pd_mask(valid, v, key, _CMP_LT_OQ);
+  }
+};
+
+#elif ALEX_SIMD_SEARCH && defined(__AVX2__)
+
+// Lanes of a 4 x 64-bit vector that are before n
+inline __m256i simd_lanes_before(int n) {
+  return _mm256_cmpgt_epi64(_mm256_set1_epi64x(n), _mm256_set_epi64x(3, 2, 1, 0));
+}
+
+// AVX2 only compares signed 64-bit integers. Flipping the sign bit of both
+// sides orders unsigned keys the same way.
+template <>
+struct SimdKeys<uint64_t> {
+  static constexpr bool kSupported = true;
+  static constexpr int kWidth = 4;
+  typedef __m256i vector;
+
+  static vector broadcast(uint64_t key) {
+    return _mm256_set1_epi64x(static_cast<int64_t>(key ^ (1ULL << 63)));
+  }
+
+  template <bool kInclusive>
+  static unsigned below(const uint64_t* keys, int n, vector key) {
+    __m256i v;
+    unsigned valid = 0xF;
+    if (n >= kWidth) {
+      v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys));
+    } else {
+      v = _mm256_maskload_epi64(reinterpret_cast<const long long*>(keys),
+                                simd_lanes_before(n));
+      valid = (1u << n) - 1;
+    }
+    v = _mm256_xor_si256(v, _mm256_set1_epi64x(static_cast<int64_t>(1ULL << 63)));
+    return compare<kInclusive>(v, key) & valid;
+  }
+
+  template <bool kInclusive>
+  static unsigned compare(__m256i v, __m256i key) {
+    if (kInclusive) {
+      return ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, key))) & 0xF;
+    }
+    return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(key, v)));
+  }
+};
+
+template <>
+struct SimdKeys<int64_t> {
+  static constexpr bool kSupported = true;
+  static constexpr int kWidth = 4;
+  typedef __m256i vector;
+
+  static vector broadcast(int64_t key) { return _mm256_set1_epi64x(key); }
+
+  template <bool kInclusive>
+  static unsigned below(const int64_t* keys, int n, vector key) {
+    __m256i v;
+    unsigned valid = 0xF;
+    if (n >= kWidth) {
+      v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys));
+    } else {
+      v = _mm256_maskload_epi64(reinterpret_cast<const long long*>(keys),
+                                simd_lanes_before(n));
+      valid = (1u << n) - 1;
+    }
+    return SimdKeys<uint64_t>::compare<kInclusive>(v, key) & valid;
+  }
+};
+
+template <>
+struct SimdKeys<double> {
+  static constexpr bool kSupported = true;
+  static constexpr int kWidth = 4;
+  typedef __m256d vector;
+
+  static vector broadcast(double key) { return _mm256_set1_pd(key); }
+
+  template <bool kInclusive>
+  static unsigned below(const double* keys, int n, vector key) {
+    __m256d v;
+    unsigned valid = 0xF;
+    if (n >= kWidth) {
+      v = _mm256_loadu_pd(keys);
+    } else {
+      v = _mm256_maskload_pd(keys, simd_lanes_before(n));
+      valid = (1u << n) - 1;
+    }
+    __m256d cmp = kInclusive ? _mm256_cmp_pd(v, key, _CMP_LE_OQ)
+                             : _mm256_cmp_pd(v, key, _CMP_LT_OQ);
+    return _mm256_movemask_pd(cmp) & valid;
+  }
+};
+
+#endif
+
+// Number of keys in the sorted keys[0, n) that are less than key, or less
+// than or equal to key with kInclusive
+template <bool kInclusive, class T>
+inline int simd_count_below(const T* keys, int n, T key) {
+  typedef SimdKeys<T> S;
+  typename S::vector key_vector = S::broadcast(key);
+  int count = 0;
+  for (int i = 0; i < n; i += S::kWidth) {
+    // The keys below form a prefix of the vector
+    int num_below = __builtin_popcount(S::template below<kInclusive>(keys + i, n - i, key_vector));
+    count += num_below;
+    if (num_below < S::kWidth) {
+      break;
+    }
+  }
+  return count;
+}
+
+}  // namespace alex
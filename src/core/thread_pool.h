@@ -0,0 +1,210 @@
+/* This file contains the work-stealing thread pool that runs the independent
+ * parts of a bulk load in parallel (see Alex::bulk_load).
+ *
+ * Every worker owns a queue of tasks. A task that spawns more tasks pushes
+ * them to its own worker's queue, which the worker pops from the back, so
+ * that it continues depth-first with the work it just created. Idle workers
+ * steal from the front of the other queues, where the oldest and therefore
+ * largest subtrees are. Tasks are grouped with a TaskGroup; a thread waiting
+ * for a group runs pending tasks in the meantime instead of blocking, so that
+ * nested groups cannot deadlock the pool.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace alex {
+
+class ThreadPool {
+ public:
+  // Starts num_threads - 1 workers. The thread that waits on a TaskGroup is
+  // the last one.
+  explicit ThreadPool(int num_threads) {
+    int num_queues = std::max(num_threads, 1);
+    for (int i = 0; i < num_queues; i++) {
+      queues_.emplace_back(new Queue());
+    }
+    for (int i = 1; i < num_queues; i++) {
+      workers_.emplace_back([this, i] { work(i); });
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> guard(sleep_mutex_);
+      stopping_ = true;
+    }
+    sleep_cv_.notify_all();
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  int num_threads() const { return static_cast<int>(queues_.size()); }
+
+  // Queues fn on the calling worker's queue, or on the first queue for
+  // threads outside the pool
+  void submit(std::function<void()> fn) {
+    int index = (current_pool() == this) ? current_index() : 0;
+    {
+      std::lock_guard<std::mutex> guard(queues_[index]->mutex);
+      queues_[index]->tasks.push_back(std::move(fn));
+    }
+    // Sequentially consistent, like the worker's side, so that either the
+    // worker sees the task or we see the worker asleep
+    num_queued_.fetch_add(1);
+    if (num_sleeping_.load() > 0) {
+      std::lock_guard<std::mutex> guard(sleep_mutex_);
+      sleep_cv_.notify_one();
+    }
+  }
+
+  // Runs one queued task, preferring the calling worker's own queue. Returns
+  // false if there was none.
+  bool run_one() {
+    int own = (current_pool() == this) ? current_index() : 0;
+    std::function<void()> task;
+    if (!pop_back(own, &task)) {
+      bool stolen = false;
+      for (int i = 1; i < num_threads() && !stolen; i++) {
+        stolen = steal_front((own + i) % num_threads(), &task);
+      }
+      if (!stolen) {
+        return false;
+      }
+    }
+    num_queued_.fetch_sub(1, std::memory_order_relaxed);
+    task();
+    return true;
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  static ThreadPool*& current_pool() {
+    thread_local ThreadPool* pool = nullptr;
+    return pool;
+  }
+
+  static int& current_index() {
+    thread_local int index = 0;
+    return index;
+  }
+
+  bool pop_back(int index, std::function<void()>* task) {
+    std::lock_guard<std::mutex> guard(queues_[index]->mutex);
+    if (queues_[index]->tasks.empty()) {
+      return false;
+    }
+    *task = std::move(queues_[index]->tasks.back());
+    queues_[index]->tasks.pop_back();
+    return true;
+  }
+
+  bool steal_front(int index, std::function<void()>* task) {
+    std::lock_guard<std::mutex> guard(queues_[index]->mutex);
+    if (queues_[index]->tasks.empty()) {
+      return false;
+    }
+    *task = std::move(queues_[index]->tasks.front());
+    queues_[index]->tasks.pop_front();
+    return true;
+  }
+
+  void work(int index) {
+    current_pool() = this;
+    current_index() = index;
+    while (true) {
+      if (run_one()) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      num_sleeping_.fetch_add(1);
+      sleep_cv_.wait(lock, [this] { return stopping_ || num_queued_.load() > 0; });
+      num_sleeping_.fetch_sub(1);
+      if (stopping_) {
+        return;
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<int> num_queued_{0};
+  std::atomic<int> num_sleeping_{0};
+  std::mutex sleep_mutex_;
+  std::condition_variable sleep_cv_;
+  bool stopping_ = false;
+};
+
+// Tasks that a caller forks and then joins. Without a pool, tasks run right
+// away on the calling thread.
+class TaskGroup {
+ public:
+  explicit TaskGroup(ThreadPool* pool) : pool_(pool) {}
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+  ~TaskGroup() { wait_quietly(); }
+
+  template <class Fn>
+  void run(Fn&& fn) {
+    if (pool_ == nullptr) {
+      fn();
+      return;
+    }
+    num_pending_.fetch_add(1, std::memory_order_relaxed);
+    pool_->submit([this, fn = std::forward<Fn>(fn)]() mutable {
+      try {
+        fn();
+      } catch (...) {
+        std::lock_guard<std::mutex> guard(error_mutex_);
+        if (!error_) {
+          error_ = std::current_exception();
+        }
+      }
+      num_pending_.fetch_sub(1, std::memory_order_release);
+    });
+  }
+
+  // Runs queued tasks until all tasks of the group finished. Rethrows the
+  // first exception that one of them threw.
+  void wait() {
+    wait_quietly();
+    if (error_) {
+      std::exception_ptr error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+
+ private:
+  void wait_quietly() {
+    while (num_pending_.load(std::memory_order_acquire) > 0) {
+      if (!pool_->run_one()) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  ThreadPool* pool_;
+  std::atomic<int> num_pending_{0};
+  std::mutex error_mutex_;
+  std::exception_ptr error_;
+};
+
+}  // namespace alex
@@ -0,0 +1,470 @@
+/* This file contains the write-ahead log that makes inserts, erases and
+ * payload updates durable between checkpoints of a storage-backed ALEX (see
+ * Alex::set_wal).
+ *
+ * Log file:
+ *   WalFileHeader | WalRecord | WalRecord | ...
+ *
+ * Every record carries a log sequence number (LSN), one more than the record
+ * before it, and a checksum. A record torn by a crash fails its checksum; it
+ * and everything after it are cut off when the log is opened again.
+ *
+ * Writers append records to a buffer in memory. The buffer is written and
+ * synced as one batch, so that many records share a single fdatasync (group
+ * commit): whoever needs a record to be durable becomes the leader of the
+ * next batch if no batch is being written, otherwise waits for the leader,
+ * while the others keep appending to the batch after that. With a commit
+ * interval, writers do not wait at all and a background thread commits the
+ * buffer at least that often, which bounds the records a crash can lose.
+ *
+ * Alex saves the LSN of the last record it applied with each checkpoint, and
+ * replay skips the records up to it, so replaying the same log again does
+ * not apply a record twice. Once a checkpoint is durable, reset() empties the
+ * log.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+#include "flat_node.h"
+
+namespace alex {
+
+constexpr uint32_t kWalMagic = 0x4c574c41;  // "ALWL"
+
+enum class WalOp : uint32_t {
+  kInsert = 1,
+  kErase = 2,     // all keys with the record's key
+  kEraseOne = 3,  // the left-most key with the record's key
+  kEraseAt = 4,   // a key with the record's key, and payload if one matches
+  kUpdate = 5,    // payload of the key that a lookup of the record's key finds
+};
+
+struct WalFileHeader {
+  uint32_t magic;
+  uint32_t record_size;  // depends on the key and payload types
+  uint64_t base_lsn;     // LSN of the last record before the first one here
+};
+
+template <class T, class P>
+struct WalRecord {
+  uint64_t lsn;
+  uint64_t checksum;  // flat_hash_bytes of the rest of the record
+  WalOp op;
+  T key;
+  P payload;
+};
+
+template <class T, class P>
+class WriteAheadLog {
+ public:
+  typedef WalRecord<T, P> record_type;
+
+  static_assert(std::is_trivially_copyable<T>::value &&
+                    std::is_trivially_copyable<P>::value,
+                "Logged keys and payloads are written as raw bytes");
+
+  // Commits every 1ms by default
+  static constexpr long kDefaultCommitIntervalUs = 1000;
+
+  // Buffered records that wake up the background thread before the interval
+  // is over, and that make a writer commit by itself
+  static constexpr size_t kGroupCommitBytes = 1 << 20;
+  static constexpr size_t kMaxBufferBytes = 4 * kGroupCommitBytes;
+
+  // Opens the log at path, or creates an empty one, and cuts off a torn tail.
+  // With commit_interval_us == 0, every log() waits until its record is
+  // durable. Otherwise log() returns right away, and a background thread
+  // commits the buffered records every commit_interval_us.
+  explicit WriteAheadLog(const std::string& path,
+                         long commit_interval_us = kDefaultCommitIntervalUs)
+      : path_(path), commit_interval_us_(commit_interval_us) {
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0) {
+      std::cerr << "Error opening " << path << std::endl;
+      exit(1);
+    }
+    struct stat statbuf;
+    if (fstat(fd_, &statbuf) < 0) {
+      std::cerr << "Error obtaining fstat" << std::endl;
+      exit(1);
+    }
+    if (statbuf.st_size == 0) {
+      write_header(fd_, 0);
+      sync_fd(fd_);
+    } else {
+      recover_end(statbuf.st_size);
+    }
+    if (commit_interval_us_ > 0) {
+      committer_ = std::thread([this] { commit_periodically(); });
+    }
+  }
+
+  WriteAheadLog(const WriteAheadLog&) = delete;
+  WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+  // Commits what is still buffered
+  ~WriteAheadLog() {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      stopping_ = true;
+    }
+    commit_cv_.notify_all();
+    if (committer_.joinable()) {
+      committer_.join();
+    }
+    try {
+      sync();
+    } catch (const std::exception& e) {
+      std::cerr << "Error committing " << path_ << ": " << e.what() << std::endl;
+    }
+    close(fd_);
+  }
+
+  // Appends a record and returns its LSN. Without a commit interval, returns
+  // only once the record is durable. Callers that need the log to follow the
+  // order in which operations changed the index must hold a lock that orders
+  // them.
+  uint64_t log(WalOp op, const T& key, const P& payload) {
+    record_type record;
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.key = key;
+    record.payload = payload;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    check_error();
+    record.lsn = ++last_lsn_;
+    record.checksum = checksum(record);
+    const char* bytes = reinterpret_cast<const char*>(&record);
+    buffer_.insert(buffer_.end(), bytes, bytes + sizeof(record));
+    num_records_++;
+    if (commit_interval_us_ == 0 || buffer_.size() >= kMaxBufferBytes) {
+      commit(&lock, record.lsn);
+    } else if (buffer_.size() >= kGroupCommitBytes) {
+      commit_cv_.notify_one();
+    }
+    return record.lsn;
+  }
+
+  // Waits until every record logged so far is durable
+  void sync() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    commit(&lock, last_lsn_);
+  }
+
+  // Calls fn(record) on every record in the file with an LSN greater than
+  // after_lsn, in order. Records logged since the log was opened are included
+  // only once committed.
+  template <class Fn>
+  void replay(uint64_t after_lsn, Fn fn) const {
+    std::vector<char> chunk(kGroupCommitBytes / sizeof(record_type) * sizeof(record_type));
+    size_t end;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      end = file_end_;
+    }
+    size_t offset = sizeof(WalFileHeader);
+    while (offset < end) {
+      size_t n = std::min(chunk.size(), end - offset);
+      read_at(fd_, chunk.data(), n, offset);
+      for (size_t i = 0; i + sizeof(record_type) <= n; i += sizeof(record_type)) {
+        record_type record;
+        memcpy(&record, chunk.data() + i, sizeof(record));
+        if (record.lsn > after_lsn) {
+          fn(record);
+        }
+      }
+      offset += n;
+    }
+  }
+
+  // Empties the log, e.g. once a checkpoint that covers all its records is
+  // durable. LSNs continue where they were. The empty log replaces the old
+  // one atomically. Records that writers log while the log is reset are kept
+  // in the new one.
+  void reset() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    uint64_t base_lsn = last_lsn_;
+    commit(&lock, base_lsn);
+    // Writers may have logged more records while the commit was writing, and
+    // one of them may be committing those to the old file
+    while (committing_) {
+      durable_cv_.wait(lock);
+    }
+    check_error();
+    // The records after base_lsn that are already in the old file move to the
+    // new one, the others are still buffered
+    size_t carried_offset =
+        sizeof(WalFileHeader) + (base_lsn - base_lsn_) * sizeof(record_type);
+    std::vector<char> carried(file_end_ - carried_offset);
+    if (!carried.empty()) {
+      read_at(fd_, carried.data(), carried.size(), carried_offset);
+    }
+    std::string tmp_path = path_ + ".tmp";
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      throw std::runtime_error("Error opening " + tmp_path + ": " + strerror(errno));
+    }
+    try {
+      write_header(fd, base_lsn);
+      write_at(fd, carried.data(), carried.size(), sizeof(WalFileHeader));
+      sync_fd(fd);
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    if (rename(tmp_path.c_str(), path_.c_str()) != 0) {
+      close(fd);
+      throw std::runtime_error("Error renaming " + tmp_path + ": " + strerror(errno));
+    }
+    sync_parent_dir();
+    close(fd_);
+    fd_ = fd;
+    base_lsn_ = base_lsn;
+    file_end_ = sizeof(WalFileHeader) + carried.size();
+  }
+
+  // LSN of the last record before the first one in the file
+  uint64_t base_lsn() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return base_lsn_;
+  }
+
+  // LSN of the last record logged, 0 if there never was one
+  uint64_t last_lsn() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return last_lsn_;
+  }
+
+  // Records logged and fdatasyncs made since the log was opened. Their ratio
+  // is the average size of a commit group.
+  long long num_records() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return num_records_;
+  }
+
+  long long num_syncs() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return num_syncs_;
+  }
+
+ private:
+  // Hashes the bytes around the checksum field, padding included, which
+  // log() zeroes
+  static uint64_t checksum(const record_type& record) {
+    auto bytes = reinterpret_cast<const char*>(&record);
+    size_t field = offsetof(record_type, checksum);
+    size_t rest = field + sizeof(record.checksum);
+    uint64_t hash = flat_hash_bytes(bytes, field);
+    return flat_hash_bytes(bytes + rest, sizeof(record) - rest, hash);
+  }
+
+  static void write_header(int fd, uint64_t base_lsn) {
+    WalFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kWalMagic;
+    header.record_size = sizeof(record_type);
+    header.base_lsn = base_lsn;
+    write_at(fd, reinterpret_cast<const char*>(&header), sizeof(header), 0);
+  }
+
+  static void write_at(int fd, const char* arr, size_t n, size_t offset) {
+    size_t done = 0;
+    while (done < n) {
+      ssize_t ret = pwrite(fd, arr + done, n - done, offset + done);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("pwrite failed at offset " + std::to_string(offset + done) +
+                                 ": " + strerror(errno));
+      }
+      done += ret;
+    }
+  }
+
+  static void read_at(int fd, char* arr, size_t n, size_t offset) {
+    size_t done = 0;
+    while (done < n) {
+      ssize_t ret = pread(fd, arr + done, n - done, offset + done);
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        throw std::runtime_error("pread failed at offset " + std::to_string(offset + done) +
+                                 ": " + (ret < 0 ? strerror(errno) : "end of file"));
+      }
+      done += ret;
+    }
+  }
+
+  static void sync_fd(int fd) {
+    if (fdatasync(fd) != 0) {
+      throw std::runtime_error(std::string("fdatasync failed: ") + strerror(errno));
+    }
+  }
+
+  // Makes a rename in the log's directory durable
+  void sync_parent_dir() const {
+    size_t slash = path_.rfind('/');
+    std::string dir = (slash == std::string::npos) ? "." : path_.substr(0, slash + 1);
+    int fd = open(dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+  }
+
+  // Finds the last valid record of an existing log, and truncates what
+  // follows it
+  void recover_end(size_t file_size) {
+    WalFileHeader header;
+    if (file_size < sizeof(header)) {
+      std::cerr << "Error: " << path_ << " is not a write-ahead log" << std::endl;
+      exit(1);
+    }
+    read_at(fd_, reinterpret_cast<char*>(&header), sizeof(header), 0);
+    if (header.magic != kWalMagic) {
+      std::cerr << "Error: " << path_ << " is not a write-ahead log" << std::endl;
+      exit(1);
+    }
+    if (header.record_size != sizeof(record_type)) {
+      std::cerr << "Error: " << path_ << " was written with different key or payload types"
+                << std::endl;
+      exit(1);
+    }
+    base_lsn_ = header.base_lsn;
+    last_lsn_ = header.base_lsn;
+    file_end_ = sizeof(header);
+    std::vector<char> chunk(kGroupCommitBytes / sizeof(record_type) * sizeof(record_type));
+    bool torn = false;
+    while (!torn && file_end_ + sizeof(record_type) <= file_size) {
+      size_t n = std::min(chunk.size(), (file_size - file_end_) / sizeof(record_type) *
+                                            sizeof(record_type));
+      read_at(fd_, chunk.data(), n, file_end_);
+      for (size_t i = 0; i < n; i += sizeof(record_type)) {
+        record_type record;
+        memcpy(&record, chunk.data() + i, sizeof(record));
+        if (record.lsn != last_lsn_ + 1 || record.checksum != checksum(record)) {
+          torn = true;
+          break;
+        }
+        last_lsn_ = record.lsn;
+        file_end_ += sizeof(record_type);
+      }
+    }
+    if (file_end_ < file_size) {
+      if (ftruncate(fd_, file_end_) != 0) {
+        std::cerr << "Error truncating " << path_ << std::endl;
+        exit(1);
+      }
+      sync_fd(fd_);
+    }
+    durable_lsn_ = last_lsn_;
+  }
+
+  // Must hold lock. Returns once the record with the given LSN is durable,
+  // writing the buffered records as the leader of a commit group if no other
+  // thread is doing so.
+  void commit(std::unique_lock<std::mutex>* lock, uint64_t lsn) {
+    while (durable_lsn_ < lsn) {
+      check_error();
+      if (committing_) {
+        durable_cv_.wait(*lock);
+        continue;
+      }
+      committing_ = true;
+      std::vector<char> batch;
+      batch.swap(buffer_);
+      buffer_.swap(spare_buffer_);
+      uint64_t batch_lsn = last_lsn_;
+      size_t offset = file_end_;
+      int fd = fd_;
+      lock->unlock();
+      std::string error;
+      try {
+        write_at(fd, batch.data(), batch.size(), offset);
+        sync_fd(fd);
+      } catch (const std::exception& e) {
+        error = e.what();
+      }
+      lock->lock();
+      committing_ = false;
+      if (error.empty()) {
+        durable_lsn_ = batch_lsn;
+        file_end_ = offset + batch.size();
+        num_syncs_++;
+      } else {
+        // The records are lost, so must be the ones that follow them
+        error_ = error;
+      }
+      batch.clear();
+      spare_buffer_.swap(batch);
+      durable_cv_.notify_all();
+    }
+  }
+
+  // Must hold mutex_. A failed commit fails every later call.
+  void check_error() const {
+    if (!error_.empty()) {
+      throw std::runtime_error("Write-ahead log " + path_ + " failed: " + error_);
+    }
+  }
+
+  void commit_periodically() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      commit_cv_.wait_for(lock, std::chrono::microseconds(commit_interval_us_), [this] {
+        return stopping_ || buffer_.size() >= kGroupCommitBytes;
+      });
+      if (error_.empty() && durable_lsn_ < last_lsn_) {
+        try {
+          commit(&lock, last_lsn_);
+        } catch (const std::exception&) {
+          // Reported to the writers by check_error
+        }
+      }
+    }
+  }
+
+  std::string path_;
+  long commit_interval_us_;
+  int fd_ = -1;
+
+  mutable std::mutex mutex_;
+  std::condition_variable commit_cv_;   // wakes up the background thread
+  std::condition_variable durable_cv_;  // signals that a commit finished
+  std::vector<char> buffer_;            // records after durable_lsn_
+  std::vector<char> spare_buffer_;      // the previous batch, for reuse
+  bool committing_ = false;
+  bool stopping_ = false;
+  std::string error_;
+  uint64_t base_lsn_ = 0;
+  uint64_t last_lsn_ = 0;
+  uint64_t durable_lsn_ = 0;
+  size_t file_end_ = sizeof(WalFileHeader);
+  long long num_records_ = 0;
+  long long num_syncs_ = 0;
+  std::thread committer_;
+};
+
+}  // namespace alex
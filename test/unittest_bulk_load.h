@@ -0,0 +1,306 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include "doctest.h"
+
+#include <cstdio>
+#include <map>
+#include <random>
+
+#include "alex.h"
+
+using namespace alex;
+
+namespace {
+
+typedef Alex<uint64_t, uint64_t> BulkLoadIndex;
+
+// Sorted keys with a skewed distribution, so that the tree has model nodes of
+// different fanouts at several levels
+std::vector<BulkLoadIndex::V> skewed_values(int num_keys, int seed) {
+  std::mt19937_64 gen(seed);
+  std::lognormal_distribution<double> dist(0, 2);
+  std::vector<BulkLoadIndex::V> values;
+  for (int i = 0; i < num_keys; i++) {
+    values.emplace_back(static_cast<uint64_t>(dist(gen) * 1e9), i);
+  }
+  std::sort(values.begin(), values.end());
+  return values;
+}
+
+// Checks that two indexes have the same nodes, in the same places
+void check_same_tree(const BulkLoadIndex& index, const BulkLoadIndex& other) {
+  CHECK_EQ(index.get_stats().num_model_nodes,
+           other.get_stats().num_model_nodes);
+  CHECK_EQ(index.get_stats().num_data_nodes, other.get_stats().num_data_nodes);
+  BulkLoadIndex::NodeIterator it(&index);
+  BulkLoadIndex::NodeIterator other_it(&other);
+  for (; !it.is_end() && !other_it.is_end(); it.next(), other_it.next()) {
+    AlexNode<uint64_t, uint64_t>* node = it.current();
+    AlexNode<uint64_t, uint64_t>* other_node = other_it.current();
+    REQUIRE_EQ(node->is_leaf_, other_node->is_leaf_);
+    CHECK_EQ(node->level_, other_node->level_);
+    CHECK_EQ(node->duplication_factor_, other_node->duplication_factor_);
+    CHECK_EQ(node->model_.a_, other_node->model_.a_);
+    CHECK_EQ(node->model_.b_, other_node->model_.b_);
+    CHECK_EQ(node->cost_, other_node->cost_);
+    if (!node->is_leaf_) {
+      auto model_node = static_cast<BulkLoadIndex::model_node_type*>(node);
+      auto other_model_node =
+          static_cast<BulkLoadIndex::model_node_type*>(other_node);
+      CHECK_EQ(model_node->num_children_, other_model_node->num_children_);
+      continue;
+    }
+    auto data_node = static_cast<BulkLoadIndex::data_node_type*>(node);
+    auto other_data_node =
+        static_cast<BulkLoadIndex::data_node_type*>(other_node);
+    REQUIRE_EQ(data_node->data_capacity_, other_data_node->data_capacity_);
+    CHECK_EQ(data_node->num_keys_, other_data_node->num_keys_);
+    for (int i = 0; i < data_node->data_capacity_; i++) {
+      REQUIRE_EQ(data_node->check_exists(i), other_data_node->check_exists(i));
+      CHECK_EQ(data_node->get_key(i), other_data_node->get_key(i));
+      if (data_node->check_exists(i)) {
+        CHECK_EQ(data_node->get_payload(i), other_data_node->get_payload(i));
+      }
+    }
+  }
+  CHECK(it.is_end());
+  CHECK(other_it.is_end());
+}
+
+// Streams keys, where keys[i] gets payload i, into an index saved to a page
+// file, and checks that the index loaded again holds them in order
+void check_streaming_bulk_load(const std::vector<uint64_t>& keys,
+                               int window_keys) {
+  const std::string page_path = "unittest_streaming_page";
+  const std::string index_path = "unittest_streaming_index";
+  {
+    WritePager<uint64_t, uint64_t> pager(page_path);
+    BulkLoadIndex index(&pager);
+    index.set_max_node_size(1 << 14);
+    index.bulk_load_streaming(
+        keys.data(), static_cast<int>(keys.size()),
+        [](int i) { return static_cast<uint64_t>(i); }, window_keys);
+    CHECK_EQ(index.size(), keys.size());
+    std::ofstream ofs(index_path);
+    boost::archive::binary_oarchive oa(ofs);
+    oa << index;
+  }
+  {
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    BulkLoadIndex index(&pager);
+    std::ifstream ifs(index_path);
+    boost::archive::binary_iarchive ia(ifs);
+    ia >> index;
+    CHECK_EQ(index.size(), keys.size());
+    size_t i = 0;
+    for (auto it = index.begin(); !it.is_end(); it++, i++) {
+      REQUIRE_LT(i, keys.size());
+      CHECK_EQ(it.key(), keys[i]);
+      CHECK_EQ(it.payload(), i);
+    }
+    CHECK_EQ(i, keys.size());
+    for (uint64_t key : keys) {
+      uint64_t* payload = index.get_payload(key);
+      REQUIRE(payload != nullptr);
+      CHECK_EQ(keys[*payload], key);
+    }
+  }
+  std::remove(page_path.c_str());
+  std::remove(index_path.c_str());
+}
+
+// Sorted values of a bulk_insert batch, which fall with a skewed distribution
+// around center, and repeat each key `copies` times. Payloads count up from
+// first_payload.
+std::vector<BulkLoadIndex::V> skewed_batch(int num_keys, int copies,
+                                           uint64_t center,
+                                           uint64_t first_payload,
+                                           std::mt19937_64& gen) {
+  std::lognormal_distribution<double> dist(0, 1.5);
+  std::vector<uint64_t> keys;
+  for (int i = 0; i < num_keys; i++) {
+    keys.push_back(center + static_cast<uint64_t>(dist(gen) * 1e5));
+  }
+  std::sort(keys.begin(), keys.end());
+  std::vector<BulkLoadIndex::V> values;
+  for (uint64_t key : keys) {
+    for (int c = 0; c < copies; c++) {
+      values.emplace_back(key, first_payload + values.size());
+    }
+  }
+  return values;
+}
+
+// Checks that index holds the keys and payloads of ref, in the same order,
+// and that none of its data nodes is larger than max_node_size allows
+template <class Index, class Map>
+void check_bulk_inserted(Index& index, const Map& ref, int max_node_size) {
+  CHECK(index.validate_structure(true));
+  CHECK_EQ(index.size(), ref.size());
+  auto ref_it = ref.begin();
+  for (auto it = index.begin(); !it.is_end(); it++, ++ref_it) {
+    REQUIRE(ref_it != ref.end());
+    CHECK_EQ(it.key(), ref_it->first);
+    CHECK_EQ(it.payload(), ref_it->second);
+  }
+  CHECK(ref_it == ref.end());
+  int max_data_node_slots =
+      max_node_size / static_cast<int>(sizeof(typename Index::V));
+  for (typename Index::NodeIterator node_it(&index); !node_it.is_end();
+       node_it.next()) {
+    if (node_it.current()->is_leaf_) {
+      auto data_node =
+          static_cast<typename Index::data_node_type*>(node_it.current());
+      CHECK_LE(data_node->data_capacity_, max_data_node_slots);
+    }
+  }
+}
+
+}  // namespace
+
+TEST_SUITE("BulkLoad") {
+
+TEST_CASE("TestParallelBulkLoadMatchesSerial") {
+  // Model nodes with at least 64K keys build their children in parallel
+  std::vector<BulkLoadIndex::V> values = skewed_values(400000, 11);
+  for (int max_node_size : {1 << 14, 1 << 16, 1 << 24}) {
+    BulkLoadIndex serial(nullptr);
+    serial.set_max_node_size(max_node_size);
+    serial.bulk_load(values.data(), static_cast<int>(values.size()));
+    for (int num_threads : {2, 4}) {
+      BulkLoadIndex parallel(nullptr);
+      parallel.set_max_node_size(max_node_size);
+      parallel.bulk_load(values.data(), static_cast<int>(values.size()),
+                         num_threads);
+      CHECK(parallel.validate_structure(true));
+      check_same_tree(serial, parallel);
+    }
+  }
+}
+
+TEST_CASE("TestStreamingBulkLoadWindows") {
+  // Runs of equal keys, one of them longer than the smaller windows but
+  // short enough for a data node
+  std::vector<uint64_t> keys;
+  for (int i = 0; i < 20000; i++) {
+    keys.push_back(i < 8000 || i >= 8600 ? i / 3 * 10 : 8000 / 3 * 10 + 5);
+  }
+  std::sort(keys.begin(), keys.end());
+  int num_keys = static_cast<int>(keys.size());
+  // One window for all keys, one key too few, windows that split the keys
+  // into parts at and off the run boundaries, and a single key per window
+  for (int window_keys : {num_keys, num_keys - 1, 1000, 500, 499, 1}) {
+    check_streaming_bulk_load(keys, window_keys);
+  }
+}
+
+TEST_CASE("TestStreamingBulkLoadSingleKey") {
+  // Keys that are all equal cannot be split into windows. They still have to
+  // fit in a data node.
+  std::vector<uint64_t> keys(600, 42);
+  check_streaming_bulk_load(keys, 100);
+}
+
+TEST_CASE("TestStreamingBulkLoadUnsorted") {
+  const std::string page_path = "unittest_streaming_page";
+  std::vector<uint64_t> keys;
+  for (int i = 0; i < 10000; i++) {
+    keys.push_back(i * 10);
+  }
+  std::swap(keys[6000], keys[6001]);
+  auto payload_of = [](int i) { return static_cast<uint64_t>(i); };
+  {
+    WritePager<uint64_t, uint64_t> pager(page_path);
+    // Both when the keys fit in the window, and when the unsorted keys are
+    // found while streaming the parts
+    for (int window_keys : {20000, 500}) {
+      BulkLoadIndex index(&pager);
+      CHECK_THROWS_AS(index.bulk_load_streaming(keys.data(), 10000, payload_of,
+                                                window_keys),
+                      std::invalid_argument);
+      CHECK(index.empty());
+      CHECK_EQ(index.get_stats().num_data_nodes, 1);
+      // The index is left as it was, so the sorted keys can still be loaded
+      std::vector<uint64_t> sorted_keys = keys;
+      std::sort(sorted_keys.begin(), sorted_keys.end());
+      index.bulk_load_streaming(sorted_keys.data(), 10000, payload_of,
+                                window_keys);
+      CHECK_EQ(index.size(), 10000);
+    }
+  }
+  std::remove(page_path.c_str());
+}
+
+TEST_CASE("TestBulkInsertSkewed") {
+  // Skewed batches that fall in a few data nodes, with keys that are already
+  // in the index and keys repeated within a batch
+  const int max_node_size = 1 << 14;
+  std::mt19937_64 gen(13);
+  std::vector<BulkLoadIndex::V> values;
+  std::multimap<uint64_t, uint64_t> ref;
+  for (uint64_t i = 0; i < 20000; i++) {
+    values.emplace_back(i * 1000, i);
+    ref.emplace(i * 1000, i);
+  }
+  BulkLoadIndex index(nullptr);
+  index.set_max_node_size(max_node_size);
+  index.bulk_load(values.data(), static_cast<int>(values.size()));
+  for (int batch = 0; batch < 3; batch++) {
+    std::vector<BulkLoadIndex::V> batch_values = skewed_batch(
+        10000, 3, 5000000 + batch * 3000000, 1000000 * (batch + 1), gen);
+    // Some values equal to keys that the index has
+    for (auto& value : batch_values) {
+      if (gen() % 10 == 0) {
+        value.first -= value.first % 1000;
+      }
+    }
+    std::sort(batch_values.begin(), batch_values.end());
+    for (const auto& value : batch_values) {
+      ref.emplace(value.first, value.second);
+    }
+    CHECK_EQ(index.bulk_insert(batch_values.data(),
+                               static_cast<int>(batch_values.size())),
+             batch_values.size());
+    check_bulk_inserted(index, ref, max_node_size);
+  }
+}
+
+TEST_CASE("TestBulkInsertNoDuplicates") {
+  typedef Alex<uint64_t, uint64_t, AlexCompare,
+               std::allocator<std::pair<uint64_t, uint64_t>>, false>
+      UniqueIndex;
+  const int max_node_size = 1 << 14;
+  std::mt19937_64 gen(17);
+  std::vector<UniqueIndex::V> values;
+  std::map<uint64_t, uint64_t> ref;
+  for (uint64_t i = 0; i < 20000; i++) {
+    values.emplace_back(i * 1000, i);
+    ref.emplace(i * 1000, i);
+  }
+  UniqueIndex index(nullptr);
+  index.set_max_node_size(max_node_size);
+  index.bulk_load(values.data(), static_cast<int>(values.size()));
+  for (int batch = 0; batch < 3; batch++) {
+    std::vector<UniqueIndex::V> batch_values = skewed_batch(
+        20000, 2, 5000000 + batch * 3000000, 1000000 * (batch + 1), gen);
+    for (auto& value : batch_values) {
+      if (gen() % 10 == 0) {
+        value.first -= value.first % 1000;
+      }
+    }
+    std::sort(batch_values.begin(), batch_values.end());
+    // Neither keys that the index has nor repeats within the batch are
+    // inserted, and the first value of a key is the one kept
+    size_t num_new = 0;
+    for (const auto& value : batch_values) {
+      num_new += ref.emplace(value.first, value.second).second;
+    }
+    CHECK_EQ(index.bulk_insert(batch_values.data(),
+                               static_cast<int>(batch_values.size())),
+             num_new);
+    check_bulk_inserted(index, ref, max_node_size);
+  }
+}
+
+}
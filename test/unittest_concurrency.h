@@ -0,0 +1,181 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include "doctest.h"
+
+#include <atomic>
+#include <memory>
+#include <random>
+#include <set>
+#include <thread>
+
+#include "alex.h"
+
+using namespace alex;
+
+namespace {
+
+// Writers may draw the same key twice, which the index then holds once, as
+// the std::set that it is checked against does
+typedef Alex<uint64_t, uint64_t, AlexCompare,
+             std::allocator<std::pair<uint64_t, uint64_t>>, false>
+    SharedIndex;
+
+const uint64_t kDomainMin = 1000000000;
+const int kNumBulkLoadedKeys = 50000;
+
+// Bulk loaded keys are kDomainMin + i * 1000 and their own payloads
+SharedIndex* new_shared_index(std::set<uint64_t>* ref) {
+  std::vector<SharedIndex::V> values;
+  for (uint64_t i = 0; i < kNumBulkLoadedKeys; i++) {
+    uint64_t key = kDomainMin + i * 1000;
+    values.emplace_back(key, key);
+    ref->insert(key);
+  }
+  auto index = new SharedIndex(nullptr);
+  index->set_max_node_size(1 << 14);
+  index->bulk_load(values.data(), static_cast<int>(values.size()));
+  return index;
+}
+
+// The keys that writer w inserts, which no other writer touches. Writer 0
+// inserts above the key domain and writer 1 below it, so that both expand
+// the root, and the others insert within it.
+std::vector<uint64_t> writer_keys(int w, int num_keys) {
+  std::mt19937_64 gen(w + 1);
+  std::vector<uint64_t> keys;
+  for (int i = 0; i < num_keys; i++) {
+    if (w == 0) {
+      keys.push_back(2 * kDomainMin + i * 7);
+    } else if (w == 1) {
+      keys.push_back(kDomainMin - 1 - i * 7);
+    } else {
+      keys.push_back(kDomainMin + (gen() % kNumBulkLoadedKeys) * 1000 + w);
+    }
+  }
+  return keys;
+}
+
+// Bulk loaded keys in [kErasedBegin, kErasedEnd) are erased by the last
+// writer, which empties their data nodes so that they merge
+const uint64_t kErasedBegin = kDomainMin + 20000 * 1000;
+const uint64_t kErasedEnd = kDomainMin + 30000 * 1000;
+
+// Runs writers that insert and erase their own keys, and a reader that looks
+// up bulk loaded keys that are never erased, on index in multi-writer mode.
+// Updates ref with the keys that the writers leave in the index, and returns
+// the number of lookups that did not find the right payload.
+long run_writers(SharedIndex* index, std::set<uint64_t>* ref) {
+  const int kNumWriters = 4;
+  const int kKeysPerWriter = 20000;
+  std::vector<std::set<uint64_t>> remaining(kNumWriters);
+  std::vector<std::thread> writers;
+  for (int w = 0; w < kNumWriters; w++) {
+    writers.emplace_back([index, w, &remaining] {
+      std::mt19937_64 gen(w + 100);
+      std::vector<uint64_t> keys = writer_keys(w, kKeysPerWriter);
+      for (size_t i = 0; i < keys.size(); i++) {
+        if (index->insert(keys[i], keys[i]).second) {
+          remaining[w].insert(keys[i]);
+        }
+        // Erase one of the keys inserted so far every fourth insert
+        if (i % 4 == 3) {
+          uint64_t key = keys[gen() % (i + 1)];
+          index->erase(key);
+          remaining[w].erase(key);
+        }
+        if (w == kNumWriters - 1 && i < 10000) {
+          index->erase(kErasedBegin + i * 1000);
+        }
+      }
+    });
+  }
+  std::atomic<bool> done{false};
+  std::atomic<long> num_bad_lookups{0};
+  std::thread reader([index, &done, &num_bad_lookups] {
+    std::mt19937_64 gen(7);
+    while (!done) {
+      uint64_t key = kDomainMin + (gen() % kNumBulkLoadedKeys) * 1000;
+      if (key >= kErasedBegin && key < kErasedEnd) {
+        continue;
+      }
+      uint64_t payload;
+      if (!index->get_payload(key, &payload) || payload != key) {
+        num_bad_lookups++;
+      }
+    }
+  });
+  for (auto& writer : writers) {
+    writer.join();
+  }
+  done = true;
+  reader.join();
+
+  for (uint64_t key = kErasedBegin; key < kErasedEnd; key += 1000) {
+    ref->erase(key);
+  }
+  for (const auto& keys : remaining) {
+    ref->insert(keys.begin(), keys.end());
+  }
+  return num_bad_lookups;
+}
+
+// Checks, in single-threaded mode, that index holds exactly the keys of ref,
+// each with its own payload
+void check_shared_index(SharedIndex& index, const std::set<uint64_t>& ref) {
+  CHECK(index.validate_structure(true));
+  CHECK_EQ(index.size(), ref.size());
+  auto ref_it = ref.begin();
+  for (auto it = index.begin(); !it.is_end(); it++, ++ref_it) {
+    REQUIRE(ref_it != ref.end());
+    CHECK_EQ(it.key(), *ref_it);
+    CHECK_EQ(it.payload(), *ref_it);
+  }
+  CHECK(ref_it == ref.end());
+  for (uint64_t key : ref) {
+    uint64_t* payload = index.get_payload(key);
+    REQUIRE(payload != nullptr);
+    CHECK_EQ(*payload, key);
+  }
+}
+
+}  // namespace
+
+TEST_SUITE("Concurrency") {
+
+TEST_CASE("TestConcurrentInsertErase") {
+  std::set<uint64_t> ref;
+  std::unique_ptr<SharedIndex> index(new_shared_index(&ref));
+  index->set_concurrency_mode(ConcurrencyMode::kMultiWriter);
+  CHECK_EQ(run_writers(index.get(), &ref), 0);
+  CHECK_EQ(index->size(), ref.size());
+  // Lookups that return pointers into the index are not safe with writers
+  CHECK_THROWS_AS(index->get_payload(kDomainMin), std::logic_error);
+  index->set_concurrency_mode(ConcurrencyMode::kSingleThreaded);
+  check_shared_index(*index, ref);
+}
+
+TEST_CASE("TestBackgroundReorganization") {
+  // Waiting for the queued reorganizations, or leaving multi-writer mode
+  // right away, which waits for them too
+  for (bool wait : {true, false}) {
+    std::set<uint64_t> ref;
+    std::unique_ptr<SharedIndex> index(new_shared_index(&ref));
+    CHECK_THROWS_AS(index->set_background_reorganization(true),
+                    std::invalid_argument);
+    index->set_concurrency_mode(ConcurrencyMode::kMultiWriter);
+    index->set_background_reorganization(true);
+    CHECK_EQ(run_writers(index.get(), &ref), 0);
+    CHECK_EQ(index->size(), ref.size());
+    if (wait) {
+      index->wait_for_reorganization();
+      CHECK(index->get_background_reorganization());
+      CHECK(index->validate_structure(true));
+    }
+    index->set_concurrency_mode(ConcurrencyMode::kSingleThreaded);
+    CHECK_FALSE(index->get_background_reorganization());
+    check_shared_index(*index, ref);
+  }
+}
+
+}
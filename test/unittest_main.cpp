@@ -7,4 +7,8 @@
 #include "unittest_alex.h"
 #include "unittest_alex_map.h"
 #include "unittest_alex_multimap.h"
+#include "unittest_bulk_load.h"
+#include "unittest_concurrency.h"
 #include "unittest_nodes.h"
+#include "unittest_pager.h"
+#include "unittest_wal.h"
@@ -87,6 +87,76 @@ TEST_CASE("TestExponentialSearch") {
   }
 }
 
+// Checks the bounds that exponential search finds from every position against
+// std::lower_bound and std::upper_bound, and that it counts as many
+// iterations as the scalar search would
+template <class T>
+void check_exponential_search(AlexDataNode<T, int>& node,
+                              const std::vector<T>& keys_to_search) {
+  T* begin = &node.get_key(0);
+  T* end = begin + node.data_capacity_;
+  for (T key : keys_to_search) {
+    int expected_lower = static_cast<int>(std::lower_bound(begin, end, key) - begin);
+    int expected_upper = static_cast<int>(std::upper_bound(begin, end, key) - begin);
+    for (int m = 0; m < node.data_capacity_; m++) {
+      // The scalar search doubles the bound while it stays short of the
+      // bound, and within the node
+      int expected_iterations = 0;
+      int distance = (begin[m] > key) ? m - expected_upper : expected_upper - m;
+      int size = (begin[m] > key) ? m : node.data_capacity_ - m;
+      for (int bound = 1; bound < size && ((begin[m] > key) ? bound <= distance
+                                                            : bound < distance);
+           bound *= 2) {
+        expected_iterations++;
+      }
+      int64_t iterations_before = node.num_exp_search_iterations_;
+      CHECK_EQ(node.exponential_search_upper_bound(m, key), expected_upper);
+      CHECK_EQ(node.num_exp_search_iterations_ - iterations_before, expected_iterations);
+      CHECK_EQ(node.exponential_search_lower_bound(m, key), expected_lower);
+    }
+    CHECK_EQ(node.binary_search_upper_bound(0, node.data_capacity_, key), expected_upper);
+    CHECK_EQ(node.binary_search_lower_bound(0, node.data_capacity_, key), expected_lower);
+  }
+}
+
+TEST_CASE("TestSimdSearch") {
+  // Unsigned keys above 2^63, which AVX2 compares as signed, with duplicates
+  AlexDataNode<uint64_t, int> unsigned_node;
+  std::vector<std::pair<uint64_t, int>> unsigned_values;
+  std::vector<uint64_t> unsigned_keys;
+  for (int i = 0; i < 300; i++) {
+    unsigned_values.push_back({(1ULL << 63) - 600 + (i / 3) * 12, 0});
+  }
+  unsigned_node.bulk_load(unsigned_values.data(), 300);
+  for (uint64_t key = (1ULL << 63) - 610; key < (1ULL << 63) + 620; key += 5) {
+    unsigned_keys.push_back(key);
+  }
+  unsigned_keys.push_back(0);
+  unsigned_keys.push_back(std::numeric_limits<uint64_t>::max());
+  check_exponential_search(unsigned_node, unsigned_keys);
+
+  AlexDataNode<int64_t, int> signed_node;
+  std::vector<std::pair<int64_t, int>> signed_values;
+  std::vector<int64_t> signed_keys;
+  for (int i = 0; i < 200; i++) {
+    signed_values.push_back({(i - 100) * 7, 0});
+    signed_keys.push_back((i - 100) * 7);
+    signed_keys.push_back((i - 100) * 7 + 3);
+  }
+  signed_node.bulk_load(signed_values.data(), 200);
+  check_exponential_search(signed_node, signed_keys);
+
+  AlexDataNode<double, int> double_node;
+  std::vector<std::pair<double, int>> double_values;
+  std::vector<double> double_keys;
+  for (int i = 0; i < 200; i++) {
+    double_values.push_back({(i / 2) * 0.5, 0});
+    double_keys.push_back(i * 0.25);
+  }
+  double_node.bulk_load(double_values.data(), 200);
+  check_exponential_search(double_node, double_keys);
+}
+
 TEST_CASE("TestNumKeysInRange") {
   AlexDataNode<int, int> node;
 
@@ -342,6 +412,47 @@ TEST_CASE("TestIteratorWithDuplicates") {
   CHECK_EQ(4, results.size());
 }
 
+TEST_CASE("TestScan") {
+  AlexDataNode<int, int> node;
+
+  AlexDataNode<int, int>::V values[200];
+  for (int i = 0; i < 200; i++) {
+    values[i].first = 3 * i;
+    values[i].second = i;
+  }
+
+  std::sort(values, values + 200);
+  node.bulk_load(values, 200);
+
+  std::vector<int> results;
+  auto emit = [&results](const int& key, int& payload) {
+    CHECK_EQ(key, 3 * payload);
+    results.push_back(key);
+  };
+  bool stopped;
+
+  // Up to a key
+  int end_key = 301;
+  CHECK_EQ(50, node.scan(node.find_lower(151), &end_key, 1000, emit, &stopped));
+  CHECK(stopped);
+  CHECK_EQ(153, results.front());
+  CHECK_EQ(300, results.back());
+
+  // Up to a number of keys
+  results.clear();
+  CHECK_EQ(7, node.scan(node.find_lower(10), nullptr, 7, emit, &stopped));
+  CHECK(stopped);
+  CHECK_EQ(12, results.front());
+  CHECK_EQ(30, results.back());
+
+  // To the end of the node
+  results.clear();
+  CHECK_EQ(200, node.scan(0, nullptr, 1000, emit, &stopped));
+  CHECK_FALSE(stopped);
+  CHECK(std::is_sorted(results.begin(), results.end()));
+  CHECK_EQ(597, results.back());
+}
+
 TEST_CASE("TestBulkLoadFromExisting") {
   AlexDataNode<int, int> node;
 
@@ -0,0 +1,232 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include "doctest.h"
+
+#include <cstdio>
+#include <map>
+#include <random>
+
+#include "alex.h"
+
+using namespace alex;
+
+namespace {
+
+typedef Alex<uint64_t, uint64_t> PagedIndex;
+
+size_t page_file_size(const std::string& path) {
+  std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+  return static_cast<size_t>(ifs.tellg());
+}
+
+void save_index(PagedIndex& index, const std::string& index_path) {
+  std::ofstream ofs(index_path);
+  boost::archive::binary_oarchive oa(ofs);
+  oa << index;
+}
+
+void load_index(PagedIndex& index, const std::string& index_path) {
+  std::ifstream ifs(index_path);
+  boost::archive::binary_iarchive ia(ifs);
+  ia >> index;
+}
+
+// Checks that index holds exactly the keys and payloads of ref, in order
+void check_contents(PagedIndex& index,
+                    const std::map<uint64_t, uint64_t>& ref) {
+  CHECK_EQ(index.size(), ref.size());
+  auto ref_it = ref.begin();
+  for (auto it = index.begin(); !it.is_end(); it++, ++ref_it) {
+    REQUIRE(ref_it != ref.end());
+    CHECK_EQ(it.key(), ref_it->first);
+    CHECK_EQ(it.payload(), ref_it->second);
+  }
+  CHECK(ref_it == ref.end());
+  for (const auto& kv : ref) {
+    uint64_t* payload = index.get_payload(kv.first);
+    REQUIRE(payload != nullptr);
+    CHECK_EQ(*payload, kv.second);
+  }
+}
+
+// Checks that index iterates over exactly the keys and payloads of ref in
+// reverse order
+void check_reverse_contents(PagedIndex& index,
+                            const std::map<uint64_t, uint64_t>& ref) {
+  auto ref_it = ref.rbegin();
+  for (auto it = index.rbegin(); !it.is_end(); it++, ++ref_it) {
+    REQUIRE(ref_it != ref.rend());
+    CHECK_EQ(it.key(), ref_it->first);
+    CHECK_EQ(it.payload(), ref_it->second);
+  }
+  CHECK(ref_it == ref.rend());
+}
+
+}  // namespace
+
+TEST_SUITE("Pager") {
+
+TEST_CASE("TestCompaction") {
+  const std::string page_path = "unittest_pager_page";
+  const std::string index_path = "unittest_pager_index";
+  const std::string compact_page_path = "unittest_pager_compact_page";
+  const std::string compact_index_path = "unittest_pager_compact_index";
+  std::mt19937_64 gen(5);
+  std::map<uint64_t, uint64_t> ref;
+  {
+    std::vector<PagedIndex::V> values;
+    for (uint64_t i = 0; i < 50000; i++) {
+      values.emplace_back(i * 100, i);
+      ref.emplace(i * 100, i);
+    }
+    WritePager<uint64_t, uint64_t> pager(page_path);
+    PagedIndex index(&pager);
+    index.set_max_node_size(1 << 14);
+    index.bulk_load(values.data(), static_cast<int>(values.size()));
+    save_index(index, index_path);
+  }
+  size_t bulk_loaded_size = page_file_size(page_path);
+
+  // Every checkpoint appends the data nodes that the inserts changed
+  for (int checkpoint = 0; checkpoint < 3; checkpoint++) {
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    PagedIndex index(&pager);
+    load_index(index, index_path);
+    for (int i = 0; i < 2000; i++) {
+      uint64_t key = gen() % 5000000;
+      if (ref.emplace(key, key).second) {
+        index.insert(key, key);
+      }
+    }
+    save_index(index, index_path);
+  }
+  size_t checkpointed_size = page_file_size(page_path);
+  CHECK_GT(checkpointed_size, bulk_loaded_size);
+
+  {
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    PagedIndex index(&pager);
+    load_index(index, index_path);
+    {
+      WritePager<uint64_t, uint64_t> compact_pager(compact_page_path);
+      std::ofstream ofs(compact_index_path);
+      boost::archive::binary_oarchive oa(ofs);
+      index.save_compacted(oa, &compact_pager);
+    }
+    // The index still checkpoints to its own page file, where nothing changed
+    save_index(index, index_path);
+    CHECK_EQ(page_file_size(page_path), checkpointed_size);
+  }
+  CHECK_LT(page_file_size(compact_page_path), checkpointed_size);
+
+  {
+    ReadPager<uint64_t, uint64_t> pager(compact_page_path);
+    PagedIndex index(&pager);
+    load_index(index, compact_index_path);
+    CHECK(index.validate_structure(true));
+    check_contents(index, ref);
+  }
+  {
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    PagedIndex index(&pager);
+    load_index(index, index_path);
+    check_contents(index, ref);
+  }
+  std::remove(page_path.c_str());
+  std::remove(index_path.c_str());
+  std::remove(compact_page_path.c_str());
+  std::remove(compact_index_path.c_str());
+}
+
+TEST_CASE("TestLoadedLeafLinks") {
+  // Page file records do not link data nodes, so a loaded index finds the
+  // neighbors of a leaf once an iterator crosses to them
+  const std::string page_path = "unittest_pager_page";
+  const std::string index_path = "unittest_pager_index";
+  std::mt19937_64 gen(7);
+  std::map<uint64_t, uint64_t> ref;
+  {
+    std::vector<PagedIndex::V> values;
+    std::lognormal_distribution<double> dist(0, 2);
+    while (ref.size() < 100000) {
+      uint64_t key = static_cast<uint64_t>(dist(gen) * 1e9);
+      ref.emplace(key, key / 3);
+    }
+    for (const auto& kv : ref) {
+      values.push_back(kv);
+    }
+    WritePager<uint64_t, uint64_t> pager(page_path);
+    PagedIndex index(&pager);
+    index.set_max_node_size(1 << 14);
+    index.bulk_load(values.data(), static_cast<int>(values.size()));
+    CHECK_GT(index.get_stats().num_data_nodes, 100);
+    save_index(index, index_path);
+  }
+  {
+    // Reverse iteration first, so that it cannot use the links that forward
+    // iteration made
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    PagedIndex index(&pager);
+    load_index(index, index_path);
+    check_reverse_contents(index, ref);
+    check_contents(index, ref);
+  }
+  {
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    PagedIndex index(&pager);
+    load_index(index, index_path);
+    check_contents(index, ref);
+    check_reverse_contents(index, ref);
+  }
+
+  // Splits and erases that empty and merge data nodes replace leaves whose
+  // neighbors were not linked yet
+  {
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    PagedIndex index(&pager);
+    load_index(index, index_path);
+    for (int i = 0; i < 30000; i++) {
+      uint64_t key = gen() % 20000000000ULL;
+      if (ref.emplace(key, i).second) {
+        index.insert(key, i);
+      }
+    }
+    auto erase_begin = ref.lower_bound(500000000);
+    auto erase_end = ref.lower_bound(1500000000);
+    for (auto it = erase_begin; it != erase_end; ++it) {
+      CHECK_EQ(index.erase(it->first), 1);
+    }
+    ref.erase(erase_begin, erase_end);
+    CHECK_GT(index.get_stats().num_sideways_splits +
+                 index.get_stats().num_downward_splits,
+             0);
+    CHECK(index.validate_structure(true));
+    check_reverse_contents(index, ref);
+    check_contents(index, ref);
+    save_index(index, index_path);
+  }
+  {
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    PagedIndex index(&pager);
+    load_index(index, index_path);
+    check_reverse_contents(index, ref);
+    check_contents(index, ref);
+    // Iterators that start in the middle of the index
+    for (int i = 0; i < 1000; i++) {
+      uint64_t key = gen() % 20000000000ULL;
+      auto it = index.lower_bound(key);
+      auto ref_it = ref.lower_bound(key);
+      if (ref_it == ref.end()) {
+        CHECK(it.is_end());
+      } else {
+        REQUIRE_FALSE(it.is_end());
+        CHECK_EQ(it.key(), ref_it->first);
+      }
+    }
+  }
+  std::remove(page_path.c_str());
+  std::remove(index_path.c_str());
+}
+
+}
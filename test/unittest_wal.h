@@ -0,0 +1,245 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include "doctest.h"
+
+#include <cstdio>
+#include <thread>
+
+#include "alex.h"
+
+using namespace alex;
+
+namespace {
+
+typedef Alex<uint64_t, uint64_t> LoggedIndex;
+
+void save_logged_index(LoggedIndex& index, const std::string& index_path) {
+  std::ofstream ofs(index_path);
+  boost::archive::binary_oarchive oa(ofs);
+  oa << index;
+}
+
+void load_logged_index(LoggedIndex& index, const std::string& index_path) {
+  std::ifstream ifs(index_path);
+  boost::archive::binary_iarchive ia(ifs);
+  ia >> index;
+}
+
+typedef WriteAheadLog<uint64_t, uint64_t> TestWal;
+
+// LSNs of the records that replay(after_lsn) finds in wal
+std::vector<uint64_t> replayed_lsns(const TestWal& wal, uint64_t after_lsn) {
+  std::vector<uint64_t> lsns;
+  wal.replay(after_lsn, [&lsns](const TestWal::record_type& record) {
+    lsns.push_back(record.lsn);
+  });
+  return lsns;
+}
+
+size_t wal_file_size(const std::string& path) {
+  std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+  return static_cast<size_t>(ifs.tellg());
+}
+
+}  // namespace
+
+TEST_SUITE("WriteAheadLog") {
+
+TEST_CASE("TestWalLsnAfterUnset") {
+  const std::string page_path = "unittest_wal_page";
+  const std::string index_path = "unittest_wal_index";
+  const std::string wal_path = "unittest_wal_log";
+  std::remove(wal_path.c_str());
+  {
+    std::vector<LoggedIndex::V> values;
+    for (uint64_t i = 0; i < 1000; i++) {
+      values.emplace_back(i * 10, i);
+    }
+    WritePager<uint64_t, uint64_t> pager(page_path);
+    LoggedIndex index(&pager);
+    index.bulk_load(values.data(), static_cast<int>(values.size()));
+    save_logged_index(index, index_path);
+  }
+  {
+    WriteAheadLog<uint64_t, uint64_t> wal(wal_path, 0);
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    LoggedIndex index(&pager);
+    load_logged_index(index, index_path);
+    CHECK_EQ(index.replay_wal(wal), 0);
+    index.set_wal(&wal);
+    for (uint64_t i = 0; i < 100; i++) {
+      index.insert(i * 10 + 5, i);
+    }
+    // The index must still save the LSN of the inserts once the log is unset
+    index.set_wal(nullptr);
+    CHECK_EQ(index.wal_lsn(), 100);
+    save_logged_index(index, index_path);
+  }
+  {
+    // Restart: the log still holds the inserts, which the archive covers
+    WriteAheadLog<uint64_t, uint64_t> wal(wal_path, 0);
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    LoggedIndex index(&pager);
+    load_logged_index(index, index_path);
+    CHECK_EQ(index.replay_wal(wal), 0);
+    CHECK_EQ(index.size(), 1100);
+    CHECK_EQ(index.count(15), 1);
+  }
+  std::remove(page_path.c_str());
+  std::remove(index_path.c_str());
+  std::remove(wal_path.c_str());
+}
+
+TEST_CASE("TestWalTornTail") {
+  const std::string wal_path = "unittest_wal_log";
+  std::remove(wal_path.c_str());
+  const size_t record_size = sizeof(TestWal::record_type);
+  {
+    TestWal wal(wal_path, 0);
+    for (uint64_t i = 1; i <= 10; i++) {
+      CHECK_EQ(wal.log(WalOp::kInsert, i, i), i);
+    }
+  }
+  size_t full_size = sizeof(WalFileHeader) + 10 * record_size;
+  CHECK_EQ(wal_file_size(wal_path), full_size);
+  {
+    // Half of an eleventh record, as a crash in the middle of a write leaves
+    std::ofstream ofs(wal_path, std::ios::binary | std::ios::app);
+    std::vector<char> half(record_size / 2, 7);
+    ofs.write(half.data(), half.size());
+  }
+  {
+    TestWal wal(wal_path, 0);
+    CHECK_EQ(wal.last_lsn(), 10);
+    CHECK_EQ(wal_file_size(wal_path), full_size);
+    CHECK_EQ(replayed_lsns(wal, 0).size(), 10);
+    // Logging continues after the last valid record
+    CHECK_EQ(wal.log(WalOp::kErase, 3, 0), 11);
+  }
+  {
+    // A record whose checksum does not match cuts off everything after it
+    std::fstream fs(wal_path, std::ios::binary | std::ios::in | std::ios::out);
+    fs.seekp(sizeof(WalFileHeader) + 7 * record_size + offsetof(TestWal::record_type, key));
+    char byte = 0x5a;
+    fs.write(&byte, 1);
+  }
+  {
+    TestWal wal(wal_path, 0);
+    CHECK_EQ(wal.last_lsn(), 7);
+    CHECK_EQ(wal_file_size(wal_path), sizeof(WalFileHeader) + 7 * record_size);
+    std::vector<uint64_t> lsns = replayed_lsns(wal, 5);
+    REQUIRE_EQ(lsns.size(), 2);
+    CHECK_EQ(lsns[0], 6);
+    CHECK_EQ(lsns[1], 7);
+  }
+  std::remove(wal_path.c_str());
+}
+
+TEST_CASE("TestWalReplayAcrossReset") {
+  const std::string page_path = "unittest_wal_page";
+  const std::string index_path = "unittest_wal_index";
+  const std::string old_index_path = "unittest_wal_old_index";
+  const std::string wal_path = "unittest_wal_log";
+  std::remove(wal_path.c_str());
+  {
+    std::vector<LoggedIndex::V> values;
+    for (uint64_t i = 0; i < 1000; i++) {
+      values.emplace_back(i * 10, i);
+    }
+    WritePager<uint64_t, uint64_t> pager(page_path);
+    LoggedIndex index(&pager);
+    index.bulk_load(values.data(), static_cast<int>(values.size()));
+    save_logged_index(index, index_path);
+    save_logged_index(index, old_index_path);
+  }
+  {
+    TestWal wal(wal_path, 0);
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    LoggedIndex index(&pager);
+    load_logged_index(index, index_path);
+    index.set_wal(&wal);
+    for (uint64_t i = 0; i < 50; i++) {
+      index.insert(i * 10 + 1, i);
+    }
+    // Checkpoint, and empty the log that it covers
+    save_logged_index(index, index_path);
+    wal.reset();
+    CHECK_EQ(wal.base_lsn(), 50);
+    CHECK(replayed_lsns(wal, 0).empty());
+    for (uint64_t i = 0; i < 20; i++) {
+      index.insert(i * 10 + 2, i);
+    }
+    index.erase(0);
+    index.set_wal(nullptr);
+  }
+  {
+    // Restart from the checkpoint: only the writes after the reset are redone
+    TestWal wal(wal_path, 0);
+    CHECK_EQ(wal.base_lsn(), 50);
+    CHECK_EQ(wal.last_lsn(), 71);
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    LoggedIndex index(&pager);
+    load_logged_index(index, index_path);
+    CHECK_EQ(index.replay_wal(wal), 21);
+    CHECK_EQ(index.wal_lsn(), 71);
+    CHECK_EQ(index.size(), 1000 + 50 + 20 - 1);
+    CHECK_EQ(index.count(0), 0);
+    CHECK_EQ(index.count(191), 1);
+    CHECK_EQ(index.count(192), 1);
+  }
+  {
+    // The archive from before the checkpoint misses the writes that the
+    // reset dropped
+    TestWal wal(wal_path, 0);
+    ReadPager<uint64_t, uint64_t> pager(page_path);
+    LoggedIndex index(&pager);
+    load_logged_index(index, old_index_path);
+    CHECK_THROWS_AS(index.replay_wal(wal), std::runtime_error);
+  }
+  std::remove(page_path.c_str());
+  std::remove(index_path.c_str());
+  std::remove(old_index_path.c_str());
+  std::remove(wal_path.c_str());
+}
+
+TEST_CASE("TestWalResetWhileLogging") {
+  const std::string wal_path = "unittest_wal_log";
+  std::remove(wal_path.c_str());
+  const int kNumThreads = 4;
+  const int kRecordsPerThread = 20000;
+  uint64_t base_lsn;
+  {
+    // Group commits from a background thread, so that writers keep logging
+    // while a commit, or the reset, writes
+    TestWal wal(wal_path, 100);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kNumThreads; t++) {
+      threads.emplace_back([&wal, t] {
+        for (int i = 0; i < kRecordsPerThread; i++) {
+          wal.log(WalOp::kInsert, t, i);
+        }
+      });
+    }
+    for (int r = 0; r < 5; r++) {
+      wal.reset();
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    base_lsn = wal.base_lsn();
+  }
+  // Every record logged after the last reset started is still there, with
+  // consecutive LSNs
+  TestWal wal(wal_path, 0);
+  CHECK_EQ(wal.base_lsn(), base_lsn);
+  CHECK_EQ(wal.last_lsn(), kNumThreads * kRecordsPerThread);
+  std::vector<uint64_t> lsns = replayed_lsns(wal, 0);
+  REQUIRE_EQ(lsns.size(), wal.last_lsn() - base_lsn);
+  for (size_t i = 0; i < lsns.size(); i++) {
+    CHECK_EQ(lsns[i], base_lsn + 1 + i);
+  }
+  std::remove(wal_path.c_str());
+}
+
+}